@@ -0,0 +1,337 @@
+// Times the functions on the shading hot path, one at a time, over the WIF
+// files in tests/ and a few large synthetic patterns. Each function is called
+// on the same fixed-seed set of shading points, and the result is written
+// as one CSV row (or JSON object) per pattern and function.
+// Run from this directory, see usage below.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+static const char *wif_files[] = {
+    "../../tests/test_calculate_segment_size/2parallel.wif",
+    "../../tests/test_calculate_segment_size/54235plain.wif",
+    "../../tests/test_yarn_size/3parallelwarps.wif",
+    "../../tests/test_yarn_size/3parallelwefts.wif",
+    "../../tests/test_yarn_size/test.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(*wif_files))
+
+// Side lengths of the synthetic patterns
+static const uint32_t synthetic_sizes[] = {256, 1024, 4096};
+#define NUM_SYNTHETIC (sizeof(synthetic_sizes)/sizeof(*synthetic_sizes))
+
+// The WIF patterns are small, so they are repeated this many times over the
+// uv range. The synthetic patterns are shown once.
+#define WIF_UV_SCALE 8.f
+
+typedef struct
+{
+    int json;
+    uint32_t num_points;
+    uint32_t seed;
+    double min_time; //Seconds per measurement
+    int repetitions; //The fastest is reported
+} BenchOptions;
+
+typedef struct
+{
+    const tlWeaveParameters *params;
+    uint32_t count;
+    const tlIntersectionData *points;
+    const tlPatternData *data;
+    float u_scale, v_scale;
+} BenchInput;
+
+static volatile float sink;
+
+static uint32_t xorshift(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static float rnd(uint32_t *state)
+{
+    return (float)(xorshift(state) >> 8)*(1.f/16777216.f);
+}
+
+// Uniform uvs in [0,1) and directions in the upper hemisphere, up to 86
+// degrees from the normal
+static void random_points(tlIntersectionData *points, uint32_t count,
+    uint32_t seed)
+{
+    uint32_t state = seed ? seed : 1;
+    for(uint32_t i=0;i<count;i++){
+        float phi_i = 2.f*(float)M_PI*rnd(&state), theta_i = 1.5f*rnd(&state);
+        float phi_o = 2.f*(float)M_PI*rnd(&state), theta_o = 1.5f*rnd(&state);
+        tlIntersectionData d = {rnd(&state), rnd(&state),
+            sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i),
+            cosf(theta_i),
+            sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o),
+            cosf(theta_o), 0};
+        points[i] = d;
+    }
+}
+
+// -- Benchmarked functions -- //
+// Each runs the function once per point and returns something depending on
+// every result, so that no call can be removed by the compiler.
+
+static float run_get_pattern_data(const BenchInput *in)
+{
+    float sum = 0.f;
+    for(uint32_t i=0;i<in->count;i++){
+        tlPatternData data = tl_get_pattern_data(in->points[i], in->params);
+        sum += data.yarn_hit ? data.normal_z : 0.f;
+    }
+    return sum;
+}
+
+static float run_get_yarn_segment(const BenchInput *in)
+{
+    float sum = 0.f;
+    for(uint32_t i=0;i<in->count;i++){
+        const tlIntersectionData *d = in->points + i;
+        tlYarnSegment segment = tl_get_yarn_segment(d->uv_x*in->u_scale,
+            d->uv_y*in->v_scale, in->params, d);
+        sum += segment.yarn_hit ? segment.length : 0.f;
+    }
+    return sum;
+}
+
+static float run_eval_diffuse(const BenchInput *in)
+{
+    float sum = 0.f;
+    for(uint32_t i=0;i<in->count;i++){
+        sum += tl_eval_diffuse(in->points[i], in->data[i], in->params).g;
+    }
+    return sum;
+}
+
+static float run_eval_specular(const BenchInput *in)
+{
+    float sum = 0.f;
+    for(uint32_t i=0;i<in->count;i++){
+        sum += tl_eval_specular(in->points[i], in->data[i], in->params).g;
+    }
+    return sum;
+}
+
+static float run_eval_opacity(const BenchInput *in)
+{
+    float sum = 0.f;
+    for(uint32_t i=0;i<in->count;i++){
+        sum += tl_eval_opacity(in->points[i], in->data[i], in->params).g;
+    }
+    return sum;
+}
+
+static float run_shade(const BenchInput *in)
+{
+    float sum = 0.f;
+    for(uint32_t i=0;i<in->count;i++){
+        sum += tl_shade(in->points[i], in->params).g;
+    }
+    return sum;
+}
+
+// -- Measurement -- //
+
+static double now()
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const BenchOptions *options, const char *pattern,
+    const tlWeaveParameters *params, const char *function,
+    float (*run)(const BenchInput*), const BenchInput *in)
+{
+    // One untimed pass to warm up the caches
+    sink = run(in);
+    double best = 1e30;
+    uint64_t calls = 0;
+    for(int r=0;r<options->repetitions;r++){
+        uint64_t passes = 0;
+        double start = now(), elapsed;
+        do{
+            sink = run(in);
+            passes++;
+            elapsed = now() - start;
+        }while(elapsed < options->min_time);
+        double ns = elapsed*1e9/(double)(passes*in->count);
+        best = ns < best ? ns : best;
+        calls += passes*in->count;
+    }
+    if(options->json){
+        printf("{\"pattern\":\"%s\",\"width\":%u,\"height\":%u,"
+            "\"function\":\"%s\",\"calls\":%llu,\"ns_per_call\":%.3f,"
+            "\"calls_per_s\":%.0f}\n", pattern, params->pattern_width,
+            params->pattern_height, function, (unsigned long long)calls,
+            best, 1e9/best);
+    } else{
+        printf("%s,%u,%u,%s,%llu,%.3f,%.0f\n", pattern, params->pattern_width,
+            params->pattern_height, function, (unsigned long long)calls,
+            best, 1e9/best);
+    }
+    fflush(stdout);
+}
+
+static void set_psi(tlWeaveParameters *params, float psi)
+{
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        params->yarn_types[i].psi = psi;
+        params->yarn_types[i].psi_enabled = 1;
+    }
+    tl_prepare(params);
+}
+
+static void compute_pattern_data(BenchInput *in, tlPatternData *data)
+{
+    for(uint32_t i=0;i<in->count;i++){
+        data[i] = tl_get_pattern_data(in->points[i], in->params);
+    }
+    in->data = data;
+}
+
+static void bench_pattern(const BenchOptions *options, const char *name,
+    tlWeaveParameters *params, const tlIntersectionData *points)
+{
+    params->realworld_uv = 0;
+    params->intensity_fineness = 0.f;
+    // Staple yarns, with the default psi
+    set_psi(params, tl_default_yarn_type.psi);
+    tlPatternData *data = (tlPatternData*)malloc(
+        options->num_points*sizeof(tlPatternData));
+    BenchInput in = {params, options->num_points, points, 0, 1.f, 1.f};
+    tl_uv_scale(params, &in.u_scale, &in.v_scale);
+    compute_pattern_data(&in, data);
+    report(options, name, params, "tl_get_pattern_data",
+        run_get_pattern_data, &in);
+    report(options, name, params, "tl_get_yarn_segment",
+        run_get_yarn_segment, &in);
+    report(options, name, params, "tl_eval_diffuse", run_eval_diffuse, &in);
+    report(options, name, params, "tl_eval_specular_staple",
+        run_eval_specular, &in);
+    report(options, name, params, "tl_eval_opacity", run_eval_opacity, &in);
+    report(options, name, params, "tl_shade", run_shade, &in);
+    // psi is 0 for filament yarns, which changes the normals too
+    set_psi(params, 0.f);
+    compute_pattern_data(&in, data);
+    report(options, name, params, "tl_eval_specular_filament",
+        run_eval_specular, &in);
+    free(data);
+}
+
+// A jacquard-like pattern of blocks of twills and satins with four yarn
+// types, so that the segments vary in length across the pattern
+static tlWeaveParameters *synthetic_pattern(uint32_t size)
+{
+    uint8_t *warp_above = (uint8_t*)malloc(size*size);
+    uint8_t *yarn_type = (uint8_t*)malloc(size*size);
+    tlColor colors[4] = {{0.8f,0.2f,0.2f}, {0.2f,0.7f,0.3f},
+        {0.2f,0.3f,0.8f}, {0.9f,0.9f,0.8f}};
+    for(uint32_t y=0;y<size;y++){
+        for(uint32_t x=0;x<size;x++){
+            uint32_t block = (x/32)*7 + (y/32)*3;
+            uint32_t repeat = 2 + block%5;
+            uint32_t shift = block%2 ? 1 : (repeat > 3 ? 2 : 1);
+            warp_above[x + y*size] = (x + shift*y)%repeat == 0;
+            yarn_type[x + y*size] = (uint8_t)(1 + (warp_above[x + y*size]
+                ? (x/4)%2 : 2 + (y/6)%2));
+        }
+    }
+    tlWeaveParameters *params = tl_weave_pattern_from_data(warp_above,
+        yarn_type, 4, colors, size, size);
+    free(warp_above);
+    free(yarn_type);
+    params->uscale = 1.f;
+    params->vscale = 1.f;
+    return params;
+}
+
+static void usage()
+{
+    printf(
+"usage: bench_shading.bin [options]\n"
+"  --json        Write one JSON object per line instead of CSV\n"
+"  --points N    Number of shading points (default 65536)\n"
+"  --seed N      Seed of the shading points (default 1)\n"
+"  --time S      Minimum time of each measurement in seconds (default 0.2)\n"
+"  --reps N      Measurements per function, the fastest is reported\n"
+"                (default 3)\n"
+"Run from the directory of the benchmark, since the WIF files are found\n"
+"relative to it.\n");
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options = {0, 65536, 1, 0.2, 3};
+    for(int i=1;i<argc;i++){
+        const char *value = i + 1 < argc ? argv[i + 1] : "";
+        int ok = 1;
+        if(strcmp(argv[i], "--json") == 0){
+            options.json = 1;
+            continue;
+        } else if(strcmp(argv[i], "--points") == 0){
+            ok = sscanf(value, "%u", &options.num_points) == 1
+                && options.num_points > 0;
+        } else if(strcmp(argv[i], "--seed") == 0){
+            ok = sscanf(value, "%u", &options.seed) == 1;
+        } else if(strcmp(argv[i], "--time") == 0){
+            ok = sscanf(value, "%lf", &options.min_time) == 1;
+        } else if(strcmp(argv[i], "--reps") == 0){
+            ok = sscanf(value, "%d", &options.repetitions) == 1
+                && options.repetitions > 0;
+        } else{
+            ok = 0;
+        }
+        if(!ok){
+            usage();
+            return 1;
+        }
+        i++;
+    }
+
+    tlIntersectionData *points = (tlIntersectionData*)malloc(
+        options.num_points*sizeof(tlIntersectionData));
+    random_points(points, options.num_points, options.seed);
+    if(!options.json){
+        printf("pattern,width,height,function,calls,ns_per_call,"
+            "calls_per_s\n");
+    }
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        const char *error = 0;
+        tlWeaveParameters *params = tl_weave_pattern_from_file(wif_files[f],
+            &error);
+        if(!params){
+            fprintf(stderr, "ERROR: %s: %s\n", wif_files[f], error);
+            return 1;
+        }
+        params->uscale = WIF_UV_SCALE;
+        params->vscale = WIF_UV_SCALE;
+        const char *name = strrchr(wif_files[f], '/') + 1;
+        bench_pattern(&options, name, params, points);
+        tl_free_weave_parameters(params);
+        free(params);
+    }
+    for(uint32_t s=0;s<NUM_SYNTHETIC;s++){
+        char name[64];
+        sprintf(name, "synthetic_%u", synthetic_sizes[s]);
+        tlWeaveParameters *params = synthetic_pattern(synthetic_sizes[s]);
+        bench_pattern(&options, name, params, points);
+        tl_free_weave_parameters(params);
+        free(params);
+    }
+    free(points);
+    return 0;
+}
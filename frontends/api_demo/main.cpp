@@ -1,60 +1,469 @@
+// tl_render renders a flat swatch of a pattern to a PNG or EXR file, using
+// all cores. Run it without arguments for the usage.
 #define TL_NO_TEXTURE_CALLBACKS
 #define TL_THUNDERLOOM_IMPLEMENTATION
 #include "thunderloom.h"
-#include "stdlib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-int main(int argc, char **argv)
+static void usage()
+{
+    printf(
+"usage: tl_render [options] [pattern.wif|pattern.ptn]\n"
+"  -o FILE           Output file, .png or .exr (default out.png)\n"
+"  --size WxH        Image size in pixels (default 500x500)\n"
+"  --spp N           Samples per pixel, stratified and jittered (default 4)\n"
+"  --threads N       Number of threads, 0 for one per core (default 0)\n"
+"  --tile N          Tile size in pixels (default 32)\n"
+"  --light THETA,PHI Direction to the light in degrees (default 0,0)\n"
+"  --view THETA,PHI  Direction to the camera in degrees (default 0,0)\n"
+"  --seed N          Seed of the jitter (default 0)\n"
+"  --set NAME=VALUE  Sets a fabric parameter, such as uscale or uvrotation\n"
+"  --set I.NAME=VALUE\n"
+"                    Sets a parameter of yarn type I, such as\n"
+"                    0.specular_amount=0.5 or 1.color=0.8,0.2,0.2\n"
+"The pattern defaults to test.wif. The uv coordinates go from 0 to 1 across\n"
+"the image, scaled by uscale and vscale, which are 1 unless set. PNG files\n"
+"are written in sRGB.\n");
+}
+
+// -- Parameters -- //
+
+static int parse_color(const char *value, tlColor *color)
+{
+    int n = sscanf(value, "%f,%f,%f", &color->r, &color->g, &color->b);
+    if(n == 1){
+        color->g = color->b = color->r;
+    }
+    return n == 1 || n == 3;
+}
+
+// Sets a parameter given as NAME=VALUE or I.NAME=VALUE, see usage
+static int set_parameter(tlWeaveParameters *params, const char *assignment)
+{
+    char name[64];
+    const char *equals = strchr(assignment, '=');
+    if(!equals || equals - assignment >= (long)sizeof(name)){
+        return 0;
+    }
+    memcpy(name, assignment, equals - assignment);
+    name[equals - assignment] = 0;
+    const char *value = equals + 1;
+    const char *dot = strchr(name, '.');
+    if(!dot){
+#define TL_FLOAT_PARAM(param) \
+        if(strcmp(name, #param) == 0){\
+            return sscanf(value, "%f", &params->param) == 1;\
+        }
+#define TL_INT_PARAM(param) \
+        if(strcmp(name, #param) == 0){\
+            params->param = (uint8_t)atoi(value);\
+            return 1;\
+        }
+#define TL_COLOR_PARAM(param) \
+        if(strcmp(name, #param) == 0){\
+            return parse_color(value, &params->param);\
+        }
+TL_FABRIC_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+        return 0;
+    }
+    uint32_t index = (uint32_t)atoi(name);
+    if(index >= params->num_yarn_types){
+        return 0;
+    }
+    tlYarnType *yarn_type = &params->yarn_types[index];
+    const char *param_name = dot + 1;
+#define TL_FLOAT_PARAM(param) \
+    if(strcmp(param_name, #param) == 0){\
+        yarn_type->param##_enabled = 1;\
+        return sscanf(value, "%f", &yarn_type->param) == 1;\
+    }
+#define TL_COLOR_PARAM(param) \
+    if(strcmp(param_name, #param) == 0){\
+        yarn_type->param##_enabled = 1;\
+        return parse_color(value, &yarn_type->param);\
+    }
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_COLOR_PARAM
+    return 0;
+}
+
+// -- Output -- //
+
+static unsigned char to_srgb(float value)
+{
+    value = value < 0.f ? 0.f : (value > 1.f ? 1.f : value);
+    value = value <= 0.0031308f ? 12.92f*value
+        : 1.055f*powf(value, 1.f/2.4f) - 0.055f;
+    return (unsigned char)(255.f*value + 0.5f);
+}
+
+static int write_png(const char *filename, const float *rgb, int w, int h)
 {
-    //TODO(Vidar):Use a ptn file instead...
-    const char *errors =0;
-    tlWeaveParameters *params =tl_weave_pattern_from_file("test.wif",&errors);
-    if(params){
-        params->uscale = 1.f;
-        params->vscale = 1.f;
-        params->intensity_fineness = 0.f;
-        params->realworld_uv = 0;
-        tl_prepare(params);
-
-        int w =500, h=500;
-        unsigned char *pixels = (unsigned char*)calloc(w*h,3);
-        float inv_w = 1.f/(float)w;
-        float inv_h = 1.f/(float)h;
-
-        tlIntersectionData intersection;
-        intersection.wi_x = 0.f;
-        intersection.wi_y = 0.f;
-        intersection.wi_z = 1.f;
-
-        intersection.wo_x = 0.f;
-        intersection.wo_y = 0.f;
-        intersection.wo_z = -1.f;
-
-        intersection.context = NULL;
-
-        printf("w: %d h: %d\n", params->pattern_width, params->pattern_height);
-        printf("yarn types: %d\n", params->num_yarn_types);
-
-        int y; int x;
-        for(y=0;y<h;y++){
-            intersection.uv_y = (float)y*inv_h;
-            for(x=0;x<w;x++){
-                intersection.uv_x = (float)x*inv_w;
-                tlPatternData pattern_data = tl_get_pattern_data(intersection, 
-                        params);
-                tlColor col = tl_shade(intersection, params);
-                float pattern_type = (float) pattern_data.yarn_type /
-                    (float)(params->num_yarn_types - 1);
-                pixels[3*(x + y*h) + 0] = (unsigned char)(255.f * col.r);
-                pixels[3*(x + y*w) + 1] = (unsigned char)(255.f * col.g);
-                pixels[3*(x + y*w) + 2] = (unsigned char)(255.f * col.b);
+    std::vector<unsigned char> pixels((size_t)w*h*3);
+    for(size_t i=0;i<pixels.size();i++){
+        pixels[i] = to_srgb(rgb[i]);
+    }
+    return stbi_write_png(filename, w, h, 3, pixels.data(), 0);
+}
+
+static void put_bytes(std::vector<unsigned char> &out, const void *data,
+    size_t size)
+{
+    const unsigned char *bytes = (const unsigned char*)data;
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+static void put_int(std::vector<unsigned char> &out, int32_t value)
+{
+    // EXR files are little endian
+    for(int i=0;i<4;i++){
+        out.push_back((unsigned char)((uint32_t)value >> (8*i)));
+    }
+}
+
+static void put_float(std::vector<unsigned char> &out, float value)
+{
+    int32_t bits;
+    memcpy(&bits, &value, 4);
+    put_int(out, bits);
+}
+
+static void put_attribute(std::vector<unsigned char> &out, const char *name,
+    const char *type, int32_t size)
+{
+    put_bytes(out, name, strlen(name) + 1);
+    put_bytes(out, type, strlen(type) + 1);
+    put_int(out, size);
+}
+
+// Writes an uncompressed scanline EXR file with 32 bit float RGB channels
+static int write_exr(const char *filename, const float *rgb, int w, int h)
+{
+    std::vector<unsigned char> out;
+    put_int(out, 20000630); //Magic number
+    put_int(out, 2); //Version 2, scanline
+    // The channels are stored in alphabetical order
+    const char *channels[] = {"B", "G", "R"};
+    put_attribute(out, "channels", "chlist", 3*(2 + 16) + 1);
+    for(int c=0;c<3;c++){
+        put_bytes(out, channels[c], 2);
+        put_int(out, 2); //FLOAT
+        unsigned char linear[4] = {0, 0, 0, 0};
+        put_bytes(out, linear, 4);
+        put_int(out, 1); //x sampling
+        put_int(out, 1); //y sampling
+    }
+    out.push_back(0);
+    put_attribute(out, "compression", "compression", 1);
+    out.push_back(0); //No compression
+    int32_t window[4] = {0, 0, w - 1, h - 1};
+    put_attribute(out, "dataWindow", "box2i", 16);
+    for(int i=0;i<4;i++) put_int(out, window[i]);
+    put_attribute(out, "displayWindow", "box2i", 16);
+    for(int i=0;i<4;i++) put_int(out, window[i]);
+    put_attribute(out, "lineOrder", "lineOrder", 1);
+    out.push_back(0); //Increasing y
+    put_attribute(out, "pixelAspectRatio", "float", 4);
+    put_float(out, 1.f);
+    put_attribute(out, "screenWindowCenter", "v2f", 8);
+    put_float(out, 0.f);
+    put_float(out, 0.f);
+    put_attribute(out, "screenWindowWidth", "float", 4);
+    put_float(out, 1.f);
+    out.push_back(0); //End of header
+
+    uint64_t line_size = 8 + (uint64_t)w*3*4;
+    uint64_t first_line = out.size() + (uint64_t)h*8;
+    for(int y=0;y<h;y++){
+        uint64_t offset = first_line + (uint64_t)y*line_size;
+        put_int(out, (int32_t)(uint32_t)offset);
+        put_int(out, (int32_t)(uint32_t)(offset >> 32));
+    }
+    for(int y=0;y<h;y++){
+        put_int(out, y);
+        put_int(out, w*3*4);
+        for(int c=2;c>=0;c--){
+            for(int x=0;x<w;x++){
+                put_float(out, rgb[3*(x + y*w) + c]);
             }
         }
-        stbi_write_png("out.png", w, h, 3, pixels, 0);
-        tl_free_weave_parameters(params);
-    }else{
-        printf("ERROR: %s\n",errors);
     }
+    FILE *f = fopen(filename, "wb");
+    if(!f){
+        return 0;
+    }
+    int ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    return fclose(f) == 0 && ok;
+}
+
+// -- Rendering -- //
+
+typedef struct
+{
+    const tlWeaveParameters *params;
+    int width, height;
+    int tile_size, tiles_x;
+    int spp;
+    uint32_t seed;
+    tlVector wi, wo;
+    float *rgb;
+} RenderJob;
+
+// The tiles which one thread has left to render. The owner takes tiles from
+// the front and other threads steal from the back once their own are done.
+typedef struct
+{
+    std::mutex lock;
+    int begin, end;
+} TileQueue;
+
+static uint32_t hash(uint32_t x)
+{
+    x ^= x >> 16; x *= 0x7feb352d;
+    x ^= x >> 15; x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static float jitter(uint32_t *state)
+{
+    *state = hash(*state + 0x9e3779b9);
+    return (float)(*state >> 8)*(1.f/16777216.f);
+}
+
+static void render_tile(const RenderJob *job, int tile,
+    std::vector<float> *buffer)
+{
+    int x0 = (tile%job->tiles_x)*job->tile_size;
+    int y0 = (tile/job->tiles_x)*job->tile_size;
+    int x1 = x0 + job->tile_size < job->width ? x0 + job->tile_size
+        : job->width;
+    int y1 = y0 + job->tile_size < job->height ? y0 + job->tile_size
+        : job->height;
+    int spp = job->spp;
+    // The samples are spread over a strata_x by strata_y grid of
+    // strata, using the first spp of them
+    int strata_x = (int)ceilf(sqrtf((float)spp));
+    int strata_y = (spp + strata_x - 1)/strata_x;
+    size_t count = (size_t)(x1 - x0)*(y1 - y0)*spp;
+    // One array per member of tlIntersectionBatch, then the
+    // output
+    buffer->resize(count*11);
+    float *a = buffer->data();
+    float *uv_x = a, *uv_y = a + count;
+    float *wi_x = a + 2*count, *wi_y = a + 3*count, *wi_z = a + 4*count;
+    float *wo_x = a + 5*count, *wo_y = a + 6*count, *wo_z = a + 7*count;
+    float *r = a + 8*count, *g = a + 9*count, *b = a + 10*count;
+    float inv_w = 1.f/(float)job->width, inv_h = 1.f/(float)job->height;
+    size_t i = 0;
+    for(int y=y0;y<y1;y++){
+        for(int x=x0;x<x1;x++){
+            uint32_t state = hash((uint32_t)(x + y*job->width) ^ job->seed);
+            for(int s=0;s<spp;s++){
+                float sx = ((float)(s%strata_x) + jitter(&state))
+                    /(float)strata_x;
+                float sy = ((float)(s/strata_x) + jitter(&state))
+                    /(float)strata_y;
+                uv_x[i] = ((float)x + sx)*inv_w;
+                uv_y[i] = ((float)y + sy)*inv_h;
+                wi_x[i] = job->wi.x; wi_y[i] = job->wi.y; wi_z[i] = job->wi.z;
+                wo_x[i] = job->wo.x; wo_y[i] = job->wo.y; wo_z[i] = job->wo.z;
+                i++;
+            }
+        }
+    }
+    tlIntersectionBatch batch = {uv_x, uv_y, wi_x, wi_y, wi_z,
+        wo_x, wo_y, wo_z, 0, 0, 0, 0, 0, 0};
+    tlColorBatch out = {r, g, b};
+    tl_shade_batch(&batch, job->params, (uint32_t)count, out);
+    i = 0;
+    float inv_spp = 1.f/(float)spp;
+    for(int y=y0;y<y1;y++){
+        for(int x=x0;x<x1;x++){
+            float sum[3] = {0.f, 0.f, 0.f};
+            for(int s=0;s<spp;s++){
+                sum[0] += r[i]; sum[1] += g[i]; sum[2] += b[i];
+                i++;
+            }
+            float *pixel = job->rgb + 3*(x + y*job->width);
+            pixel[0] = sum[0]*inv_spp;
+            pixel[1] = sum[1]*inv_spp;
+            pixel[2] = sum[2]*inv_spp;
+        }
+    }
+}
+
+static int take_tile(TileQueue *queue, int from_back)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    if(queue->begin >= queue->end){
+        return -1;
+    }
+    return from_back ? --queue->end : queue->begin++;
+}
+
+static void render_thread(const RenderJob *job, TileQueue *queues,
+    int num_threads, int index)
+{
+    std::vector<float> buffer;
+    for(;;){
+        int tile = take_tile(&queues[index], 0);
+        for(int i=1;tile < 0 && i<num_threads;i++){
+            tile = take_tile(&queues[(index + i)%num_threads], 1);
+        }
+        if(tile < 0){
+            return;
+        }
+        render_tile(job, tile, &buffer);
+    }
+}
+
+static tlVector direction(float theta, float phi)
+{
+    theta *= (float)M_PI/180.f;
+    phi *= (float)M_PI/180.f;
+    tlVector ret = {sinf(theta)*cosf(phi), sinf(theta)*sinf(phi),
+        cosf(theta), 0.f};
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = "out.png";
+    const char *pattern = "test.wif";
+    int width = 500, height = 500, spp = 4, num_threads = 0, tile_size = 32;
+    unsigned int seed = 0;
+    float light[2] = {0.f, 0.f}, view[2] = {0.f, 0.f};
+    std::vector<const char*> assignments;
+    for(int i=1;i<argc;i++){
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : 0;
+        int ok = 1;
+        if(arg[0] != '-'){
+            pattern = arg;
+            continue;
+        }
+        if(!value){
+            ok = 0;
+        } else if(strcmp(arg, "-o") == 0){
+            output = value;
+        } else if(strcmp(arg, "--size") == 0){
+            ok = sscanf(value, "%dx%d", &width, &height) == 2;
+        } else if(strcmp(arg, "--spp") == 0){
+            ok = sscanf(value, "%d", &spp) == 1;
+        } else if(strcmp(arg, "--threads") == 0){
+            ok = sscanf(value, "%d", &num_threads) == 1;
+        } else if(strcmp(arg, "--tile") == 0){
+            ok = sscanf(value, "%d", &tile_size) == 1;
+        } else if(strcmp(arg, "--light") == 0){
+            ok = sscanf(value, "%f,%f", &light[0], &light[1]) == 2;
+        } else if(strcmp(arg, "--view") == 0){
+            ok = sscanf(value, "%f,%f", &view[0], &view[1]) == 2;
+        } else if(strcmp(arg, "--seed") == 0){
+            ok = sscanf(value, "%u", &seed) == 1;
+        } else if(strcmp(arg, "--set") == 0){
+            assignments.push_back(value);
+        } else{
+            ok = 0;
+        }
+        if(!ok || width <= 0 || height <= 0 || spp <= 0 || num_threads < 0
+                || tile_size <= 0){
+            printf("ERROR: invalid option %s\n\n", arg);
+            usage();
+            return 1;
+        }
+        i++;
+    }
+    const char *errors = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(pattern, &errors);
+    if(!params){
+        printf("ERROR: %s\n", errors);
+        return 1;
+    }
+    params->uscale = 1.f;
+    params->vscale = 1.f;
+    params->intensity_fineness = 0.f;
+    params->realworld_uv = 0;
+    for(size_t i=0;i<assignments.size();i++){
+        if(!set_parameter(params, assignments[i])){
+            printf("ERROR: can not set %s\n", assignments[i]);
+            tl_free_weave_parameters(params);
+            free(params);
+            return 1;
+        }
+    }
+    tl_prepare(params);
+    printf("w: %d h: %d\n", params->pattern_width, params->pattern_height);
+    printf("yarn types: %d\n", params->num_yarn_types);
+
+    if(num_threads == 0){
+        num_threads = (int)std::thread::hardware_concurrency();
+        num_threads = num_threads > 0 ? num_threads : 1;
+    }
+    std::vector<float> rgb((size_t)width*height*3);
+    RenderJob job;
+    job.params = params;
+    job.width = width;
+    job.height = height;
+    job.tile_size = tile_size;
+    job.tiles_x = (width + tile_size - 1)/tile_size;
+    job.spp = spp;
+    job.seed = hash(seed);
+    job.wi = direction(light[0], light[1]);
+    job.wo = direction(view[0], view[1]);
+    job.rgb = rgb.data();
+    int num_tiles = job.tiles_x*((height + tile_size - 1)/tile_size);
+    // Each thread starts with a contiguous range of tiles
+    std::vector<TileQueue> queues(num_threads);
+    for(int t=0;t<num_threads;t++){
+        queues[t].begin = (int)((int64_t)num_tiles*t/num_threads);
+        queues[t].end = (int)((int64_t)num_tiles*(t + 1)/num_threads);
+    }
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(int t=1;t<num_threads;t++){
+        threads.push_back(std::thread(render_thread, &job, queues.data(),
+            num_threads, t));
+    }
+    render_thread(&job, queues.data(), num_threads, 0);
+    for(size_t t=0;t<threads.size();t++){
+        threads[t].join();
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    size_t len = strlen(output);
+    int ok;
+    if(len >= 4 && strcmp(output + len - 4, ".exr") == 0){
+        ok = write_exr(output, rgb.data(), width, height);
+    } else{
+        ok = write_png(output, rgb.data(), width, height);
+    }
+    tl_free_weave_parameters(params);
+    free(params);
+    if(!ok){
+        printf("ERROR: could not write %s\n", output);
+        return 1;
+    }
+    double points = (double)width*height*spp;
+    printf("threads: %d\n", num_threads);
+    printf("wall time: %.3f s\n", seconds);
+    printf("shading points per second: %.0f\n", points/seconds);
     return 0;
 }
@@ -75,7 +75,7 @@ struct BRDFThunderLoom: VRayBSDF {
         paramList->setParamCache("uscale", &m_uscale);
         paramList->setParamCache("vscale", &m_vscale);
         paramList->setParamCache("uvrotation", &m_uvrotation);
-        
+        m_tl_wparams = 0;
     }
 
     tlWeaveParameters *m_tl_wparams;
@@ -142,7 +142,15 @@ void BRDFThunderLoom::frameBegin(VRayRenderer *vray) {
     // Load file and set the global settings.
     const char* filepath_str = (char*)m_filepath.ptr();
     const char *errors = 0;
-    m_tl_wparams = tl_weave_pattern_from_file(filepath_str, &errors);
+    // Materials using the same file share the pattern through the
+    // pattern cache. The previous frame's parameters are freed after loading,
+    // so that the file stays in the cache between frames.
+    tlWeaveParameters *prev_tl_wparams = m_tl_wparams;
+    m_tl_wparams = tl_weave_pattern_from_file_cached(filepath_str, &errors);
+    if (prev_tl_wparams) {
+        tl_free_weave_parameters(prev_tl_wparams);
+        free(prev_tl_wparams);
+    }
     if (errors) {
         prog->error("Error: ThunderLoom: %s", errors);
         return; //Abort a little nicer
@@ -366,15 +374,14 @@ void BRDFThunderLoomSampler::init(const VR::VRayContext &rc, tlWeaveParameters *
     
     intersection_data.context = (void *)&rc;
 
-    tlPatternData pattern_data = tl_get_pattern_data(intersection_data, m_tl_wparams);
+    tlEvalResult result = tl_eval_all(intersection_data, m_tl_wparams,
+        TL_EVAL_DIFFUSE | TL_EVAL_OPACITY);
 
-    m_yarn_type_id = pattern_data.yarn_type;
-    m_yarn_type = m_tl_wparams->yarn_types[pattern_data.yarn_type];
-	m_yarn_hit = pattern_data.yarn_hit;
-    tlColor d = tl_eval_diffuse( intersection_data, pattern_data, m_tl_wparams);
-	m_diffuse_color.set(d.r, d.g, d.b);
-    tlColor o = tl_eval_opacity( intersection_data, pattern_data, m_tl_wparams);
-	m_opacity_color.set(o.r, o.g, o.b);
+    m_yarn_type_id = result.pattern_data.yarn_type;
+    m_yarn_type = m_tl_wparams->yarn_types[result.pattern_data.yarn_type];
+	m_yarn_hit = result.pattern_data.yarn_hit;
+	m_diffuse_color.set(result.diffuse.r, result.diffuse.g, result.diffuse.b);
+	m_opacity_color.set(result.opacity.r, result.opacity.g, result.opacity.b);
 
     return;
 }
@@ -488,10 +495,8 @@ ShadeCol BRDFThunderLoomSampler::eval( const VRayContext &rc, const ShadeVec &di
         
         intersection_data.context = (void *)&rc;
 
-        tlPatternData pattern_data = tl_get_pattern_data(intersection_data,
-                m_tl_wparams);
-        tlColor s = 
-            tl_eval_specular(intersection_data, pattern_data, m_tl_wparams);
+        tlColor s = tl_eval_all(intersection_data, m_tl_wparams,
+            TL_EVAL_SPECULAR).specular;
 
         reflect_color.set(s.r, s.g, s.b);
 
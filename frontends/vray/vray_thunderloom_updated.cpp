@@ -63,6 +63,7 @@ BRDFThunderLoomUpdated::BRDFThunderLoomUpdated(VRayPluginDesc *pluginDesc):VRayB
 	paramList->setParamCache("uscale", &m_uscale);
 	paramList->setParamCache("vscale", &m_vscale);
 	paramList->setParamCache("uvrotation", &m_uvrotation);
+	m_tl_wparams = 0;
 	paramList->setParamCache("bend", &yarnCache.bend);
 	paramList->setParamCache("yarnsize", &yarnCache.yarnsize);
 	paramList->setParamCache("twist", &yarnCache.twist);
@@ -114,7 +115,15 @@ void BRDFThunderLoomUpdated::frameBegin(VRayRenderer *vray) {
 	// Now we don't need to get the params because they are already in the cashe 
     const char* filepath_str = (char*)m_filepath.ptr();
     const char *errors = 0;
-    m_tl_wparams = tl_weave_pattern_from_file(filepath_str, &errors);
+    // Materials using the same file share the pattern through the
+    // pattern cache. The previous frame's parameters are freed after loading,
+    // so that the file stays in the cache between frames.
+    tlWeaveParameters *prev_tl_wparams = m_tl_wparams;
+    m_tl_wparams = tl_weave_pattern_from_file_cached(filepath_str, &errors);
+    if (prev_tl_wparams) {
+        tl_free_weave_parameters(prev_tl_wparams);
+        free(prev_tl_wparams);
+    }
     if (errors) {
         prog->error("Error: ThunderLoom: %s", errors);
         return;
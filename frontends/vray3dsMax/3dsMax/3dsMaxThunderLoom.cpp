@@ -166,6 +166,7 @@ struct YarnTypeDlgProcData
 
 INT_PTR YarnTypeDlgProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
 
+
 class PatternRolloutDlgProc: public ParamMap2UserDlgProc{
 public:
 	IParamMap *pmap;
@@ -299,6 +300,7 @@ public:
                                         sm->pblock->GetValue(mtl_uvrotation,0,
                                             sm->m_weave_parameters->uvrotation,
                                             sm->ivalid);
+                                        sm->publish_pattern();
                                         int num_yarn_types=sm->m_weave_parameters->
                                             num_yarn_types;
                                         sm->m_yarn_type_rollup_open[0]=1;
@@ -350,6 +352,9 @@ public:
                                 sm->pblock->GetValue(mtl_uvrotation,0,
                                     sm->m_weave_parameters->uvrotation,
                                     sm->ivalid);
+                                // The editor changes the pattern
+                                // and yarn types in place
+                                sm->publish_pattern();
 								int num_yarn_types=sm->m_weave_parameters->
 									num_yarn_types;
 								sm->m_yarn_type_rollup_open[0]=1;
@@ -529,6 +534,7 @@ INT_PTR YarnTypeDlgProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
                 data->yarn_type];
 			 //NOTE(Vidar): Hack to update the preview ball
 		#define UPDATE_BALL\
+            data->sm->publish_pattern();\
             data->sm->pblock->SetValue(mtl_dummy,0,0.5f);
 
 	    //NOTE(Vidar): Update checkbox
@@ -685,6 +691,8 @@ void ThunderLoomMtl::Reset() {
 
 ThunderLoomMtl::ThunderLoomMtl(BOOL loading) {
     m_i_mtl_params = 0;
+    m_pattern_slot.current = 0;
+    m_pattern_slot.readers = 0;
 	pblock=NULL;
 	ivalid.SetEmpty();
 	thunderLoomDesc.MakeAutoParamBlocks(this);
@@ -755,24 +763,28 @@ RefResult ThunderLoomMtl::NotifyRefChanged(NOTIFY_REF_CHANGED_ARGS) {
 						int realworld;
 						pblock->GetValue(mtl_realworld,0,realworld,ivalid);
 						m_weave_parameters->realworld_uv=realworld;
+						publish_pattern();
 						break;
 					}
 					case mtl_uscale:
 					{
 						pblock->GetValue(mtl_uscale,0,m_weave_parameters->uscale,
 							ivalid);
+						publish_pattern();
 						break;
 					}
 					case mtl_vscale:
 					{
 						pblock->GetValue(mtl_vscale,0,m_weave_parameters->vscale,
 							ivalid);
+						publish_pattern();
 						break;
 					}
 					case mtl_uvrotation:
 					{
 						pblock->GetValue(mtl_uvrotation,0,m_weave_parameters->uvrotation,
 							ivalid);
+						publish_pattern();
 						break;
 					}
 				}
@@ -938,6 +950,17 @@ RefTargetHandle ThunderLoomMtl::Clone(RemapDir &remap) {
 	mnew->m_weave_parameters=
 		(tlWeaveParameters*)calloc(1,sizeof(tlWeaveParameters));
 	*mnew->m_weave_parameters=*m_weave_parameters;
+	// The tables built by tl_prepare belong to the original. The
+	// clone is compiled and published in its own renderBegin
+	mnew->m_weave_parameters->pattern_runs=0;
+	mnew->m_weave_parameters->resolved_yarn_types=0;
+	mnew->m_weave_parameters->resolved_yarn_texmaps=0;
+	mnew->m_weave_parameters->baked_yarnsize=0;
+	// The pattern is copied below, so the clone does not share
+	// the mapping of a PTN v3 file or a pattern cache entry
+	mnew->m_weave_parameters->ptn_mapping=0;
+	mnew->m_weave_parameters->ptn_mapping_size=0;
+	mnew->m_weave_parameters->cache_entry=0;
 	if(m_weave_parameters->pattern){
 		int num_entries=m_weave_parameters->pattern_width *
 			m_weave_parameters->pattern_height;
@@ -1012,17 +1035,20 @@ float ThunderLoomMtl::WireSize(int mtlNum, BOOL backFace) {
  |	Render intialization and deinitialization (From VUtils::VRenderMtl)
 \*===========================================================================*/
 
-void ThunderLoomMtl::renderBegin(TimeValue t, VR::VRayRenderer *vray) {
-	ivalid.SetInfinite();
-
-	lock_dynamic_library();
-	
-	#define DYNAMIC_FUNC_ARG_TYPES tlWeaveParameters *
-	#define DYNAMIC_FUNC_ARG_NAMES  m_weave_parameters
-			CALL_DYNAMIC_FUNC_VOID(tl_prepare)
+ThunderLoomMtl::~ThunderLoomMtl() {
+	// Releases the last compiled pattern
+	#define DYNAMIC_FUNC_ARG_TYPES tlPatternSlot *, tlCompiledPattern *
+	#define DYNAMIC_FUNC_ARG_NAMES  &m_pattern_slot, 0
+			CALL_DYNAMIC_FUNC_VOID(tl_pattern_slot_publish)
 	#undef DYNAMIC_FUNC_ARG_TYPES
 	#undef DYNAMIC_FUNC_ARG_NAMES
-    
+}
+
+// m_weave_parameters is only the description edited in the UI. The render
+// threads shade with a compiled copy of it, which is replaced here after
+// each edit. A thread which is in the middle of shading keeps the copy it
+// acquired in newBSDF until deleteBSDF.
+void ThunderLoomMtl::publish_pattern() {
     if(m_weave_parameters->pattern){
 		for(int i=0;i<m_weave_parameters->num_yarn_types;i++){
 			tlYarnType *yarn_type=&m_weave_parameters->yarn_types[i];
@@ -1034,6 +1060,27 @@ void ThunderLoomMtl::renderBegin(TimeValue t, VR::VRayRenderer *vray) {
 		}
 	}
 
+	// tl_compile_pattern resolves the texmaps, so it has to be called
+	// after they have been assigned
+	#define DYNAMIC_FUNC_ARG_TYPES const tlWeaveParameters *, uint32_t, void *
+	#define DYNAMIC_FUNC_ARG_NAMES  m_weave_parameters, 0, 0
+			CALL_DYNAMIC_FUNC(tl_compile_pattern, tlCompiledPattern *, compiled)
+	#undef DYNAMIC_FUNC_ARG_TYPES
+	#undef DYNAMIC_FUNC_ARG_NAMES
+	#define DYNAMIC_FUNC_ARG_TYPES tlPatternSlot *, tlCompiledPattern *
+	#define DYNAMIC_FUNC_ARG_NAMES  &m_pattern_slot, compiled
+			CALL_DYNAMIC_FUNC_VOID(tl_pattern_slot_publish)
+	#undef DYNAMIC_FUNC_ARG_TYPES
+	#undef DYNAMIC_FUNC_ARG_NAMES
+}
+
+void ThunderLoomMtl::renderBegin(TimeValue t, VR::VRayRenderer *vray) {
+	ivalid.SetInfinite();
+
+	lock_dynamic_library();
+
+	publish_pattern();
+
 	const VR::VRaySequenceData &sdata=vray->getSequenceData();
 	bsdfPool.init(sdata.maxRenderThreads);
 }
@@ -1044,16 +1091,35 @@ void ThunderLoomMtl::renderEnd(VR::VRayRenderer *vray) {
 	renderChannels.freeMem();
 }
 
+static void release_pattern(tlCompiledPattern *compiled)
+{
+	#define DYNAMIC_FUNC_ARG_TYPES tlCompiledPattern *
+	#define DYNAMIC_FUNC_ARG_NAMES  compiled
+			CALL_DYNAMIC_FUNC_VOID(tl_release_compiled_pattern)
+	#undef DYNAMIC_FUNC_ARG_TYPES
+	#undef DYNAMIC_FUNC_ARG_NAMES
+}
+
 VR::BSDFSampler* ThunderLoomMtl::newBSDF(const VR::VRayContext &rc, VR::VRenderMtlFlags flags) {
+	#define DYNAMIC_FUNC_ARG_TYPES tlPatternSlot *
+	#define DYNAMIC_FUNC_ARG_NAMES  &m_pattern_slot
+			CALL_DYNAMIC_FUNC(tl_pattern_slot_acquire, tlCompiledPattern *, compiled)
+	#undef DYNAMIC_FUNC_ARG_TYPES
+	#undef DYNAMIC_FUNC_ARG_NAMES
+	if (!compiled) return NULL;
 	MyBlinnBSDF *bsdf=bsdfPool.newBRDF(rc);
-	if (!bsdf) return NULL;
-	bsdf->init(rc, m_weave_parameters);
+	if (!bsdf) {
+		release_pattern(compiled);
+		return NULL;
+	}
+	bsdf->init(rc, compiled);
 	return bsdf;
 }
 
 void ThunderLoomMtl::deleteBSDF(const VR::VRayContext &rc, VR::BSDFSampler *b) {
 	if (!b) return;
 	MyBlinnBSDF *bsdf=static_cast<MyBlinnBSDF*>(b);
+	release_pattern(bsdf->getCompiledPattern());
 	bsdfPool.deleteBRDF(rc, bsdf);
 }
 
@@ -109,6 +109,8 @@ public:
 
 	Interval ivalid;
     tlWeaveParameters *m_weave_parameters;
+    // The compiled pattern which the render threads shade with
+    tlPatternSlot m_pattern_slot;
     IMtlParams *m_i_mtl_params;
     bool m_yarn_type_rollup_open[TL_MAX_YARN_TYPES];
 
@@ -120,6 +122,8 @@ public:
 	void Reset();
 
 	ThunderLoomMtl(BOOL loading);
+	~ThunderLoomMtl();
+	void publish_pattern();
 	Class_ID ClassID() { return MTL_CLASSID; }
 	SClass_ID SuperClassID() { return MATERIAL_CLASS_ID; }
 	void GetClassName(TSTR& s) { s=STR_CLASSNAME; }
@@ -63,17 +63,13 @@ void EvalDiffuseFunc (const VUtils::VRayContext *rc,
 
     intersection_data.context = &sc;
 
-    tlPatternData pattern_data = tl_get_pattern_data(intersection_data,
-        weave_parameters);
-	*yarn_type_id = pattern_data.yarn_type;
-	*yarn_type = weave_parameters->yarn_types[pattern_data.yarn_type];
-	*yarn_hit = pattern_data.yarn_hit;
-    tlColor d = 
-        tl_eval_diffuse( intersection_data, pattern_data, weave_parameters);
-	diffuse_color->set(d.r, d.g, d.b);
-    tlColor o = 
-        tl_eval_opacity( intersection_data, pattern_data, weave_parameters);
-	opacity_color->set(o.r, o.g, o.b);
+    tlEvalResult result = tl_eval_all(intersection_data, weave_parameters,
+        TL_EVAL_DIFFUSE | TL_EVAL_OPACITY);
+	*yarn_type_id = result.pattern_data.yarn_type;
+	*yarn_type = weave_parameters->yarn_types[result.pattern_data.yarn_type];
+	*yarn_hit = result.pattern_data.yarn_hit;
+	diffuse_color->set(result.diffuse.r, result.diffuse.g, result.diffuse.b);
+	opacity_color->set(result.opacity.r, result.opacity.g, result.opacity.b);
 }
 
 DYNAMIC_FUNC_PREFIX
@@ -130,9 +126,8 @@ const VUtils::ShadeVec *direction, tlWeaveParameters *weave_parameters, VUtils::
 
     intersection_data.context = &sc;
 
-    tlPatternData pattern_data = tl_get_pattern_data(intersection_data,
-        weave_parameters);
-    tlColor s = tl_eval_specular(intersection_data, pattern_data, weave_parameters);
+    tlColor s = tl_eval_all(intersection_data, weave_parameters,
+        TL_EVAL_SPECULAR).specular;
     reflection_color->set(s.r, s.g, s.b);
 }
 
@@ -15,10 +15,13 @@ using namespace VUtils;
 // From this point, several rays can be fired in different directions, each
 // one calling eval(). In this function we can do all the work that is common
 // throughout all directions, such as computing the diffuse color.
-void MyBaseBSDF::init(const VRayContext &rc, tlWeaveParameters *weave_parameters) {
-    m_weave_parameters = weave_parameters;
+// compiled has been acquired by ThunderLoomMtl::newBSDF, and is released in
+// deleteBSDF.
+void MyBaseBSDF::init(const VRayContext &rc, tlCompiledPattern *compiled) {
+    m_compiled = compiled;
+    m_weave_parameters = &compiled->params;
 #define DYNAMIC_FUNC_ARG_TYPES const VUtils::VRayContext *, tlWeaveParameters*, VUtils::ShadeCol*, VUtils::ShadeCol*, tlYarnType*, int*, int*
-#define DYNAMIC_FUNC_ARG_NAMES &rc,weave_parameters,&m_diffuse_color, &m_opacity_color,&m_yarn_type, &m_yarn_type_id,&m_yarn_hit
+#define DYNAMIC_FUNC_ARG_NAMES &rc,m_weave_parameters,&m_diffuse_color, &m_opacity_color,&m_yarn_type, &m_yarn_type_id,&m_yarn_hit
 		CALL_DYNAMIC_FUNC_VOID(EvalDiffuseFunc)
 #undef DYNAMIC_FUNC_ARG_TYPES
 #undef DYNAMIC_FUNC_ARG_NAMES
@@ -14,6 +14,7 @@ protected:
 	ShadeVec normal, gnormal;
     int orig_backside;
 
+    tlCompiledPattern *m_compiled;
     tlWeaveParameters *m_weave_parameters;
 	Texmap **m_texmaps;
 	tlYarnType m_yarn_type;
@@ -23,7 +24,8 @@ protected:
 public:
 
 	// Initialization
-	void init(const VRayContext &rc, tlWeaveParameters *weave_parameters);
+	void init(const VRayContext &rc, tlCompiledPattern *compiled);
+	tlCompiledPattern *getCompiledPattern() { return m_compiled; }
 
 	// From BRDFSampler
 	ShadeVec getDiffuseNormal(const VR::VRayContext &rc);
@@ -316,7 +316,10 @@ MStatus ThunderLoomCommand::doIt( const MArgList& args ) {
                 
                 // Start to look for file
                 const char *error;
-                tlWeaveParameters *tl_wparams = tl_weave_pattern_from_file(filepath, &error);
+                // This is called on every UI refresh. The cache
+                // keeps the file loaded after it is freed below, which saves
+                // us from parsing it each time
+                tlWeaveParameters *tl_wparams = tl_weave_pattern_from_file_cached(filepath, &error);
                 if (!tl_wparams) {
                     MPxCommand::clearResult();
                     MPxCommand::appendToResult(0.f);
@@ -347,6 +350,8 @@ TL_PARAMS
 #undef TL_PARAM_BOOL
                 
                 }
+                tl_free_weave_parameters(tl_wparams);
+                free(tl_wparams);
             }
         }
     } else {
@@ -296,6 +296,9 @@ tlWeaveParameters *tl_pattern_editor(tlWeaveParameters *param)
     glfwMakeContextCurrent(window);
     gl3wInit();
 
+    // The editor works on the whole pattern
+    tl_expand_pattern_repeats(param);
+
     EditorData data={};
     data.bitmap=(unsigned char*)calloc(param->pattern_width*param->pattern_height,4);
     data.center_x = 0.5f;
@@ -383,6 +386,7 @@ tlWeaveParameters *tl_pattern_editor(tlWeaveParameters *param)
                     if(p){
                         tl_free_weave_parameters(param);
                         param = p;
+                        tl_expand_pattern_repeats(param);
                         data.center_x = 0.5f;
                         data.center_y = 0.5f;
                         data.current_yarn_type=1;
@@ -27,10 +27,25 @@ TL_PUBLIC_FUNC_PREFIX
 tlWeaveParameters *tl_weave_pattern_from_file(const char *filename,const char **error);
 
 /* Before each frame, call tl_prepare to apply all changes to parameters
+ * tl_prepare also builds the lookup tables used during shading, so it has to
+ * be called again whenever the pattern, a yarn type parameter or a texmap
+ * pointer is changed.
  */
 TL_PUBLIC_FUNC_PREFIX
 void tl_prepare(tlWeaveParameters *params);
 
+/* After only changing yarn type parameters or texmap pointers, call
+ * tl_update_yarn_types instead, which skips rebuilding the pattern tables.
+ * The number of yarn types must not change. Tables built by
+ * tl_prepare_baked_yarnsize, tl_prepare_prefiltered and tl_prepare_far_field
+ * are not updated.
+ * Like tl_prepare, it must not be called while other threads are shading
+ * with params. To apply edits during an interactive render, compile the
+ * edited parameters and publish them instead, see Compiled patterns.
+ */
+TL_PUBLIC_FUNC_PREFIX
+void tl_update_yarn_types(tlWeaveParameters *params);
+
 /* During rendering, fill out an instance of tlIntersectionData
  * with the relevant information about the current shading point,
  * and call tl_shade to recieve the reflected color.
@@ -106,6 +121,9 @@ struct tlIntersectionData
     float wi_x, wi_y, wi_z; // Incident direction 
     float wo_x, wo_y, wo_z; // Outgoing direction
 	void *context;          // User data sent to texturing callbacks
+    // Optional screen space derivatives of uv_x and uv_y, see Prefiltered
+    // shading. Leave them at 0 if they are not known.
+    float du_dx, dv_dx, du_dy, dv_dy;
 };
 /* The coordinate system for the directions needs to be defined such that
  * x points along dP/du, y points along dP/dv, and z points along the normal.
@@ -127,7 +145,14 @@ struct tlIntersectionData
  * from tlIntersectionData.
  * If you don't want to implement these callbacks, make sure that
  * TL_NO_TEXTURE_CALLBACKS is defined when you include thunderloom.h
+ * If the renderer never sets any texmaps, define TL_NO_TEXMAPS instead. The
+ * texmap checks are then compiled out of the parameter getters, and any
+ * texmaps in tlYarnType are ignored. TL_NO_TEXMAPS implies
+ * TL_NO_TEXTURE_CALLBACKS.
  */
+#if defined(TL_NO_TEXMAPS) && !defined(TL_NO_TEXTURE_CALLBACKS)
+#define TL_NO_TEXTURE_CALLBACKS
+#endif
 //TODO(Vidar): Send these callbacks as parameters instead??
 TL_PUBLIC_FUNC_PREFIX
 float tl_eval_texmap_mono_lookup(void *texmap, float u, float v, void *context);
@@ -138,6 +163,35 @@ float tl_eval_texmap_mono(void *texmap, void *context);
 TL_PUBLIC_FUNC_PREFIX
 tlColor tl_eval_texmap_color(void *texmap, void *context);
 
+/* --- Batched texturing ---
+ * Renderers which can evaluate a texture for many points at once can define
+ * TL_TEXTURE_BATCH_CALLBACKS and implement the batch callbacks below as
+ * well. Each one evaluates texmap for count points and writes one result per
+ * point. The same texmap and context would otherwise have been sent to the
+ * scalar callback once per point, so both must give the same results.
+ * tl_shade_batch and tl_eval_specular_batch gather the texmap requests of up
+ * to TL_TEXTURE_PACKET_SIZE points, across all yarn types and parameters, and
+ * make one call per texmap. The lookup variant is used by
+ * tl_prepare_baked_yarnsize, where all points share the same context.
+ * The yarnsize lookups made while finding the yarn segment are still made
+ * one point at a time, unless they are baked with tl_prepare_baked_yarnsize.
+ */
+#ifndef TL_TEXTURE_PACKET_SIZE
+#define TL_TEXTURE_PACKET_SIZE 64
+#endif
+#ifdef TL_TEXTURE_BATCH_CALLBACKS
+#include <stdint.h>
+TL_PUBLIC_FUNC_PREFIX
+void tl_eval_texmap_mono_lookup_batch(void *texmap, const float *u,
+    const float *v, void * const *context, uint32_t count, float *result);
+TL_PUBLIC_FUNC_PREFIX
+void tl_eval_texmap_mono_batch(void *texmap, void * const *context,
+    uint32_t count, float *result);
+TL_PUBLIC_FUNC_PREFIX
+void tl_eval_texmap_color_batch(void *texmap, void * const *context,
+    uint32_t count, tlColor *result);
+#endif
+
 /* --- Separating diffuse and specular reflection ---
  * ...
  */ 
@@ -147,6 +201,7 @@ tlColor tl_eval_texmap_color(void *texmap, void *context);
 /* ------------ Implementation --------------------- */
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct
 {
@@ -175,6 +230,49 @@ TL_YARN_PARAMETERS
 #undef TL_COLOR_PARAM
 }tlYarnType;
 
+// Index of each yarn parameter, used for the bits in
+// tlResolvedYarnType.textured and for indexing resolved_yarn_texmaps
+enum
+{
+#define TL_FLOAT_PARAM(name) TL_YARN_PARAM_##name,
+#define TL_INT_PARAM(name)  TL_YARN_PARAM_##name,
+#define TL_COLOR_PARAM(name) TL_YARN_PARAM_##name,
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+    TL_YARN_PARAM_COUNT
+};
+// The textured mask is 32 bits wide
+typedef char tl_yarn_param_count_check[TL_YARN_PARAM_COUNT <= 32 ? 1 : -1];
+
+#ifndef TL_ALIGN
+#ifdef _MSC_VER
+#define TL_ALIGN(n) __declspec(align(n))
+#else
+#define TL_ALIGN(n) __attribute__((aligned(n)))
+#endif
+#endif
+#define TL_CACHE_LINE_SIZE 64
+
+// Yarn type parameters with the inheritance from yarn type 0 already
+// resolved. Built by tl_prepare, one per yarn type, and read by the
+// tl_yarn_type_get_* functions. If bit TL_YARN_PARAM_[param] of textured is
+// set, the parameter is evaluated from the texmap in
+// tlWeaveParameters.resolved_yarn_texmaps instead.
+typedef struct TL_ALIGN(TL_CACHE_LINE_SIZE) tlResolvedYarnType
+{
+#define TL_FLOAT_PARAM(name) float name;
+#define TL_INT_PARAM(name)  uint8_t name;
+#define TL_COLOR_PARAM(name) tlColor name;
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+    uint32_t textured;
+    uint8_t specular_kernel; //Index in tl_specular_kernels
+}tlResolvedYarnType;
+
 typedef struct
 {
     uint8_t warp_above;
@@ -183,6 +281,70 @@ typedef struct
 }PatternEntry;
 #define TL_MAX_YARN_TYPES 256
 
+// Number of neighbouring cells with the same warp_above as a pattern cell,
+// counted in each direction along x and y, wrapping around the pattern.
+// Runs longer than TL_PATTERN_RUN_SATURATED are stored as
+// TL_PATTERN_RUN_SATURATED and continued from the cell that many steps away.
+typedef struct
+{
+    uint8_t x_left, x_right;
+    uint8_t y_left, y_right;
+}tlPatternRuns;
+#define TL_PATTERN_RUN_SATURATED 255
+
+// Yarn sizes sampled once per cell by tl_prepare_baked_yarnsize. The entry
+// of the cell with total (non repeating) coordinates (x,y) is
+// yarnsize[(x-x0) + (y-y0)*width].
+typedef struct
+{
+    int32_t x0, y0;
+    uint32_t width, height;
+    float *yarnsize;
+}tlBakedYarnsize;
+
+// The draft of a pattern, see tl_weave_pattern_from_file_draft. The cell at
+// (x,y) has warp_above = tieup[treadling[y] + threading[x]*num_treadles].
+typedef struct
+{
+    uint32_t num_shafts, num_treadles;
+    uint32_t *threading; //Shaft of each warp thread, pattern_width entries
+    uint32_t *treadling; //Treadle of each weft thread, pattern_height entries
+    uint8_t *tieup; //num_treadles*num_shafts entries
+    uint8_t *warp_yarn_types; //pattern_width entries
+    uint8_t *weft_yarn_types; //pattern_height entries
+}tlPatternDraft;
+
+// A pattern packed by tl_pack_pattern. The cells are grouped in 8x8 tiles,
+// stored row by row. Cell (x,y) is bit (x%8) + (y%8)*8 of its tile.
+typedef struct
+{
+    uint32_t tiles_x, tiles_y;
+    uint32_t yarn_type_bits; //0, 1, 2, 4 or 8
+    uint8_t palette[TL_MAX_YARN_TYPES]; //Yarn type of each palette index
+    uint64_t *warp_above; //One word per tile
+    uint64_t *yarn_types; //yarn_type_bits words per tile, palette indices
+}tlPackedPattern;
+
+// A procedural weave, see tl_weave_pattern_from_procedural. The cells are
+// grouped in blocks of block_width by block_height cells, and block (bx,by)
+// has warp_above if (bx + shift*by)%repeat < warp_float.
+typedef struct
+{
+    uint32_t family;
+    uint32_t repeat, warp_float, shift;
+    uint32_t block_width, block_height;
+    uint32_t warp_period, weft_period;
+    uint8_t *warp_yarn_types; //warp_period entries
+    uint8_t *weft_yarn_types; //weft_period entries
+    // The number of following blocks with the same warp_above,
+    // repeat entries for each direction along x and y, see tl_procedural_run
+    uint32_t *block_runs;
+}tlProceduralWeave;
+
+typedef struct tlPatternCacheEntry tlPatternCacheEntry;
+typedef struct tlPrefilteredPattern tlPrefilteredPattern;
+typedef struct tlFarFieldBRDF tlFarFieldBRDF;
+
 struct tlWeaveParameters
 {
 #define TL_FLOAT_PARAM(name) float name;
@@ -202,6 +364,31 @@ TL_FABRIC_PARAMETERS
     float specular_normalization; //Deprecated
     float pattern_realheight;
     float pattern_realwidth;
+// Number of times the pattern is repeated along x and y in the file it was
+// loaded from, see tl_expand_pattern_repeats. 0 means 1. pattern_realwidth
+// and pattern_realheight are the size of all repeats.
+    uint32_t pattern_repeats_x, pattern_repeats_y;
+// These are built by tl_prepare and freed by tl_free_weave_parameters
+    tlPatternRuns *pattern_runs; //One entry per pattern cell
+    tlResolvedYarnType *resolved_yarn_types; //One entry per yarn type
+    void **resolved_yarn_texmaps; //TL_YARN_PARAM_COUNT entries per yarn type
+    tlBakedYarnsize *baked_yarnsize; //Only built by tl_prepare_baked_yarnsize
+    tlPrefilteredPattern *prefiltered; //Only built by tl_prepare_prefiltered
+    tlFarFieldBRDF *far_field; //Only built by tl_prepare_far_field
+    uint64_t prepare_id; //Unique for each call to tl_prepare
+// Set when the pattern was loaded from a PTN v3 file, in which case pattern
+// points into this mapping and tl_free_weave_parameters unmaps it
+    void *ptn_mapping;
+    size_t ptn_mapping_size;
+// Set when loaded by tl_weave_pattern_from_file_cached, in which case pattern
+// and pattern_runs are shared with the cache entry
+    tlPatternCacheEntry *cache_entry;
+// Set instead of pattern when the pattern is stored as a draft
+    tlPatternDraft *draft;
+// Set instead of pattern when the pattern has been packed by tl_pack_pattern
+    tlPackedPattern *packed;
+// Set instead of pattern for tl_weave_pattern_from_procedural
+    tlProceduralWeave *procedural;
 };
 
 typedef struct
@@ -230,6 +417,90 @@ TL_PUBLIC_FUNC_PREFIX
 tlColor tl_eval_opacity(tlIntersectionData intersection_data,
     tlPatternData data, const tlWeaveParameters *params);
 
+/* tl_eval_all computes the pattern data together with the lobes selected by
+ * flags, evaluating each yarn parameter, and thus each texmap, at most once.
+ * This is cheaper than calling tl_get_pattern_data followed by the
+ * tl_eval_* functions above, unless their _cached variants are used, see
+ * Yarn parameter cache below, and gives the same result. Lobes which are not
+ * requested are set to black, except the opacity which is always computed
+ * together with the diffuse.
+ * tl_eval_shadow_opacity only computes the opacity, for shadow rays.
+ */
+#define TL_EVAL_DIFFUSE  1
+#define TL_EVAL_SPECULAR 2
+#define TL_EVAL_OPACITY  4
+#define TL_EVAL_ALL (TL_EVAL_DIFFUSE | TL_EVAL_SPECULAR | TL_EVAL_OPACITY)
+typedef struct
+{
+    tlPatternData pattern_data;
+    tlColor diffuse;
+    tlColor specular;
+    tlColor opacity;
+} tlEvalResult;
+TL_PUBLIC_FUNC_PREFIX
+tlEvalResult tl_eval_all(tlIntersectionData intersection_data,
+    const tlWeaveParameters *params, uint32_t flags);
+TL_PUBLIC_FUNC_PREFIX
+tlColor tl_eval_shadow_opacity(tlIntersectionData intersection_data,
+    const tlWeaveParameters *params);
+
+/* --- Fast math ---
+ * Define TL_FAST_MATH when including the implementation to let tl_shade and
+ * the tl_eval functions use a polynomial approximation of atan2 instead of
+ * libm, the same one as tl_shade_batch uses, and reuse sin and cos of an
+ * angle instead of calling tanf on it. Each channel is within 1e-4 of the
+ * exact value relative to it, plus 1e-6 absolute, except for points right at
+ * the edge of a highlight. In tests/test_golden tl_shade is 5-9% faster with
+ * it than without, built with gcc -O2 against glibc.
+ */
+
+/* --- Batch shading ---
+ * Renderers which shade several points at once can use tl_shade_batch
+ * instead of calling tl_shade once per point. The shading points are given
+ * as a structure of arrays, each array having one entry per point.
+ * If mask is not NULL, only the points with a nonzero mask entry are shaded,
+ * and the output of the other points is left untouched. context can be NULL,
+ * in which case the texturing callbacks get a NULL context.
+ *
+ * The pattern lookup is done one point at a time and the texmaps are
+ * evaluated per packet, see Batched texturing above, while the specular and
+ * diffuse terms are computed TL_SIMD_WIDTH points at a time, using AVX2 if
+ * the compiler targets it and SSE otherwise. Define TL_NO_SIMD to use plain
+ * C.
+ * The vectorized kernels use polynomial approximations of sin, cos, atan2
+ * and acos, so the result differs slightly from tl_shade. Each channel is
+ * within 2e-4 of the tl_shade value relative to it, plus 1e-6 absolute.
+ * The exception is a point right at the edge of a highlight, where the
+ * rounding can decide whether it is inside the highlight or not. This
+ * affects far less than 0.1% of the points. The results are the same for
+ * every SIMD width.
+ */
+typedef struct
+{
+    const float *uv_x, *uv_y;
+    const float *wi_x, *wi_y, *wi_z;
+    const float *wo_x, *wo_y, *wo_z;
+    const uint8_t *mask;   //Optional
+    void * const *context; //Optional, one context per point
+    const float *du_dx, *dv_dx, *du_dy, *dv_dy; //Optional, all or none
+} tlIntersectionBatch;
+
+typedef struct
+{
+    float *r, *g, *b;
+} tlColorBatch;
+
+TL_PUBLIC_FUNC_PREFIX
+void tl_shade_batch(const tlIntersectionBatch *intersection_data,
+    const tlWeaveParameters *params, uint32_t count, tlColorBatch out);
+TL_PUBLIC_FUNC_PREFIX
+void tl_get_pattern_data_batch(const tlIntersectionBatch *intersection_data,
+    const tlWeaveParameters *params, uint32_t count, tlPatternData *data);
+TL_PUBLIC_FUNC_PREFIX
+void tl_eval_specular_batch(const tlIntersectionBatch *intersection_data,
+    const tlPatternData *data, const tlWeaveParameters *params,
+    uint32_t count, tlColorBatch out);
+
 TL_PUBLIC_FUNC_PREFIX
 tlWeaveParameters *tl_weave_pattern_from_data(uint8_t *warp_above,
     uint8_t *yarn_type, uint32_t num_yarn_types, tlColor *yarn_colors,
@@ -243,6 +514,375 @@ TL_PUBLIC_FUNC_PREFIX
 tlWeaveParameters *tl_weave_pattern_from_ptn(unsigned char *data,long len,
                 const char **error);
 
+/* --- Drafts ---
+ * A WIF file describes the pattern by its draft: the threading, treadling and
+ * tieup, which are usually much smaller than the pattern itself.
+ * tl_weave_pattern_from_file_draft and tl_weave_pattern_from_wif_draft keep
+ * the draft instead of expanding it into tlWeaveParameters::pattern, which is
+ * then 0, and look up each cell from the draft while shading. The pattern
+ * runs built by tl_prepare are stored per treadle and shaft instead of per
+ * cell. Shading is identical to the expanded pattern.
+ * This saves memory when the number of shafts and treadles is small compared
+ * to the size of the pattern. PTN files store the expanded pattern and are
+ * loaded as usual.
+ */
+TL_PUBLIC_FUNC_PREFIX
+tlWeaveParameters *tl_weave_pattern_from_file_draft(const char *filename,
+                const char **error);
+TL_PUBLIC_FUNC_PREFIX
+tlWeaveParameters *tl_weave_pattern_from_wif_draft(unsigned char *data,long len,
+                const char **error);
+
+/* --- Procedural weaves ---
+ * tl_weave_pattern_from_procedural describes the most common weaves by a few
+ * numbers instead of a pattern, and the yarn types by stripes of warp and
+ * weft threads. Each cell, and the length of the yarn it belongs to, is
+ * computed while shading, so the memory used does not depend on the size of
+ * the pattern and tl_prepare builds no pattern runs.
+ * TL_WEAVE_PLAIN  Plain weave. warp_float, weft_float and shift are ignored.
+ * TL_WEAVE_TWILL  Each warp thread goes over warp_float weft threads and under
+ *                 weft_float. Each row is shifted shift cells from the one
+ *                 before, 1 if shift is 0.
+ * TL_WEAVE_SATIN  Like a twill, but warp_float or weft_float must be 1 and
+ *                 shift is the move number, which must be larger than 1,
+ *                 smaller than warp_float + weft_float - 1 and have no common
+ *                 factor with it. warp_float + weft_float must be at least 5.
+ * TL_WEAVE_BASKET A plain weave of blocks of warp_float by weft_float cells.
+ * The stripes are repeated across the pattern, each using count threads of
+ * yarn_type, which like for tl_weave_pattern_from_data is between 1 and
+ * num_yarn_types. The pattern is as large as the smallest repeat of both the
+ * weave and the stripes, at most TL_MAX_PROCEDURAL_SIZE cells along x and y.
+ * Returns 0 and sets error if the parameters are invalid.
+ */
+#define TL_WEAVE_PLAIN  0
+#define TL_WEAVE_TWILL  1
+#define TL_WEAVE_SATIN  2
+#define TL_WEAVE_BASKET 3
+#ifndef TL_MAX_PROCEDURAL_SIZE
+#define TL_MAX_PROCEDURAL_SIZE (1<<16)
+#endif
+typedef struct
+{
+    uint32_t count;
+    uint8_t yarn_type;
+}tlYarnStripe;
+TL_PUBLIC_FUNC_PREFIX
+tlWeaveParameters *tl_weave_pattern_from_procedural(uint32_t family,
+    uint32_t warp_float, uint32_t weft_float, uint32_t shift,
+    const tlYarnStripe *warp_stripes, uint32_t num_warp_stripes,
+    const tlYarnStripe *weft_stripes, uint32_t num_weft_stripes,
+    uint32_t num_yarn_types, tlColor *yarn_colors, const char **error);
+
+/* --- Packed patterns ---
+ * tl_pack_pattern converts a loaded pattern to a compact storage, which is
+ * worthwhile for large jacquard patterns. Each cell takes one bit for
+ * warp_above and 0 to 8 bits for the yarn type, depending on how many
+ * different yarn types the pattern uses, instead of two bytes. The cells are
+ * stored in 8x8 tiles, so that neighbouring cells along both x and y share
+ * cache lines. No per cell pattern runs are built by tl_prepare for a packed
+ * pattern, the runs are counted from the tiles instead.
+ * Afterwards, tlWeaveParameters::pattern is 0. Shading is identical to the
+ * unpacked pattern. Patterns which are drafts or shared through the pattern
+ * cache are left as they are. Call tl_prepare after packing.
+ */
+TL_PUBLIC_FUNC_PREFIX
+void tl_pack_pattern(tlWeaveParameters *params);
+
+/* --- Pattern repeats ---
+ * WIF files often contain the same small pattern repeated many times to fill
+ * the width of the loom. When a WIF or PTN v1/v2 file is loaded, the smallest
+ * pattern that the file is an exact repeat of is found, checking both
+ * warp_above and yarn_type, and only that pattern is stored.
+ * tlWeaveParameters::pattern_repeats_x and pattern_repeats_y are set to the
+ * number of repeats. uscale, vscale, pattern_realwidth and pattern_realheight
+ * still refer to the whole pattern of the file, so nothing changes for the
+ * host. The shading is done in cells of the whole pattern, and only the
+ * lookups in the stored pattern wrap around at the end of a repeat, so the
+ * result is exactly the same as for the whole pattern. A pattern is not
+ * shrunk along x if some row is all warp or all weft, and likewise for
+ * columns along y, since the length of such a yarn depends on the size of
+ * the pattern.
+ * PTN v3 files keep the single repeat and the number of repeats, while
+ * tl_pattern_to_ptn_file writes the whole pattern so that older versions can
+ * read it.
+ * tl_expand_pattern_repeats stores the whole pattern again, which is needed
+ * before editing it. Call tl_prepare afterwards.
+ */
+TL_PUBLIC_FUNC_PREFIX
+void tl_expand_pattern_repeats(tlWeaveParameters *params);
+
+/* --- Baked yarn sizes ---
+ * A yarnsize texmap is evaluated with tl_eval_texmap_mono_lookup at the
+ * centre of a cell, up to five times per shading point. Since the result only
+ * depends on the cell, tl_prepare_baked_yarnsize can be called instead of
+ * tl_prepare to sample it once per cell into a table, which is then read
+ * during shading. context is passed to tl_eval_texmap_mono_lookup in place of
+ * the shading context, so this is only correct when the lookup depends on
+ * the texmap and the uv coordinates alone.
+ * The table covers the cells of the unit uv square, after scaling and
+ * rotation, and is not built if it would have more than
+ * TL_MAX_BAKED_YARNSIZE_CELLS entries or if no yarnsize is textured. Other
+ * cells use the callback as usual. Calling tl_prepare removes the table.
+ */
+#ifndef TL_MAX_BAKED_YARNSIZE_CELLS
+#define TL_MAX_BAKED_YARNSIZE_CELLS (1<<24)
+#endif
+TL_PUBLIC_FUNC_PREFIX
+void tl_prepare_baked_yarnsize(tlWeaveParameters *params, void *context);
+
+/* --- Prefiltered shading ---
+ * When a pixel covers several cells of the pattern, point sampling the yarns
+ * gives moire and sparkling highlights unless many samples are taken per
+ * pixel. Calling tl_prepare_prefiltered after tl_prepare, or after
+ * tl_prepare_baked_yarnsize, builds a prefiltered version of one repeat of
+ * the pattern, which tl_shade, tl_eval_all, tl_eval_shadow_opacity and
+ * tl_shade_batch switch to when the uv derivatives of the shading point are
+ * given and its footprint is large. Calling tl_prepare removes it.
+ *
+ * The prefiltered pattern stores the fraction of the repeat covered by each
+ * yarn type, giving the averaged diffuse and opacity, and for each yarn type
+ * and orientation a few points on the yarn, chosen and weighted so that they
+ * represent the whole repeat, whose specular is summed into an aggregate
+ * lobe. The yarn parameters are still evaluated at the shading point, but
+ * context is passed to tl_eval_texmap_mono_lookup in place of the shading
+ * context for textured yarn sizes.
+ *
+ * The footprint is the longest of the two derivative vectors, measured in
+ * pattern cells. Below TL_PREFILTER_MIN_FOOTPRINT cells the pattern is shaded
+ * as usual, above TL_PREFILTER_MAX_FOOTPRINT only the prefiltered pattern is
+ * used, and in between the two are blended smoothly. The pattern data
+ * returned by tl_eval_all is always the one at the shading point.
+ */
+#ifndef TL_PREFILTER_MIN_FOOTPRINT
+#define TL_PREFILTER_MIN_FOOTPRINT 1.f
+#endif
+#ifndef TL_PREFILTER_MAX_FOOTPRINT
+#define TL_PREFILTER_MAX_FOOTPRINT 3.f
+#endif
+// Number of points per yarn type and orientation is at most the square of
+// this
+#ifndef TL_PREFILTER_STRATA
+#define TL_PREFILTER_STRATA 8
+#endif
+// Number of points per cell along each axis used to build the prefiltered
+// pattern, lowered for large patterns to stay below
+// TL_MAX_PREFILTER_SAMPLES in total
+#ifndef TL_PREFILTER_SAMPLES_PER_CELL
+#define TL_PREFILTER_SAMPLES_PER_CELL 8
+#endif
+#ifndef TL_MAX_PREFILTER_SAMPLES
+#define TL_MAX_PREFILTER_SAMPLES (1<<22)
+#endif
+typedef struct
+{
+    tlPatternData data; //Without the segment uv and normal
+    float weight; //Fraction of the repeat which this point represents
+} tlPrefilteredSample;
+struct tlPrefilteredPattern
+{
+    uint32_t num_yarn_types;
+    float *coverage; //Fraction of the repeat covered by each yarn type
+    float gap_coverage; //Fraction of the repeat between the yarns
+    // Sorted by yarn type, the samples of yarn type i are
+    // first_sample[i] to first_sample[i+1]-1
+    uint32_t *first_sample; //num_yarn_types+1 entries
+    tlPrefilteredSample *samples;
+};
+TL_PUBLIC_FUNC_PREFIX
+void tl_prepare_prefiltered(tlWeaveParameters *params, void *context);
+
+/* --- Far-field BRDF ---
+ * For cloth far away from the camera, and for secondary and GI rays, the
+ * yarns do not need to be resolved at all. tl_prepare_far_field tabulates the
+ * diffuse and specular of tl_eval_all, averaged over one repeat of the
+ * pattern and over all rotations of it around the normal, as a function of
+ * theta_i, theta_o and the azimuth phi_i - phi_o. tl_eval_far_field then
+ * looks up the table with trilinear interpolation instead of looking up the
+ * pattern. Its pattern data is always a miss, and its opacity is the average
+ * over the repeat.
+ * The table is built by num_threads threads, or one per processor if
+ * num_threads is 0, so the texturing callbacks are called from several
+ * threads at once. context is passed to them in place of the shading
+ * context. Define TL_NO_THREADS to build it on the calling thread. Calling
+ * tl_prepare removes the table, and tl_eval_far_field falls back to
+ * tl_eval_all without it.
+ *
+ * Building the table takes a while, so it can be saved with
+ * tl_far_field_to_blob, which returns a buffer which should be freed with
+ * free, and loaded again with tl_far_field_from_blob. Each table stores
+ * tl_far_field_hash of the pattern and yarn types it was built from, and
+ * tl_far_field_from_blob returns 0 and sets error if it does not match the
+ * current parameters, in which case the table should be built again. The
+ * values of textured parameters are not part of the hash. As for PTN v3, a
+ * blob is only loaded by a build with the same byte order.
+ */
+#ifndef TL_FAR_FIELD_THETA_RESOLUTION
+#define TL_FAR_FIELD_THETA_RESOLUTION 16
+#endif
+#ifndef TL_FAR_FIELD_PHI_RESOLUTION
+#define TL_FAR_FIELD_PHI_RESOLUTION 32
+#endif
+// Number of points on the repeat, each with its own rotation, which are
+// averaged for each entry of the table. The points are placed on a grid
+// which the samples fill exactly, which is square for square numbers.
+#ifndef TL_FAR_FIELD_SAMPLES
+#define TL_FAR_FIELD_SAMPLES 2025
+#endif
+// Entry (i,o,p) is at theta_i = i*pi/2/(theta_resolution-1), theta_o likewise
+// and phi_i - phi_o = p*2pi/phi_resolution, stored at index
+// i + o*theta_resolution + p*theta_resolution^2.
+struct tlFarFieldBRDF
+{
+    uint64_t hash;
+    uint32_t theta_resolution, phi_resolution;
+    tlColor opacity;
+    tlColor *diffuse;
+    tlColor *specular;
+};
+TL_PUBLIC_FUNC_PREFIX
+uint64_t tl_far_field_hash(const tlWeaveParameters *params);
+TL_PUBLIC_FUNC_PREFIX
+void tl_prepare_far_field(tlWeaveParameters *params, void *context,
+    uint32_t num_threads);
+TL_PUBLIC_FUNC_PREFIX
+tlEvalResult tl_eval_far_field(tlIntersectionData intersection_data,
+    const tlWeaveParameters *params, uint32_t flags);
+TL_PUBLIC_FUNC_PREFIX
+unsigned char *tl_far_field_to_blob(const tlWeaveParameters *params,
+    long *ret_len);
+TL_PUBLIC_FUNC_PREFIX
+int tl_far_field_from_blob(tlWeaveParameters *params,
+    const unsigned char *data, long len, const char **error);
+
+/* --- Compiled patterns ---
+ * During interactive rendering the parameters are edited while the render
+ * threads are shading with them. To keep the two apart, the tlWeaveParameters
+ * edited by the user can be treated as a description only, which is compiled
+ * into an immutable tlCompiledPattern for the renderer.
+ * tl_compile_pattern copies the pattern, the fabric parameters and the yarn
+ * types, and calls tl_prepare on the copy, followed by
+ * tl_prepare_baked_yarnsize, tl_prepare_prefiltered and tl_prepare_far_field
+ * (on the calling thread only) as selected by flags, passing them context.
+ * The description can then be edited or freed without affecting the copy,
+ * except for the texmaps, which are shared. The parameters of the copy,
+ * compiled->params, must not be modified.
+ *
+ * A tlPatternSlot holds the current compiled pattern. Render threads call
+ * tl_pattern_slot_acquire, shade with the compiled pattern it returns, and
+ * pass it to tl_release_compiled_pattern when done, typically once per bucket
+ * or pass. After an edit, tl_compile_pattern is called on any thread and the
+ * result given to tl_pattern_slot_publish, which replaces the current one
+ * with an atomic swap. Threads which acquired the old one keep using it, and
+ * it is freed by whichever thread releases it last. Neither acquiring nor
+ * releasing ever waits for a lock. tl_pattern_slot_publish waits for the
+ * threads which are in the middle of tl_pattern_slot_acquire, which is a few
+ * instructions.
+ * A zero-initialized slot is empty, and tl_pattern_slot_acquire then returns
+ * NULL. Publishing NULL empties the slot again, which releases the last
+ * compiled pattern.
+ */
+#define TL_COMPILE_BAKED_YARNSIZE 1
+#define TL_COMPILE_PREFILTERED    2
+#define TL_COMPILE_FAR_FIELD      4
+typedef struct
+{
+    tlWeaveParameters params;
+    volatile int32_t ref_count;
+}tlCompiledPattern;
+typedef struct
+{
+    tlCompiledPattern *volatile current;
+    volatile int32_t readers;
+}tlPatternSlot;
+TL_PUBLIC_FUNC_PREFIX
+tlCompiledPattern *tl_compile_pattern(const tlWeaveParameters *params,
+    uint32_t flags, void *context);
+TL_PUBLIC_FUNC_PREFIX
+void tl_release_compiled_pattern(tlCompiledPattern *compiled);
+TL_PUBLIC_FUNC_PREFIX
+tlCompiledPattern *tl_pattern_slot_acquire(tlPatternSlot *slot);
+TL_PUBLIC_FUNC_PREFIX
+void tl_pattern_slot_publish(tlPatternSlot *slot,
+    tlCompiledPattern *compiled);
+
+/* --- Segment cache ---
+ * Neighbouring shading points usually hit the same cell of the pattern,
+ * which then resolves to the same yarn segment. If TL_SEGMENT_CACHE is
+ * defined, each thread keeps the pattern lookups and yarn sizes of the cell
+ * it shaded last, so a shading point in the same cell only computes its
+ * position within the segment. The results are identical to those without
+ * the cache.
+ * The cache is emptied by tl_prepare, and is not used for patterns with a
+ * textured yarnsize which has not been baked by tl_prepare_baked_yarnsize,
+ * since the yarn size then depends on the shading point.
+ * tl_segment_cache_stats returns the number of segments which were found in
+ * the cache and the number which were not, counted for the calling thread
+ * since the last reset.
+ */
+typedef struct
+{
+    uint64_t hits, misses;
+}tlSegmentCacheStats;
+#ifdef TL_SEGMENT_CACHE
+TL_PUBLIC_FUNC_PREFIX
+tlSegmentCacheStats tl_segment_cache_stats(int reset);
+#endif
+
+/* --- Statistics ---
+ * If TL_STATS is defined when including the implementation, the shader
+ * counts how often its expensive parts run, which helps to find out why a
+ * fabric renders slowly. Each thread counts into its own tlStats, and
+ * tl_stats_get adds up the counters of every thread which has shaded so far,
+ * including threads which have exited. Without TL_STATS the counting code is
+ * not compiled at all.
+ * segment_lookups         Calls to tl_get_yarn_segment
+ * yarn_misses             Segment lookups which hit the gap between yarns
+ * segment_walks           Segments whose length was measured along the yarn
+ * segment_walk_steps      Cells walked over to measure them
+ * extension_searches      Searches across the yarn for an extension, done
+ *                         when a thin yarn is missed
+ * extension_search_steps  Cells stepped over by these searches
+ * pattern_run_reads       Reads of the pattern run tables, or of the pattern
+ *                         where there are none, done by the walks and
+ *                         searches above
+ * texmap_evaluations      Texmap evaluations per parameter, indexed by
+ *                         TL_YARN_PARAM_[name]. A batched callback shared by
+ *                         several parameters counts for the first of them.
+ * staple_specular         Specular evaluations of staple yarns (psi > 0)
+ * filament_specular       Specular evaluations of filament yarns
+ * specular_width_rejected Specular evaluations which were zero because the
+ *                         highlight fell outside of delta_x
+ * With the segment cache or the prefiltered pattern, fewer segments are
+ * looked up, which shows up in these counters as well.
+ * tl_stats_reset makes all counters start over from zero. Other threads may
+ * keep shading meanwhile, but tl_stats_get and tl_stats_reset must not be
+ * called at the same time. tl_stats_print writes the counters as one
+ * "name value" line each.
+ */
+typedef struct
+{
+    uint64_t segment_lookups;
+    uint64_t yarn_misses;
+    uint64_t segment_walks;
+    uint64_t segment_walk_steps;
+    uint64_t extension_searches;
+    uint64_t extension_search_steps;
+    uint64_t pattern_run_reads;
+    uint64_t texmap_evaluations[TL_YARN_PARAM_COUNT];
+    uint64_t staple_specular;
+    uint64_t filament_specular;
+    uint64_t specular_width_rejected;
+}tlStats;
+#ifdef TL_STATS
+#include <stdio.h>
+TL_PUBLIC_FUNC_PREFIX
+void tl_stats_get(tlStats *stats);
+TL_PUBLIC_FUNC_PREFIX
+void tl_stats_reset();
+TL_PUBLIC_FUNC_PREFIX
+void tl_stats_print(const tlStats *stats, FILE *file);
+#endif
+
 #ifdef TL_WCHAR
 TL_PUBLIC_FUNC_PREFIX
 tlWeaveParameters *tl_weave_pattern_from_wif_wchar(const wchar_t *filename,
@@ -252,6 +892,47 @@ tlWeaveParameters *tl_weave_pattern_from_wif_wchar(const wchar_t *filename,
 TL_PUBLIC_FUNC_PREFIX
 unsigned char * tl_pattern_to_ptn_file(tlWeaveParameters *param, long *ret_len);
 
+/* --- PTN v3 ---
+ * tl_pattern_to_ptn_v3_file writes the pattern and yarn types exactly as they
+ * are laid out in memory, behind a fixed header and at 64 byte aligned
+ * offsets. When a v3 file is opened with tl_weave_pattern_from_file, the file
+ * is memory mapped and tlWeaveParameters::pattern points straight into the
+ * mapping, so loading does not depend on the size of the pattern and the
+ * pages are shared between processes loading the same file. The mapping is
+ * copy-on-write, so the pattern may still be modified.
+ * The yarn types are copied out of the file, since their texmaps are set by
+ * the frontends.
+ * Since the layout depends on the compiler and platform, a v3 file is only
+ * loaded if the struct sizes and byte order in its header match. Use
+ * tl_pattern_to_ptn_file for files that should be portable.
+ */
+TL_PUBLIC_FUNC_PREFIX
+unsigned char * tl_pattern_to_ptn_v3_file(tlWeaveParameters *param,
+    long *ret_len);
+
+/* --- Pattern cache ---
+ * tl_weave_pattern_from_file_cached works like tl_weave_pattern_from_file,
+ * but each file is only loaded once per process. Materials that load the same
+ * file share the pattern and the pattern runs built by tl_prepare, which must
+ * therefore not be modified. The fabric parameters and yarn types are copied
+ * for each call, and can be changed freely.
+ * Files are identified by their full path, modification time and size, so a
+ * file which is changed on disk is loaded again.
+ * When the last tlWeaveParameters using a file is freed with
+ * tl_free_weave_parameters, the file is kept loaded, so that a frontend
+ * which loads and frees the same file over and over only parses it once.
+ * At most TL_PATTERN_CACHE_RETAINED such unused files are kept, the ones
+ * which were used last. tl_clear_pattern_cache frees all of them.
+ */
+#ifndef TL_PATTERN_CACHE_RETAINED
+#define TL_PATTERN_CACHE_RETAINED 8
+#endif
+TL_PUBLIC_FUNC_PREFIX
+tlWeaveParameters *tl_weave_pattern_from_file_cached(const char *filename,
+    const char **error);
+TL_PUBLIC_FUNC_PREFIX
+void tl_clear_pattern_cache();
+
 typedef struct
 {
     PatternEntry pattern_entry;
@@ -286,64 +967,144 @@ TL_PUBLIC_FUNC_PREFIX
 tlYarnSegment tl_get_yarn_segment(float total_u, float total_v,
 	const tlWeaveParameters *params, const tlIntersectionData *intersection_data);
 
+// Returns the yarn type whose value and texmap is used for the parameter,
+// i.e. yarn type 0 unless yarn type i has [param]_enabled set.
+// Only used if tl_prepare has not built the resolved table.
+#define TL_YARN_TYPE_SOURCE(p,i,param) ((p)->yarn_types[i].param##_enabled ?\
+    &(p)->yarn_types[i] : &(p)->yarn_types[0])
+
+// Nonzero if the parameter has a texmap, given the texmap or textured bit.
+// Always 0 with TL_NO_TEXMAPS, so that the compiler removes the texmap code.
+#ifdef TL_NO_TEXMAPS
+#define TL_HAS_TEXMAP(texmap) 0
+#else
+#define TL_HAS_TEXMAP(texmap) (texmap)
+#endif
+
+// Adds amount to one of the tlStats counters of the calling thread, see
+// Statistics above. Expands to nothing without TL_STATS.
+#if defined(TL_STATS) && defined(TL_THUNDERLOOM_IMPLEMENTATION)
+typedef struct tlStatsBlock tlStatsBlock;
+struct tlStatsBlock
+{
+    tlStats stats;
+    tlStatsBlock *next;
+};
+static tlStatsBlock *tl_register_stats_block();
+#ifdef _MSC_VER
+static __declspec(thread) tlStatsBlock *tl_thread_stats_block;
+#else
+static __thread tlStatsBlock *tl_thread_stats_block;
+#endif
+// Only the owning thread writes its counters, but tl_stats_get
+// reads them from other threads, so the accesses are atomic. Relaxed loads
+// and stores compile to plain moves.
+static inline void tl_stats_add(uint64_t *counter, uint64_t amount)
+{
+#ifdef _MSC_VER
+    *(volatile uint64_t*)counter += amount;
+#else
+    __atomic_store_n(counter,__atomic_load_n(counter,__ATOMIC_RELAXED)
+        + amount,__ATOMIC_RELAXED);
+#endif
+}
+#define TL_STATS_ADD(counter,amount) tl_stats_add(\
+    &(tl_thread_stats_block ? tl_thread_stats_block :\
+    tl_register_stats_block())->stats.counter,(uint64_t)(amount))
+#else
+#define TL_STATS_ADD(counter,amount)
+#endif
+
 static float tl_yarn_type_get_lookup_yarnsize(const tlWeaveParameters *p,
         uint32_t i, float u, float v, void* context) {
-    tlYarnType yarn_type = p->yarn_types[i];
-    float ret;
-    if(yarn_type.yarnsize_enabled){
-        ret = yarn_type.yarnsize;
-        if(yarn_type.yarnsize_texmap){
-            ret=tl_eval_texmap_mono_lookup(yarn_type.yarnsize_texmap,u,v,context);
+    void *texmap;
+    if(p->resolved_yarn_types){
+        const tlResolvedYarnType *yarn_type = &p->resolved_yarn_types[i];
+        if(!TL_HAS_TEXMAP(yarn_type->textured & (1u<<TL_YARN_PARAM_yarnsize))){
+            return yarn_type->yarnsize;
         }
+        texmap = p->resolved_yarn_texmaps[i*TL_YARN_PARAM_COUNT
+            + TL_YARN_PARAM_yarnsize];
     } else{
-        ret = p->yarn_types[0].yarnsize;
-        if(p->yarn_types[0].yarnsize_texmap){
-            ret=tl_eval_texmap_mono_lookup(p->yarn_types[0].yarnsize_texmap,u,v,context);
-            //ret=tl_eval_texmap_mono(p->yarn_types[0].param##_texmap,context);
+        const tlYarnType *yarn_type = TL_YARN_TYPE_SOURCE(p,i,yarnsize);
+        if(!TL_HAS_TEXMAP(yarn_type->yarnsize_texmap)){
+            return yarn_type->yarnsize;
         }
+        texmap = yarn_type->yarnsize_texmap;
     }
-    return ret;
+    TL_STATS_ADD(texmap_evaluations[TL_YARN_PARAM_yarnsize],1);
+    return tl_eval_texmap_mono_lookup(texmap,u,v,context);
 }
 // Getter functions for the yarn type parameters.
 // These take into account whether the parameter is enabled or not
 // and handle the texmaps
-#define TL_FLOAT_PARAM(param) static float tl_yarn_type_get_##param\
-    (const tlWeaveParameters *p, uint32_t i, void* context){\
-	tlYarnType yarn_type = p->yarn_types[i];\
-    float ret;\
-	if(yarn_type.param##_enabled){\
-		ret = yarn_type.param;\
-		if(yarn_type.param##_texmap){\
-			ret=tl_eval_texmap_mono(yarn_type.param##_texmap,context);\
-		}\
-	} else{\
-		ret = p->yarn_types[0].param;\
-		if(p->yarn_types[0].param##_texmap){\
-			ret=tl_eval_texmap_mono(p->yarn_types[0].param##_texmap,context);\
-		}\
-	}\
-	return ret;}
-#define TL_COLOR_PARAM(param)  static tlColor tl_yarn_type_get_##param\
+#define TL_YARN_TYPE_GETTER(type,param,eval) static type tl_yarn_type_get_##param\
     (const tlWeaveParameters *p, uint32_t i, void* context){\
-	tlYarnType yarn_type = p->yarn_types[i];\
-    tlColor ret;\
-	if(yarn_type.param##_enabled){\
-		ret = yarn_type.param;\
-		if(yarn_type.param##_texmap){\
-			ret=tl_eval_texmap_color(yarn_type.param##_texmap,context);\
-		}\
-	} else{\
-		ret = p->yarn_types[0].param;\
-		if(p->yarn_types[0].param##_texmap){\
-			ret=tl_eval_texmap_color(p->yarn_types[0].param##_texmap,context);\
-		}\
-	}\
-	return ret;}
+    void *texmap;\
+    if(p->resolved_yarn_types){\
+        const tlResolvedYarnType *yarn_type = &p->resolved_yarn_types[i];\
+        if(!TL_HAS_TEXMAP(yarn_type->textured & (1u<<TL_YARN_PARAM_##param))){\
+            return yarn_type->param;\
+        }\
+        texmap = p->resolved_yarn_texmaps[i*TL_YARN_PARAM_COUNT\
+            + TL_YARN_PARAM_##param];\
+    } else{\
+        const tlYarnType *yarn_type = TL_YARN_TYPE_SOURCE(p,i,param);\
+        if(!TL_HAS_TEXMAP(yarn_type->param##_texmap)){\
+            return yarn_type->param;\
+        }\
+        texmap = yarn_type->param##_texmap;\
+    }\
+    TL_STATS_ADD(texmap_evaluations[TL_YARN_PARAM_##param],1);\
+    return eval(texmap,context);}
+#define TL_FLOAT_PARAM(param) \
+    TL_YARN_TYPE_GETTER(float,param,tl_eval_texmap_mono)
+#define TL_COLOR_PARAM(param) \
+    TL_YARN_TYPE_GETTER(tlColor,param,tl_eval_texmap_color)
 #define TL_INT_PARAM(param) 
 TL_YARN_PARAMETERS
 #undef TL_FLOAT_PARAM
 #undef TL_COLOR_PARAM
 #undef TL_INT_PARAM
+#undef TL_YARN_TYPE_GETTER
+
+// Evaluate a texmap for count points, using the batch callbacks if the
+// renderer provides them and the scalar ones otherwise.
+static void tl_texmap_mono_lookup_batch(void *texmap, const float *u,
+    const float *v, void * const *context, uint32_t count, float *result)
+{
+#ifdef TL_TEXTURE_BATCH_CALLBACKS
+    tl_eval_texmap_mono_lookup_batch(texmap,u,v,context,count,result);
+#else
+    for(uint32_t i=0;i<count;i++){
+        result[i] = tl_eval_texmap_mono_lookup(texmap,u[i],v[i],context[i]);
+    }
+#endif
+}
+
+static void tl_texmap_mono_batch(void *texmap, void * const *context,
+    uint32_t count, float *result)
+{
+#ifdef TL_TEXTURE_BATCH_CALLBACKS
+    tl_eval_texmap_mono_batch(texmap,context,count,result);
+#else
+    for(uint32_t i=0;i<count;i++){
+        result[i] = tl_eval_texmap_mono(texmap,context[i]);
+    }
+#endif
+}
+
+static void tl_texmap_color_batch(void *texmap, void * const *context,
+    uint32_t count, tlColor *result)
+{
+#ifdef TL_TEXTURE_BATCH_CALLBACKS
+    tl_eval_texmap_color_batch(texmap,context,count,result);
+#else
+    for(uint32_t i=0;i<count;i++){
+        result[i] = tl_eval_texmap_color(texmap,context[i]);
+    }
+#endif
+}
 
 static const int TL_NUM_YARN_PARAMETERS = 0
 #define TL_FLOAT_PARAM(name) + 1
@@ -360,10 +1121,110 @@ typedef struct
     float x,y,z,w;
 } tlVector;
 
+// tl_sample is kept for the 3ds Max plugin, new code should use
+// tl_sample_specular below, which comes with a pdf.
+TL_PUBLIC_FUNC_PREFIX
 tlVector tl_sample (tlIntersectionData intersection_data,
     tlPatternData data, const tlWeaveParameters *params, float rnd, float *factor)
 ;
 
+/* --- Importance sampling ---
+ * tl_sample_specular samples an incoming direction wi, in the same shading
+ * space as intersection_data, for the wo in intersection_data. The yarn
+ * highlights lie on the cone of directions which reflect wo around the fiber
+ * at the shading point, so the angle to the fiber is sampled uniformly in a
+ * band around that cone, which is as wide as the highlight, and the angle
+ * around the fiber from the wrapped Cauchy distribution of the yarn model.
+ * rnd_x and rnd_y are uniform random numbers in [0,1). The pdf, with respect
+ * to solid angle, is returned in pdf. It is 0 if no direction could be
+ * sampled, for instance if the sampled direction is below the surface.
+ * tl_pdf_specular returns the pdf of sampling the wi in intersection_data.
+ *
+ * The specular sampling only covers the directions around the highlights,
+ * so it has to be combined with a sampling of the whole hemisphere, like
+ * cosine weighted sampling for the diffuse. tl_specular_lobe_probability
+ * gives a probability for choosing the specular lobe, based on the
+ * specular and diffuse strength at the shading point. With p being this
+ * probability, the pdf of the combined sampling is
+ *     p*tl_pdf_specular + (1-p)*wi_z/pi
+ */
+TL_PUBLIC_FUNC_PREFIX
+tlVector tl_sample_specular(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params, float rnd_x,
+    float rnd_y, float *pdf);
+TL_PUBLIC_FUNC_PREFIX
+float tl_pdf_specular(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params);
+TL_PUBLIC_FUNC_PREFIX
+float tl_specular_lobe_probability(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params);
+
+/* --- Yarn parameter cache ---
+ * Each of the functions above fetches the yarn parameters it needs, so a
+ * textured parameter is evaluated once per function that uses it. For
+ * instance, specular_color is needed by both tl_eval_diffuse and
+ * tl_eval_specular, and umax by both tl_get_pattern_data and
+ * tl_eval_specular. A renderer which calls several of them for the same
+ * shading point can instead keep a tlYarnParameterCache on the stack,
+ * initialize it with tl_yarn_parameter_cache_init and pass it to the
+ * _cached variants below. Each parameter of a yarn type is then evaluated at
+ * most once for the shading point. tl_eval_all, tl_shade and the batch
+ * functions do this internally.
+ * The cache holds the parameters of up to TL_YARN_CACHE_YARN_TYPES yarn
+ * types, e.g. the one which was hit and yarn type 0, which is used between
+ * the yarns. It must only be used for one shading point, with the context of
+ * that point, and not after params has changed.
+ */
+#define TL_YARN_CACHE_YARN_TYPES 2
+typedef struct
+{
+    uint32_t yarn_type;
+    uint32_t fetched; //Bit TL_YARN_PARAM_[param] is set once it is fetched
+#define TL_FLOAT_PARAM(name) float name;
+#define TL_INT_PARAM(name)  uint8_t name;
+#define TL_COLOR_PARAM(name) tlColor name;
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+} tlYarnParameterValues;
+
+typedef struct
+{
+    const tlWeaveParameters *params;
+    void *context;
+    uint32_t yarn_type; //Set from the pattern data by the functions below
+    uint32_t num_yarn_types;
+    tlYarnParameterValues values[TL_YARN_CACHE_YARN_TYPES];
+} tlYarnParameterCache;
+
+TL_PUBLIC_FUNC_PREFIX
+void tl_yarn_parameter_cache_init(tlYarnParameterCache *cache,
+    const tlWeaveParameters *params, void *context);
+TL_PUBLIC_FUNC_PREFIX
+tlPatternData tl_get_pattern_data_cached(tlIntersectionData intersection_data,
+    tlYarnParameterCache *cache);
+TL_PUBLIC_FUNC_PREFIX
+tlColor tl_eval_diffuse_cached(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache);
+TL_PUBLIC_FUNC_PREFIX
+tlColor tl_eval_specular_cached(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache);
+TL_PUBLIC_FUNC_PREFIX
+tlColor tl_eval_opacity_cached(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache);
+TL_PUBLIC_FUNC_PREFIX
+tlVector tl_sample_specular_cached(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache, float rnd_x,
+    float rnd_y, float *pdf);
+TL_PUBLIC_FUNC_PREFIX
+float tl_pdf_specular_cached(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache);
+TL_PUBLIC_FUNC_PREFIX
+float tl_specular_lobe_probability_cached(
+    tlIntersectionData intersection_data, tlPatternData data,
+    tlYarnParameterCache *cache);
+
 /* ----------- IMPLEMENTATION --------------- */
 
 #ifdef TL_THUNDERLOOM_IMPLEMENTATION
@@ -371,7 +1232,6 @@ tlVector tl_sample (tlIntersectionData intersection_data,
 #ifndef TL_NO_FILES
 #define REALWORLD_UV_WIF_TO_MM 10.0f
 #include "wif/wif.cpp"
-#include "wif/ini.cpp"
 #endif
 
 // For M_PI etc.
@@ -382,6 +1242,30 @@ tlVector tl_sample (tlIntersectionData intersection_data,
 
 //TODO(Vidar): Do we need this?
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef _MSC_VER
+#include <malloc.h>
+#include <intrin.h>
+#endif
+
+#if !defined(TL_NO_FILES) || !defined(TL_NO_THREADS)
+// For memory mapping PTN v3 files, locking the pattern cache and building the
+// far-field BRDF in parallel
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+#endif
+#ifndef _WIN32
+#include <sched.h>
+#endif
 
 // -- 3D Vector data structure -- //
 
@@ -440,54 +1324,451 @@ static tlVector tlVector_scale(float a, tlVector b)
 
 // -- //
 
-//NOTE(Vidar):These are the building blocks of a PTN file
-struct tlPtnEntry  {
-    uint32_t type,offset,size,version;
-    const char *name;
-};
-#define TL_PTN_ENTRY(parent_struct,name,size) \
-    {2,(uint32_t)((intptr_t)&tmp_##parent_struct.name-(intptr_t)&tmp_##parent_struct),\
-        size, 1, #name},
+// -- SIMD -- //
+
+// Thin wrappers around the SSE/AVX2 intrinsics used by the batch shading
+// functions. tlVf holds TL_SIMD_WIDTH floats, tlVi as many int32s.
+// Comparisons return masks with all bits set in the lanes where they are
+// true. Define TL_NO_SIMD to use the plain C fallback, which has a width
+// of one.
+// tl_simd_end has to be called after the vector code, before calling
+// non-AVX code such as libm or the texmap callbacks. Otherwise every SSE
+// instruction there pays for the dirty upper halves of the AVX registers.
+#if !defined(TL_NO_SIMD) && defined(__AVX2__)
+#define TL_SIMD_AVX2
+#define TL_SIMD_WIDTH 8
+#include <immintrin.h>
+#elif !defined(TL_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TL_SIMD_SSE
+#define TL_SIMD_WIDTH 4
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#else
+#define TL_SIMD_WIDTH 1
+#endif
 
-//This is what is read from/written to the .PTN files for each struct
-tlWeaveParameters tmp_tlWeaveParameters;
-tlPtnEntry ptn_entry_weave_params[]={
-    {1,0,0,1, "tlWeaveParameters"},
-#define TL_FLOAT_PARAM(name) TL_PTN_ENTRY(tlWeaveParameters,name,sizeof(float))
-#define TL_INT_PARAM(name)  TL_PTN_ENTRY(tlWeaveParameters,name,sizeof(uint8_t))
-#define TL_COLOR_PARAM(name) TL_PTN_ENTRY(tlWeaveParameters,name,sizeof(tlColor))
-    TL_FABRIC_PARAMETERS
-#undef TL_FLOAT_PARAM
-#undef TL_INT_PARAM
-#undef TL_COLOR_PARAM
-    TL_PTN_ENTRY(tlWeaveParameters,pattern_height,sizeof(uint32_t))
-    TL_PTN_ENTRY(tlWeaveParameters,pattern_width,sizeof(uint32_t))
-    TL_PTN_ENTRY(tlWeaveParameters,num_yarn_types,sizeof(uint32_t))
-    TL_PTN_ENTRY(tlWeaveParameters,specular_normalization,sizeof(float))
-    TL_PTN_ENTRY(tlWeaveParameters,pattern_realheight,sizeof(float))
-    TL_PTN_ENTRY(tlWeaveParameters,pattern_realwidth,sizeof(float))
-    {0,0,0,0,"end"}
-};
+#if defined(TL_SIMD_AVX2)
+typedef __m256 tlVf;
+typedef __m256i tlVi;
+static inline tlVf tl_vf_set1(float a){ return _mm256_set1_ps(a); }
+static inline tlVf tl_vf_load(const float *p){ return _mm256_loadu_ps(p); }
+static inline void tl_vf_store(float *p, tlVf a){ _mm256_storeu_ps(p,a); }
+static inline float tl_vf_first(tlVf a){ return _mm256_cvtss_f32(a); }
+static inline tlVf tl_vf_add(tlVf a, tlVf b){ return _mm256_add_ps(a,b); }
+static inline tlVf tl_vf_sub(tlVf a, tlVf b){ return _mm256_sub_ps(a,b); }
+static inline tlVf tl_vf_mul(tlVf a, tlVf b){ return _mm256_mul_ps(a,b); }
+static inline tlVf tl_vf_div(tlVf a, tlVf b){ return _mm256_div_ps(a,b); }
+static inline tlVf tl_vf_sqrt(tlVf a){ return _mm256_sqrt_ps(a); }
+static inline tlVf tl_vf_min(tlVf a, tlVf b){ return _mm256_min_ps(a,b); }
+static inline tlVf tl_vf_max(tlVf a, tlVf b){ return _mm256_max_ps(a,b); }
+static inline tlVf tl_vf_and(tlVf a, tlVf b){ return _mm256_and_ps(a,b); }
+static inline tlVf tl_vf_andnot(tlVf a, tlVf b){ return _mm256_andnot_ps(a,b); }
+static inline tlVf tl_vf_or(tlVf a, tlVf b){ return _mm256_or_ps(a,b); }
+static inline tlVf tl_vf_xor(tlVf a, tlVf b){ return _mm256_xor_ps(a,b); }
+static inline tlVf tl_vf_cmplt(tlVf a, tlVf b)
+{ return _mm256_cmp_ps(a,b,_CMP_LT_OQ); }
+static inline tlVf tl_vf_cmple(tlVf a, tlVf b)
+{ return _mm256_cmp_ps(a,b,_CMP_LE_OQ); }
+static inline tlVf tl_vf_cmpgt(tlVf a, tlVf b)
+{ return _mm256_cmp_ps(a,b,_CMP_GT_OQ); }
+static inline tlVf tl_vf_select(tlVf mask, tlVf a, tlVf b)
+{ return _mm256_blendv_ps(b,a,mask); }
+static inline int tl_vf_any(tlVf mask){ return _mm256_movemask_ps(mask) != 0; }
+static inline tlVi tl_vi_set1(int32_t a){ return _mm256_set1_epi32(a); }
+static inline tlVi tl_vi_add(tlVi a, tlVi b){ return _mm256_add_epi32(a,b); }
+static inline tlVi tl_vi_sub(tlVi a, tlVi b){ return _mm256_sub_epi32(a,b); }
+static inline tlVi tl_vi_and(tlVi a, tlVi b){ return _mm256_and_si256(a,b); }
+static inline tlVi tl_vi_andnot(tlVi a, tlVi b)
+{ return _mm256_andnot_si256(a,b); }
+static inline tlVi tl_vi_cmpeq(tlVi a, tlVi b){ return _mm256_cmpeq_epi32(a,b); }
+static inline tlVi tl_vi_shift_to_sign(tlVi a){ return _mm256_slli_epi32(a,29); }
+static inline tlVi tl_vf_to_vi(tlVf a){ return _mm256_cvttps_epi32(a); }
+static inline tlVf tl_vi_to_vf(tlVi a){ return _mm256_cvtepi32_ps(a); }
+static inline tlVf tl_vi_as_vf(tlVi a){ return _mm256_castsi256_ps(a); }
+static inline void tl_simd_end(){ _mm256_zeroupper(); }
+#elif defined(TL_SIMD_SSE)
+typedef __m128 tlVf;
+typedef __m128i tlVi;
+static inline tlVf tl_vf_set1(float a){ return _mm_set1_ps(a); }
+static inline tlVf tl_vf_load(const float *p){ return _mm_loadu_ps(p); }
+static inline void tl_vf_store(float *p, tlVf a){ _mm_storeu_ps(p,a); }
+static inline float tl_vf_first(tlVf a){ return _mm_cvtss_f32(a); }
+static inline tlVf tl_vf_add(tlVf a, tlVf b){ return _mm_add_ps(a,b); }
+static inline tlVf tl_vf_sub(tlVf a, tlVf b){ return _mm_sub_ps(a,b); }
+static inline tlVf tl_vf_mul(tlVf a, tlVf b){ return _mm_mul_ps(a,b); }
+static inline tlVf tl_vf_div(tlVf a, tlVf b){ return _mm_div_ps(a,b); }
+static inline tlVf tl_vf_sqrt(tlVf a){ return _mm_sqrt_ps(a); }
+static inline tlVf tl_vf_min(tlVf a, tlVf b){ return _mm_min_ps(a,b); }
+static inline tlVf tl_vf_max(tlVf a, tlVf b){ return _mm_max_ps(a,b); }
+static inline tlVf tl_vf_and(tlVf a, tlVf b){ return _mm_and_ps(a,b); }
+static inline tlVf tl_vf_andnot(tlVf a, tlVf b){ return _mm_andnot_ps(a,b); }
+static inline tlVf tl_vf_or(tlVf a, tlVf b){ return _mm_or_ps(a,b); }
+static inline tlVf tl_vf_xor(tlVf a, tlVf b){ return _mm_xor_ps(a,b); }
+static inline tlVf tl_vf_cmplt(tlVf a, tlVf b){ return _mm_cmplt_ps(a,b); }
+static inline tlVf tl_vf_cmple(tlVf a, tlVf b){ return _mm_cmple_ps(a,b); }
+static inline tlVf tl_vf_cmpgt(tlVf a, tlVf b){ return _mm_cmpgt_ps(a,b); }
+static inline tlVf tl_vf_select(tlVf mask, tlVf a, tlVf b)
+{
+#ifdef __SSE4_1__
+    return _mm_blendv_ps(b,a,mask);
+#else
+    return _mm_or_ps(_mm_and_ps(mask,a),_mm_andnot_ps(mask,b));
+#endif
+}
+static inline int tl_vf_any(tlVf mask){ return _mm_movemask_ps(mask) != 0; }
+static inline tlVi tl_vi_set1(int32_t a){ return _mm_set1_epi32(a); }
+static inline tlVi tl_vi_add(tlVi a, tlVi b){ return _mm_add_epi32(a,b); }
+static inline tlVi tl_vi_sub(tlVi a, tlVi b){ return _mm_sub_epi32(a,b); }
+static inline tlVi tl_vi_and(tlVi a, tlVi b){ return _mm_and_si128(a,b); }
+static inline tlVi tl_vi_andnot(tlVi a, tlVi b){ return _mm_andnot_si128(a,b); }
+static inline tlVi tl_vi_cmpeq(tlVi a, tlVi b){ return _mm_cmpeq_epi32(a,b); }
+static inline tlVi tl_vi_shift_to_sign(tlVi a){ return _mm_slli_epi32(a,29); }
+static inline tlVi tl_vf_to_vi(tlVf a){ return _mm_cvttps_epi32(a); }
+static inline tlVf tl_vi_to_vf(tlVi a){ return _mm_cvtepi32_ps(a); }
+static inline tlVf tl_vi_as_vf(tlVi a){ return _mm_castsi128_ps(a); }
+static inline void tl_simd_end(){}
+#else
+typedef float tlVf;
+typedef int32_t tlVi;
+static inline uint32_t tl_vf_bits(float a){ uint32_t u; memcpy(&u,&a,4); return u; }
+static inline float tl_vf_from_bits(uint32_t u){ float a; memcpy(&a,&u,4); return a; }
+static inline tlVf tl_vf_set1(float a){ return a; }
+static inline tlVf tl_vf_load(const float *p){ return *p; }
+static inline void tl_vf_store(float *p, tlVf a){ *p = a; }
+static inline float tl_vf_first(tlVf a){ return a; }
+static inline tlVf tl_vf_add(tlVf a, tlVf b){ return a+b; }
+static inline tlVf tl_vf_sub(tlVf a, tlVf b){ return a-b; }
+static inline tlVf tl_vf_mul(tlVf a, tlVf b){ return a*b; }
+static inline tlVf tl_vf_div(tlVf a, tlVf b){ return a/b; }
+static inline tlVf tl_vf_sqrt(tlVf a){ return sqrtf(a); }
+static inline tlVf tl_vf_min(tlVf a, tlVf b){ return a<b ? a : b; }
+static inline tlVf tl_vf_max(tlVf a, tlVf b){ return a>b ? a : b; }
+static inline tlVf tl_vf_and(tlVf a, tlVf b)
+{ return tl_vf_from_bits(tl_vf_bits(a)&tl_vf_bits(b)); }
+static inline tlVf tl_vf_andnot(tlVf a, tlVf b)
+{ return tl_vf_from_bits(~tl_vf_bits(a)&tl_vf_bits(b)); }
+static inline tlVf tl_vf_or(tlVf a, tlVf b)
+{ return tl_vf_from_bits(tl_vf_bits(a)|tl_vf_bits(b)); }
+static inline tlVf tl_vf_xor(tlVf a, tlVf b)
+{ return tl_vf_from_bits(tl_vf_bits(a)^tl_vf_bits(b)); }
+static inline tlVf tl_vf_cmplt(tlVf a, tlVf b)
+{ return tl_vf_from_bits(a<b ? 0xffffffffu : 0u); }
+static inline tlVf tl_vf_cmple(tlVf a, tlVf b)
+{ return tl_vf_from_bits(a<=b ? 0xffffffffu : 0u); }
+static inline tlVf tl_vf_cmpgt(tlVf a, tlVf b)
+{ return tl_vf_from_bits(a>b ? 0xffffffffu : 0u); }
+static inline tlVf tl_vf_select(tlVf mask, tlVf a, tlVf b)
+{ return tl_vf_bits(mask) ? a : b; }
+static inline int tl_vf_any(tlVf mask){ return tl_vf_bits(mask) != 0; }
+static inline tlVi tl_vi_set1(int32_t a){ return a; }
+static inline tlVi tl_vi_add(tlVi a, tlVi b){ return a+b; }
+static inline tlVi tl_vi_sub(tlVi a, tlVi b){ return a-b; }
+static inline tlVi tl_vi_and(tlVi a, tlVi b){ return a&b; }
+static inline tlVi tl_vi_andnot(tlVi a, tlVi b){ return ~a&b; }
+static inline tlVi tl_vi_cmpeq(tlVi a, tlVi b){ return a==b ? -1 : 0; }
+static inline tlVi tl_vi_shift_to_sign(tlVi a){ return (int32_t)((uint32_t)a<<29); }
+static inline tlVi tl_vf_to_vi(tlVf a){ return (int32_t)a; }
+static inline tlVf tl_vi_to_vf(tlVi a){ return (float)a; }
+static inline tlVf tl_vi_as_vf(tlVi a){ return tl_vf_from_bits((uint32_t)a); }
+static inline void tl_simd_end(){}
+#endif
 
-tlYarnType tmp_tlYarnType;
-tlPtnEntry ptn_entry_yarn_type[]={
-    {1,0,0,1, "tlYarnType"},
-#define TL_FLOAT_PARAM(name) TL_PTN_ENTRY(tlYarnType,name,sizeof(float)) \
-    TL_PTN_ENTRY(tlYarnType,name##_enabled,sizeof(uint8_t)) 
-#define TL_INT_PARAM(name)  TL_PTN_ENTRY(tlYarnType,name,sizeof(uint8_t))\
-    TL_PTN_ENTRY(tlYarnType,name##_enabled,sizeof(uint8_t)) 
-#define TL_COLOR_PARAM(name) TL_PTN_ENTRY(tlYarnType,name,sizeof(tlColor))\
-    TL_PTN_ENTRY(tlYarnType,name##_enabled,sizeof(uint8_t)) 
-    TL_YARN_PARAMETERS
-#undef TL_FLOAT_PARAM
-#undef TL_INT_PARAM
-#undef TL_COLOR_PARAM
-    {0,0,0,0,"end"}
-};
+static inline tlVf tl_vf_sign_mask(){ return tl_vf_set1(-0.f); }
+static inline tlVf tl_vf_abs(tlVf a){ return tl_vf_andnot(tl_vf_sign_mask(),a); }
+static inline tlVf tl_vf_neg(tlVf a){ return tl_vf_xor(tl_vf_sign_mask(),a); }
+#ifdef TL_STATS
+// Number of lanes set in mask, for counting with TL_STATS
+static uint32_t tl_vf_count(tlVf mask)
+{
+    float lanes[TL_SIMD_WIDTH];
+    tl_vf_store(lanes,mask);
+    uint32_t count = 0;
+    for(int i=0;i<TL_SIMD_WIDTH;i++){
+        uint32_t bits;
+        memcpy(&bits,&lanes[i],4);
+        count += bits != 0;
+    }
+    return count;
+}
+#endif
+// Scalar value for filling in lane masks which are later loaded with
+// tl_vf_load
+static inline float tl_lane_mask(int on)
+{
+    uint32_t u = on ? 0xffffffffu : 0u;
+    float f;
+    memcpy(&f,&u,sizeof(f));
+    return f;
+}
 
-//NOTE(Vidar):This is a bit special, the size will be multiplied by 
-// the number of entries in the pattern
-tlPtnEntry ptn_entry_pattern = {3,0,2*sizeof(uint8_t),1, "tlPattern"};
+// Computes sin and cos at the same time. Same range reduction and
+// polynomials as sinf/cosf in the Cephes library, the error is a couple of
+// ulp for |x| < 8192.
+static inline void tl_vf_sincos(tlVf x, tlVf *s, tlVf *c)
+{
+    tlVf sign_sin = tl_vf_and(x,tl_vf_sign_mask());
+    x = tl_vf_abs(x);
+
+    // Octant of x, rounded up to an even number
+    tlVi j = tl_vf_to_vi(tl_vf_mul(x,tl_vf_set1(1.27323954473516f)));
+    j = tl_vi_and(tl_vi_add(j,tl_vi_set1(1)),tl_vi_set1(~1));
+    tlVf y = tl_vi_to_vf(j);
+
+    tlVf swap_sign_sin = tl_vi_as_vf(tl_vi_shift_to_sign(
+        tl_vi_and(j,tl_vi_set1(4))));
+    tlVf poly_mask = tl_vi_as_vf(tl_vi_cmpeq(tl_vi_and(j,tl_vi_set1(2)),
+        tl_vi_set1(0)));
+    tlVf sign_cos = tl_vi_as_vf(tl_vi_shift_to_sign(
+        tl_vi_andnot(tl_vi_sub(j,tl_vi_set1(2)),tl_vi_set1(4))));
+    sign_sin = tl_vf_xor(sign_sin,swap_sign_sin);
+
+    // Extended precision modular arithmetic, x - y*pi/4
+    x = tl_vf_sub(x,tl_vf_mul(y,tl_vf_set1(0.78515625f)));
+    x = tl_vf_sub(x,tl_vf_mul(y,tl_vf_set1(2.4187564849853515625e-4f)));
+    x = tl_vf_sub(x,tl_vf_mul(y,tl_vf_set1(3.77489497744594108e-8f)));
+    tlVf z = tl_vf_mul(x,x);
+
+    tlVf cos_poly = tl_vf_set1(2.443315711809948e-5f);
+    cos_poly = tl_vf_add(tl_vf_mul(cos_poly,z),tl_vf_set1(-1.388731625493765e-3f));
+    cos_poly = tl_vf_add(tl_vf_mul(cos_poly,z),tl_vf_set1(4.166664568298827e-2f));
+    cos_poly = tl_vf_mul(tl_vf_mul(cos_poly,z),z);
+    cos_poly = tl_vf_sub(cos_poly,tl_vf_mul(z,tl_vf_set1(0.5f)));
+    cos_poly = tl_vf_add(cos_poly,tl_vf_set1(1.f));
+
+    tlVf sin_poly = tl_vf_set1(-1.9515295891e-4f);
+    sin_poly = tl_vf_add(tl_vf_mul(sin_poly,z),tl_vf_set1(8.3321608736e-3f));
+    sin_poly = tl_vf_add(tl_vf_mul(sin_poly,z),tl_vf_set1(-1.6666654611e-1f));
+    sin_poly = tl_vf_add(tl_vf_mul(tl_vf_mul(sin_poly,z),x),x);
+
+    *s = tl_vf_xor(tl_vf_select(poly_mask,sin_poly,cos_poly),sign_sin);
+    *c = tl_vf_xor(tl_vf_select(poly_mask,cos_poly,sin_poly),sign_cos);
+}
+
+// atan2 using the Cephes atanf polynomial on min(|x|,|y|)/max(|x|,|y|).
+// The error is a couple of ulp. atan2(0,0) returns 0.
+static inline tlVf tl_vf_atan2(tlVf y, tlVf x)
+{
+    tlVf ax = tl_vf_abs(x);
+    tlVf ay = tl_vf_abs(y);
+    tlVf hi = tl_vf_max(ax,ay);
+    tlVf lo = tl_vf_min(ax,ay);
+    tlVf t = tl_vf_div(lo,tl_vf_max(hi,tl_vf_set1(1e-30f)));
+
+    // Reduce t to [0,tan(pi/8)]
+    tlVf reduce = tl_vf_cmpgt(t,tl_vf_set1(0.4142135623730950f));
+    t = tl_vf_select(reduce,tl_vf_div(tl_vf_sub(t,tl_vf_set1(1.f)),
+        tl_vf_add(t,tl_vf_set1(1.f))),t);
+    tlVf z = tl_vf_mul(t,t);
+    tlVf p = tl_vf_set1(8.05374449538e-2f);
+    p = tl_vf_add(tl_vf_mul(p,z),tl_vf_set1(-1.38776856032e-1f));
+    p = tl_vf_add(tl_vf_mul(p,z),tl_vf_set1(1.99777106478e-1f));
+    p = tl_vf_add(tl_vf_mul(p,z),tl_vf_set1(-3.33329491539e-1f));
+    p = tl_vf_add(tl_vf_mul(tl_vf_mul(p,z),t),t);
+    tlVf a = tl_vf_add(p,tl_vf_and(reduce,tl_vf_set1((float)M_PI_4)));
+
+    a = tl_vf_select(tl_vf_cmpgt(ay,ax),
+        tl_vf_sub(tl_vf_set1((float)M_PI_2),a),a);
+    a = tl_vf_select(tl_vf_cmplt(x,tl_vf_set1(0.f)),
+        tl_vf_sub(tl_vf_set1((float)M_PI),a),a);
+    return tl_vf_or(a,tl_vf_and(y,tl_vf_sign_mask()));
+}
+
+// acos for |x| <= 1
+static inline tlVf tl_vf_acos(tlVf x)
+{
+    tlVf one = tl_vf_set1(1.f);
+    tlVf s = tl_vf_sqrt(tl_vf_max(tl_vf_mul(tl_vf_sub(one,x),tl_vf_add(one,x)),
+        tl_vf_set1(0.f)));
+    return tl_vf_atan2(s,x);
+}
+
+typedef struct
+{
+    tlVf x,y,z;
+} tlVf3;
+
+static inline tlVf3 tl_vf3(tlVf x, tlVf y, tlVf z)
+{
+    tlVf3 ret = {x,y,z};
+    return ret;
+}
+
+static inline tlVf3 tl_vf3_load(const float *x, const float *y, const float *z)
+{
+    return tl_vf3(tl_vf_load(x),tl_vf_load(y),tl_vf_load(z));
+}
+
+static inline tlVf3 tl_vf3_add(tlVf3 a, tlVf3 b)
+{
+    return tl_vf3(tl_vf_add(a.x,b.x),tl_vf_add(a.y,b.y),tl_vf_add(a.z,b.z));
+}
+
+static inline tlVf tl_vf3_dot(tlVf3 a, tlVf3 b)
+{
+    return tl_vf_add(tl_vf_add(tl_vf_mul(a.x,b.x),tl_vf_mul(a.y,b.y)),
+        tl_vf_mul(a.z,b.z));
+}
+
+static inline tlVf tl_vf3_magnitude(tlVf3 a)
+{
+    return tl_vf_sqrt(tl_vf3_dot(a,a));
+}
+
+static inline tlVf3 tl_vf3_cross(tlVf3 a, tlVf3 b)
+{
+    return tl_vf3(
+        tl_vf_sub(tl_vf_mul(a.y,b.z),tl_vf_mul(a.z,b.y)),
+        tl_vf_sub(tl_vf_mul(a.z,b.x),tl_vf_mul(a.x,b.z)),
+        tl_vf_sub(tl_vf_mul(a.x,b.y),tl_vf_mul(a.y,b.x)));
+}
+
+static inline tlVf3 tl_vf3_normalize(tlVf3 a)
+{
+    tlVf inv_mag = tl_vf_div(tl_vf_set1(1.f),tl_vf3_magnitude(a));
+    return tl_vf3(tl_vf_mul(a.x,inv_mag),tl_vf_mul(a.y,inv_mag),
+        tl_vf_mul(a.z,inv_mag));
+}
+
+// -- //
+
+// -- Fast math -- //
+
+// The shading kernels call libm through the functions below. If TL_FAST_MATH
+// is defined, atan2 is a scalar version of the Cephes polynomial that
+// tl_vf_atan2 uses for tl_shade_batch, and tan and 1/sin are computed from
+// sin and cos that the kernels already have or from sinf alone. sin, cos
+// and acos always come from libm, since glibc's versions were measured to be
+// faster than the polynomials for the small angles the kernels see. The
+// maximum absolute error of tl_atan2f, measured in tests/test_fast_math
+// against double precision libm, is 6e-7.
+// Without TL_FAST_MATH the results are exactly the same as when calling libm
+// directly.
+static inline void tl_sincosf(float x, float *s, float *c)
+{
+    *s = sinf(x);
+    *c = cosf(x);
+}
+
+static inline float tl_acosf(float x)
+{
+    return acosf(x);
+}
+
+#ifdef TL_FAST_MATH
+// tan(x) given sin(x) and cos(x), which the kernels have computed already
+static inline float tl_tanf(float x, float sin_x, float cos_x)
+{
+    return sin_x/cos_x;
+}
+
+static inline float tl_recip_sinf(float x)
+{
+    return 1.f/sinf(x);
+}
+
+// The selections in tl_atan2f are done on the bits, since they depend on the
+// directions and branches on them are often mispredicted
+static inline float tl_select(uint32_t mask, float a, float b)
+{
+    uint32_t ua, ub;
+    memcpy(&ua,&a,sizeof(ua));
+    memcpy(&ub,&b,sizeof(ub));
+    ua = (ua & mask) | (ub & ~mask);
+    memcpy(&a,&ua,sizeof(a));
+    return a;
+}
+
+static inline float tl_atan2f(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    float hi = ax > ay ? ax : ay;
+    float lo = ax > ay ? ay : ax;
+    float t = lo/(hi > 1e-30f ? hi : 1e-30f);
+
+    // Reduce t to [0,tan(pi/8)]
+    uint32_t reduce = 0u - (uint32_t)(t > 0.4142135623730950f);
+    t = tl_select(reduce,(t - 1.f)/(t + 1.f),t);
+    float z = t*t;
+    float p = 8.05374449538e-2f;
+    p = p*z - 1.38776856032e-1f;
+    p = p*z + 1.99777106478e-1f;
+    p = p*z - 3.33329491539e-1f;
+    float a = p*z*t + t + tl_select(reduce,(float)M_PI_4,0.f);
+
+    a = tl_select(0u - (uint32_t)(ay > ax),(float)M_PI_2 - a,a);
+    a = tl_select(0u - (uint32_t)(x < 0.f),(float)M_PI - a,a);
+    return copysignf(a,y);
+}
+#else
+static inline float tl_tanf(float x, float sin_x, float cos_x)
+{
+    return tanf(x);
+}
+
+static inline float tl_recip_sinf(float x)
+{
+    return 1.f/(sin(x));
+}
+
+static inline float tl_atan2f(float y, float x)
+{
+    return atan2f(y,x);
+}
+#endif
+
+// -- //
+
+//NOTE(Vidar):These are the building blocks of a PTN file
+struct tlPtnEntry  {
+    uint32_t type,offset,size,version;
+    const char *name;
+};
+#define TL_PTN_ENTRY(parent_struct,name,size) \
+    {2,(uint32_t)((intptr_t)&tmp_##parent_struct.name-(intptr_t)&tmp_##parent_struct),\
+        size, 1, #name},
+
+//This is what is read from/written to the .PTN files for each struct
+static tlWeaveParameters tmp_tlWeaveParameters;
+static tlPtnEntry ptn_entry_weave_params[]={
+    {1,0,0,1, "tlWeaveParameters"},
+#define TL_FLOAT_PARAM(name) TL_PTN_ENTRY(tlWeaveParameters,name,sizeof(float))
+#define TL_INT_PARAM(name)  TL_PTN_ENTRY(tlWeaveParameters,name,sizeof(uint8_t))
+#define TL_COLOR_PARAM(name) TL_PTN_ENTRY(tlWeaveParameters,name,sizeof(tlColor))
+    TL_FABRIC_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+    TL_PTN_ENTRY(tlWeaveParameters,pattern_height,sizeof(uint32_t))
+    TL_PTN_ENTRY(tlWeaveParameters,pattern_width,sizeof(uint32_t))
+    TL_PTN_ENTRY(tlWeaveParameters,num_yarn_types,sizeof(uint32_t))
+    TL_PTN_ENTRY(tlWeaveParameters,specular_normalization,sizeof(float))
+    TL_PTN_ENTRY(tlWeaveParameters,pattern_realheight,sizeof(float))
+    TL_PTN_ENTRY(tlWeaveParameters,pattern_realwidth,sizeof(float))
+    {0,0,0,0,"end"}
+};
+
+static tlYarnType tmp_tlYarnType;
+static tlPtnEntry ptn_entry_yarn_type[]={
+    {1,0,0,1, "tlYarnType"},
+#define TL_FLOAT_PARAM(name) TL_PTN_ENTRY(tlYarnType,name,sizeof(float)) \
+    TL_PTN_ENTRY(tlYarnType,name##_enabled,sizeof(uint8_t)) 
+#define TL_INT_PARAM(name)  TL_PTN_ENTRY(tlYarnType,name,sizeof(uint8_t))\
+    TL_PTN_ENTRY(tlYarnType,name##_enabled,sizeof(uint8_t)) 
+#define TL_COLOR_PARAM(name) TL_PTN_ENTRY(tlYarnType,name,sizeof(tlColor))\
+    TL_PTN_ENTRY(tlYarnType,name##_enabled,sizeof(uint8_t)) 
+    TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+    {0,0,0,0,"end"}
+};
+
+//NOTE(Vidar):This is a bit special, the size will be multiplied by 
+// the number of entries in the pattern
+static tlPtnEntry ptn_entry_pattern = {3,0,2*sizeof(uint8_t),1, "tlPattern"};
 
 
 //atof equivalent function wich is not dependent
@@ -545,7 +1826,7 @@ static float sample_TEA_single(uint32_t v0, uint32_t v1, int rounds)
     return x.f - 1.0f;
 }
 
-void sample_cosine_hemisphere(float sample_x, float sample_y, float *p_x,
+static void sample_cosine_hemisphere(float sample_x, float sample_y, float *p_x,
         float *p_y, float *p_z)
 {
     //sample uniform disk concentric
@@ -571,7 +1852,7 @@ void sample_cosine_hemisphere(float sample_x, float sample_y, float *p_x,
     *p_z = sqrtf(1.0f - (*p_x)*(*p_x) - (*p_y)*(*p_y));
 }
 
-void sample_uniform_hemisphere(float sample_x, float sample_y, float *p_x,
+static void sample_uniform_hemisphere(float sample_x, float sample_y, float *p_x,
         float *p_y, float *p_z)
 {
     //Source: http://mathworld.wolfram.com/SpherePointPicking.html
@@ -582,8 +1863,164 @@ void sample_uniform_hemisphere(float sample_x, float sample_y, float *p_x,
     *p_z = sinf(phi);
 }
 
-void calculate_segment_uv_and_normal(tlPatternData *pattern_data,
-        const tlWeaveParameters *params,tlIntersectionData *intersection_data)
+void tl_yarn_parameter_cache_init(tlYarnParameterCache *cache,
+    const tlWeaveParameters *params, void *context)
+{
+    cache->params = params;
+    cache->context = context;
+    cache->yarn_type = 0;
+    cache->num_yarn_types = 0;
+}
+
+// Returns the values of yarn_type, making room for them if the yarn type is
+// not in the cache yet. When the cache is full, the last yarn type in it is
+// replaced.
+static tlYarnParameterValues *tl_yarn_cache_values(
+    tlYarnParameterCache *cache, uint32_t yarn_type)
+{
+    for(uint32_t i=0;i<cache->num_yarn_types;i++){
+        if(cache->values[i].yarn_type == yarn_type){
+            return &cache->values[i];
+        }
+    }
+    uint32_t i = cache->num_yarn_types;
+    if(i < TL_YARN_CACHE_YARN_TYPES){
+        cache->num_yarn_types++;
+    } else{
+        i = TL_YARN_CACHE_YARN_TYPES - 1;
+    }
+    cache->values[i].yarn_type = yarn_type;
+    cache->values[i].fetched = 0;
+    return &cache->values[i];
+}
+
+// tl_yarn_cache_get_type_[param] fetches the parameter of any yarn type,
+// tl_yarn_cache_get_[param] the one of cache->yarn_type
+#define TL_YARN_CACHE_GETTER(type,param)\
+    static type tl_yarn_cache_get_type_##param(tlYarnParameterCache *cache,\
+    uint32_t yarn_type){\
+    tlYarnParameterValues *values = tl_yarn_cache_values(cache,yarn_type);\
+    if(!(values->fetched & (1u<<TL_YARN_PARAM_##param))){\
+        values->param = tl_yarn_type_get_##param(cache->params,\
+            yarn_type,cache->context);\
+        values->fetched |= 1u<<TL_YARN_PARAM_##param;\
+    }\
+    return values->param;}\
+    static type tl_yarn_cache_get_##param(tlYarnParameterCache *cache){\
+    return tl_yarn_cache_get_type_##param(cache,cache->yarn_type);}
+#define TL_FLOAT_PARAM(param) TL_YARN_CACHE_GETTER(float,param)
+#define TL_COLOR_PARAM(param) TL_YARN_CACHE_GETTER(tlColor,param)
+#define TL_INT_PARAM(param)
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_COLOR_PARAM
+#undef TL_INT_PARAM
+#undef TL_YARN_CACHE_GETTER
+
+// Nonzero for the parameters which are evaluated with tl_eval_texmap_color
+static const uint8_t tl_yarn_param_is_color[TL_YARN_PARAM_COUNT] = {
+#define TL_FLOAT_PARAM(name) 0,
+#define TL_INT_PARAM(name) 0,
+#define TL_COLOR_PARAM(name) 1,
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+};
+
+// Fetches the textured parameters in needed[i] for each of the count caches
+// up front. The requests of all caches are grouped by texmap, so that each
+// texmap is evaluated with a single batch call. The cache getters then
+// return the fetched values. Untextured parameters are left to the getters.
+static void tl_batch_fetch_textured(tlYarnParameterCache *cache,
+    const uint32_t *needed, uint32_t count)
+{
+    if(count == 0 || !cache[0].params->resolved_yarn_types){
+        return;
+    }
+    const tlWeaveParameters *params = cache[0].params;
+    tlYarnParameterValues *values[TL_TEXTURE_PACKET_SIZE];
+    uint32_t pending[TL_TEXTURE_PACKET_SIZE];
+    uint32_t any = 0;
+    for(uint32_t i=0;i<count;i++){
+        uint32_t textured =
+            params->resolved_yarn_types[cache[i].yarn_type].textured;
+        values[i] = tl_yarn_cache_values(&cache[i],cache[i].yarn_type);
+        pending[i] = TL_HAS_TEXMAP(textured) & needed[i] & ~values[i]->fetched;
+        any |= pending[i];
+    }
+    uint32_t first = 0;
+    while(any){
+        // Take the first pending request and gather every
+        // request for the same texmap, evaluated the same way
+        while(!pending[first]){
+            first++;
+        }
+        uint32_t bit = 0;
+        while(!(pending[first] & (1u<<bit))){
+            bit++;
+        }
+        void **texmaps = params->resolved_yarn_texmaps;
+        void *texmap = texmaps[cache[first].yarn_type*TL_YARN_PARAM_COUNT
+            + bit];
+        uint8_t is_color = tl_yarn_param_is_color[bit];
+        uint32_t lanes[TL_TEXTURE_PACKET_SIZE];
+        uint32_t matched[TL_TEXTURE_PACKET_SIZE];
+        void *context[TL_TEXTURE_PACKET_SIZE];
+        uint32_t num = 0;
+        any = 0;
+        for(uint32_t i=first;i<count;i++){
+            void **t = texmaps + cache[i].yarn_type*TL_YARN_PARAM_COUNT;
+            uint32_t match = 0;
+            for(uint32_t p=pending[i];p;p&=p-1){
+                uint32_t param = 0;
+                while(!(p & (1u<<param))){
+                    param++;
+                }
+                if(t[param] == texmap
+                        && tl_yarn_param_is_color[param] == is_color){
+                    match |= 1u<<param;
+                }
+            }
+            if(match){
+                lanes[num] = i;
+                matched[num] = match;
+                context[num] = cache[i].context;
+                num++;
+                pending[i] &= ~match;
+            }
+            any |= pending[i];
+        }
+        float mono[TL_TEXTURE_PACKET_SIZE];
+        tlColor color[TL_TEXTURE_PACKET_SIZE];
+        TL_STATS_ADD(texmap_evaluations[bit],num);
+        if(is_color){
+            tl_texmap_color_batch(texmap,context,num,color);
+        } else{
+            tl_texmap_mono_batch(texmap,context,num,mono);
+        }
+        for(uint32_t k=0;k<num;k++){
+            tlYarnParameterValues *c = values[lanes[k]];
+#define TL_FLOAT_PARAM(name) \
+            if(matched[k] & (1u<<TL_YARN_PARAM_##name)){\
+                c->name = mono[k];\
+            }
+#define TL_COLOR_PARAM(name) \
+            if(matched[k] & (1u<<TL_YARN_PARAM_##name)){\
+                c->name = color[k];\
+            }
+#define TL_INT_PARAM(name)
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+            c->fetched |= matched[k];
+        }
+    }
+}
+
+static void tl_segment_uv_and_normal(tlPatternData *pattern_data,
+        tlYarnParameterCache *cache)
 {
     //Calculate the yarn-segment-local u v coordinates along the curved cylinder
     //NOTE: This is different from how Irawan does it
@@ -595,9 +2032,7 @@ void calculate_segment_uv_and_normal(tlPatternData *pattern_data,
         //if segment is extension between to parallel yarns -> bend = 0
         umax = 0.0001f;
     } else {
-        umax = tl_yarn_type_get_umax(params,
-                pattern_data->yarn_type,
-                intersection_data->context);
+        umax = tl_yarn_cache_get_umax(cache);
     }
     // We are assuming that the given pattern_data is already in yarn local
     // coordinates (Y running along the yarn segment).
@@ -605,9 +2040,12 @@ void calculate_segment_uv_and_normal(tlPatternData *pattern_data,
     float segment_v = pattern_data->x*(float)M_PI_2;
 
     //Calculate the normal in yarn-local coordinates
-    float normal_x = sinf(segment_v);
-    float normal_y = sinf(segment_u)*cosf(segment_v);
-    float normal_z = cosf(segment_u)*cosf(segment_v);
+    float sin_u, cos_u, sin_v, cos_v;
+    tl_sincosf(segment_u, &sin_u, &cos_u);
+    tl_sincosf(segment_v, &sin_v, &cos_v);
+    float normal_x = sin_v;
+    float normal_y = sin_u*cos_v;
+    float normal_z = cos_u*cos_v;
     
     //TODO(Vidar): This is pretty weird, right? Now x and y are not yarn-local
     // anymore...
@@ -625,6 +2063,15 @@ void calculate_segment_uv_and_normal(tlPatternData *pattern_data,
     pattern_data->normal_z = normal_z;
 }
 
+static void calculate_segment_uv_and_normal(tlPatternData *pattern_data,
+        const tlWeaveParameters *params,tlIntersectionData *intersection_data)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache,params,intersection_data->context);
+    cache.yarn_type = pattern_data->yarn_type;
+    tl_segment_uv_and_normal(pattern_data,&cache);
+}
+
 tlVector tl_sample (tlIntersectionData intersection_data,
     tlPatternData data, const tlWeaveParameters *params, float rnd, float *factor)
 {
@@ -713,1311 +2160,5032 @@ static void halton_4(int n, float val[]){
     }
 }
 
-void tl_prepare(tlWeaveParameters *params)
+// -- Pattern lookup -- //
+
+static int tl_has_pattern(const tlWeaveParameters *params)
 {
+    return params->pattern != 0 || params->draft != 0 || params->packed != 0
+        || params->procedural != 0;
 }
 
-tlWeaveParameters *tl_weave_pattern_from_data(uint8_t *warp_above, uint8_t *yarn_type,
-    uint32_t num_yarn_types, tlColor *yarn_colors, uint32_t pattern_width,
-    uint32_t pattern_height)
+static float tl_pattern_repeats(uint32_t repeats)
 {
-    tlWeaveParameters *params =
-        (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
-    params->pattern_width = pattern_width;
-    params->pattern_height = pattern_height;
-    num_yarn_types++;
-    params->num_yarn_types = num_yarn_types;
-    params->yarn_types = (tlYarnType*)calloc(sizeof(tlYarnType),num_yarn_types);
-    params->yarn_types[0] = tl_default_yarn_type;
-    for(unsigned int i=1;i<num_yarn_types;i++){
-        params->yarn_types[i] = tl_default_yarn_type;
-        params->yarn_types[i].color = yarn_colors[i-1];
-        params->yarn_types[i].color_enabled = 1;
+    return repeats ? (float)repeats : 1.f;
+}
+
+// Size in cells of the pattern as it was loaded, which can be several
+// repeats of the stored one. The segments are found in cells of the whole
+// pattern, so that the rounding is the same as if it had not been shrunk.
+static uint32_t tl_loaded_pattern_width(const tlWeaveParameters *params)
+{
+    return params->pattern_repeats_x ?
+        params->pattern_width*params->pattern_repeats_x : params->pattern_width;
+}
+
+static uint32_t tl_loaded_pattern_height(const tlWeaveParameters *params)
+{
+    return params->pattern_repeats_y ?
+        params->pattern_height*params->pattern_repeats_y : params->pattern_height;
+}
+
+// Scale from uv coordinates to repeats of the loaded pattern
+static void tl_uv_scale(const tlWeaveParameters *params, float *u_scale,
+    float *v_scale)
+{
+    if (params->realworld_uv) {
+        //the user parameters uscale, vscale change roles when realworld_uv
+        // is true. If true they are then used to tweak the realworld scales
+        *u_scale = params->uscale/params->pattern_realwidth; 
+        *v_scale = params->vscale/params->pattern_realheight;
+    } else {
+        *u_scale = params->uscale;
+        *v_scale = params->vscale;
     }
-    uint32_t pattern_size = pattern_width*pattern_height;
-    params->pattern = (PatternEntry*)calloc(sizeof(PatternEntry),pattern_size);
-    for(unsigned int i=0;i<pattern_size;i++){
-        params->pattern[i].warp_above = warp_above[i];
-        params->pattern[i].yarn_type = yarn_type[i];
+}
+
+static PatternEntry tl_packed_entry(const tlPackedPattern *packed,
+    uint32_t x, uint32_t y)
+{
+    size_t tile = (x>>3) + (size_t)(y>>3)*packed->tiles_x;
+    uint32_t bit = (x&7) + (y&7)*8;
+    uint32_t bits = packed->yarn_type_bits;
+    uint32_t index = 0;
+    if(bits){
+        uint32_t offset = bit*bits;
+        uint64_t word = packed->yarn_types[tile*bits + (offset>>6)];
+        index = (uint32_t)(word >> (offset&63)) & ((1u<<bits)-1);
     }
-    return params;
+    PatternEntry entry;
+    entry.warp_above = (uint8_t)((packed->warp_above[tile] >> bit) & 1);
+    entry.yarn_type = packed->palette[index];
+    return entry;
 }
 
-#ifndef TL_NO_FILES
+// Index of the block containing cell (x,y) within a repeat of the weave
+static uint32_t tl_procedural_phase(const tlProceduralWeave *weave,
+    uint32_t x, uint32_t y)
+{
+    uint64_t block_x = x/weave->block_width;
+    uint64_t block_y = y/weave->block_height;
+    return (uint32_t)((block_x + weave->shift*(block_y%weave->repeat))
+        %weave->repeat);
+}
 
-tlWeaveParameters *tl_weave_pattern_from_file(const char *filename,const char **error)
+static PatternEntry tl_procedural_entry(const tlProceduralWeave *weave,
+    uint32_t x, uint32_t y)
 {
-	tlWeaveParameters *param = 0;
-	int len = 0;
-	while(filename[len] != 0){
-		len++;
-	}
-	if(len >=5){
-		bool wif_ok = true;
-		bool ptn_ok = true;
-		const char *wif_ext = ".wif";
-		const char *ptn_ext = ".ptn";
-		for(int i=0;i<4;i++){
-			char c = filename[len-1-i];
-			c = (c <= 'Z' && c >= 'A') ? c + 32 : c;
-			if(c != wif_ext[3-i]){
-				wif_ok = false;
-			}
-			if(c != ptn_ext[3-i]){
-				ptn_ok = false;
-			}
-        }   
-        if(wif_ok || ptn_ok){
-            FILE *fp = 0;
-            if(wif_ok){
-             fp = fopen(filename,"rt");
-            }
-            if(ptn_ok){
-             fp = fopen(filename,"rb");
-            }
-            if (!fp) {
-                *error = "File not found.";
-                return 0;
-            }
-            fseek(fp,0,SEEK_END);
-            long len = ftell(fp);
-            fseek(fp,0,SEEK_SET);
-            unsigned char *data = (unsigned char*)calloc(len,1);
-            fread(data,1,len,fp);
-            fclose(fp);
-            if(wif_ok){
-                param = tl_weave_pattern_from_wif(data,len,error);
-            }
-            if(ptn_ok){
-                param = tl_weave_pattern_from_ptn(data,len,error);
-            }
-            free(data);
-		}
-	}
-	return param;
+    PatternEntry entry;
+    entry.warp_above = tl_procedural_phase(weave,x,y) < weave->warp_float;
+    entry.yarn_type = entry.warp_above ?
+        weave->warp_yarn_types[x%weave->warp_period] :
+        weave->weft_yarn_types[y%weave->weft_period];
+    return entry;
 }
-#ifdef TL_WCHAR
-tlWeaveParameters *tl_weave_pattern_from_wif_wchar(const wchar_t *filename,const char **error)
+
+// Returns the pattern entry of cell (x,y), which has to be inside the pattern
+static PatternEntry tl_pattern_entry(const tlWeaveParameters *params,
+    uint32_t x, uint32_t y)
 {
-	tlWeaveParameters *param = 0;
-	int len = 0;
-	while(filename[len] != 0){
-		len++;
-	}
-	if(len >=5){
-		bool wif_ok = true;
-		bool ptn_ok = true;
-		wchar_t *wif_ext = L".wif";
-		wchar_t *ptn_ext = L".ptn";
-		for(int i=0;i<4;i++){
-			wchar_t c = filename[len-1-i];
-			c = towlower(c);
-			if(c != wif_ext[3-i]){
-				wif_ok = false;
-			}
-			if(c != ptn_ext[3-i]){
-				ptn_ok = false;
-			}
-		}
-		if(wif_ok || ptn_ok){
-			FILE *fp;
-			if(wif_ok){
-			 fp = _wfopen(filename,L"rt");
-			}
-			if(ptn_ok){
-			 fp = _wfopen(filename,L"rb");
-			}
-			fseek(fp,0,SEEK_END);
-			long len = ftell(fp);
-			fseek(fp,0,SEEK_SET);
-			unsigned char *data = (unsigned char*)calloc(len,1);
-			fread(data,1,len,fp);
-			fclose(fp);
-			if(wif_ok){
-				param = tl_weave_pattern_from_wif(data,len,error);
-			}
-			if(ptn_ok){
-				param = tl_weave_pattern_from_ptn(data,len,error);
-			}
-			free(data);
-		}else{
-			*error = "Unknown file format";
-		}
-	}else{
-		*error = "Unknown file format";
-	}
-	return param;
-}
-#endif
-
-tlWeaveParameters *tl_weave_pattern_from_wif(unsigned char *data,long len,const char **error)
-{
-    WeaveData *weave_data = wif_read((char*)data,len,error);
-    if(weave_data){
-        tlWeaveParameters *params = (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
-        wif_get_pattern(params, weave_data,
-            &params->pattern_width, &params->pattern_height,
-            &params->pattern_realwidth, &params->pattern_realheight);
-        wif_free_weavedata(weave_data);
-        return params;
+    if(params->pattern){
+        return params->pattern[x + y*params->pattern_width];
     }
-    return 0;
+    if(params->packed){
+        return tl_packed_entry(params->packed, x, y);
+    }
+    if(params->procedural){
+        return tl_procedural_entry(params->procedural, x, y);
+    }
+    const tlPatternDraft *draft = params->draft;
+    PatternEntry entry;
+    entry.warp_above = draft->tieup[draft->treadling[y]
+        + draft->threading[x]*draft->num_treadles];
+    entry.yarn_type = entry.warp_above ? draft->warp_yarn_types[x]
+        : draft->weft_yarn_types[y];
+    return entry;
 }
-#endif
-
-struct tlPtnWriteCommand{
-    tlPtnEntry *entry;
-    unsigned char *data;
-};
 
-static unsigned char* tl_buffer_from_ptn_write_commands(int num_write_commands,
-    tlPtnWriteCommand* write_commands, long *ret_len)
+// Returns a pattern with one entry per cell, either the pattern itself or,
+// for a draft, packed or procedural pattern, a newly allocated one which
+// should be freed with free.
+static PatternEntry *tl_expanded_pattern(const tlWeaveParameters *params)
 {
-    int version = 2;
-    //NOTE(Vidar):Calculate needed size of buffer
-    size_t len = 2*sizeof(int); //Version number & end specifier
-    for(int i=0;i<num_write_commands;i++) {
-        tlPtnEntry *entry = write_commands[i].entry;
-        do{
-			size_t name_len = strlen(entry->name)+1;
-            len+= 4*sizeof(uint32_t) + entry->size+name_len;
-            entry++;
-        }while((entry-1)->type != 0 && (entry-1)->type != 3);
+    if(!params->draft && !params->packed && !params->procedural){
+        return params->pattern;
     }
-
-    //NOTE(Vidar):Allocate buffer
-    unsigned char *data = (unsigned char *)calloc(len,1);
-    unsigned char *dest=data;
-
-    //NOTE(Vidar):Write version
-    *(int*)dest=version;
-    dest+=sizeof(int);
-
-    //NOTE(Vidar):Write data
-    for(int i=0;i<num_write_commands;i++) {
-        tlPtnEntry *entry = write_commands[i].entry;
-        do{
-			uint32_t name_len = (uint32_t)(strlen(entry->name)+1);
-            ((uint32_t*)dest)[0]=entry->type;
-            ((uint32_t*)dest)[1]=name_len;
-            ((uint32_t*)dest)[2]=entry->size;
-            ((uint32_t*)dest)[3]=entry->version;
-            dest+=4*sizeof(uint32_t);
-            memcpy(dest,entry->name,name_len);
-            dest+=name_len;
-            memcpy(dest,write_commands[i].data + entry->offset,entry->size);
-            dest+=entry->size;
-            entry++;
-        } while((entry-1)->type != 0 && (entry-1)->type != 3);
+    uint32_t w = params->pattern_width;
+    uint32_t h = params->pattern_height;
+    PatternEntry *pattern = (PatternEntry*)calloc((size_t)w*h,
+        sizeof(PatternEntry));
+    for(uint32_t y=0;y<h;y++){
+        for(uint32_t x=0;x<w;x++){
+            pattern[x + y*w] = tl_pattern_entry(params,x,y);
+        }
     }
-
-    *(uint32_t*)dest = 0;
-    *ret_len = (long)len;
-    return data;
+    return pattern;
 }
 
-unsigned char * tl_pattern_to_ptn_file(tlWeaveParameters *param,
-    long *ret_len)
+static void tl_free_draft(tlPatternDraft *draft)
 {
-    uint32_t pattern_size = param->pattern_width*param->pattern_height;
-    int num_write_commands = 2+param->num_yarn_types;
-    tlPtnWriteCommand *write_commands =
-        (tlPtnWriteCommand*)calloc(num_write_commands,
-        sizeof(tlPtnWriteCommand));
-    write_commands[0].entry = ptn_entry_weave_params;
-    write_commands[0].data  = (unsigned char *)param;
-    //NOTE(vidar):We make a copy of the pattern entry so that we can change the
-    // size
-    tlPtnEntry pattern_entry = ptn_entry_pattern;
-    pattern_entry.size      *= pattern_size;
-    write_commands[1].entry  = &pattern_entry;
-    write_commands[1].data   = (unsigned char *)param->pattern;
-    int a = 2;
-    for(unsigned int i=0;i<param->num_yarn_types;i++){
-        write_commands[a+i].entry = ptn_entry_yarn_type;
-        write_commands[a+i].data  = (unsigned char *)(param->yarn_types+i);
-    }
-    unsigned char *data = tl_buffer_from_ptn_write_commands(num_write_commands,
-        write_commands, ret_len);
-    free(write_commands);
-    return data;
+    free(draft->threading);
+    free(draft->treadling);
+    free(draft->tieup);
+    free(draft->warp_yarn_types);
+    free(draft->weft_yarn_types);
+    free(draft);
 }
 
-struct tlPtnConverter
+static void tl_free_packed_pattern(tlPackedPattern *packed)
 {
-    uint32_t src_version, target_version, src_size, target_size;
-    const char *src_name,*target_name;
-    unsigned char*(*func)(unsigned char *data);
-};
+    free(packed->warp_above);
+    free(packed->yarn_types);
+    free(packed);
+}
 
-static unsigned char* tl_ptn_specular_strength_to_specular_color( unsigned char *data)
+static void tl_free_procedural_weave(tlProceduralWeave *weave)
 {
-    float val=*(float*)data;
-    tlColor *col=(tlColor*)calloc(1,sizeof(tlColor));
-    col->r=val;
-    col->g=val;
-    col->b=val;
-    return (unsigned char *)col;
+    free(weave->warp_yarn_types);
+    free(weave->weft_yarn_types);
+    free(weave->block_runs);
+    free(weave);
 }
 
-static struct tlPtnConverter tl_ptn_converters[]={
-    {1,1,sizeof(float),sizeof(tlColor),"specular_strength","specular_color",
-    tl_ptn_specular_strength_to_specular_color}
-};
-static uint32_t tl_num_ptn_converters=sizeof(tl_ptn_converters)/sizeof(*tl_ptn_converters);
-
-unsigned char *tl_read_ptn_section(void *out, unsigned char* data,
-    tlPtnEntry *entries)
+// Fills in the runs along one row (along_y = 0) or one column
+// (along_y = 1) of the pattern. first is the index of the first cell in the
+// line and stride is the distance between two cells in the line.
+static void tl_build_pattern_runs_line(const PatternEntry *pattern,
+    tlPatternRuns *runs, uint32_t first, uint32_t stride, uint32_t size,
+    uint8_t along_y)
 {
-    uint32_t type;
-    do{
-        type              = ((uint32_t*)data)[0];
-        uint32_t name_len = ((uint32_t*)data)[1];
-        uint32_t size     = ((uint32_t*)data)[2];
-        uint32_t version  = ((uint32_t*)data)[3];
-        data += 4*sizeof(uint32_t);
-        const char *name = (char*)data;
-        printf("  name: %s\n",name);
-        data += name_len;
-        tlPtnEntry *entry = entries;
-        int must_free=0;
-        unsigned char *entry_data=data;
-        data += size;
-        for(unsigned int i=0;i<tl_num_ptn_converters;i++){
-            static tlPtnConverter c=tl_ptn_converters[i];
-            if(c.src_version==version && c.src_size==size && strcmp(c.src_name,name)==0){
-                version=c.target_version;
-                size=c.target_size;
-                name=c.target_name;
-                unsigned char *old_entry_data=entry_data;
-                entry_data=c.func(entry_data);
-                if(must_free){
-                    free(old_entry_data);
-                }
-                must_free=1;
-            }
+#define TL_RUN_CELL(i) (first + ((i)%size)*stride)
+#define TL_RUN_CLAMP(val) (uint8_t)((val) < TL_PATTERN_RUN_SATURATED ? \
+    (val) : TL_PATTERN_RUN_SATURATED)
+    // Find a cell which starts a run. If there is none, the whole line has
+    // the same warp_above.
+    uint32_t start = size;
+    for(uint32_t i=0;i<size;i++){
+        if(pattern[TL_RUN_CELL(i)].warp_above !=
+                pattern[TL_RUN_CELL(i+size-1)].warp_above){
+            start = i;
+            break;
         }
-        while(entry->type != 0){
-            if(strcmp(entry->name,name)==0 && entry->version == version){
-                if(size == entry->size){
-                    memcpy((unsigned char*)out+entry->offset,entry_data,size);
-                }else{
-                    printf("Warning: %s had the wrong size, not read\n", name);
-                }
-            }
-            entry++;
+    }
+    uint32_t run_left = 0;
+    uint32_t run_right = 0;
+    for(uint32_t i=0;i<size;i++){
+        // Walk forward from the start of a run for the left runs and
+        // backwards from the end of a run for the right runs.
+        uint32_t cell_left  = start + i;
+        uint32_t cell_right = start + 2*size - 1 - i;
+        if(start == size){
+            run_left = run_right = size;
+        } else if(i > 0){
+            run_left = (pattern[TL_RUN_CELL(cell_left)].warp_above ==
+                pattern[TL_RUN_CELL(cell_left-1)].warp_above) ? run_left+1 : 0;
+            run_right = (pattern[TL_RUN_CELL(cell_right)].warp_above ==
+                pattern[TL_RUN_CELL(cell_right+1)].warp_above) ? run_right+1 : 0;
         }
-        if(must_free){
-            free(entry_data);
+        tlPatternRuns *left  = runs + TL_RUN_CELL(cell_left);
+        tlPatternRuns *right = runs + TL_RUN_CELL(cell_right);
+        if(along_y){
+            left->y_left   = TL_RUN_CLAMP(run_left);
+            right->y_right = TL_RUN_CLAMP(run_right);
+        } else {
+            left->x_left   = TL_RUN_CLAMP(run_left);
+            right->x_right = TL_RUN_CLAMP(run_right);
         }
-    } while(type != 0);
-    return data;
+    }
+#undef TL_RUN_CLAMP
+#undef TL_RUN_CELL
 }
 
-static tlWeaveParameters *tl_pattern_from_ptn_file_v2(unsigned char *data,
-    long len,const char **error)
+struct tlPatternCacheEntry
 {
-    printf("loading PTN file version 2\n");
-	tlWeaveParameters *param =
-        (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
-    unsigned int num_read_yarn_types = 0;
-	unsigned int num_read_pattern_entries = 0;
-    while(1){
-        uint32_t type     = ((uint32_t*)data)[0];
-        if(type==0){
-            break;
-        }
-        uint32_t name_len = ((uint32_t*)data)[1];
-        uint32_t size     = ((uint32_t*)data)[2];
-        uint32_t version  = ((uint32_t*)data)[3];
-        data += 4*sizeof(uint32_t);
-        char *name = (char*)data;
-        printf("type: %d size: %d version %d name: %s\n",type,size,version,name);
-        data += name_len;
-        data += size;
-        //NOTE(Vidar):Right now we assume that tlWeaveParameters is the first
-        // section written, and that all info is correct
-        if(strcmp(name,"tlWeaveParameters") == 0){
-            data = tl_read_ptn_section(param,data,ptn_entry_weave_params);
-            param->yarn_types = (tlYarnType*)calloc(param->num_yarn_types,
-                    sizeof(tlYarnType));
-            for (int i = 0; i < param->num_yarn_types; i++) {
-                param->yarn_types[i] = tl_default_yarn_type;
+    char *path;
+    uint64_t mtime, size;
+    uint32_t ref_count;
+    uint64_t last_release; //Orders the unused entries, oldest first
+    tlWeaveParameters *params; //The loaded pattern, shared by all users
+    tlPatternCacheEntry *next;
+};
+
+static void tl_build_pattern_runs(tlWeaveParameters *params)
+{
+    if(params->cache_entry){
+        params->pattern_runs = params->cache_entry->params->pattern_runs;
+        return;
+    }
+    if(params->pattern_runs){
+        free(params->pattern_runs);
+        params->pattern_runs = 0;
+    }
+    uint32_t w = params->pattern_width;
+    uint32_t h = params->pattern_height;
+    if(!tl_has_pattern(params) || params->packed || params->procedural
+            || w == 0 || h == 0){
+        // Packed patterns count their runs from the tiles, and
+        // procedural ones from a single repeat of the weave
+        return;
+    }
+    const tlPatternDraft *draft = params->draft;
+    if(draft){
+        // The rows of a draft only depend on the treadle and the
+        // columns only on the shaft. The runs along x of each treadle are
+        // followed by the runs along y of each shaft.
+        uint32_t num_treadles = draft->num_treadles;
+        uint32_t num_shafts = draft->num_shafts;
+        tlPatternRuns *runs = (tlPatternRuns*)calloc(
+            (size_t)num_treadles*w + (size_t)num_shafts*h,
+            sizeof(tlPatternRuns));
+        PatternEntry *line = (PatternEntry*)calloc(w > h ? w : h,
+            sizeof(PatternEntry));
+        for(uint32_t treadle=0;treadle<num_treadles;treadle++){
+            for(uint32_t x=0;x<w;x++){
+                line[x].warp_above = draft->tieup[treadle
+                    + draft->threading[x]*num_treadles];
             }
-            uint32_t pattern_size = param->pattern_width*param->pattern_height;
-            param->pattern = (PatternEntry*)calloc(pattern_size,
-                    sizeof(PatternEntry));
+            tl_build_pattern_runs_line(line, runs + treadle*w, 0, 1, w, 0);
         }
-        if(strcmp(name,"tlYarnType") == 0){
-            if(num_read_yarn_types < param->num_yarn_types){
-                data = tl_read_ptn_section(&param->yarn_types[num_read_yarn_types],
-                    data,ptn_entry_yarn_type);
-                num_read_yarn_types++;
+        tlPatternRuns *shaft_runs = runs + (size_t)num_treadles*w;
+        for(uint32_t shaft=0;shaft<num_shafts;shaft++){
+            for(uint32_t y=0;y<h;y++){
+                line[y].warp_above = draft->tieup[draft->treadling[y]
+                    + shaft*num_treadles];
             }
+            tl_build_pattern_runs_line(line, shaft_runs + shaft*h, 0, 1, h, 1);
         }
-        if(strcmp(name,"tlPattern") == 0){
-            if(version == 1){
-                memcpy(param->pattern,data-size,size);
-            }
-            num_read_pattern_entries++;
+        free(line);
+        params->pattern_runs = runs;
+        return;
+    }
+    // The pattern of a PTN v3 file is not validated when it is loaded,
+    // so a yarn type outside of the resolved tables is replaced by the
+    // default one here, where every cell is visited anyway
+    for(uint32_t i=0;i<w*h;i++){
+        if(params->pattern[i].yarn_type >= params->num_yarn_types){
+            params->pattern[i].yarn_type = 0;
         }
     }
-    return param;
+    tlPatternRuns *runs = (tlPatternRuns*)calloc(w*h,sizeof(tlPatternRuns));
+    for(uint32_t y=0;y<h;y++){
+        tl_build_pattern_runs_line(params->pattern, runs, y*w, 1, w, 0);
+    }
+    for(uint32_t x=0;x<w;x++){
+        tl_build_pattern_runs_line(params->pattern, runs, x, w, h, 1);
+    }
+    params->pattern_runs = runs;
 }
 
+// Memory for tables which are read during shading is aligned to cache lines
+static void *tl_aligned_alloc(size_t size)
+{
+#ifdef _MSC_VER
+    return _aligned_malloc(size,TL_CACHE_LINE_SIZE);
+#else
+    void *ret = 0;
+    if(posix_memalign(&ret,TL_CACHE_LINE_SIZE,size) != 0){
+        return 0;
+    }
+    return ret;
+#endif
+}
 
-static tlWeaveParameters *tl_pattern_from_ptn_file_v1(unsigned char *data,
-    long len,const char **error)
+static void tl_aligned_free(void *ptr)
 {
-    int num_yarn_types = *(int*)(data + 24);
-    printf("num yarn types: %d\n",num_yarn_types);
-    int num_write_commands = 2+num_yarn_types;
-    tlPtnWriteCommand *write_commands =
-        (tlPtnWriteCommand*)calloc(num_write_commands,sizeof(tlPtnWriteCommand));
-    int pattern_size = *(int*)(data+16) * *(int*)(data+20);
-    printf("Pattern size: %d\n",pattern_size);
+#ifdef _MSC_VER
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
 
-    //NOTE(Vidar):These are the structures as of v 0.91
-    tlPtnEntry ptn_entry_weave_paramsv091[]={
-        {1,  0,  0, 1, "tlWeaveParameters"},
-        {2,  0,  4, 1, "uscale"},
-        {2,  4,  4, 1, "vscale"},
-        {2,  8,  4, 1, "intensity_fineness"},
-        {2, 12,  1, 1, "realworld_uv"},
-        {2, 16,  4, 1, "pattern_height"},
-        {2, 20,  4, 1, "pattern_width"},
-        {2, 24,  4, 1, "num_yarn_types"},
-        {2, 48,  4, 1, "specular_normalization"},
-        {2, 52,  4, 1, "pattern_realheight"},
-        {2, 56,  4, 1, "pattern_realwidth"},
-        {0,  0,  0, 0, "end"}
-    };
-    int weave_paramsv091_len = 64;
-
-    tlPtnEntry ptn_entry_yarn_typev091[]={
-        {1,  0,  0, 1, "tlYarnType"},
-        {2,  0,  4, 1, "umax"},
-        {2, 44,  1, 1, "umax_enabled"},
-        {2,  4,  4, 1, "yarnsize"},
-        {2, 45,  1, 1, "yarnsize_enabled"},
-        {2,  8,  4, 1, "psi"},
-        {2, 46,  1, 1, "psi_enabled"},
-        {2, 12,  4, 1, "alpha"},
-        {2, 47,  1, 1, "alpha_enabled"},
-        {2, 16,  4, 1, "beta"},
-        {2, 48,  1, 1, "beta_enabled"},
-        {2, 20,  4, 1, "delta_x"},
-        {2, 49,  1, 1, "delta_x_enabled"},
-        {2, 24,  4, 1, "specular_strength"},
-        {2, 50,  1, 1, "specular_strength_enabled"},
-        {2, 28,  4, 1, "specular_noise"},
-        {2, 51,  1, 1, "specular_noise_enabled"},
-        {2, 32, 12, 1, "color"},
-        {2, 52,  1, 1, "color_enabled"},
-        {0,  0,  0, 0, "end"}
-    };
-    int yarn_typev091_len = 128;
+static void tl_free_resolved_yarn_types(tlWeaveParameters *params)
+{
+    if(params->resolved_yarn_types){
+        tl_aligned_free(params->resolved_yarn_types);
+        params->resolved_yarn_types = 0;
+    }
+    if(params->resolved_yarn_texmaps){
+        free(params->resolved_yarn_texmaps);
+        params->resolved_yarn_texmaps = 0;
+    }
+}
 
-    write_commands[0].entry = ptn_entry_weave_paramsv091;
-    write_commands[0].data = data;
-    data += weave_paramsv091_len;
-    for(int i=0;i<num_yarn_types;i++){
-        write_commands[2+i].entry = ptn_entry_yarn_typev091;
-        write_commands[2+i].data = data;
-        data += yarn_typev091_len;
+static void tl_free_baked_yarnsize(tlWeaveParameters *params)
+{
+    if(params->baked_yarnsize){
+        free(params->baked_yarnsize->yarnsize);
+        free(params->baked_yarnsize);
+        params->baked_yarnsize = 0;
     }
-    tlPtnEntry ptn_entry_patternv091 = {3,0,
-        (uint32_t)(2*sizeof(uint8_t)*pattern_size),1, "tlPattern"};
-    tlPtnEntry pattern_entry = ptn_entry_pattern;
-    pattern_entry.size      *= pattern_size;
-    write_commands[1].entry  = &ptn_entry_patternv091;
-    write_commands[1].data   = data;
+}
 
-    long ptn_v2_len=0;
-    unsigned char *ptn_v2_buffer = tl_buffer_from_ptn_write_commands(
-        num_write_commands,write_commands,&ptn_v2_len);
-    tlWeaveParameters *param = tl_pattern_from_ptn_file_v2(
-            ptn_v2_buffer+sizeof(int), ptn_v2_len,error);
-    free(ptn_v2_buffer);
-	return param;
+static void tl_free_prefiltered(tlWeaveParameters *params)
+{
+    if(params->prefiltered){
+        free(params->prefiltered->coverage);
+        free(params->prefiltered->first_sample);
+        free(params->prefiltered->samples);
+        free(params->prefiltered);
+        params->prefiltered = 0;
+    }
 }
 
-tlWeaveParameters *tl_weave_pattern_from_ptn(unsigned char *data,long len,
-    const char **error)
+static void tl_free_far_field(tlWeaveParameters *params)
 {
-	tlWeaveParameters *param = 0;
-	int version = 0;
-	memcpy(&version,data,sizeof(int));\
-	data += sizeof(int);
-	len -= sizeof(int);
-	switch(version){
-	case 1:
-		param = tl_pattern_from_ptn_file_v1(data,len,error);
-		break;
-    case 2:
-        param = tl_pattern_from_ptn_file_v2(data,len,error);
-        break;
-	default:
-		*error = "Unknown PTN file version";
-		return 0;
-	}
-	return param;
+    if(params->far_field){
+        free(params->far_field->diffuse);
+        free(params->far_field->specular);
+        free(params->far_field);
+        params->far_field = 0;
+    }
 }
 
+// -- Specular kernels -- //
 
-//TODO(Vidar):This should free params too, right?
-void tl_free_weave_parameters(tlWeaveParameters *params)
+// Variants of tl_specular where the choice between filament and staple yarn
+// and whether specular noise is applied are made at compile time. They are
+// defined after tl_specular. TL_SPECULAR_KERNEL(name, filament, noise)
+#define TL_SPECULAR_KERNELS\
+    TL_SPECULAR_KERNEL(staple,0,0)\
+    TL_SPECULAR_KERNEL(staple_noise,0,1)\
+    TL_SPECULAR_KERNEL(filament,1,0)\
+    TL_SPECULAR_KERNEL(filament_noise,1,1)
+
+enum
 {
-    if (params->yarn_types) {
-        free(params->yarn_types);
+    TL_SPECULAR_KERNEL_generic, //Makes the choices for each shading point
+#define TL_SPECULAR_KERNEL(name,filament,noise) TL_SPECULAR_KERNEL_##name,
+TL_SPECULAR_KERNELS
+#undef TL_SPECULAR_KERNEL
+    TL_SPECULAR_KERNEL_COUNT
+};
+
+// Picks the kernel for a yarn type. The choices can only be made up front if
+// the parameters they depend on are not textured.
+static uint8_t tl_specular_kernel_index(const tlResolvedYarnType *r)
+{
+    if(r->textured & ((1u<<TL_YARN_PARAM_psi)
+            | (1u<<TL_YARN_PARAM_specular_noise))){
+        return TL_SPECULAR_KERNEL_generic;
     }
-    if (params->pattern) {
-        free(params->pattern);
+    int filament = r->psi <= 0.001f;
+    int noise = r->specular_noise > 0.001f;
+    if(filament){
+        return noise ? TL_SPECULAR_KERNEL_filament_noise :
+            TL_SPECULAR_KERNEL_filament;
     }
+    return noise ? TL_SPECULAR_KERNEL_staple_noise : TL_SPECULAR_KERNEL_staple;
 }
 
-static float intensity_variation(tlPatternData pattern_data)
+// Flattens the yarn type 0 inheritance of yarn type i, so that the getters
+// only need a single lookup per parameter.
+static void tl_resolve_yarn_type(const tlWeaveParameters *params, uint32_t i,
+    tlResolvedYarnType *r, void **t)
 {
-	//NOTE(Vidar): a fineness of 3 seems to work fine...
-	uint32_t intensity_fineness = 3;
-
-    // have index to make a grid of finess*fineness squares 
-    // of which to have the same brightness variations.
-
-    uint32_t tindex_x = pattern_data.total_index_x;
-    uint32_t tindex_y = pattern_data.total_index_y;
+    const tlYarnType *source;
+    memset(r,0,sizeof(tlResolvedYarnType));
+#define TL_FLOAT_PARAM(name) \
+    source = TL_YARN_TYPE_SOURCE(params,i,name);\
+    r->name = source->name;\
+    t[TL_YARN_PARAM_##name] = source->name##_texmap;\
+    if(TL_HAS_TEXMAP(source->name##_texmap)){\
+        r->textured |= 1u<<TL_YARN_PARAM_##name;\
+    }
+#define TL_INT_PARAM(name) TL_FLOAT_PARAM(name)
+#define TL_COLOR_PARAM(name) TL_FLOAT_PARAM(name)
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+    r->specular_kernel = tl_specular_kernel_index(r);
+}
 
-    //Switch X and Y for warp, so that we have the yarn going along y
-    if(!pattern_data.warp_above){
-		uint32_t tmp = tindex_x;
-        tindex_x = tindex_y;
-        tindex_y = tmp;
+static void tl_build_resolved_yarn_types(tlWeaveParameters *params)
+{
+    tl_free_resolved_yarn_types(params);
+    uint32_t num = params->num_yarn_types;
+    if(params->yarn_types == 0 || num == 0){
+        return;
+    }
+    tlResolvedYarnType *resolved = (tlResolvedYarnType*)
+        tl_aligned_alloc(num*sizeof(tlResolvedYarnType));
+    void **texmaps = (void**)calloc(num*TL_YARN_PARAM_COUNT,sizeof(void*));
+    if(resolved == 0 || texmaps == 0){
+        // The getters fall back to reading yarn_types directly
+        if(resolved){
+            tl_aligned_free(resolved);
+        }
+        free(texmaps);
+        return;
+    }
+    for(uint32_t i=0;i<num;i++){
+        tl_resolve_yarn_type(params,i,&resolved[i],
+            texmaps + i*TL_YARN_PARAM_COUNT);
     }
+    params->resolved_yarn_types = resolved;
+    params->resolved_yarn_texmaps = texmaps;
+}
 
-    // Potential overflow of r1 and r2 is acceptable here.
-    uint32_t r1 = tindex_x*intensity_fineness - 
-        (pattern_data.x*0.5)*pattern_data.width*intensity_fineness;
-    uint32_t r2 = tindex_y*intensity_fineness - 
-        (pattern_data.y*0.5)*pattern_data.length*intensity_fineness;
+// Gives params a new prepare_id, which tells the segment caches of all
+// threads that the tables have changed
+static void tl_new_prepare_id(tlWeaveParameters *params)
+{
+    static volatile int64_t last_prepare_id = 0;
+#ifdef _MSC_VER
+    params->prepare_id = (uint64_t)_InterlockedIncrement64(&last_prepare_id);
+#else
+    params->prepare_id = (uint64_t)__sync_add_and_fetch(&last_prepare_id,1);
+#endif
+}
 
-    float xi = sample_TEA_single(r1, r2, 8);
-    float log_xi = -logf(xi);
-    return log_xi < 10.f ? log_xi : 10.f;
+void tl_prepare(tlWeaveParameters *params)
+{
+    tl_build_pattern_runs(params);
+    tl_build_resolved_yarn_types(params);
+    tl_free_baked_yarnsize(params);
+    tl_free_prefiltered(params);
+    tl_free_far_field(params);
+    tl_new_prepare_id(params);
 }
 
+void tl_update_yarn_types(tlWeaveParameters *params)
+{
+    if(!params->resolved_yarn_types){
+        tl_build_resolved_yarn_types(params);
+    } else{
+        // The number of yarn types is the same, so the tables are reused
+        for(uint32_t i=0;i<params->num_yarn_types;i++){
+            tl_resolve_yarn_type(params,i,params->resolved_yarn_types + i,
+                params->resolved_yarn_texmaps + i*TL_YARN_PARAM_COUNT);
+        }
+    }
+    tl_new_prepare_id(params);
+}
+
+// -- Pattern repeats -- //
 
-static void calculate_length_of_segment(uint8_t warp_above, uint32_t pattern_x,
-                uint32_t pattern_y, uint32_t *steps_left,
-                uint32_t *steps_right,  uint32_t pattern_width,
-                uint32_t pattern_height, PatternEntry *pattern_entries)
+// Returns the pattern repeated repeats_x times along x and repeats_y times
+// along y, which should be freed with free.
+static PatternEntry *tl_repeated_pattern(const PatternEntry *pattern,
+    uint32_t w, uint32_t h, uint32_t repeats_x, uint32_t repeats_y)
 {
+    size_t repeated_w = (size_t)w*repeats_x;
+    size_t repeated_h = (size_t)h*repeats_y;
+    PatternEntry *repeated = (PatternEntry*)malloc(repeated_w*repeated_h
+        *sizeof(PatternEntry));
+    for(size_t y=0;y<repeated_h;y++){
+        for(uint32_t i=0;i<repeats_x;i++){
+            memcpy(repeated + y*repeated_w + i*w, pattern + (y%h)*w,
+                w*sizeof(PatternEntry));
+        }
+    }
+    return repeated;
+}
 
-    uint32_t current_x = pattern_x;
-    uint32_t current_y = pattern_y;
-    uint32_t *incremented_coord = warp_above ? &current_y : &current_x;
-    uint32_t max_size = warp_above ? pattern_height: pattern_width;
-    uint32_t initial_coord = warp_above ? pattern_y: pattern_x;
-    *steps_right = 0;
-    *steps_left  = 0;
-    do{
-        (*incremented_coord)++;
-        if(*incremented_coord == max_size){
-            *incremented_coord = 0;
+// Returns the smallest width that the pattern is a whole number of repeats of
+static uint32_t tl_find_repeat_width(const PatternEntry *pattern,
+    uint32_t w, uint32_t h)
+{
+    for(uint32_t period=1;period<w;period++){
+        if(w%period != 0){
+            continue;
         }
-        if((pattern_entries[current_x +
-                current_y*pattern_width].warp_above) != warp_above){
-            break;
+        uint32_t y = 0;
+        for(;y<h;y++){
+            const PatternEntry *row = pattern + (size_t)y*w;
+            if(memcmp(row,row+period,(w-period)*sizeof(PatternEntry)) != 0){
+                break;
+            }
         }
-        (*steps_right)++;
-    } while(*incremented_coord != initial_coord);
+        if(y == h){
+            return period;
+        }
+    }
+    return w;
+}
 
-    *incremented_coord = initial_coord;
-    do{
-        if(*incremented_coord == 0){
-            *incremented_coord = max_size;
+static uint32_t tl_find_repeat_height(const PatternEntry *pattern,
+    uint32_t w, uint32_t h)
+{
+    for(uint32_t period=1;period<h;period++){
+        if(h%period == 0 && memcmp(pattern,pattern + (size_t)period*w,
+                (size_t)(h-period)*w*sizeof(PatternEntry)) == 0){
+            return period;
         }
-        (*incremented_coord)--;
-        if((pattern_entries[current_x +
-                current_y*pattern_width].warp_above) != warp_above){
-            break;
+    }
+    return h;
+}
+
+// Returns 1 if some row, or column if along_y is set, is all warp or all weft
+static uint8_t tl_has_uniform_line(const PatternEntry *pattern,
+    uint32_t w, uint32_t h, uint8_t along_y)
+{
+    uint32_t num_lines = along_y ? w : h;
+    uint32_t line_length = along_y ? h : w;
+    size_t stride = along_y ? w : 1;
+    for(uint32_t line=0;line<num_lines;line++){
+        const PatternEntry *first = pattern + (along_y ? line : (size_t)line*w);
+        uint32_t i = 1;
+        while(i<line_length && first[i*stride].warp_above == first->warp_above){
+            i++;
         }
-        (*steps_left)++;
-    } while(*incremented_coord != initial_coord);
+        if(i == line_length){
+            return 1;
+        }
+    }
+    return 0;
 }
 
-static float wrapped_cauchy(float cos_x, float rho) {
-    if (rho > 0.999f) {
-        return 0.f;
+// Replaces a loaded pattern by its smallest repeat, see
+// tl_expand_pattern_repeats
+static void tl_shrink_pattern_to_repeat(tlWeaveParameters *params)
+{
+    uint32_t w = params->pattern_width;
+    uint32_t h = params->pattern_height;
+    if(!params->pattern || params->ptn_mapping || params->cache_entry
+            || w == 0 || h == 0){
+        return;
     }
-    float rho2 = rho * rho;
-    return M_1_PI * 0.5f * (1.f - rho2) / (1.f - 2.f * rho * cos_x + rho2);
+    // A yarn that runs along a whole row or column is as long as
+    // the pattern, so those patterns can't be shrunk along that direction
+    // without changing the segments
+    uint32_t repeat_w = tl_has_uniform_line(params->pattern,w,h,0) ? w :
+        tl_find_repeat_width(params->pattern,w,h);
+    uint32_t repeat_h = tl_has_uniform_line(params->pattern,w,h,1) ? h :
+        tl_find_repeat_height(params->pattern,w,h);
+    if(repeat_w == w && repeat_h == h){
+        return;
+    }
+    PatternEntry *pattern = (PatternEntry*)malloc((size_t)repeat_w*repeat_h
+        *sizeof(PatternEntry));
+    for(uint32_t y=0;y<repeat_h;y++){
+        memcpy(pattern + (size_t)y*repeat_w, params->pattern + (size_t)y*w,
+            repeat_w*sizeof(PatternEntry));
+    }
+    free(params->pattern);
+    params->pattern = pattern;
+    params->pattern_width = repeat_w;
+    params->pattern_height = repeat_h;
+    params->pattern_repeats_x = (uint32_t)tl_pattern_repeats(
+        params->pattern_repeats_x)*(w/repeat_w);
+    params->pattern_repeats_y = (uint32_t)tl_pattern_repeats(
+        params->pattern_repeats_y)*(h/repeat_h);
 }
 
-static void lookup_pattern_entry(PatternEntry* entry, const tlWeaveParameters* params, const int8_t x, const int8_t y) {
-    //function to get pattern entry. Takes care of coordinate wrapping!
-    int32_t tmpx = (int32_t)fmod(x,(float)params->pattern_width);
-    int32_t tmpy = (int32_t)fmod(y,(float)params->pattern_height);
-    if (tmpx < 0.f) {
-        tmpx = params->pattern_width + tmpx;
+// Sets up yarn type 0 and one yarn type for each of the colors
+static void tl_set_yarn_colors(tlWeaveParameters *params,
+    uint32_t num_yarn_types, tlColor *yarn_colors)
+{
+    num_yarn_types++;
+    params->num_yarn_types = num_yarn_types;
+    params->yarn_types = (tlYarnType*)calloc(sizeof(tlYarnType),num_yarn_types);
+    params->yarn_types[0] = tl_default_yarn_type;
+    for(unsigned int i=1;i<num_yarn_types;i++){
+        params->yarn_types[i] = tl_default_yarn_type;
+        params->yarn_types[i].color = yarn_colors[i-1];
+        params->yarn_types[i].color_enabled = 1;
     }
-    if (tmpy < 0.f) {
-        tmpy = params->pattern_height + tmpy;
+}
+
+tlWeaveParameters *tl_weave_pattern_from_data(uint8_t *warp_above, uint8_t *yarn_type,
+    uint32_t num_yarn_types, tlColor *yarn_colors, uint32_t pattern_width,
+    uint32_t pattern_height)
+{
+    tlWeaveParameters *params =
+        (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
+    params->pattern_width = pattern_width;
+    params->pattern_height = pattern_height;
+    tl_set_yarn_colors(params, num_yarn_types, yarn_colors);
+    uint32_t pattern_size = pattern_width*pattern_height;
+    params->pattern = (PatternEntry*)calloc(sizeof(PatternEntry),pattern_size);
+    for(unsigned int i=0;i<pattern_size;i++){
+        params->pattern[i].warp_above = warp_above[i];
+        params->pattern[i].yarn_type = yarn_type[i];
     }
-    *entry = params->pattern[tmpx + tmpy*params->pattern_width];
+    return params;
 }
 
-static int32_t tl_repeat_index(const int32_t coord, const int32_t size) {
-    //coord = -0.124*2 = -0.248
-    float tmpcoord = (float)fmod((float)coord, (float)size);
-    if (tmpcoord < 0.f) {
-        tmpcoord = size + tmpcoord;
+// -- Procedural weaves -- //
+
+static uint64_t tl_gcd(uint64_t a, uint64_t b)
+{
+    while(b){
+        uint64_t t = a%b;
+        a = b;
+        b = t;
     }
-    return (int32_t)tmpcoord;
+    return a;
 }
 
-static float get_yarn_segment_size(int32_t total_pattern_x, int32_t total_pattern_y,
-		const tlWeaveParameters *params, const tlIntersectionData *intersection_data) {
-        //remove scaling from coords
-		float lookup_u = (total_pattern_x + 0.5f)/((float)(params->pattern_width)*params->uscale);
-		float lookup_v = (total_pattern_y + 0.5f)/((float)(params->pattern_height)*params->vscale);
-		
-        PatternEntry yrntype;
-		lookup_pattern_entry(&yrntype, params, total_pattern_x, total_pattern_y);
+// Expands the stripes to one yarn type per thread. Returns the number of
+// threads, or 0 if the stripes are invalid.
+static uint32_t tl_stripe_yarn_types(const tlYarnStripe *stripes,
+    uint32_t num_stripes, uint32_t num_yarn_types, uint8_t **yarn_types)
+{
+    uint64_t period = 0;
+    for(uint32_t i=0;i<num_stripes;i++){
+        if(stripes[i].count == 0 || stripes[i].yarn_type == 0
+                || stripes[i].yarn_type > num_yarn_types){
+            return 0;
+        }
+        period += stripes[i].count;
+    }
+    if(period == 0 || period > TL_MAX_PROCEDURAL_SIZE){
+        return 0;
+    }
+    *yarn_types = (uint8_t*)malloc((size_t)period);
+    uint8_t *dest = *yarn_types;
+    for(uint32_t i=0;i<num_stripes;i++){
+        memset(dest,stripes[i].yarn_type,stripes[i].count);
+        dest += stripes[i].count;
+    }
+    return (uint32_t)period;
+}
 
-		//Sample potential yarnsize texmap in middle of cell
-        float size = tl_yarn_type_get_lookup_yarnsize(params, yrntype.yarn_type,
-                lookup_u, lookup_v, intersection_data->context);
-		//float size = tl_yarn_type_get_yarnsize(params, yrntype.yarn_type, intersection_data->context);
-		return size;
-	}
+tlWeaveParameters *tl_weave_pattern_from_procedural(uint32_t family,
+    uint32_t warp_float, uint32_t weft_float, uint32_t shift,
+    const tlYarnStripe *warp_stripes, uint32_t num_warp_stripes,
+    const tlYarnStripe *weft_stripes, uint32_t num_weft_stripes,
+    uint32_t num_yarn_types, tlColor *yarn_colors, const char **error)
+{
+    uint64_t repeat = (uint64_t)warp_float + weft_float;
+    uint32_t block_width = 1, block_height = 1;
+    switch(family){
+    case TL_WEAVE_PLAIN:
+        warp_float = 1;
+        repeat = 2;
+        shift = 1;
+        break;
+    case TL_WEAVE_TWILL:
+        if(warp_float == 0 || weft_float == 0){
+            *error = "Twill floats must be at least 1";
+            return 0;
+        }
+        if(shift == 0){
+            shift = 1;
+        }
+        break;
+    case TL_WEAVE_SATIN:
+        if(warp_float == 0 || weft_float == 0
+                || (warp_float != 1 && weft_float != 1) || repeat < 5
+                || shift < 2 || shift >= repeat - 1
+                || tl_gcd(shift,repeat) != 1){
+            *error = "Invalid satin parameters";
+            return 0;
+        }
+        break;
+    case TL_WEAVE_BASKET:
+        if(warp_float == 0 || weft_float == 0){
+            *error = "Basket blocks must be at least 1 cell";
+            return 0;
+        }
+        block_width = warp_float;
+        block_height = weft_float;
+        warp_float = 1;
+        repeat = 2;
+        shift = 1;
+        break;
+    default:
+        *error = "Unknown weave family";
+        return 0;
+    }
+    if(num_warp_stripes == 0 || num_weft_stripes == 0){
+        *error = "Warp and weft need at least one stripe each";
+        return 0;
+    }
+    if(num_yarn_types >= TL_MAX_YARN_TYPES){
+        *error = "Too many yarn types";
+        return 0;
+    }
+    if(repeat*block_width > TL_MAX_PROCEDURAL_SIZE
+            || repeat*block_height > TL_MAX_PROCEDURAL_SIZE){
+        *error = "Procedural weave is too large";
+        return 0;
+    }
 
-tlYarnSegment tl_get_yarn_segment(float total_u, float total_v,
-		const tlWeaveParameters *params, const tlIntersectionData *intersection_data) {
-    //total_u and total_v are scaled and non_repeating
+    tlProceduralWeave *weave = (tlProceduralWeave*)calloc(1,
+        sizeof(tlProceduralWeave));
+    weave->family = family;
+    weave->repeat = (uint32_t)repeat;
+    weave->warp_float = warp_float;
+    weave->shift = (uint32_t)(shift%repeat);
+    weave->block_width = block_width;
+    weave->block_height = block_height;
+    weave->warp_period = tl_stripe_yarn_types(warp_stripes, num_warp_stripes,
+        num_yarn_types, &weave->warp_yarn_types);
+    weave->weft_period = tl_stripe_yarn_types(weft_stripes, num_weft_stripes,
+        num_yarn_types, &weave->weft_yarn_types);
+    if(weave->warp_period == 0 || weave->weft_period == 0){
+        tl_free_procedural_weave(weave);
+        *error = "Invalid yarn stripes";
+        return 0;
+    }
 
-    float u = fmod(total_u,1.f);
-    float v = fmod(total_v,1.f);
-    if (u < 0.f) {
-        u = u - floor(u);
+    // Along x the blocks step one phase at a time, along y
+    // they step shift phases, which may visit only some of them
+    uint64_t weave_width = repeat*block_width;
+    uint64_t weave_height = repeat/tl_gcd(weave->shift,repeat)*block_height;
+    uint64_t width = weave_width/tl_gcd(weave_width,weave->warp_period)
+        *weave->warp_period;
+    uint64_t height = weave_height/tl_gcd(weave_height,weave->weft_period)
+        *weave->weft_period;
+    if(width > TL_MAX_PROCEDURAL_SIZE || height > TL_MAX_PROCEDURAL_SIZE){
+        tl_free_procedural_weave(weave);
+        *error = "Procedural weave is too large";
+        return 0;
     }
-    if (v < 0.f) {
-        v = v - floor(v);
+
+    uint32_t n = weave->repeat;
+    uint32_t steps[4] = {n - 1, 1, n - weave->shift, weave->shift};
+    weave->block_runs = (uint32_t*)calloc(4*(size_t)n,sizeof(uint32_t));
+    for(uint32_t table=0;table<4;table++){
+        for(uint32_t phase=0;phase<n;phase++){
+            uint8_t warp_above = phase < weave->warp_float;
+            uint32_t next = phase;
+            uint32_t blocks = 0;
+            while(blocks < n){
+                next = (next + steps[table])%n;
+                if((next < weave->warp_float) != warp_above){
+                    break;
+                }
+                blocks++;
+            }
+            weave->block_runs[table*n + phase] = blocks;
+        }
     }
 
-    uint32_t pattern_width = params->pattern_width;
+    tlWeaveParameters *params =
+        (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
+    params->pattern_width = (uint32_t)width;
+    params->pattern_height = (uint32_t)height;
+    tl_set_yarn_colors(params, num_yarn_types, yarn_colors);
+    params->procedural = weave;
+    return params;
+}
+
+#ifndef TL_NO_FILES
+
+static unsigned char *tl_map_file(const char *filename, size_t *size);
+#ifdef TL_WCHAR
+static unsigned char *tl_map_file_wchar(const wchar_t *filename, size_t *size);
+#endif
+static tlWeaveParameters *tl_pattern_from_ptn_v3_mapping(unsigned char *mapping,
+    size_t size, const char **error);
+
+// Reads the version number at the start of a PTN file
+static int tl_ptn_file_version(FILE *fp)
+{
+    int version = 0;
+    if(fread(&version,sizeof(int),1,fp) != 1){
+        version = 0;
+    }
+    fseek(fp,0,SEEK_SET);
+    return version;
+}
+
+// Loads a WIF or PTN file. If draft is set, WIF files are loaded as drafts.
+static tlWeaveParameters *tl_load_weave_pattern(const char *filename,
+    int draft, const char **error)
+{
+	tlWeaveParameters *param = 0;
+	int len = 0;
+	while(filename[len] != 0){
+		len++;
+	}
+	if(len >=5){
+		bool wif_ok = true;
+		bool ptn_ok = true;
+		const char *wif_ext = ".wif";
+		const char *ptn_ext = ".ptn";
+		for(int i=0;i<4;i++){
+			char c = filename[len-1-i];
+			c = (c <= 'Z' && c >= 'A') ? c + 32 : c;
+			if(c != wif_ext[3-i]){
+				wif_ok = false;
+			}
+			if(c != ptn_ext[3-i]){
+				ptn_ok = false;
+			}
+        }   
+        if(wif_ok || ptn_ok){
+            FILE *fp = 0;
+            if(wif_ok){
+             fp = fopen(filename,"rt");
+            }
+            if(ptn_ok){
+             fp = fopen(filename,"rb");
+            }
+            if (!fp) {
+                *error = "File not found.";
+                return 0;
+            }
+            if(ptn_ok && tl_ptn_file_version(fp) == 3){
+                fclose(fp);
+                size_t size = 0;
+                unsigned char *mapping = tl_map_file(filename,&size);
+                if(!mapping){
+                    *error = "Could not map PTN file.";
+                    return 0;
+                }
+                return tl_pattern_from_ptn_v3_mapping(mapping,size,error);
+            }
+            fseek(fp,0,SEEK_END);
+            long len = ftell(fp);
+            fseek(fp,0,SEEK_SET);
+            unsigned char *data = (unsigned char*)calloc(len,1);
+            fread(data,1,len,fp);
+            fclose(fp);
+            if(wif_ok){
+                param = draft ? tl_weave_pattern_from_wif_draft(data,len,error)
+                    : tl_weave_pattern_from_wif(data,len,error);
+            }
+            if(ptn_ok){
+                param = tl_weave_pattern_from_ptn(data,len,error);
+            }
+            free(data);
+		}
+	}
+	return param;
+}
+
+tlWeaveParameters *tl_weave_pattern_from_file(const char *filename,const char **error)
+{
+    return tl_load_weave_pattern(filename,0,error);
+}
+
+tlWeaveParameters *tl_weave_pattern_from_file_draft(const char *filename,
+    const char **error)
+{
+    return tl_load_weave_pattern(filename,1,error);
+}
+#ifdef TL_WCHAR
+tlWeaveParameters *tl_weave_pattern_from_wif_wchar(const wchar_t *filename,const char **error)
+{
+	tlWeaveParameters *param = 0;
+	int len = 0;
+	while(filename[len] != 0){
+		len++;
+	}
+	if(len >=5){
+		bool wif_ok = true;
+		bool ptn_ok = true;
+		wchar_t *wif_ext = L".wif";
+		wchar_t *ptn_ext = L".ptn";
+		for(int i=0;i<4;i++){
+			wchar_t c = filename[len-1-i];
+			c = towlower(c);
+			if(c != wif_ext[3-i]){
+				wif_ok = false;
+			}
+			if(c != ptn_ext[3-i]){
+				ptn_ok = false;
+			}
+		}
+		if(wif_ok || ptn_ok){
+			FILE *fp;
+			if(wif_ok){
+			 fp = _wfopen(filename,L"rt");
+			}
+			if(ptn_ok){
+			 fp = _wfopen(filename,L"rb");
+			}
+			if(ptn_ok && tl_ptn_file_version(fp) == 3){
+				fclose(fp);
+				size_t size = 0;
+				unsigned char *mapping = tl_map_file_wchar(filename,&size);
+				if(!mapping){
+					*error = "Could not map PTN file.";
+					return 0;
+				}
+				return tl_pattern_from_ptn_v3_mapping(mapping,size,error);
+			}
+			fseek(fp,0,SEEK_END);
+			long len = ftell(fp);
+			fseek(fp,0,SEEK_SET);
+			unsigned char *data = (unsigned char*)calloc(len,1);
+			fread(data,1,len,fp);
+			fclose(fp);
+			if(wif_ok){
+				param = tl_weave_pattern_from_wif(data,len,error);
+			}
+			if(ptn_ok){
+				param = tl_weave_pattern_from_ptn(data,len,error);
+			}
+			free(data);
+		}else{
+			*error = "Unknown file format";
+		}
+	}else{
+		*error = "Unknown file format";
+	}
+	return param;
+}
+#endif
+
+tlWeaveParameters *tl_weave_pattern_from_wif(unsigned char *data,long len,const char **error)
+{
+    WeaveData *weave_data = wif_read((char*)data,len,error);
+    if(weave_data){
+        tlWeaveParameters *params = (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
+        wif_get_pattern(params, weave_data,
+            &params->pattern_width, &params->pattern_height,
+            &params->pattern_realwidth, &params->pattern_realheight);
+        wif_free_weavedata(weave_data);
+        tl_shrink_pattern_to_repeat(params);
+        return params;
+    }
+    return 0;
+}
+
+tlWeaveParameters *tl_weave_pattern_from_wif_draft(unsigned char *data,
+    long len,const char **error)
+{
+    WeaveData *weave_data = wif_read((char*)data,len,error);
+    if(weave_data){
+        tlWeaveParameters *params = (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
+        wif_get_draft(params, weave_data,
+            &params->pattern_width, &params->pattern_height,
+            &params->pattern_realwidth, &params->pattern_realheight);
+        wif_free_weavedata(weave_data);
+        return params;
+    }
+    return 0;
+}
+#endif
+
+struct tlPtnWriteCommand{
+    tlPtnEntry *entry;
+    unsigned char *data;
+};
+
+static unsigned char* tl_buffer_from_ptn_write_commands(int num_write_commands,
+    tlPtnWriteCommand* write_commands, long *ret_len)
+{
+    int version = 2;
+    //NOTE(Vidar):Calculate needed size of buffer
+    size_t len = 2*sizeof(int); //Version number & end specifier
+    for(int i=0;i<num_write_commands;i++) {
+        tlPtnEntry *entry = write_commands[i].entry;
+        do{
+			size_t name_len = strlen(entry->name)+1;
+            len+= 4*sizeof(uint32_t) + entry->size+name_len;
+            entry++;
+        }while((entry-1)->type != 0 && (entry-1)->type != 3);
+    }
+
+    //NOTE(Vidar):Allocate buffer
+    unsigned char *data = (unsigned char *)calloc(len,1);
+    unsigned char *dest=data;
+
+    //NOTE(Vidar):Write version
+    *(int*)dest=version;
+    dest+=sizeof(int);
+
+    //NOTE(Vidar):Write data
+    for(int i=0;i<num_write_commands;i++) {
+        tlPtnEntry *entry = write_commands[i].entry;
+        do{
+			uint32_t name_len = (uint32_t)(strlen(entry->name)+1);
+            ((uint32_t*)dest)[0]=entry->type;
+            ((uint32_t*)dest)[1]=name_len;
+            ((uint32_t*)dest)[2]=entry->size;
+            ((uint32_t*)dest)[3]=entry->version;
+            dest+=4*sizeof(uint32_t);
+            memcpy(dest,entry->name,name_len);
+            dest+=name_len;
+            memcpy(dest,write_commands[i].data + entry->offset,entry->size);
+            dest+=entry->size;
+            entry++;
+        } while((entry-1)->type != 0 && (entry-1)->type != 3);
+    }
+
+    *(uint32_t*)dest = 0;
+    *ret_len = (long)len;
+    return data;
+}
+
+unsigned char * tl_pattern_to_ptn_file(tlWeaveParameters *param,
+    long *ret_len)
+{
+    // Older readers don't know about pattern repeats, so we save
+    // all of them. They are found again when the file is loaded.
+    uint32_t repeats_x = (uint32_t)tl_pattern_repeats(param->pattern_repeats_x);
+    uint32_t repeats_y = (uint32_t)tl_pattern_repeats(param->pattern_repeats_y);
+    tlWeaveParameters repeated_param = *param;
+    repeated_param.pattern_width      *= repeats_x;
+    repeated_param.pattern_height     *= repeats_y;
+    uint32_t pattern_size = repeated_param.pattern_width
+        *repeated_param.pattern_height;
+    int num_write_commands = 2+param->num_yarn_types;
+    tlPtnWriteCommand *write_commands =
+        (tlPtnWriteCommand*)calloc(num_write_commands,
+        sizeof(tlPtnWriteCommand));
+    write_commands[0].entry = ptn_entry_weave_params;
+    write_commands[0].data  = (unsigned char *)&repeated_param;
+    //NOTE(vidar):We make a copy of the pattern entry so that we can change the
+    // size
+    tlPtnEntry pattern_entry = ptn_entry_pattern;
+    pattern_entry.size      *= pattern_size;
+    write_commands[1].entry  = &pattern_entry;
+    PatternEntry *pattern = tl_expanded_pattern(param);
+    if(repeats_x != 1 || repeats_y != 1){
+        PatternEntry *repeated_pattern = tl_repeated_pattern(pattern,
+            param->pattern_width, param->pattern_height, repeats_x, repeats_y);
+        if(pattern != param->pattern){
+            free(pattern);
+        }
+        pattern = repeated_pattern;
+    }
+    write_commands[1].data   = (unsigned char *)pattern;
+    int a = 2;
+    for(unsigned int i=0;i<param->num_yarn_types;i++){
+        write_commands[a+i].entry = ptn_entry_yarn_type;
+        write_commands[a+i].data  = (unsigned char *)(param->yarn_types+i);
+    }
+    unsigned char *data = tl_buffer_from_ptn_write_commands(num_write_commands,
+        write_commands, ret_len);
+    free(write_commands);
+    if(pattern != param->pattern){
+        free(pattern);
+    }
+    return data;
+}
+
+// -- PTN v3 -- //
+
+#define TL_PTN_V3_ALIGNMENT TL_CACHE_LINE_SIZE
+#define TL_PTN_V3_BYTE_ORDER 0x01020304
+
+// The version must come first, tl_weave_pattern_from_ptn reads
+// it before it knows the layout of the rest of the file
+typedef struct
+{
+    int32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t yarn_type_size;
+    uint32_t pattern_entry_size;
+    uint32_t pattern_width;
+    uint32_t pattern_height;
+    uint32_t num_yarn_types;
+    uint32_t pattern_repeats_x;
+    uint32_t pattern_repeats_y;
+    uint64_t yarn_types_offset;
+    uint64_t pattern_offset;
+    uint64_t file_size;
+    float specular_normalization;
+    float pattern_realheight;
+    float pattern_realwidth;
+#define TL_FLOAT_PARAM(name) float name;
+#define TL_INT_PARAM(name)  uint8_t name;
+#define TL_COLOR_PARAM(name) tlColor name;
+TL_FABRIC_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+}tlPtnV3Header;
+
+static uint64_t tl_ptn_v3_align(uint64_t offset)
+{
+    return (offset + TL_PTN_V3_ALIGNMENT - 1) & ~(uint64_t)(TL_PTN_V3_ALIGNMENT - 1);
+}
+
+static void tl_clear_yarn_type_texmaps(tlYarnType *yarn_type)
+{
+#define TL_FLOAT_PARAM(name) yarn_type->name##_texmap = 0;
+#define TL_INT_PARAM(name)  yarn_type->name##_texmap = 0;
+#define TL_COLOR_PARAM(name) yarn_type->name##_texmap = 0;
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+}
+
+unsigned char * tl_pattern_to_ptn_v3_file(tlWeaveParameters *param,
+    long *ret_len)
+{
+    uint64_t pattern_size = (uint64_t)param->pattern_width
+        * param->pattern_height;
+    tlPtnV3Header header;
+    memset(&header,0,sizeof(header));
+    header.version            = 3;
+    header.byte_order         = TL_PTN_V3_BYTE_ORDER;
+    header.header_size        = sizeof(tlPtnV3Header);
+    header.yarn_type_size     = sizeof(tlYarnType);
+    header.pattern_entry_size = sizeof(PatternEntry);
+    header.pattern_width      = param->pattern_width;
+    header.pattern_height     = param->pattern_height;
+    header.num_yarn_types     = param->num_yarn_types;
+    header.pattern_repeats_x  = param->pattern_repeats_x;
+    header.pattern_repeats_y  = param->pattern_repeats_y;
+    header.yarn_types_offset  = tl_ptn_v3_align(sizeof(tlPtnV3Header));
+    header.pattern_offset     = tl_ptn_v3_align(header.yarn_types_offset
+        + param->num_yarn_types*sizeof(tlYarnType));
+    header.file_size          = header.pattern_offset
+        + pattern_size*sizeof(PatternEntry);
+    header.specular_normalization = param->specular_normalization;
+    header.pattern_realheight     = param->pattern_realheight;
+    header.pattern_realwidth      = param->pattern_realwidth;
+#define TL_FLOAT_PARAM(name) header.name = param->name;
+#define TL_INT_PARAM(name)  header.name = param->name;
+#define TL_COLOR_PARAM(name) header.name = param->name;
+TL_FABRIC_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+
+    unsigned char *data = (unsigned char *)calloc((size_t)header.file_size,1);
+    memcpy(data,&header,sizeof(header));
+    tlYarnType *yarn_types = (tlYarnType*)(data + header.yarn_types_offset);
+    memcpy(yarn_types,param->yarn_types,
+        param->num_yarn_types*sizeof(tlYarnType));
+    // Texmaps are pointers into the frontend, they can't be saved
+    for(uint32_t i=0;i<param->num_yarn_types;i++){
+        tl_clear_yarn_type_texmaps(yarn_types+i);
+    }
+    PatternEntry *pattern = tl_expanded_pattern(param);
+    memcpy(data + header.pattern_offset,pattern,
+        (size_t)pattern_size*sizeof(PatternEntry));
+    if(pattern != param->pattern){
+        free(pattern);
+    }
+    *ret_len = (long)header.file_size;
+    return data;
+}
+
+struct tlPtnConverter
+{
+    uint32_t src_version, target_version, src_size, target_size;
+    const char *src_name,*target_name;
+    unsigned char*(*func)(unsigned char *data);
+};
+
+static unsigned char* tl_ptn_specular_strength_to_specular_color( unsigned char *data)
+{
+    float val=*(float*)data;
+    tlColor *col=(tlColor*)calloc(1,sizeof(tlColor));
+    col->r=val;
+    col->g=val;
+    col->b=val;
+    return (unsigned char *)col;
+}
+
+static struct tlPtnConverter tl_ptn_converters[]={
+    {1,1,sizeof(float),sizeof(tlColor),"specular_strength","specular_color",
+    tl_ptn_specular_strength_to_specular_color}
+};
+static uint32_t tl_num_ptn_converters=sizeof(tl_ptn_converters)/sizeof(*tl_ptn_converters);
+
+static unsigned char *tl_read_ptn_section(void *out, unsigned char* data,
+    tlPtnEntry *entries)
+{
+    uint32_t type;
+    do{
+        type              = ((uint32_t*)data)[0];
+        uint32_t name_len = ((uint32_t*)data)[1];
+        uint32_t size     = ((uint32_t*)data)[2];
+        uint32_t version  = ((uint32_t*)data)[3];
+        data += 4*sizeof(uint32_t);
+        const char *name = (char*)data;
+        printf("  name: %s\n",name);
+        data += name_len;
+        tlPtnEntry *entry = entries;
+        int must_free=0;
+        unsigned char *entry_data=data;
+        data += size;
+        for(unsigned int i=0;i<tl_num_ptn_converters;i++){
+            static tlPtnConverter c=tl_ptn_converters[i];
+            if(c.src_version==version && c.src_size==size && strcmp(c.src_name,name)==0){
+                version=c.target_version;
+                size=c.target_size;
+                name=c.target_name;
+                unsigned char *old_entry_data=entry_data;
+                entry_data=c.func(entry_data);
+                if(must_free){
+                    free(old_entry_data);
+                }
+                must_free=1;
+            }
+        }
+        while(entry->type != 0){
+            if(strcmp(entry->name,name)==0 && entry->version == version){
+                if(size == entry->size){
+                    memcpy((unsigned char*)out+entry->offset,entry_data,size);
+                }else{
+                    printf("Warning: %s had the wrong size, not read\n", name);
+                }
+            }
+            entry++;
+        }
+        if(must_free){
+            free(entry_data);
+        }
+    } while(type != 0);
+    return data;
+}
+
+static tlWeaveParameters *tl_pattern_from_ptn_file_v2(unsigned char *data,
+    long len,const char **error)
+{
+    printf("loading PTN file version 2\n");
+	tlWeaveParameters *param =
+        (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
+    unsigned int num_read_yarn_types = 0;
+	unsigned int num_read_pattern_entries = 0;
+    while(1){
+        uint32_t type     = ((uint32_t*)data)[0];
+        if(type==0){
+            break;
+        }
+        uint32_t name_len = ((uint32_t*)data)[1];
+        uint32_t size     = ((uint32_t*)data)[2];
+        uint32_t version  = ((uint32_t*)data)[3];
+        data += 4*sizeof(uint32_t);
+        char *name = (char*)data;
+        printf("type: %d size: %d version %d name: %s\n",type,size,version,name);
+        data += name_len;
+        data += size;
+        //NOTE(Vidar):Right now we assume that tlWeaveParameters is the first
+        // section written, and that all info is correct
+        if(strcmp(name,"tlWeaveParameters") == 0){
+            data = tl_read_ptn_section(param,data,ptn_entry_weave_params);
+            param->yarn_types = (tlYarnType*)calloc(param->num_yarn_types,
+                    sizeof(tlYarnType));
+            for (int i = 0; i < param->num_yarn_types; i++) {
+                param->yarn_types[i] = tl_default_yarn_type;
+            }
+            uint32_t pattern_size = param->pattern_width*param->pattern_height;
+            param->pattern = (PatternEntry*)calloc(pattern_size,
+                    sizeof(PatternEntry));
+        }
+        if(strcmp(name,"tlYarnType") == 0){
+            if(num_read_yarn_types < param->num_yarn_types){
+                data = tl_read_ptn_section(&param->yarn_types[num_read_yarn_types],
+                    data,ptn_entry_yarn_type);
+                num_read_yarn_types++;
+            }
+        }
+        if(strcmp(name,"tlPattern") == 0){
+            if(version == 1){
+                memcpy(param->pattern,data-size,size);
+            }
+            num_read_pattern_entries++;
+        }
+    }
+    return param;
+}
+
+
+static tlWeaveParameters *tl_pattern_from_ptn_file_v1(unsigned char *data,
+    long len,const char **error)
+{
+    int num_yarn_types = *(int*)(data + 24);
+    printf("num yarn types: %d\n",num_yarn_types);
+    int num_write_commands = 2+num_yarn_types;
+    tlPtnWriteCommand *write_commands =
+        (tlPtnWriteCommand*)calloc(num_write_commands,sizeof(tlPtnWriteCommand));
+    int pattern_size = *(int*)(data+16) * *(int*)(data+20);
+    printf("Pattern size: %d\n",pattern_size);
+
+    //NOTE(Vidar):These are the structures as of v 0.91
+    tlPtnEntry ptn_entry_weave_paramsv091[]={
+        {1,  0,  0, 1, "tlWeaveParameters"},
+        {2,  0,  4, 1, "uscale"},
+        {2,  4,  4, 1, "vscale"},
+        {2,  8,  4, 1, "intensity_fineness"},
+        {2, 12,  1, 1, "realworld_uv"},
+        {2, 16,  4, 1, "pattern_height"},
+        {2, 20,  4, 1, "pattern_width"},
+        {2, 24,  4, 1, "num_yarn_types"},
+        {2, 48,  4, 1, "specular_normalization"},
+        {2, 52,  4, 1, "pattern_realheight"},
+        {2, 56,  4, 1, "pattern_realwidth"},
+        {0,  0,  0, 0, "end"}
+    };
+    int weave_paramsv091_len = 64;
+
+    tlPtnEntry ptn_entry_yarn_typev091[]={
+        {1,  0,  0, 1, "tlYarnType"},
+        {2,  0,  4, 1, "umax"},
+        {2, 44,  1, 1, "umax_enabled"},
+        {2,  4,  4, 1, "yarnsize"},
+        {2, 45,  1, 1, "yarnsize_enabled"},
+        {2,  8,  4, 1, "psi"},
+        {2, 46,  1, 1, "psi_enabled"},
+        {2, 12,  4, 1, "alpha"},
+        {2, 47,  1, 1, "alpha_enabled"},
+        {2, 16,  4, 1, "beta"},
+        {2, 48,  1, 1, "beta_enabled"},
+        {2, 20,  4, 1, "delta_x"},
+        {2, 49,  1, 1, "delta_x_enabled"},
+        {2, 24,  4, 1, "specular_strength"},
+        {2, 50,  1, 1, "specular_strength_enabled"},
+        {2, 28,  4, 1, "specular_noise"},
+        {2, 51,  1, 1, "specular_noise_enabled"},
+        {2, 32, 12, 1, "color"},
+        {2, 52,  1, 1, "color_enabled"},
+        {0,  0,  0, 0, "end"}
+    };
+    int yarn_typev091_len = 128;
+
+    write_commands[0].entry = ptn_entry_weave_paramsv091;
+    write_commands[0].data = data;
+    data += weave_paramsv091_len;
+    for(int i=0;i<num_yarn_types;i++){
+        write_commands[2+i].entry = ptn_entry_yarn_typev091;
+        write_commands[2+i].data = data;
+        data += yarn_typev091_len;
+    }
+    tlPtnEntry ptn_entry_patternv091 = {3,0,
+        (uint32_t)(2*sizeof(uint8_t)*pattern_size),1, "tlPattern"};
+    tlPtnEntry pattern_entry = ptn_entry_pattern;
+    pattern_entry.size      *= pattern_size;
+    write_commands[1].entry  = &ptn_entry_patternv091;
+    write_commands[1].data   = data;
+
+    long ptn_v2_len=0;
+    unsigned char *ptn_v2_buffer = tl_buffer_from_ptn_write_commands(
+        num_write_commands,write_commands,&ptn_v2_len);
+    tlWeaveParameters *param = tl_pattern_from_ptn_file_v2(
+            ptn_v2_buffer+sizeof(int), ptn_v2_len,error);
+    free(ptn_v2_buffer);
+	return param;
+}
+
+// Reads a PTN v3 file, including the version number. If zero_copy is set
+// the pattern points into data, which must then outlive the parameters,
+// otherwise it is copied.
+// The pattern entries are not validated, since that would mean
+// touching every page of the file. tl_prepare clamps their yarn types.
+static tlWeaveParameters *tl_pattern_from_ptn_file_v3(unsigned char *data,
+    size_t len, int zero_copy, const char **error)
+{
+    tlPtnV3Header header;
+    if(len < sizeof(tlPtnV3Header)){
+        *error = "PTN file is truncated";
+        return 0;
+    }
+    memcpy(&header,data,sizeof(header));
+    if(header.byte_order != TL_PTN_V3_BYTE_ORDER
+        || header.header_size != sizeof(tlPtnV3Header)
+        || header.yarn_type_size != sizeof(tlYarnType)
+        || header.pattern_entry_size != sizeof(PatternEntry)){
+        *error = "PTN file was written by an incompatible build";
+        return 0;
+    }
+    uint64_t pattern_bytes = (uint64_t)header.pattern_width
+        * header.pattern_height * sizeof(PatternEntry);
+    uint64_t yarn_types_bytes = (uint64_t)header.num_yarn_types
+        * sizeof(tlYarnType);
+    if(header.file_size != len
+        || header.num_yarn_types == 0
+        || header.num_yarn_types > TL_MAX_YARN_TYPES
+        || header.yarn_types_offset % TL_PTN_V3_ALIGNMENT
+        || header.pattern_offset % TL_PTN_V3_ALIGNMENT
+        || header.yarn_types_offset > len
+        || yarn_types_bytes > len - header.yarn_types_offset
+        || header.pattern_offset > len
+        || pattern_bytes > len - header.pattern_offset){
+        *error = "PTN file is corrupt";
+        return 0;
+    }
+
+	tlWeaveParameters *param =
+        (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
+#define TL_FLOAT_PARAM(name) param->name = header.name;
+#define TL_INT_PARAM(name)  param->name = header.name;
+#define TL_COLOR_PARAM(name) param->name = header.name;
+TL_FABRIC_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_INT_PARAM
+#undef TL_COLOR_PARAM
+    param->pattern_width          = header.pattern_width;
+    param->pattern_height         = header.pattern_height;
+    param->num_yarn_types         = header.num_yarn_types;
+    param->specular_normalization = header.specular_normalization;
+    param->pattern_realheight     = header.pattern_realheight;
+    param->pattern_realwidth      = header.pattern_realwidth;
+    param->pattern_repeats_x      = header.pattern_repeats_x;
+    param->pattern_repeats_y      = header.pattern_repeats_y;
+
+    param->yarn_types = (tlYarnType*)calloc(param->num_yarn_types,
+        sizeof(tlYarnType));
+    memcpy(param->yarn_types,data + header.yarn_types_offset,
+        (size_t)yarn_types_bytes);
+    for(uint32_t i=0;i<param->num_yarn_types;i++){
+        tl_clear_yarn_type_texmaps(param->yarn_types+i);
+    }
+
+    if(zero_copy){
+        param->pattern = (PatternEntry*)(data + header.pattern_offset);
+    }else{
+        param->pattern = (PatternEntry*)malloc((size_t)pattern_bytes);
+        memcpy(param->pattern,data + header.pattern_offset,
+            (size_t)pattern_bytes);
+    }
+    return param;
+}
+
+#ifndef TL_NO_FILES
+
+// The mapping is private and writable, so the pages are shared
+// with other processes until someone writes to the pattern
+#ifdef _WIN32
+static unsigned char *tl_map_file_handle(HANDLE file, size_t *size)
+{
+    if(file == INVALID_HANDLE_VALUE){
+        return 0;
+    }
+    unsigned char *mapping = 0;
+    LARGE_INTEGER file_size;
+    if(GetFileSizeEx(file,&file_size) && file_size.QuadPart > 0){
+        HANDLE file_mapping = CreateFileMappingA(file,0,PAGE_WRITECOPY,0,0,0);
+        if(file_mapping){
+            mapping = (unsigned char*)MapViewOfFile(file_mapping,FILE_MAP_COPY,
+                0,0,0);
+            // The view keeps the mapping alive
+            CloseHandle(file_mapping);
+            *size = (size_t)file_size.QuadPart;
+        }
+    }
+    CloseHandle(file);
+    return mapping;
+}
+
+static unsigned char *tl_map_file(const char *filename, size_t *size)
+{
+    return tl_map_file_handle(CreateFileA(filename,GENERIC_READ,
+        FILE_SHARE_READ,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0),size);
+}
+
+#ifdef TL_WCHAR
+static unsigned char *tl_map_file_wchar(const wchar_t *filename, size_t *size)
+{
+    return tl_map_file_handle(CreateFileW(filename,GENERIC_READ,
+        FILE_SHARE_READ,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0),size);
+}
+#endif
+
+static void tl_unmap_file(void *mapping, size_t size)
+{
+    UnmapViewOfFile(mapping);
+}
+#else
+static unsigned char *tl_map_file(const char *filename, size_t *size)
+{
+    int fd = open(filename,O_RDONLY);
+    if(fd < 0){
+        return 0;
+    }
+    unsigned char *mapping = 0;
+    struct stat st;
+    if(fstat(fd,&st) == 0 && st.st_size > 0){
+        void *ret = mmap(0,(size_t)st.st_size,PROT_READ|PROT_WRITE,
+            MAP_PRIVATE,fd,0);
+        if(ret != MAP_FAILED){
+            mapping = (unsigned char*)ret;
+            *size = (size_t)st.st_size;
+        }
+    }
+    // The mapping stays valid after the file is closed
+    close(fd);
+    return mapping;
+}
+
+static void tl_unmap_file(void *mapping, size_t size)
+{
+    munmap(mapping,size);
+}
+#endif
+
+static tlWeaveParameters *tl_pattern_from_ptn_v3_mapping(unsigned char *mapping,
+    size_t size, const char **error)
+{
+    tlWeaveParameters *param = tl_pattern_from_ptn_file_v3(mapping,size,1,
+        error);
+    if(!param){
+        tl_unmap_file(mapping,size);
+        return 0;
+    }
+    param->ptn_mapping = mapping;
+    param->ptn_mapping_size = size;
+    return param;
+}
+
+// -- Pattern cache -- //
+
+static tlPatternCacheEntry *tl_pattern_cache = 0;
+
+#ifdef _WIN32
+static SRWLOCK tl_pattern_cache_lock = SRWLOCK_INIT;
+static void tl_lock_pattern_cache()
+{
+    AcquireSRWLockExclusive(&tl_pattern_cache_lock);
+}
+static void tl_unlock_pattern_cache()
+{
+    ReleaseSRWLockExclusive(&tl_pattern_cache_lock);
+}
+
+// Returns the full path of filename, which should be freed with free
+static char *tl_full_path(const char *filename)
+{
+    return _fullpath(0,filename,0);
+}
+
+static int tl_file_stamp(const char *path, uint64_t *mtime, uint64_t *size)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if(!GetFileAttributesExA(path,GetFileExInfoStandard,&attributes)){
+        return 0;
+    }
+    *mtime = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32)
+        | attributes.ftLastWriteTime.dwLowDateTime;
+    *size = ((uint64_t)attributes.nFileSizeHigh << 32)
+        | attributes.nFileSizeLow;
+    return 1;
+}
+
+#define tl_path_equal(a,b) (_stricmp(a,b) == 0)
+#else
+static pthread_mutex_t tl_pattern_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static void tl_lock_pattern_cache()
+{
+    pthread_mutex_lock(&tl_pattern_cache_lock);
+}
+static void tl_unlock_pattern_cache()
+{
+    pthread_mutex_unlock(&tl_pattern_cache_lock);
+}
+
+// Returns the full path of filename, which should be freed with free
+static char *tl_full_path(const char *filename)
+{
+    return realpath(filename,0);
+}
+
+static int tl_file_stamp(const char *path, uint64_t *mtime, uint64_t *size)
+{
+    struct stat st;
+    if(stat(path,&st) != 0){
+        return 0;
+    }
+    // Use nanoseconds where we can, so that a file which is
+    // saved and loaded again within a second is not taken from the cache
+#if defined(__APPLE__)
+    *mtime = (uint64_t)st.st_mtimespec.tv_sec*1000000000
+        + (uint64_t)st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    *mtime = (uint64_t)st.st_mtim.tv_sec*1000000000
+        + (uint64_t)st.st_mtim.tv_nsec;
+#else
+    *mtime = (uint64_t)st.st_mtime*1000000000;
+#endif
+    *size = (uint64_t)st.st_size;
+    return 1;
+}
+
+#define tl_path_equal(a,b) (strcmp(a,b) == 0)
+#endif
+
+// Must be called with the cache locked. Increments the reference count of
+// the returned entry.
+static tlPatternCacheEntry *tl_find_pattern_cache_entry(const char *path,
+    uint64_t mtime, uint64_t size)
+{
+    for(tlPatternCacheEntry *entry = tl_pattern_cache; entry;
+        entry = entry->next){
+        if(entry->mtime == mtime && entry->size == size
+            && tl_path_equal(entry->path,path)){
+            entry->ref_count++;
+            return entry;
+        }
+    }
+    return 0;
+}
+
+static void tl_free_pattern_cache_entries(tlPatternCacheEntry *entry)
+{
+    while(entry){
+        tlPatternCacheEntry *next = entry->next;
+        tl_free_weave_parameters(entry->params);
+        free(entry->params);
+        free(entry->path);
+        free(entry);
+        entry = next;
+    }
+}
+
+// Must be called with the cache locked. Unlinks the unused entries which
+// are not retained, or all of them if retained is 0, and returns them as a
+// list which should be freed once the cache is unlocked.
+static tlPatternCacheEntry *tl_evict_pattern_cache_entries(uint32_t retained)
+{
+    tlPatternCacheEntry *evicted = 0;
+    for(;;){
+        uint32_t unused = 0;
+        tlPatternCacheEntry **oldest = 0;
+        for(tlPatternCacheEntry **e = &tl_pattern_cache; *e; e = &(*e)->next){
+            if((*e)->ref_count == 0){
+                unused++;
+                if(!oldest || (*e)->last_release < (*oldest)->last_release){
+                    oldest = e;
+                }
+            }
+        }
+        if(unused <= retained){
+            return evicted;
+        }
+        tlPatternCacheEntry *entry = *oldest;
+        *oldest = entry->next;
+        entry->next = evicted;
+        evicted = entry;
+    }
+}
+
+static void tl_release_pattern_cache_entry(tlPatternCacheEntry *entry)
+{
+    static uint64_t releases = 0;
+    tl_lock_pattern_cache();
+    tlPatternCacheEntry *evicted = 0;
+    if(--entry->ref_count == 0){
+        entry->last_release = ++releases;
+        evicted = tl_evict_pattern_cache_entries(TL_PATTERN_CACHE_RETAINED);
+    }
+    tl_unlock_pattern_cache();
+    tl_free_pattern_cache_entries(evicted);
+}
+
+void tl_clear_pattern_cache()
+{
+    tl_lock_pattern_cache();
+    tlPatternCacheEntry *evicted = tl_evict_pattern_cache_entries(0);
+    tl_unlock_pattern_cache();
+    tl_free_pattern_cache_entries(evicted);
+}
+
+tlWeaveParameters *tl_weave_pattern_from_file_cached(const char *filename,
+    const char **error)
+{
+    uint64_t mtime, size;
+    char *path = tl_full_path(filename);
+    if(!path || !tl_file_stamp(path,&mtime,&size)){
+        free(path);
+        return tl_weave_pattern_from_file(filename,error);
+    }
+
+    tl_lock_pattern_cache();
+    tlPatternCacheEntry *entry = tl_find_pattern_cache_entry(path,mtime,size);
+    tl_unlock_pattern_cache();
+
+    if(!entry){
+        // The file is loaded without holding the lock, if another
+        // thread loads the same file meanwhile, we use that one instead
+        tlWeaveParameters *loaded = tl_weave_pattern_from_file(filename,error);
+        if(!loaded){
+            free(path);
+            return 0;
+        }
+        tl_build_pattern_runs(loaded);
+        tl_lock_pattern_cache();
+        entry = tl_find_pattern_cache_entry(path,mtime,size);
+        if(!entry){
+            entry = (tlPatternCacheEntry*)calloc(1,sizeof(tlPatternCacheEntry));
+            entry->path = path;
+            entry->mtime = mtime;
+            entry->size = size;
+            entry->ref_count = 1;
+            entry->params = loaded;
+            entry->next = tl_pattern_cache;
+            tl_pattern_cache = entry;
+            path = 0;
+            loaded = 0;
+        }
+        tl_unlock_pattern_cache();
+        if(loaded){
+            tl_free_weave_parameters(loaded);
+            free(loaded);
+        }
+    }
+    free(path);
+
+    tlWeaveParameters *params =
+        (tlWeaveParameters*)calloc(sizeof(tlWeaveParameters),1);
+    *params = *entry->params;
+    params->yarn_types = (tlYarnType*)calloc(params->num_yarn_types,
+        sizeof(tlYarnType));
+    memcpy(params->yarn_types,entry->params->yarn_types,
+        params->num_yarn_types*sizeof(tlYarnType));
+    params->resolved_yarn_types = 0;
+    params->resolved_yarn_texmaps = 0;
+    params->prefiltered = 0;
+    params->far_field = 0;
+    params->ptn_mapping = 0;
+    params->ptn_mapping_size = 0;
+    params->cache_entry = entry;
+    return params;
+}
+
+#endif
+
+tlWeaveParameters *tl_weave_pattern_from_ptn(unsigned char *data,long len,
+    const char **error)
+{
+	tlWeaveParameters *param = 0;
+	int version = 0;
+	memcpy(&version,data,sizeof(int));\
+	data += sizeof(int);
+	len -= sizeof(int);
+	switch(version){
+	case 1:
+		param = tl_pattern_from_ptn_file_v1(data,len,error);
+		if(param) tl_shrink_pattern_to_repeat(param);
+		break;
+    case 2:
+        param = tl_pattern_from_ptn_file_v2(data,len,error);
+        if(param) tl_shrink_pattern_to_repeat(param);
+        break;
+    case 3:
+        // The v3 header starts with the version number
+        param = tl_pattern_from_ptn_file_v3(data - sizeof(int),
+            (size_t)(len + sizeof(int)),0,error);
+        break;
+	default:
+		*error = "Unknown PTN file version";
+		return 0;
+	}
+	return param;
+}
+
+void tl_expand_pattern_repeats(tlWeaveParameters *params)
+{
+    uint32_t repeats_x = (uint32_t)tl_pattern_repeats(params->pattern_repeats_x);
+    uint32_t repeats_y = (uint32_t)tl_pattern_repeats(params->pattern_repeats_y);
+    if(!params->pattern || params->cache_entry
+            || (repeats_x == 1 && repeats_y == 1)){
+        return;
+    }
+    PatternEntry *pattern = tl_repeated_pattern(params->pattern,
+        params->pattern_width, params->pattern_height, repeats_x, repeats_y);
+#ifndef TL_NO_FILES
+    if(params->ptn_mapping){
+        tl_unmap_file(params->ptn_mapping, params->ptn_mapping_size);
+        params->ptn_mapping = 0;
+        params->ptn_mapping_size = 0;
+    } else
+#endif
+    free(params->pattern);
+    params->pattern = pattern;
+    params->pattern_width *= repeats_x;
+    params->pattern_height *= repeats_y;
+    params->pattern_repeats_x = 0;
+    params->pattern_repeats_y = 0;
+    if(params->pattern_runs){
+        free(params->pattern_runs);
+        params->pattern_runs = 0;
+    }
+}
+
+// -- Packed patterns -- //
+
+void tl_pack_pattern(tlWeaveParameters *params)
+{
+    if(!params->pattern || params->cache_entry){
+        return;
+    }
+    uint32_t w = params->pattern_width;
+    uint32_t h = params->pattern_height;
+    uint8_t used[TL_MAX_YARN_TYPES] = {0};
+    for(size_t i=0;i<(size_t)w*h;i++){
+        used[params->pattern[i].yarn_type] = 1;
+    }
+    tlPackedPattern *packed = (tlPackedPattern*)calloc(1,
+        sizeof(tlPackedPattern));
+    uint8_t palette_index[TL_MAX_YARN_TYPES];
+    uint32_t palette_size = 0;
+    for(uint32_t i=0;i<TL_MAX_YARN_TYPES;i++){
+        if(used[i]){
+            palette_index[i] = (uint8_t)palette_size;
+            packed->palette[palette_size++] = (uint8_t)i;
+        }
+    }
+    uint32_t bits = 0;
+    while((1u<<bits) < palette_size){
+        // Only 1, 2, 4 and 8 bits are used, so that an entry
+        // never straddles two words
+        bits = bits ? bits*2 : 1;
+    }
+    packed->yarn_type_bits = bits;
+    packed->tiles_x = (w+7)/8;
+    packed->tiles_y = (h+7)/8;
+    size_t num_tiles = (size_t)packed->tiles_x*packed->tiles_y;
+    packed->warp_above = (uint64_t*)calloc(num_tiles,sizeof(uint64_t));
+    if(bits){
+        packed->yarn_types = (uint64_t*)calloc(num_tiles*bits,
+            sizeof(uint64_t));
+    }
+    for(uint32_t y=0;y<h;y++){
+        for(uint32_t x=0;x<w;x++){
+            PatternEntry entry = params->pattern[x + y*w];
+            size_t tile = (x>>3) + (size_t)(y>>3)*packed->tiles_x;
+            uint32_t bit = (x&7) + (y&7)*8;
+            packed->warp_above[tile] |= (uint64_t)(entry.warp_above != 0)<<bit;
+            if(bits){
+                uint32_t offset = bit*bits;
+                packed->yarn_types[tile*bits + (offset>>6)] |=
+                    (uint64_t)palette_index[entry.yarn_type] << (offset&63);
+            }
+        }
+    }
+#ifndef TL_NO_FILES
+    if(params->ptn_mapping){
+        tl_unmap_file(params->ptn_mapping, params->ptn_mapping_size);
+        params->ptn_mapping = 0;
+        params->ptn_mapping_size = 0;
+    } else
+#endif
+    free(params->pattern);
+    params->pattern = 0;
+    params->packed = packed;
+    if(params->pattern_runs){
+        free(params->pattern_runs);
+        params->pattern_runs = 0;
+    }
+}
+
+//TODO(Vidar):This should free params too, right?
+void tl_free_weave_parameters(tlWeaveParameters *params)
+{
+    if (params->yarn_types) {
+        free(params->yarn_types);
+    }
+    tl_free_resolved_yarn_types(params);
+    tl_free_baked_yarnsize(params);
+    tl_free_prefiltered(params);
+    tl_free_far_field(params);
+#ifndef TL_NO_FILES
+    if (params->cache_entry) {
+        tl_release_pattern_cache_entry(params->cache_entry);
+        return;
+    }
+    if (params->ptn_mapping) {
+        tl_unmap_file(params->ptn_mapping, params->ptn_mapping_size);
+    } else
+#endif
+    if (params->pattern) {
+        free(params->pattern);
+    }
+    if (params->draft) {
+        tl_free_draft(params->draft);
+    }
+    if (params->packed) {
+        tl_free_packed_pattern(params->packed);
+    }
+    if (params->procedural) {
+        tl_free_procedural_weave(params->procedural);
+    }
+    if (params->pattern_runs) {
+        free(params->pattern_runs);
+    }
+}
+
+// -- Compiled patterns -- //
+
+static int32_t tl_atomic_add(volatile int32_t *value, int32_t amount)
+{
+#ifdef _MSC_VER
+    return (int32_t)_InterlockedExchangeAdd((volatile long*)value,
+        (long)amount) + amount;
+#else
+    return __sync_add_and_fetch(value,amount);
+#endif
+}
+
+static int32_t tl_atomic_load(volatile int32_t *value)
+{
+#ifdef _MSC_VER
+    return (int32_t)_InterlockedCompareExchange((volatile long*)value,0,0);
+#else
+    return __atomic_load_n(value,__ATOMIC_SEQ_CST);
+#endif
+}
+
+static void *tl_atomic_exchange_pointer(void *volatile *pointer, void *value)
+{
+#ifdef _MSC_VER
+    return _InterlockedExchangePointer(pointer,value);
+#else
+    // __sync_lock_test_and_set is only an acquire barrier
+    return __atomic_exchange_n(pointer,value,__ATOMIC_SEQ_CST);
+#endif
+}
+
+static void *tl_atomic_load_pointer(void *volatile *pointer)
+{
+#ifdef _MSC_VER
+    return _InterlockedCompareExchangePointer(pointer,0,0);
+#else
+    return __atomic_load_n(pointer,__ATOMIC_SEQ_CST);
+#endif
+}
+
+// Tells the processor that the thread is busy waiting, which frees the core
+// for its other hardware thread
+static void tl_cpu_relax()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+    _mm_pause();
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+    __yield();
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Lets the OS run another thread, for waits which take longer than a few
+// tl_cpu_relax
+static void tl_thread_yield()
+{
+#if !defined(_WIN32)
+    sched_yield();
+#elif !defined(TL_NO_FILES) || !defined(TL_NO_THREADS)
+    SwitchToThread();
+#else
+    tl_cpu_relax();
+#endif
+}
+
+// Returns a copy of size bytes of data, or NULL if data is NULL
+static void *tl_copy_memory(const void *data, size_t size)
+{
+    if(!data){
+        return 0;
+    }
+    void *ret = malloc(size ? size : 1);
+    if(ret){
+        memcpy(ret,data,size);
+    }
+    return ret;
+}
+
+// Gives params its own copy of the pattern, which it shares with the
+// parameters it was copied from
+static void tl_copy_pattern_storage(tlWeaveParameters *params)
+{
+    size_t w = params->pattern_width;
+    size_t h = params->pattern_height;
+#ifndef TL_NO_FILES
+    if(params->cache_entry){
+        // Cached patterns are never modified, so the copy shares
+        // the entry
+        tl_lock_pattern_cache();
+        params->cache_entry->ref_count++;
+        tl_unlock_pattern_cache();
+        return;
+    }
+#endif
+    params->ptn_mapping = 0;
+    params->ptn_mapping_size = 0;
+    params->pattern = (PatternEntry*)tl_copy_memory(params->pattern,
+        w*h*sizeof(PatternEntry));
+    if(params->draft){
+        const tlPatternDraft *draft = params->draft;
+        tlPatternDraft *copy = (tlPatternDraft*)tl_copy_memory(draft,
+            sizeof(tlPatternDraft));
+        copy->threading = (uint32_t*)tl_copy_memory(draft->threading,
+            w*sizeof(uint32_t));
+        copy->treadling = (uint32_t*)tl_copy_memory(draft->treadling,
+            h*sizeof(uint32_t));
+        copy->tieup = (uint8_t*)tl_copy_memory(draft->tieup,
+            (size_t)draft->num_treadles*draft->num_shafts);
+        copy->warp_yarn_types = (uint8_t*)tl_copy_memory(
+            draft->warp_yarn_types, w);
+        copy->weft_yarn_types = (uint8_t*)tl_copy_memory(
+            draft->weft_yarn_types, h);
+        params->draft = copy;
+    }
+    if(params->packed){
+        const tlPackedPattern *packed = params->packed;
+        size_t num_tiles = (size_t)packed->tiles_x*packed->tiles_y;
+        tlPackedPattern *copy = (tlPackedPattern*)tl_copy_memory(packed,
+            sizeof(tlPackedPattern));
+        copy->warp_above = (uint64_t*)tl_copy_memory(packed->warp_above,
+            num_tiles*sizeof(uint64_t));
+        copy->yarn_types = (uint64_t*)tl_copy_memory(packed->yarn_types,
+            num_tiles*packed->yarn_type_bits*sizeof(uint64_t));
+        params->packed = copy;
+    }
+    if(params->procedural){
+        const tlProceduralWeave *weave = params->procedural;
+        tlProceduralWeave *copy = (tlProceduralWeave*)tl_copy_memory(weave,
+            sizeof(tlProceduralWeave));
+        copy->warp_yarn_types = (uint8_t*)tl_copy_memory(
+            weave->warp_yarn_types, weave->warp_period);
+        copy->weft_yarn_types = (uint8_t*)tl_copy_memory(
+            weave->weft_yarn_types, weave->weft_period);
+        copy->block_runs = (uint32_t*)tl_copy_memory(weave->block_runs,
+            4*(size_t)weave->repeat*sizeof(uint32_t));
+        params->procedural = copy;
+    }
+}
+
+tlCompiledPattern *tl_compile_pattern(const tlWeaveParameters *params,
+    uint32_t flags, void *context)
+{
+    tlCompiledPattern *compiled = (tlCompiledPattern*)calloc(1,
+        sizeof(tlCompiledPattern));
+    if(!compiled){
+        return 0;
+    }
+    tlWeaveParameters *copy = &compiled->params;
+    *copy = *params;
+    copy->yarn_types = (tlYarnType*)tl_copy_memory(params->yarn_types,
+        params->num_yarn_types*sizeof(tlYarnType));
+    copy->pattern_runs = 0;
+    copy->resolved_yarn_types = 0;
+    copy->resolved_yarn_texmaps = 0;
+    copy->baked_yarnsize = 0;
+    copy->prefiltered = 0;
+    copy->far_field = 0;
+    copy->prepare_id = 0;
+    tl_copy_pattern_storage(copy);
+    if(flags & TL_COMPILE_BAKED_YARNSIZE){
+        tl_prepare_baked_yarnsize(copy, context);
+    } else{
+        tl_prepare(copy);
+    }
+    if(flags & TL_COMPILE_PREFILTERED){
+        tl_prepare_prefiltered(copy, context);
+    }
+    if(flags & TL_COMPILE_FAR_FIELD){
+        tl_prepare_far_field(copy, context, 1);
+    }
+    compiled->ref_count = 1;
+    return compiled;
+}
+
+void tl_release_compiled_pattern(tlCompiledPattern *compiled)
+{
+    if(compiled && tl_atomic_add(&compiled->ref_count, -1) == 0){
+        tl_free_weave_parameters(&compiled->params);
+        free(compiled);
+    }
+}
+
+tlCompiledPattern *tl_pattern_slot_acquire(tlPatternSlot *slot)
+{
+    // While readers is nonzero, tl_pattern_slot_publish does not
+    // release the compiled pattern it replaced, so the one read here is
+    // still alive when its reference count is incremented
+    tl_atomic_add(&slot->readers, 1);
+    tlCompiledPattern *compiled = (tlCompiledPattern*)tl_atomic_load_pointer(
+        (void *volatile*)&slot->current);
+    if(compiled){
+        tl_atomic_add(&compiled->ref_count, 1);
+    }
+    tl_atomic_add(&slot->readers, -1);
+    return compiled;
+}
+
+void tl_pattern_slot_publish(tlPatternSlot *slot,
+    tlCompiledPattern *compiled)
+{
+    tlCompiledPattern *old = (tlCompiledPattern*)tl_atomic_exchange_pointer(
+        (void *volatile*)&slot->current, compiled);
+    // A thread which is still in tl_pattern_slot_acquire might
+    // have read the old pointer without having incremented its reference
+    // count yet. Threads which enter it from now on read the new one.
+    // The wait is normally a few instructions long, but the OS may suspend
+    // a reader in the middle of it, so the thread yields after a while
+    for(uint32_t tries=0;tl_atomic_load(&slot->readers) != 0;tries++){
+        if(tries < 64){
+            tl_cpu_relax();
+        } else{
+            tl_thread_yield();
+        }
+    }
+    tl_release_compiled_pattern(old);
+}
+
+static float intensity_variation(tlPatternData pattern_data)
+{
+	//NOTE(Vidar): a fineness of 3 seems to work fine...
+	uint32_t intensity_fineness = 3;
+
+    // have index to make a grid of finess*fineness squares 
+    // of which to have the same brightness variations.
+
+    uint32_t tindex_x = pattern_data.total_index_x;
+    uint32_t tindex_y = pattern_data.total_index_y;
+
+    //Switch X and Y for warp, so that we have the yarn going along y
+    if(!pattern_data.warp_above){
+		uint32_t tmp = tindex_x;
+        tindex_x = tindex_y;
+        tindex_y = tmp;
+    }
+
+    // Potential overflow of r1 and r2 is acceptable here.
+    uint32_t r1 = tindex_x*intensity_fineness - 
+        (pattern_data.x*0.5)*pattern_data.width*intensity_fineness;
+    uint32_t r2 = tindex_y*intensity_fineness - 
+        (pattern_data.y*0.5)*pattern_data.length*intensity_fineness;
+
+    float xi = sample_TEA_single(r1, r2, 8);
+    float log_xi = -logf(xi);
+    return log_xi < 10.f ? log_xi : 10.f;
+}
+
+
+// Counts the cells next to (x,y) with the same warp_above,
+// stepping in the given direction along x or y and wrapping around the
+// pattern. If the whole row or column has the same warp_above, the size of
+// the pattern in that direction is returned.
+static uint32_t tl_pattern_run_walk(const tlWeaveParameters *params,
+    uint32_t x, uint32_t y, uint8_t along_y, int32_t direction)
+{
+    uint32_t pattern_width = params->pattern_width;
+    uint32_t *coord = along_y ? &y : &x;
+    uint32_t max_size = along_y ? params->pattern_height : pattern_width;
+    uint32_t initial_coord = *coord;
+    uint8_t warp_above = tl_pattern_entry(params,x,y).warp_above;
+    uint32_t steps = 0;
+    do{
+        if(direction > 0){
+            (*coord)++;
+            if(*coord == max_size){
+                *coord = 0;
+            }
+        } else {
+            if(*coord == 0){
+                *coord = max_size;
+            }
+            (*coord)--;
+        }
+        TL_STATS_ADD(pattern_run_reads,1);
+        if(tl_pattern_entry(params,x,y).warp_above != warp_above){
+            break;
+        }
+        steps++;
+    } while(*coord != initial_coord);
+    return steps;
+}
+
+// Returns the runs of cell (x,y) from the tables built by tl_prepare
+static tlPatternRuns tl_pattern_runs_at(const tlWeaveParameters *params,
+    uint32_t x, uint32_t y)
+{
+    const tlPatternDraft *draft = params->draft;
+    if(!draft){
+        return params->pattern_runs[x + y*params->pattern_width];
+    }
+    uint32_t w = params->pattern_width;
+    uint32_t h = params->pattern_height;
+    tlPatternRuns along_x = params->pattern_runs[draft->treadling[y]*w + x];
+    tlPatternRuns along_y = params->pattern_runs[
+        (size_t)draft->num_treadles*w + draft->threading[x]*h + y];
+    along_x.y_left = along_y.y_left;
+    along_x.y_right = along_y.y_right;
+    return along_x;
+}
+
+// Returns the warp_above bits of the 8 cells along x or y in the tile row or
+// column containing (x,y). Bit i is the cell at offset i in the tile.
+static uint32_t tl_packed_line(const tlPackedPattern *packed,
+    uint32_t x, uint32_t y, uint8_t along_y)
+{
+    uint64_t word = packed->warp_above[(x>>3) + (size_t)(y>>3)*packed->tiles_x];
+    if(!along_y){
+        return (uint32_t)(word >> ((y&7)*8)) & 0xff;
+    }
+    // Gathers bit x%8 of each byte into the top byte
+    word = (word >> (x&7)) & 0x0101010101010101ull;
+    return (uint32_t)((word*0x0102040810204080ull) >> 56);
+}
+
+// Same as tl_pattern_run_walk for a packed pattern, but compares the cells
+// one tile line at a time.
+static uint32_t tl_packed_run(const tlWeaveParameters *params,
+    uint32_t x, uint32_t y, uint8_t along_y, int32_t direction)
+{
+    const tlPackedPattern *packed = params->packed;
+    uint32_t max_size = along_y ? params->pattern_height :
+        params->pattern_width;
+    uint32_t *coord = along_y ? &y : &x;
+    uint32_t warp_above = tl_packed_line(packed, x, y, along_y)
+        >> (*coord&7) & 1;
+    uint32_t steps = 0;
+    while(steps < max_size){
+        if(direction > 0){
+            *coord = *coord + 1 == max_size ? 0 : *coord + 1;
+        } else {
+            *coord = (*coord == 0 ? max_size : *coord) - 1;
+        }
+        // Set bits are cells with the same warp_above
+        TL_STATS_ADD(pattern_run_reads,1);
+        uint32_t same = tl_packed_line(packed, x, y, along_y);
+        if(!warp_above){
+            same = ~same;
+        }
+        uint32_t pos = *coord&7;
+        uint32_t tile_start = *coord - pos;
+        uint32_t end = max_size - tile_start < 8 ? max_size - tile_start : 8;
+        uint32_t count = 0;
+        if(direction > 0){
+            while(pos + count < end && (same >> (pos + count) & 1)){
+                count++;
+            }
+            steps += count;
+            if(pos + count < end){
+                break;
+            }
+            *coord = tile_start + end - 1;
+        } else {
+            while(count <= pos && (same >> (pos - count) & 1)){
+                count++;
+            }
+            steps += count;
+            if(count <= pos){
+                break;
+            }
+            *coord = tile_start;
+        }
+    }
+    return steps < max_size ? steps : max_size;
+}
+
+// Same as tl_pattern_run_walk for a procedural pattern. The cells left in
+// the block are added to the number of following blocks with the same
+// warp_above.
+static uint32_t tl_procedural_run(const tlWeaveParameters *params,
+    uint32_t x, uint32_t y, uint8_t along_y, int32_t direction)
+{
+    const tlProceduralWeave *weave = params->procedural;
+    uint32_t max_size = along_y ? params->pattern_height :
+        params->pattern_width;
+    uint32_t block_size = along_y ? weave->block_height : weave->block_width;
+    uint32_t offset = (along_y ? y : x)%block_size;
+    uint32_t table = along_y*2 + (direction > 0);
+    TL_STATS_ADD(pattern_run_reads,1);
+    uint32_t blocks = weave->block_runs[table*weave->repeat
+        + tl_procedural_phase(weave,x,y)];
+    if(blocks == weave->repeat){
+        // The whole line has the same warp_above
+        return max_size;
+    }
+    uint64_t steps = (uint64_t)blocks*block_size
+        + (direction > 0 ? block_size - 1 - offset : offset);
+    return steps < max_size ? (uint32_t)steps : max_size;
+}
+
+// Same as tl_pattern_run_walk, but uses the run tables built by tl_prepare
+// when they are available. x and y have to be inside the pattern.
+static uint32_t tl_pattern_run(const tlWeaveParameters *params,
+    uint32_t x, uint32_t y, uint8_t along_y, int32_t direction)
+{
+    if(params->packed){
+        return tl_packed_run(params, x, y, along_y, direction);
+    }
+    if(params->procedural){
+        return tl_procedural_run(params, x, y, along_y, direction);
+    }
+    if(!params->pattern_runs){
+        return tl_pattern_run_walk(params, x, y, along_y, direction);
+    }
+    uint32_t max_size = along_y ? params->pattern_height :
+        params->pattern_width;
+    uint32_t *coord = along_y ? &y : &x;
+    uint32_t hop = max_size - TL_PATTERN_RUN_SATURATED%max_size;
+    uint32_t steps = 0;
+    while(1){
+        TL_STATS_ADD(pattern_run_reads,1);
+        tlPatternRuns runs = tl_pattern_runs_at(params, x, y);
+        uint8_t run = along_y ?
+            (direction > 0 ? runs.y_right : runs.y_left) :
+            (direction > 0 ? runs.x_right : runs.x_left);
+        steps += run;
+        if(run != TL_PATTERN_RUN_SATURATED || steps >= max_size){
+            break;
+        }
+        // The run continues past the saturated entry, continue
+        // counting from the last cell of it.
+        *coord = direction > 0 ? (*coord + TL_PATTERN_RUN_SATURATED)%max_size
+            : (*coord + hop)%max_size;
+    }
+    return steps < max_size ? steps : max_size;
+}
+
+static float wrapped_cauchy(float cos_x, float rho) {
+    if (rho > 0.999f) {
+        return 0.f;
+    }
+    float rho2 = rho * rho;
+    return M_1_PI * 0.5f * (1.f - rho2) / (1.f - 2.f * rho * cos_x + rho2);
+}
+
+static void lookup_pattern_entry(PatternEntry* entry, const tlWeaveParameters* params, const int32_t x, const int32_t y) {
+    //function to get pattern entry. Takes care of coordinate wrapping!
+    int32_t tmpx = (int32_t)fmod(x,(float)params->pattern_width);
+    int32_t tmpy = (int32_t)fmod(y,(float)params->pattern_height);
+    if (tmpx < 0.f) {
+        tmpx = params->pattern_width + tmpx;
+    }
+    if (tmpy < 0.f) {
+        tmpy = params->pattern_height + tmpy;
+    }
+    *entry = tl_pattern_entry(params, tmpx, tmpy);
+}
+
+static int32_t tl_repeat_index(const int32_t coord, const int32_t size) {
+    //coord = -0.124*2 = -0.248
+    float tmpcoord = (float)fmod((float)coord, (float)size);
+    if (tmpcoord < 0.f) {
+        tmpcoord = size + tmpcoord;
+    }
+    return (int32_t)tmpcoord;
+}
+
+static float tl_lookup_yarn_segment_size(int32_t total_pattern_x,
+        int32_t total_pattern_y, const tlWeaveParameters *params,
+        void *context) {
+        //remove scaling from coords
+		float lookup_u = (total_pattern_x + 0.5f)/((float)(tl_loaded_pattern_width(params))*params->uscale);
+		float lookup_v = (total_pattern_y + 0.5f)/((float)(tl_loaded_pattern_height(params))*params->vscale);
+		
+        PatternEntry yrntype;
+		lookup_pattern_entry(&yrntype, params, total_pattern_x, total_pattern_y);
+
+		//Sample potential yarnsize texmap in middle of cell
+        float size = tl_yarn_type_get_lookup_yarnsize(params, yrntype.yarn_type,
+                lookup_u, lookup_v, context);
+		//float size = tl_yarn_type_get_yarnsize(params, yrntype.yarn_type, intersection_data->context);
+		return size;
+	}
+
+static float get_yarn_segment_size(int32_t total_pattern_x, int32_t total_pattern_y,
+		const tlWeaveParameters *params, const tlIntersectionData *intersection_data) {
+    const tlBakedYarnsize *baked = params->baked_yarnsize;
+    if(baked){
+        uint32_t x = (uint32_t)total_pattern_x - (uint32_t)baked->x0;
+        uint32_t y = (uint32_t)total_pattern_y - (uint32_t)baked->y0;
+        if(x < baked->width && y < baked->height){
+            return baked->yarnsize[x + (size_t)y*baked->width];
+        }
+    }
+    return tl_lookup_yarn_segment_size(total_pattern_x, total_pattern_y,
+        params, intersection_data->context);
+}
+
+// -- Baked yarn sizes -- //
+
+void tl_prepare_baked_yarnsize(tlWeaveParameters *params, void *context)
+{
+    tl_prepare(params);
+    uint32_t w = tl_loaded_pattern_width(params);
+    uint32_t h = tl_loaded_pattern_height(params);
+    if(!tl_has_pattern(params) || !params->resolved_yarn_types || w == 0
+            || h == 0){
+        return;
+    }
+    uint32_t textured = 0;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        textured |= params->resolved_yarn_types[i].textured;
+    }
+    if(!(textured & (1u<<TL_YARN_PARAM_yarnsize))){
+        return;
+    }
+    // Find the cells covered by the unit uv square, using the
+    // same scaling and rotation as tl_get_pattern_data
+    float u_scale, v_scale;
+    tl_uv_scale(params, &u_scale, &v_scale);
+    float rot=params->uvrotation/180.f*(float)M_PI;
+    float sin_rot, cos_rot;
+    tl_sincosf(rot, &sin_rot, &cos_rot);
+    float min_x = 0.f, max_x = 0.f, min_y = 0.f, max_y = 0.f;
+    for(int corner=1;corner<4;corner++){
+        float u = (float)(corner&1), v = (float)(corner>>1);
+        float x = (u*cos_rot-v*sin_rot)*u_scale*(float)w;
+        float y = (u*sin_rot+v*cos_rot)*v_scale*(float)h;
+        min_x = x < min_x ? x : min_x;
+        max_x = x > max_x ? x : max_x;
+        min_y = y < min_y ? y : min_y;
+        max_y = y > max_y ? y : max_y;
+    }
+    double width = floor(max_x) - floor(min_x) + 1.0;
+    double height = floor(max_y) - floor(min_y) + 1.0;
+    // Written so that NaN scales are rejected as well
+    if(!(width*height <= (double)TL_MAX_BAKED_YARNSIZE_CELLS)){
+        return;
+    }
+    tlBakedYarnsize *baked = (tlBakedYarnsize*)calloc(1,
+        sizeof(tlBakedYarnsize));
+    baked->x0 = (int32_t)floor(min_x);
+    baked->y0 = (int32_t)floor(min_y);
+    baked->width = (uint32_t)width;
+    baked->height = (uint32_t)height;
+    baked->yarnsize = (float*)malloc((size_t)baked->width*baked->height
+        *sizeof(float));
+    if(!baked->yarnsize){
+        free(baked);
+        return;
+    }
+    // Same as tl_lookup_yarn_segment_size, but the texmaps are
+    // evaluated TL_TEXTURE_PACKET_SIZE cells at a time
+    size_t num_cells = (size_t)baked->width*baked->height;
+    float lookup_scale_u = (float)w*params->uscale;
+    float lookup_scale_v = (float)h*params->vscale;
+    void *contexts[TL_TEXTURE_PACKET_SIZE];
+    for(uint32_t k=0;k<TL_TEXTURE_PACKET_SIZE;k++){
+        contexts[k] = context;
+    }
+    for(size_t start=0;start<num_cells;start+=TL_TEXTURE_PACKET_SIZE){
+        uint32_t n = (uint32_t)(num_cells - start < TL_TEXTURE_PACKET_SIZE ?
+            num_cells - start : TL_TEXTURE_PACKET_SIZE);
+        void *texmap[TL_TEXTURE_PACKET_SIZE];
+        float lookup_u[TL_TEXTURE_PACKET_SIZE];
+        float lookup_v[TL_TEXTURE_PACKET_SIZE];
+        for(uint32_t k=0;k<n;k++){
+            size_t cell = start + k;
+            int32_t x = baked->x0 + (int32_t)(cell%baked->width);
+            int32_t y = baked->y0 + (int32_t)(cell/baked->width);
+            PatternEntry entry;
+            lookup_pattern_entry(&entry, params, x, y);
+            const tlResolvedYarnType *yarn_type =
+                &params->resolved_yarn_types[entry.yarn_type];
+            texmap[k] = 0;
+            if(TL_HAS_TEXMAP(yarn_type->textured
+                    & (1u<<TL_YARN_PARAM_yarnsize))){
+                texmap[k] = params->resolved_yarn_texmaps[
+                    entry.yarn_type*TL_YARN_PARAM_COUNT
+                    + TL_YARN_PARAM_yarnsize];
+            }
+            lookup_u[k] = (x + 0.5f)/lookup_scale_u;
+            lookup_v[k] = (y + 0.5f)/lookup_scale_v;
+            baked->yarnsize[cell] = yarn_type->yarnsize;
+        }
+        for(uint32_t first=0;first<n;first++){
+            void *current = texmap[first];
+            if(!current){
+                continue;
+            }
+            uint32_t cells[TL_TEXTURE_PACKET_SIZE];
+            float u[TL_TEXTURE_PACKET_SIZE], v[TL_TEXTURE_PACKET_SIZE];
+            float result[TL_TEXTURE_PACKET_SIZE];
+            uint32_t num = 0;
+            for(uint32_t k=first;k<n;k++){
+                if(texmap[k] == current){
+                    cells[num] = k;
+                    u[num] = lookup_u[k];
+                    v[num] = lookup_v[k];
+                    num++;
+                    texmap[k] = 0;
+                }
+            }
+            TL_STATS_ADD(texmap_evaluations[TL_YARN_PARAM_yarnsize],num);
+            tl_texmap_mono_lookup_batch(current,u,v,contexts,num,result);
+            for(uint32_t k=0;k<num;k++){
+                baked->yarnsize[start + cells[k]] = result[k];
+            }
+        }
+    }
+    params->baked_yarnsize = baked;
+}
+
+// The parts of a yarn segment which only depend on the cell that was hit and
+// on which part of it was hit, see tl_get_yarn_segment
+typedef struct
+{
+    PatternEntry origin_entry;
+    float length, width;
+    float distance_left, distance_top;
+    uint8_t yarn_hit;
+    uint8_t between_parallel;
+}tlSegmentShape;
+
+// The closest cell across the yarn which is not parallel to it, in one
+// direction from the cell that was hit
+typedef struct
+{
+    PatternEntry entry;
+    int32_t x, y; //Total cell coordinates
+    float yarnsize;
+    uint8_t found;
+    uint8_t between_parallel;
+}tlSegmentExtension;
+
+static tlSegmentExtension tl_segment_extension(
+        const tlWeaveParameters *params, int32_t pattern_x, int32_t pattern_y,
+        uint8_t warp_above, int8_t direction,
+        const tlIntersectionData *intersection_data) {
+    tlSegmentExtension ext;
+    uint32_t max_size_across = warp_above ? tl_loaded_pattern_width(params) :
+        tl_loaded_pattern_height(params);
+    ext.found = 1;
+    ext.between_parallel = 0;
+    uint32_t parallel_steps = tl_pattern_run(params,
+        tl_repeat_index(pattern_x, params->pattern_width),
+        tl_repeat_index(pattern_y, params->pattern_height),
+        !warp_above, direction);
+    if (parallel_steps > 0) {
+        ext.between_parallel = 1;
+    }
+    if (parallel_steps >= max_size_across) {
+        ext.found = 0;
+        parallel_steps = max_size_across - 1;
+    }
+    TL_STATS_ADD(extension_searches,1);
+    TL_STATS_ADD(extension_search_steps,parallel_steps + 1);
+    ext.x = pattern_x;
+    ext.y = pattern_y;
+    int32_t *incremented_coord_across = warp_above ? &ext.x : &ext.y;
+    *incremented_coord_across += direction*(int32_t)(parallel_steps + 1);
+    lookup_pattern_entry(&ext.entry, params, ext.x, ext.y);
+    //Need yarnsize sampled at center of yarnsegment, which is extention...
+    ext.yarnsize = get_yarn_segment_size(ext.x, ext.y, params,
+        intersection_data);
+    return ext;
+}
+
+// origin is the cell the segment is measured from, current is
+// the cell whose neighbours along the yarn are used as borders. These are the
+// same unless an extension was looked for but not hit.
+static tlSegmentShape tl_segment_shape(const tlWeaveParameters *params,
+        PatternEntry origin_entry, int32_t origin_x, int32_t origin_y,
+        int32_t current_x, int32_t current_y, int32_t origin_offset,
+        uint8_t yarn_hit, uint8_t between_parallel,
+        const tlIntersectionData *intersection_data) {
+    uint32_t pattern_width = params->pattern_width;
     uint32_t pattern_height = params->pattern_height;
+
+    //look right and left from origin until we hit cell that is not current yarn weft/warp.
+    uint32_t steps_right = tl_pattern_run(params,
+            tl_repeat_index(origin_x, pattern_width),
+            tl_repeat_index(origin_y, pattern_height),
+            origin_entry.warp_above, 1);
+    uint32_t steps_left  = tl_pattern_run(params,
+            tl_repeat_index(origin_x, pattern_width),
+            tl_repeat_index(origin_y, pattern_height),
+            origin_entry.warp_above, -1);
+    TL_STATS_ADD(segment_walks,1);
+    TL_STATS_ADD(segment_walk_steps,steps_left + steps_right);
+
+    float border_yarn_size_left;
+    float border_yarn_size_right;
+    if (origin_entry.warp_above) {
+        border_yarn_size_left = get_yarn_segment_size(current_x, 
+                (current_y - steps_left - 1), params, intersection_data);
+        border_yarn_size_right = get_yarn_segment_size(current_x, 
+                (current_y + steps_right + 1), params, intersection_data);
+    } else {
+        border_yarn_size_left = get_yarn_segment_size(
+                (current_x - steps_left - 1), current_y, params, intersection_data);
+        border_yarn_size_right = get_yarn_segment_size(
+                (current_x + steps_right + 1), current_y, params, intersection_data);
+    }
+    
+    float width = get_yarn_segment_size(origin_x, origin_y, params, intersection_data);
+    float length = steps_left + steps_right + 1.f +
+        ((1.f-border_yarn_size_left) + (1.f-border_yarn_size_right))/2.f;
+
+    //If current segment is between two parallel yarns. Do not count self.
+    if(between_parallel) length -= 1;
+
+    tlSegmentShape shape;
+    shape.origin_entry = origin_entry;
+    shape.length = length;
+    shape.width = width;
+    shape.distance_left = steps_left + (1.f - border_yarn_size_left)/2.f;
+    if (!between_parallel) shape.distance_left += origin_offset;
+    shape.distance_top = - (1.f-width)/2.f;
+    shape.yarn_hit = yarn_hit;
+    shape.between_parallel = between_parallel;
+    return shape;
+}
+
+// -- Statistics -- //
+
+#ifdef TL_STATS
+// The blocks are never freed, so that the counts of threads
+// which have exited are kept
+static tlStatsBlock *volatile tl_stats_blocks = 0;
+static tlStats tl_stats_baseline;
+#ifdef _MSC_VER
+static __declspec(thread) tlStatsBlock tl_unlisted_stats_block;
+#else
+static __thread tlStatsBlock tl_unlisted_stats_block;
+#endif
+
+// Allocates the counters of the calling thread and adds them to the list
+// read by tl_stats_get
+static tlStatsBlock *tl_register_stats_block()
+{
+    tlStatsBlock *block = (tlStatsBlock*)calloc(1,sizeof(tlStatsBlock));
+    if(!block){
+        // Counted, but left out of tl_stats_get
+        tl_thread_stats_block = &tl_unlisted_stats_block;
+        return tl_thread_stats_block;
+    }
+#ifdef _MSC_VER
+    do{
+        block->next = tl_stats_blocks;
+    }while(_InterlockedCompareExchangePointer((void *volatile*)&tl_stats_blocks,
+        block,block->next) != block->next);
+#else
+    tlStatsBlock *head = __atomic_load_n(&tl_stats_blocks,__ATOMIC_RELAXED);
+    do{
+        block->next = head;
+    }while(!__atomic_compare_exchange_n(&tl_stats_blocks,&head,block,1,
+        __ATOMIC_RELEASE,__ATOMIC_RELAXED));
+#endif
+    tl_thread_stats_block = block;
+    return block;
+}
+
+// The sum of the counters of all threads, including those from before the
+// last tl_stats_reset
+static void tl_stats_sum(tlStats *sum)
+{
+    // tlStats only has uint64_t counters
+    const size_t num_counters = sizeof(tlStats)/sizeof(uint64_t);
+    uint64_t *total = (uint64_t*)sum;
+    memset(sum,0,sizeof(tlStats));
+#ifdef _MSC_VER
+    tlStatsBlock *block = (tlStatsBlock*)_InterlockedCompareExchangePointer(
+        (void *volatile*)&tl_stats_blocks,0,0);
+#else
+    tlStatsBlock *block = __atomic_load_n(&tl_stats_blocks,__ATOMIC_ACQUIRE);
+#endif
+    for(;block;block=block->next){
+        uint64_t *counters = (uint64_t*)&block->stats;
+        for(size_t i=0;i<num_counters;i++){
+#ifdef _MSC_VER
+            total[i] += *(volatile uint64_t*)&counters[i];
+#else
+            total[i] += __atomic_load_n(&counters[i],__ATOMIC_RELAXED);
+#endif
+        }
+    }
+}
+
+void tl_stats_get(tlStats *stats)
+{
+    tl_stats_sum(stats);
+    uint64_t *counters = (uint64_t*)stats;
+    const uint64_t *baseline = (const uint64_t*)&tl_stats_baseline;
+    for(size_t i=0;i<sizeof(tlStats)/sizeof(uint64_t);i++){
+        counters[i] -= baseline[i];
+    }
+}
+
+void tl_stats_reset()
+{
+    tl_stats_sum(&tl_stats_baseline);
+}
+
+void tl_stats_print(const tlStats *stats, FILE *file)
+{
+#define TL_STATS_PRINT(name) fprintf(file,"%s %llu\n",#name,\
+    (unsigned long long)stats->name);
+    TL_STATS_PRINT(segment_lookups)
+    TL_STATS_PRINT(yarn_misses)
+    TL_STATS_PRINT(segment_walks)
+    TL_STATS_PRINT(segment_walk_steps)
+    TL_STATS_PRINT(extension_searches)
+    TL_STATS_PRINT(extension_search_steps)
+    TL_STATS_PRINT(pattern_run_reads)
+#define TL_FLOAT_PARAM(name) \
+    fprintf(file,"texmap_evaluations.%s %llu\n",#name,\
+        (unsigned long long)stats->texmap_evaluations[TL_YARN_PARAM_##name]);
+#define TL_COLOR_PARAM(name) TL_FLOAT_PARAM(name)
+#define TL_INT_PARAM(name)
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_COLOR_PARAM
+#undef TL_INT_PARAM
+    TL_STATS_PRINT(staple_specular)
+    TL_STATS_PRINT(filament_specular)
+    TL_STATS_PRINT(specular_width_rejected)
+#undef TL_STATS_PRINT
+}
+#endif
+
+// -- Segment cache -- //
+
+// The shapes are indexed by 0 for a hit, and
+// 1 + 2*(direction > 0) + (extension hit) when the yarn was missed
+#define TL_SEGMENT_SHAPES 5
+// The parts of the segments of one cell which have been computed so far
+typedef struct
+{
+    const tlWeaveParameters *params;
+    uint64_t prepare_id;
+    uint8_t enabled;
+    int32_t pattern_x, pattern_y; //The cell, valid if any shape is
+    int32_t pattern_repeat_x, pattern_repeat_y;
+    PatternEntry entry;
+    float yarnsize;
+    uint8_t valid_extensions; //Bit (direction > 0)
+    uint8_t valid_shapes; //Bit per shape
+    tlSegmentExtension extensions[2];
+    tlSegmentShape shapes[TL_SEGMENT_SHAPES];
+    tlSegmentCacheStats stats;
+}tlSegmentCache;
+
+#ifdef TL_SEGMENT_CACHE
+#ifdef _MSC_VER
+static __declspec(thread) tlSegmentCache tl_segment_cache;
+#else
+static __thread tlSegmentCache tl_segment_cache;
+#endif
+
+tlSegmentCacheStats tl_segment_cache_stats(int reset)
+{
+    tlSegmentCacheStats stats = tl_segment_cache.stats;
+    if(reset){
+        memset(&tl_segment_cache.stats,0,sizeof(tlSegmentCacheStats));
+    }
+    return stats;
+}
+#endif
+
+// Returns the segment cache of the calling thread, emptied unless it holds
+// the cell (pattern_x,pattern_y) of params, or 0 if it can not be used.
+static tlSegmentCache *tl_get_segment_cache(const tlWeaveParameters *params,
+        int32_t pattern_x, int32_t pattern_y) {
+#ifdef TL_SEGMENT_CACHE
+    tlSegmentCache *cache = &tl_segment_cache;
+    if(cache->params != params || cache->prepare_id != params->prepare_id){
+        cache->params = params;
+        cache->prepare_id = params->prepare_id;
+        cache->valid_shapes = 0;
+        // The segment depends on the shading point through the
+        // yarnsize texmaps, unless they have been baked
+        uint32_t textured = 0;
+        if(params->resolved_yarn_types){
+            for(uint32_t i=0;i<params->num_yarn_types;i++){
+                textured |= params->resolved_yarn_types[i].textured;
+            }
+        }
+        cache->enabled = params->prepare_id != 0 &&
+            (!(textured & (1u<<TL_YARN_PARAM_yarnsize)) ||
+            params->baked_yarnsize);
+    }
+    if(!cache->enabled){
+        return 0;
+    }
+    if(!cache->valid_shapes || cache->pattern_x != pattern_x ||
+            cache->pattern_y != pattern_y){
+        cache->valid_shapes = 0;
+        cache->valid_extensions = 0;
+        cache->pattern_x = pattern_x;
+        cache->pattern_y = pattern_y;
+    }
+    return cache;
+#else
+    return 0;
+#endif
+}
+
+// -- //
+
+tlYarnSegment tl_get_yarn_segment(float total_u, float total_v,
+		const tlWeaveParameters *params, const tlIntersectionData *intersection_data) {
+    //total_u and total_v are scaled and non_repeating
+
+    float u = fmod(total_u,1.f);
+    float v = fmod(total_v,1.f);
+    if (u < 0.f) {
+        u = u - floor(u);
+    }
+    if (v < 0.f) {
+        v = v - floor(v);
+    }
+
+    uint32_t pattern_width = tl_loaded_pattern_width(params);
+    uint32_t pattern_height = tl_loaded_pattern_height(params);
     //TODO fmod repeat uvs, to avoiding the u or v == 1 check.
     int32_t pattern_x = (int32_t)floor((total_u*(float)(pattern_width)));
     int32_t pattern_y = (int32_t)floor((total_v*(float)(pattern_height)));
+
+    tlSegmentCache *segment_cache = tl_get_segment_cache(params, pattern_x,
+        pattern_y);
+    uint8_t cache_hit = segment_cache && segment_cache->valid_shapes;
+
+    int32_t pattern_repeat_x, pattern_repeat_y;
+    PatternEntry cell_entry;
+    float origin_yarnsize;
+    if(cache_hit){
+        pattern_repeat_x = segment_cache->pattern_repeat_x;
+        pattern_repeat_y = segment_cache->pattern_repeat_y;
+        cell_entry = segment_cache->entry;
+        origin_yarnsize = segment_cache->yarnsize;
+    } else {
+        pattern_repeat_x = tl_repeat_index(pattern_x, pattern_width);
+        pattern_repeat_y = tl_repeat_index(pattern_y, pattern_height);
+        //The origin is the pattern entry from which size of segment is calculated. 
+        //The origin entry changes if we miss a thin yarn.
+        cell_entry = tl_pattern_entry(params,
+            (uint32_t)pattern_repeat_x%params->pattern_width,
+            (uint32_t)pattern_repeat_y%params->pattern_height);
+        //Get segment size of yarn in current position in pattern matrix.
+        origin_yarnsize = get_yarn_segment_size(pattern_x,
+                pattern_y, params, intersection_data);
+        if(segment_cache){
+            segment_cache->pattern_repeat_x = pattern_repeat_x;
+            segment_cache->pattern_repeat_y = pattern_repeat_y;
+            segment_cache->entry = cell_entry;
+            segment_cache->yarnsize = origin_yarnsize;
+        }
+    }
+
+    uint8_t warp_above = cell_entry.warp_above;
+    float cell_x = (u == 1.f) ? 1 : u*(float)(pattern_width) - pattern_repeat_x;
+    float cell_y = (v == 1.f) ? 1 : v*(float)(pattern_height) - pattern_repeat_y;
+    float *cell_coord_along = warp_above ? &cell_y : &cell_x;
+    float *cell_coord_across = warp_above ? &cell_x : &cell_y;
+
+    uint32_t shape_index = 0;
+    tlSegmentExtension ext;
+    if (!(fabsf(2*(*cell_coord_across)-1.f) <= origin_yarnsize)) {
+        //Did not hit yarn, look for extension...
+        int8_t direction = (*cell_coord_across >= 0.5) ? 1 : -1;
+        uint32_t ext_index = direction > 0;
+        if(segment_cache &&
+                (segment_cache->valid_extensions & (1u<<ext_index))){
+            ext = segment_cache->extensions[ext_index];
+        } else {
+            ext = tl_segment_extension(params, pattern_x, pattern_y,
+                warp_above, direction, intersection_data);
+            cache_hit = 0;
+            if(segment_cache){
+                segment_cache->extensions[ext_index] = ext;
+                segment_cache->valid_extensions |= 1u<<ext_index;
+            }
+        }
+        //If there is yarn that can be used as extension. Did we hit it?
+        uint8_t extension_hit = ext.found &&
+            fabsf(2*(*cell_coord_along)-1.f) <= ext.yarnsize;
+        shape_index = 1 + 2*ext_index + extension_hit;
+    }
+
+    tlSegmentShape shape;
+    if(segment_cache && (segment_cache->valid_shapes & (1u<<shape_index))){
+        shape = segment_cache->shapes[shape_index];
+    } else {
+        if (shape_index == 0) {
+            shape = tl_segment_shape(params, cell_entry, pattern_x,
+                pattern_y, pattern_x, pattern_y, 0, 1, 0, intersection_data);
+        } else if (shape_index%2 == 0) {
+            //Yes we hit an extention. Use this pattern entry as new origin!
+            int32_t origin_offset = (!warp_above) ? (pattern_y - ext.y) :
+                (pattern_x - ext.x);
+            shape = tl_segment_shape(params, ext.entry, ext.x, ext.y,
+                ext.x, ext.y, origin_offset, 1, ext.between_parallel,
+                intersection_data);
+        } else {
+            shape = tl_segment_shape(params, cell_entry, pattern_x,
+                pattern_y, ext.x, ext.y, 0, 0, ext.between_parallel,
+                intersection_data);
+        }
+        cache_hit = 0;
+        if(segment_cache){
+            segment_cache->shapes[shape_index] = shape;
+            segment_cache->valid_shapes |= 1u<<shape_index;
+        }
+    }
+    if(segment_cache){
+        if(cache_hit){
+            segment_cache->stats.hits++;
+        } else {
+            segment_cache->stats.misses++;
+        }
+    }
+
+    //Determine coordinates for top left corner of segment.
+    float start_u, start_v;
+    {
+        float distance_left = shape.distance_left;
+        if (shape.between_parallel && *cell_coord_across >= 0.5) {
+            distance_left = -(0.5f + tl_yarn_type_get_yarnsize(params, cell_entry.yarn_type, intersection_data->context)/2.f);
+        } 
+
+        float distance_top = shape.distance_top;
+
+        if (!shape.origin_entry.warp_above) {
+            start_u = total_u + (-cell_x - distance_left)/pattern_width;
+            start_v = total_v + (-cell_y - distance_top)/pattern_height;
+        } else {
+            start_u = total_u + (-cell_x - distance_top)/pattern_width;
+            start_v = total_v + (-cell_y - distance_left)/pattern_height;
+        }
+    }
+
+    tlYarnSegment yarn;
+    yarn.length = shape.length;
+    yarn.width = shape.width;
+    yarn.start_u = start_u;
+    yarn.start_v = start_v;
+    yarn.warp_above = shape.origin_entry.warp_above;
+    yarn.pattern_entry = shape.origin_entry;
+    yarn.yarn_hit = shape.yarn_hit;
+    yarn.between_parallel = shape.between_parallel;
+    TL_STATS_ADD(segment_lookups,1);
+    TL_STATS_ADD(yarn_misses,!yarn.yarn_hit);
+    return yarn;
+}
+
+/*
+ * Given intersection_data, tl_get_pattern_data determines the current yarn
+ * segment and associated paramters needed for shading.
+ * Determination of yarn segment is made more complicated by the fact that 
+ * yarnsizes can vary. This results in a certain number of special cases.
+ */
+static tlPatternData tl_pattern_data_at(float total_u, float total_v,
+        tlIntersectionData intersection_data, const tlWeaveParameters *params,
+        tlYarnParameterCache *cache, int geometry);
+
+// Computes the pattern data and sets cache->yarn_type to the yarn type which
+// was hit. cache must have been initialized for the shading point. If
+// geometry is 0, the segment uv and normal are not computed.
+static tlPatternData tl_pattern_data(tlIntersectionData intersection_data,
+        const tlWeaveParameters *params, tlYarnParameterCache *cache,
+        int geometry) {
+    cache->yarn_type = 0;
+    if(!tl_has_pattern(params)){
+        tlPatternData data = {0};
+        return data;
+    }
+   
+    //Generate scaled uv coordinates from intersection_data
+    float uv_x = intersection_data.uv_x;
+    float uv_y = intersection_data.uv_y;
+    float u_scale, v_scale;
+    tl_uv_scale(params, &u_scale, &v_scale);
+
+    // Apply uv rotation
+    {
+        float rot=params->uvrotation/180.f*(float)M_PI;
+        float sin_rot, cos_rot;
+        tl_sincosf(rot, &sin_rot, &cos_rot);
+        float tmp_u=uv_x;
+        float tmp_v=uv_y;
+        uv_x=(tmp_u*cos_rot-tmp_v*sin_rot)*u_scale;
+        uv_y=(tmp_u*sin_rot+tmp_v*cos_rot)*v_scale;
+    }
+
+    //scaled and non-repeating uv.
+    return tl_pattern_data_at(uv_x, uv_y, intersection_data, params, cache,
+        geometry);
+}
+
+// Computes the pattern data at the scaled uv coordinates total_u, total_v,
+// where [0,1) covers one repeat of the pattern. See tl_pattern_data.
+static tlPatternData tl_pattern_data_at(float total_u, float total_v,
+        tlIntersectionData intersection_data, const tlWeaveParameters *params,
+        tlYarnParameterCache *cache, int geometry) {
+    float uv_x = total_u;
+    float uv_y = total_v;
+    float u_repeat = fmod(uv_x,1.f);
+    float v_repeat = fmod(uv_y,1.f);
+    if (u_repeat < 0.f) {
+        u_repeat = u_repeat - floor(u_repeat);
+    }
+    if (v_repeat < 0.f) {
+        v_repeat = v_repeat - floor(v_repeat);
+    }
+//non-repeating pattern index (used for specular noise)
+    uint32_t pattern_width = tl_loaded_pattern_width(params);
+    uint32_t pattern_height = tl_loaded_pattern_height(params);
+    uint32_t total_pattern_x = (uint32_t)((int32_t)(uv_x*pattern_width));
+    uint32_t total_pattern_y = (uint32_t)((int32_t)(uv_y*pattern_height));
+
+    //Get yarnsegment dimensions
+	tlYarnSegment yarnsegment = tl_get_yarn_segment(total_u, total_v, params, &intersection_data);
+    
+    if (!yarnsegment.yarn_hit) {
+        //No hit, No need to do more calculations.
+        tlPatternData ret_data;
+        ret_data.yarn_hit = 0;
+        ret_data.yarn_type = 0;
+        return ret_data;
+    }
+
+    float l = yarnsegment.length;
+	float w = yarnsegment.width;
+    float x, y;
+    if (!yarnsegment.warp_above) {
+        x = (total_u - yarnsegment.start_u)*pattern_width/l;
+        y = (total_v - yarnsegment.start_v)*pattern_height/w;
+    } else {
+        x = (total_u - yarnsegment.start_u)*pattern_width/w;
+        y = (total_v - yarnsegment.start_v)*pattern_height/l;
+    }
+    
+    //Rescale x, y to [-1,1], w,v scaled by 2
+    x = x*2.f - 1.f;
+    y = y*2.f - 1.f;
+    w = w*2.f;
+    l = l*2.f;
+
+    /* Debug */
+    /*
+    printf("yarnsegment.width: %f, yarnsegment.length: %f\n", yarnsegment.width, yarnsegment.length);
+    printf("w: %f, l: %f\n", w, l);
+    printf("x: %f, y: %f\n", x, y);
+    printf("v_repeat: %f, u_repeat: %f\n", v_repeat, u_repeat);
+    printf("total_u - yarnsegment.start_u: %f - %f = %f\n", total_u, yarnsegment.start_u, (total_u - yarnsegment.start_u));
+    printf("total_v - yarnsegment.start_v: %f - %f = %f\n", total_v, yarnsegment.start_v, (total_v - yarnsegment.start_v));
+    printf("pattern_x: %d, pattern_y: %d\n", pattern_x, pattern_y);
+    */
+
+    //Swap X and Y for warp, so that we always have the yarn going along y.
+    if(!yarnsegment.warp_above){
+        float tmp1 = x;
+        x = -y;
+        y = tmp1;
+    }
+
+    //return the results
+    tlPatternData ret_data;
+	ret_data.yarn_hit = yarnsegment.yarn_hit;
+	ret_data.ext_between_parallel = yarnsegment.between_parallel;
+	ret_data.yarn_type = yarnsegment.pattern_entry.yarn_type;
+    ret_data.length = l; 
+    ret_data.width  = w; 
+    ret_data.x = x; 
+    ret_data.y = y; 
+    ret_data.warp_above = yarnsegment.warp_above; 
+    cache->yarn_type = ret_data.yarn_type;
+    if(geometry){
+        tl_segment_uv_and_normal(&ret_data, cache);
+    }
+    ret_data.total_index_x = total_pattern_x; //total x index of wrapped pattern matrix
+    ret_data.total_index_y = total_pattern_y; //total y index of wrapped pattern matrix
+    return ret_data;
+}
+
+tlPatternData tl_get_pattern_data(tlIntersectionData intersection_data,
+        const tlWeaveParameters *params) {
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    return tl_pattern_data(intersection_data, params, &cache, 1);
+}
+
+tlPatternData tl_get_pattern_data_cached(tlIntersectionData intersection_data,
+        tlYarnParameterCache *cache) {
+    return tl_pattern_data(intersection_data, cache->params, cache, 1);
+}
+
+// -- Prefiltered pattern -- //
+
+// The points of one yarn type and orientation which fall in one stratum of
+// the yarn local coordinates, see tl_prepare_prefiltered
+typedef struct
+{
+    uint32_t count;
+    float distance; //From the centre of the stratum to data
+    tlPatternData data;
+} tlPrefilterStratum;
+
+void tl_prepare_prefiltered(tlWeaveParameters *params, void *context)
+{
+    if(!params->prepare_id){
+        tl_prepare(params);
+    }
+    tl_free_prefiltered(params);
+    uint32_t w = params->pattern_width;
+    uint32_t h = params->pattern_height;
+    uint32_t num_yarn_types = params->num_yarn_types;
+    if(!tl_has_pattern(params) || !params->resolved_yarn_types || w == 0
+            || h == 0 || num_yarn_types == 0){
+        return;
+    }
+    // Sample one repeat of the pattern on a jittered grid, since
+    // a regular grid lines up with the edges of the yarns. A stored pattern
+    // with repeats covers 1/pattern_repeats of the uv range.
+    float repeat_u = 1.f/tl_pattern_repeats(params->pattern_repeats_x);
+    float repeat_v = 1.f/tl_pattern_repeats(params->pattern_repeats_y);
+    uint64_t n_u = (uint64_t)w*TL_PREFILTER_SAMPLES_PER_CELL;
+    uint64_t n_v = (uint64_t)h*TL_PREFILTER_SAMPLES_PER_CELL;
+    while(n_u*n_v > TL_MAX_PREFILTER_SAMPLES){
+        if(n_u >= n_v){
+            n_u = (n_u + 1)/2;
+        } else{
+            n_v = (n_v + 1)/2;
+        }
+    }
+    // Each yarn type and orientation is split into
+    // TL_PREFILTER_STRATA^2 strata by the position within the segment. The
+    // point closest to the centre of a stratum represents all points in it.
+    const uint32_t S = TL_PREFILTER_STRATA;
+    uint32_t num_strata = num_yarn_types*2*S*S;
+    tlPrefilterStratum *strata = (tlPrefilterStratum*)calloc(num_strata,
+        sizeof(tlPrefilterStratum));
+    tlPrefilteredPattern *prefiltered = (tlPrefilteredPattern*)calloc(1,
+        sizeof(tlPrefilteredPattern));
+    if(!strata || !prefiltered){
+        free(strata);
+        free(prefiltered);
+        return;
+    }
+    tlIntersectionData intersection_data = {0};
+    intersection_data.context = context;
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, context);
+    uint64_t num_gap = 0;
+    for(uint64_t j=0;j<n_v;j++){
+        for(uint64_t i=0;i<n_u;i++){
+            float u = ((float)i + sample_TEA_single((uint32_t)i, (uint32_t)j,
+                8))/(float)n_u*repeat_u;
+            float v = ((float)j + sample_TEA_single((uint32_t)j,
+                ~(uint32_t)i, 8))/(float)n_v*repeat_v;
+            tlPatternData data = tl_pattern_data_at(u, v, intersection_data,
+                params, &cache, 0);
+            if(!data.yarn_hit || data.yarn_type >= num_yarn_types){
+                num_gap++;
+                continue;
+            }
+            int sx = (int)((data.x + 1.f)*0.5f*(float)S);
+            int sy = (int)((data.y + 1.f)*0.5f*(float)S);
+            sx = sx < 0 ? 0 : (sx >= (int)S ? (int)S - 1 : sx);
+            sy = sy < 0 ? 0 : (sy >= (int)S ? (int)S - 1 : sy);
+            float dx = data.x - (((float)sx + 0.5f)/(float)S*2.f - 1.f);
+            float dy = data.y - (((float)sy + 0.5f)/(float)S*2.f - 1.f);
+            float distance = dx*dx + dy*dy;
+            tlPrefilterStratum *stratum = &strata[((data.yarn_type*2
+                + (data.warp_above ? 1 : 0))*S + (uint32_t)sy)*S
+                + (uint32_t)sx];
+            if(stratum->count == 0 || distance < stratum->distance){
+                stratum->distance = distance;
+                stratum->data = data;
+            }
+            stratum->count++;
+        }
+    }
+    uint32_t num_samples = 0;
+    for(uint32_t i=0;i<num_strata;i++){
+        num_samples += strata[i].count > 0;
+    }
+    prefiltered->num_yarn_types = num_yarn_types;
+    prefiltered->coverage = (float*)calloc(num_yarn_types, sizeof(float));
+    prefiltered->first_sample = (uint32_t*)calloc(num_yarn_types + 1,
+        sizeof(uint32_t));
+    prefiltered->samples = (tlPrefilteredSample*)calloc(
+        num_samples ? num_samples : 1, sizeof(tlPrefilteredSample));
+    if(!prefiltered->coverage || !prefiltered->first_sample
+            || !prefiltered->samples){
+        params->prefiltered = prefiltered;
+        tl_free_prefiltered(params);
+        free(strata);
+        return;
+    }
+    double total = (double)n_u*(double)n_v;
+    prefiltered->gap_coverage = (float)((double)num_gap/total);
+    // The strata are already ordered by yarn type
+    uint32_t sample = 0;
+    for(uint32_t i=0;i<num_strata;i++){
+        uint32_t yarn_type = i/(2*S*S);
+        if(strata[i].count > 0){
+            tlPrefilteredSample *s = &prefiltered->samples[sample++];
+            s->data = strata[i].data;
+            s->weight = (float)((double)strata[i].count/total);
+            prefiltered->coverage[yarn_type] += s->weight;
+        }
+        prefiltered->first_sample[yarn_type + 1] = sample;
+    }
+    free(strata);
+    params->prefiltered = prefiltered;
+}
+
+// Evaluates the specular component given the yarn properties and the 
+// intersection data under the assumption that we have staple yarn (psi != 0).
+// Algorithm 3 from 'Specular Reflection from Woven Cloth', P. Irawan,
+// S. Marschner, 2012.
+static float tl_staple_specular(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache)
+{
+    TL_STATS_ADD(staple_specular,1);
+    // The algorithm in this function assumes yarn local coordiantes.
+    // That is, y-axis always runs along yarn segment and x-axis runs across, 
+    // regardless if yarn is warp or weft.
     
-    int32_t pattern_repeat_x = tl_repeat_index(pattern_x, pattern_width);
-    int32_t pattern_repeat_y = tl_repeat_index(pattern_y, pattern_height);
+    // To ensure yarn local coordinates, y-components of in and out directions,
+    // wi and wo (in global coordinate space) are swapped with their respective
+    // y-componenets if yarn_segment is weft.
+    tlVector wi = tlvector(intersection_data.wi_x, intersection_data.wi_y,
+        intersection_data.wi_z);
+    tlVector wo = tlvector(intersection_data.wo_x, intersection_data.wo_y,
+        intersection_data.wo_z);
+    if(!data.warp_above){
+        float tmp2 = wi.x;
+        float tmp3 = wo.x;
+        wi.x = -wi.y; wi.y = tmp2;
+        wo.x = -wo.y; wo.y = tmp3;
+    }
+
+    // ALG: 'COMPUTE u FROM y'
+    // Yarn coordinates have been transformed previously to the local
+    // coordinate system before hand by tl_get_pattern_data and available here 
+    // in the data parameter.
+    float u = data.u;
+    float x = data.x;
     
-    //The origin is the pattern entry from which size of segment is calculated. 
-    //The origin entry changes if we miss a thin yarn.
-    int32_t origin_x = pattern_x;
-    int32_t origin_y = pattern_y;
-    PatternEntry origin_entry = params->pattern[pattern_repeat_x + 
-        pattern_repeat_y*pattern_width];
-    uint8_t warp_above = origin_entry.warp_above;
-
-    int32_t current_x = origin_x;
-    int32_t current_y = origin_y;
-    int32_t *incremented_coord_across = warp_above ? &current_x : &current_y;
-    float cell_x = (u == 1.f) ? 1 : u*(float)(pattern_width) - pattern_repeat_x;
-    float cell_y = (v == 1.f) ? 1 : v*(float)(pattern_height) - pattern_repeat_y;
-    float *cell_coord_along = warp_above ? &cell_y : &cell_x;
-    float *cell_coord_across = warp_above ? &cell_x : &cell_y;
-    uint32_t max_size_across = warp_above ? pattern_width: pattern_height;
-    uint32_t initial_coord_across = warp_above ? pattern_x: pattern_y;
+    // ALG: 'COMPUTE v USING (3)'
+    tlVector H = tlVector_normalize(tlVector_add(wi, wo)); //Bisector of wi, wo
+    float psi = tl_yarn_cache_get_psi(cache);
+    float sin_u, cos_u, sin_psi, cos_psi;
+    tl_sincosf(u, &sin_u, &cos_u);
+    tl_sincosf(psi, &sin_psi, &cos_psi);
+    float D;
+    {
+        float a = H.y*sin_u + H.z*cos_u;
+        D = (H.y*cos_u-H.z*sin_u)/(sqrtf(H.x*H.x + a*a))/
+			tl_tanf(psi, sin_psi, cos_psi);
+    }
+    // NOTE(Peter): plus or minus on acos?
+    float specular_v = tl_atan2f(-H.y*sin_u - H.z*cos_u, H.x) + tl_acosf(D);
+    
+    
+    float reflection = 0.f;
+
+    // ALG: 'IF ABS(v) < pi/2'
+    if (fabsf(specular_v) < M_PI_2 && fabsf(D) < 1.f) {
+        
+        // TODO(Vidar): Clamp specular_v, do we need it?
+        // Make normal for highlights, uses u and specular_v
+        float sin_v, cos_v;
+        tl_sincosf(specular_v, &sin_v, &cos_v);
+        tlVector highlight_normal = tlVector_normalize(tlvector(sin_v,
+            sin_u*cos_v, cos_u*cos_v));
+
+        // Transform from angle to coordante on yarn surface.
+        // get specular_x, using irawans transformation.
+        float specular_x = specular_v/((float)M_PI_2);
+        // our transformation
+        //float specular_x = sinf(specular_v);
+
+        // Get neccessary yarn params for current type.
+        float delta_x = tl_yarn_cache_get_delta_x(cache);
+        float umax;
+        if (data.ext_between_parallel){
+            // if current segment is an extension between two parallel yarns
+            // -> bend = 0
+            umax = 0.001f;
+        } else {
+            umax = tl_yarn_cache_get_umax(cache);
+        }
+
+        // Clamp specular_x
+        specular_x = specular_x < 1.f - delta_x ? specular_x :
+            1.f - delta_x;
+        specular_x = specular_x > -1.f + delta_x ? specular_x :
+            -1.f + delta_x;
+
+        // Check that we are in the highlight width area.
+        // This takes the role of Chi in the irawan paper.
+        TL_STATS_ADD(specular_width_rejected,
+            !(fabsf(specular_x - x) < delta_x));
+        if (fabsf(specular_x - x) < delta_x) {
+            float rho = tl_yarn_cache_get_rho(cache);
+
+            // ALG: 'COMPUTE G_v USING (5)'
+            float a = 1.f; // radius of yarn
+            float R = tl_recip_sinf(umax); // radius of curvature
+            float Gv = a * (R + a * cos_v) / (
+                tlVector_magnitude(tlVector_add(wi, wo)) *
+                tlVector_dot(highlight_normal, H) * fabsf(sin_psi));
+
+            // ALG: 'COMPUTE f_c USING (7)'
+            float fc;
+            {
+				float tx = -cos_v*sin_psi;
+				float ty = cos_u*cos_psi + sin_u*sin_v*sin_psi;
+				float tz = -sin_u*cos_psi + cos_u*sin_v*sin_psi;
+
+				tlVector tvec = tlvector(tx,ty,tz);
+				tlVector svec = tlVector_normalize(tlVector_cross(tvec, highlight_normal));
+				tlVector rvec = tlVector_normalize(tlVector_cross(tvec, svec));
+
+				float wos = tlVector_dot(wo, svec);
+				float wor = tlVector_dot(wo, rvec);
+
+				float wis = tlVector_dot(wi, svec);
+				float wir = tlVector_dot(wi, rvec);
+
+				float cos_x = (wis*wos + wir*wor)/sqrtf((wis*wis+wir*wir)*(wos*wos+wor*wor));
+				fc = wrapped_cauchy(cos_x, rho);
+			}
+
+            // ALG: 'COMPUTE A USING (8)'
+            float widotn = tlVector_dot(wi, highlight_normal);
+            float wodotn = tlVector_dot(wo, highlight_normal);
+            widotn = (widotn < 0.f) ? 0.f : widotn;   
+            wodotn = (wodotn < 0.f) ? 0.f : wodotn;   
+            //TODO(Vidar): This is where we get the NAN
+            float A = 0.f;
+            if(widotn > 0.f && wodotn > 0.f){
+                A = 1.f / (4.0f * (float)M_PI) * (widotn*wodotn)/(widotn + wodotn);
+            }
+
+            // ALG: 'CLAMP x to range +/- (w-delta_x)/2'
+            // ALG: 'COMPUTE X USING (12)'
+            // We skip calculation of clamping function CHI. This is done 
+            // by the if clause above.
+
+            // ALG: 'COMPUTE BTF T USING (13)'
+            float w = 2.f; //omega
+            reflection = 2.f*w*umax*fc*Gv*A/delta_x; // The specular component!
+        }
+    }
+    return reflection;
+}
+
+// Evaluates the specular component given the yarn properties and the 
+// intersection data under the assumption that we have filament yarn (psi = 0).
+// Algorithm 4 from "Specular Reflection from Woven Cloth", P. Irawan,
+// S. Marschner, 2012.
+static float tl_filament_specular(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache)
+{
+    TL_STATS_ADD(filament_specular,1);
+    // The algorithm in this function assumes yarn local coordiantes.
+    // That is, y-axis always runs along yarn segment and x-axis runs across, 
+    // regardless if yarn is warp or weft.
+    
+    // To ensure yarn local coordinates, y-components of in and out directions,
+    // wi and wo (in global coordinate space) are swapped with their respective
+    // y-componenets if yarn_segment is weft.
+    tlVector wi = tlvector(intersection_data.wi_x, intersection_data.wi_y,
+        intersection_data.wi_z);
+    tlVector wo = tlvector(intersection_data.wo_x, intersection_data.wo_y,
+        intersection_data.wo_z);
+    if(!data.warp_above){
+        float tmp2 = wi.x;
+        float tmp3 = wo.x;
+        wi.x = -wi.y; wi.y = tmp2;
+        wo.x = -wo.y; wo.y = tmp3;
+    }
+
+    // ALG: 'COMPUTE v FROM x'
+    // Yarn coordinates have been transformed previously to the local
+    // coordinate system by tl_get_pattern_data and available here 
+    // in the data parameter.
+    float v = data.v;
+    float y = data.y;
+    
+    // ALG: 'COMPUTE u USING (4)'
+    tlVector H = tlVector_normalize(tlVector_add(wi, wo)); //Bisector of wi, wo
+    float specular_u = tl_atan2f(-H.z, H.y) + (float)M_PI_2; // plus or minus?
+    //float specular_u = atan2f(H.y, H.z);// + (float)M_PI_2; // plus or minus?
+
+    float umax;
+    if (data.ext_between_parallel == 1){
+        // if current segment is an extension between two parallel yarns
+        // -> bend = 0
+        umax = 0.0001f;
+    } else {
+        umax = tl_yarn_cache_get_umax(cache);
+    }
+    
+    float reflection = 0.f;
+    
+    // ALG: 'IF ABS(u) < umax'
+    if (fabsf(specular_u) < umax){
+       
+        // Make normal for highlights, uses v and specular_u
+        float sin_u, cos_u, sin_v, cos_v;
+        tl_sincosf(specular_u, &sin_u, &cos_u);
+        tl_sincosf(v, &sin_v, &cos_v);
+        tlVector highlight_normal = tlVector_normalize(tlvector(sin_v,
+            sin_u*cos_v, cos_u*cos_v));
+
+        // Make tangent for highlights, uses v and specular_u
+        tlVector highlight_tangent = tlVector_normalize(tlvector(0.f, 
+            cos_u, -sin_u));
+
+        // Transform from angle to coordante on yarn surface.
+        // get specular_y, using irawans transformation.
+        float specular_y = specular_u/umax;
+        // our transformation
+        //float specular_y = sinf(specular_u)/sinf(m_umax);
+
+        float delta_x = tl_yarn_cache_get_delta_x(cache);
+        
+        // Clamp specular_y
+        specular_y = specular_y < 1.f - delta_x ? specular_y :
+            1.f - delta_x;
+        specular_y = specular_y > -1.f + delta_x ? specular_y :
+            -1.f + delta_x;
+
+        // Check that we are in the highlight width area.
+        // This takes the role of Chi in the irawan paper.
+        TL_STATS_ADD(specular_width_rejected,
+            !(fabsf(specular_y - y) < delta_x));
+        if (fabsf(specular_y - y) < delta_x) {
+            // ALG: 'COMPUTE G_u USING (6)'
+            // 'We can not use u as the parameter for filament yarns. 
+            // We integrate over u for staple and v for filament.' 
+            // That is, we need Gv for staple and Gu for filament.
+            float a = 1.f; //radius of yarn
+            float R = tl_recip_sinf(umax); //radius of curvature
+            float Gu = a*(R + a*cos_v) / (
+                tlVector_magnitude(tlVector_add(wi,wo)) *
+                fabsf((tlVector_cross(highlight_tangent,H).x)) );
+
+            float rho = tl_yarn_cache_get_rho(cache);
+
+            // ALG: 'COMPUTE f_c USING (7)'
+            float fc;
+            {
+				float tx = 0.f;
+				float ty = cos_u;
+				float tz = -sin_u;
 
-    //Get segment size of yarn in current position in pattern matrix.
-    float origin_yarnsize = get_yarn_segment_size(origin_x,
-            origin_y, params, intersection_data);
-    
-    //init some flags
-    uint8_t yarn_hit = 0;			// If we have hit the yarn.
-    uint8_t between_parallel = 0;	// For later, if we are between parallel yarns.
-    uint8_t extension = 0;          // If what we hit is an extention of an adjacent yarn.
-    int32_t origin_offset = 0;      // With how much the origin is offset.
-    if (fabsf(2*(*cell_coord_across)-1.f) <= origin_yarnsize) {
-        yarn_hit = 1;
-    } else {
-        //Did not hit yarn, look for extension...
-        int8_t direction = (*cell_coord_across >= 0.5) ? 1 : -1;
-        PatternEntry tmp_pe; 
-        *incremented_coord_across = initial_coord_across;
-        uint8_t found_extension_entry = 1; //initialize flag
-        do{
-            (*incremented_coord_across) += direction;
-            lookup_pattern_entry(&tmp_pe, params, current_x, current_y);
-            if ((*incremented_coord_across) == initial_coord_across +
-                    direction && tmp_pe.warp_above == warp_above) {
-                between_parallel = 1;
-            }
-            if (abs((int)*incremented_coord_across - (int)initial_coord_across) == max_size_across) {
-                found_extension_entry = 0;
-                break;
+				tlVector tvec = tlvector(tx,ty,tz);
+				tlVector svec = tlVector_normalize(tlVector_cross(tvec, highlight_normal));
+				tlVector rvec = tlVector_normalize(tlVector_cross(tvec, svec));
+
+				float wos = tlVector_dot(wo, svec);
+				float wor = tlVector_dot(wo, rvec);
+
+				float wis = tlVector_dot(wi, svec);
+				float wir = tlVector_dot(wi, rvec);
+
+				float cos_x = (wis*wos + wir*wor)/sqrtf((wis*wis+wir*wir)*(wos*wos+wor*wor));
+				fc = wrapped_cauchy(cos_x, rho);
+			}
+
+            // ALG: 'COMPUTE A USING (8)'
+            float widotn = tlVector_dot(wi, highlight_normal);
+            float wodotn = tlVector_dot(wo, highlight_normal);
+            widotn = (widotn < 0.f) ? 0.f : widotn;   
+            wodotn = (wodotn < 0.f) ? 0.f : wodotn;   
+            float A = 0.f;
+            if(widotn > 0.f && wodotn > 0.f){
+                A = 1.f / (4.0f*(float)M_PI) * (widotn*wodotn)/(widotn+wodotn);
+                //TODO(Peter): Explain from where the 1/4*PI factor comes from
             }
-        } while (tmp_pe.warp_above == warp_above);
-            
-        //Need yarnsize sampled at center of yarnsegment, which is extention...
-        float tmp_yarnsize = get_yarn_segment_size(current_x,
-                current_y, params, intersection_data);
-        
-        //If there is yarn that can be used as extension. Did we hit it?
-        if (found_extension_entry && fabsf(2*(*cell_coord_along)-1.f) <=
-                tmp_yarnsize) {
-            //Yes we hit an extention. Use this pattern entry as new origin!
-            origin_entry = tmp_pe;
-            origin_offset = ((!warp_above) ? ((int)origin_y - current_y) : ((int)origin_x - current_x));
-            warp_above = origin_entry.warp_above;
-            origin_x = current_x;
-            origin_y = current_y;
 
-            extension = 1;
-            yarn_hit = 1;
+            // ALG: 'COMPUTE As USING (9)'
+            //TODO(Peter): Implement As, -- smoothes the dissapeares of the
+            // higlight near the ends. Described in (9).
+            
+            // ALG: 'CLAMP y to range +/- (l-delta_y)/2'
+            // ALG: 'COMPUTE X USING (12)'
+            // We skip calculation of clamping function Chi. This is done 
+            // by the if clause above.
+            
+            // ALG: 'COMPUTE BTF T USING (13)'
+            float w = 2.f;
+            reflection = 2.f*w*umax*Gu*fc*A/delta_x; // The specular component!
         }
     }
+    return reflection;
+}
 
-    //Next need to determine yarnsegment dimensions...
-    
-    //look right and left from origin until we hit cell that is not current yarn weft/warp.
-    uint32_t steps_right = 0;
-    uint32_t steps_left  = 0;
-    calculate_length_of_segment(origin_entry.warp_above,
-            tl_repeat_index(origin_x, pattern_width),
-            tl_repeat_index(origin_y, pattern_height),
-            &steps_left, &steps_right, params->pattern_width,
-            params->pattern_height, params->pattern);
+// opacity is the value returned by tl_opacity
+static tlColor tl_diffuse(tlIntersectionData intersection_data,
+        tlPatternData data, tlYarnParameterCache *cache, tlColor opacity)
+{
+    // Use the common color of yarn type 0 between the yarns
+    tlColor color = tl_yarn_cache_get_type_color(cache,
+        data.yarn_hit ? cache->yarn_type : 0);
 
-    PatternEntry border_yarn_left;
-    PatternEntry border_yarn_right;
-    float border_yarn_size_left;
-    float border_yarn_size_right;
-    if (origin_entry.warp_above) {
-        lookup_pattern_entry(&border_yarn_left, params, current_x,
-                (current_y - steps_left - 1));        
-        lookup_pattern_entry(&border_yarn_right, params, current_x,
-                (current_y + steps_right + 1));        
-        border_yarn_size_left = get_yarn_segment_size(current_x, 
-                (current_y - steps_left - 1), params, intersection_data);
-        border_yarn_size_right = get_yarn_segment_size(current_x, 
-                (current_y + steps_right + 1), params, intersection_data);
-    } else {
-        lookup_pattern_entry(&border_yarn_left, params,
-                (current_x - steps_left - 1), current_y);
-        lookup_pattern_entry(&border_yarn_right, params,
-                (current_x + steps_right + 1), current_y);
-        border_yarn_size_left = get_yarn_segment_size(
-                (current_x - steps_left - 1), current_y, params, intersection_data);
-        border_yarn_size_right = get_yarn_segment_size(
-                (current_x + steps_right + 1), current_y, params, intersection_data);
+    // Apply multiplier
+    float color_amount = tl_yarn_cache_get_color_amount(cache);
+    if (color_amount != 1.f) {
+        color.r *= color_amount;
+        color.g *= color_amount;
+        color.b *= color_amount;
     }
     
-    /*float border_yarn_size_left = params->
-        yarn_types[border_yarn_left.yarn_type].yarnsize;
-    float border_yarn_size_right = params->
-        yarn_types[border_yarn_right.yarn_type].yarnsize;
-        */
-        
-    /*float width = tl_yarn_type_get_yarnsize(params, origin_entry.yarn_type,
-            intersection_data->context);*/
-    float width = get_yarn_segment_size(origin_x, origin_y, params, intersection_data);
-    float length = steps_left + steps_right + 1.f +
-        ((1.f-border_yarn_size_left) + (1.f-border_yarn_size_right))/2.f;
-    
-    /*
-    ========== TODO ========== !!!!!!!!!!!!!!!!!!!!!!
-        Add variables so that we can sample using get_yarn_segment_size...
-        origin_x and orign_y are repeating! Must use non reapeating coords to sample get_yarn_segment_size with!
-        */
+    float value = intersection_data.wi_z;
+    color.r *= value;
+    color.g *= value;
+    color.b *= value;
 
-    //If current segment is between two parallel yarns. Do not count self.
-    if(between_parallel) length -= 1;
+    //NOTE(Vidar): We use the max of the specular color for dimming the diffuse
+    tlColor specular_color=tl_yarn_cache_get_specular_color(cache);
+    float specular_strength=specular_color.r>specular_color.g ?
+        specular_color.r : specular_color.g;
+    specular_strength=specular_color.b>specular_strength ?
+        specular_color.b : specular_strength;
+    float specular_amount = tl_yarn_cache_get_specular_amount(cache);
+    specular_strength *= specular_amount;
+
+    float specular_strength_complement=1.f-specular_strength;
+    color.r*=specular_strength_complement;
+    color.g*=specular_strength_complement;
+    color.b*=specular_strength_complement;
+
+    color.r*=opacity.r;
+    color.g*=opacity.g;
+    color.b*=opacity.b;
+
+    return color;
+}
+
+static tlColor tl_opacity(tlPatternData data, tlYarnParameterCache *cache)
+{
+    // Same as for the color in tl_diffuse
+    tlColor opacity = tl_yarn_cache_get_type_opacity(cache,
+        data.yarn_hit ? cache->yarn_type : 0);
+
+    // Apply multiplier
+    float opacity_amount = tl_yarn_cache_get_opacity_amount(cache);
+    if (opacity_amount != 1.f) {
+        opacity.r *= opacity_amount;
+        opacity.g *= opacity_amount;
+        opacity.b *= opacity_amount;
+    }
     
-    /* Debug */
-    /*
-    printf("--Debug calculateSegment--\n");
-    printf("steps_left: %d, steps_right: %d\n", steps_left, steps_right);
-    printf("border_yarn_type_left: %d, border_yarn_type_right: %d\n", border_yarn_left.yarn_type, border_yarn_right.yarn_type);
-    printf("border_yarn_size_left: %f, border_yarn_size_right: %f\n", border_yarn_size_left, border_yarn_size_right);
-    printf("border_yarn_left warp_above: %d, border_yarn_right warp_above: %d\n", border_yarn_left.warp_above, border_yarn_right.warp_above);
-    printf("tmp width: %f, length: %f \n", width, length);
-    printf("between parallel: %d\n", between_parallel);
-    printf("cell_x: %f, cell_y: %f \n", cell_x, cell_y);
-    printf("pattern_repeat_x: %d, pattern_repeat_y: %d \n", pattern_repeat_x, pattern_repeat_y);
-    printf("total_u: %f, total_v: %f \n", total_u, total_v);
-    printf("u: %f, v: %f \n", u, v);
-    */
+    return opacity;
+}
 
-    //Determine coordinates for top left corner of segment.
-    float start_u, start_v;
-    {
-        float distance_left = steps_left + (1.f - border_yarn_size_left)/2.f;
-        if (!between_parallel) distance_left += origin_offset;
-        if (between_parallel && *cell_coord_across >= 0.5) {
-            PatternEntry tmp_pe = params->pattern[
-                tl_repeat_index(pattern_x, pattern_width) +
-                tl_repeat_index(pattern_y, pattern_height)*pattern_width];
-            distance_left = -(0.5f + tl_yarn_type_get_yarnsize(params, tmp_pe.yarn_type, intersection_data->context)/2.f);
-        } 
+// The kernels for TL_SPECULAR_KERNELS. filament and noise are constants, so
+// the compiler removes the branches on them.
+static inline tlColor tl_specular_kernel(tlIntersectionData intersection_data,
+        tlPatternData data, tlYarnParameterCache *cache, int filament,
+        int noise)
+{
+    tlColor ret={0.f,0.f,0.f};
+	if(!data.yarn_hit){
+        return ret;
+	}
+    float reflection = filament ?
+        tl_filament_specular(intersection_data, data, cache) :
+        tl_staple_specular(intersection_data, data, cache);
+	float noise_factor=1.f;
+    if(noise){
+        float specular_noise=tl_yarn_cache_get_specular_noise(cache);
+		float iv = intensity_variation(data);
+		noise_factor=(1.f-specular_noise)+specular_noise * iv;
+    }
+    tlColor specular_color=tl_yarn_cache_get_specular_color(cache);
+    float specular_amount = tl_yarn_cache_get_specular_amount(cache);
+	float factor = reflection * 7.f * noise_factor * specular_amount; //NOTE(Vidar): The magic constant here is to give the highlights a reasonable strength
+    ret.r=specular_color.r*factor;
+    ret.g=specular_color.g*factor;
+    ret.b=specular_color.b*factor;
+    return ret;
+}
 
-        float distance_top = - (1.f-width)/2.f;
+// Picks the kernel at each shading point. Used for yarn types whose psi or
+// specular_noise have texmaps, and before tl_prepare has been called.
+static tlColor tl_specular_generic(tlIntersectionData intersection_data,
+        tlPatternData data, tlYarnParameterCache *cache)
+{
+    tlColor ret={0.f,0.f,0.f};
+    if(!tl_has_pattern(cache->params) || !data.yarn_hit){
+        return ret;
+    }
+    // Depending on the given psi parameter the yarn is considered
+    // staple or filament. They are treated differently in order
+    // to work better numerically. 
+    float psi = tl_yarn_cache_get_psi(cache);
+    float specular_noise = tl_yarn_cache_get_specular_noise(cache);
+    return tl_specular_kernel(intersection_data, data, cache, psi <= 0.001f,
+        specular_noise > 0.001f);
+}
 
-        if (!warp_above) {
-            start_u = total_u + (-cell_x - distance_left)/pattern_width;
-            start_v = total_v + (-cell_y - distance_top)/pattern_height;
-        } else {
-            start_u = total_u + (-cell_x - distance_top)/pattern_width;
-            start_v = total_v + (-cell_y - distance_left)/pattern_height;
-        }
+typedef tlColor (*tlSpecularKernel)(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache);
+
+#define TL_SPECULAR_KERNEL(name,filament,noise) \
+    static tlColor tl_specular_##name(tlIntersectionData intersection_data,\
+        tlPatternData data, tlYarnParameterCache *cache){\
+        return tl_specular_kernel(intersection_data,data,cache,filament,noise);}
+TL_SPECULAR_KERNELS
+#undef TL_SPECULAR_KERNEL
+
+static const tlSpecularKernel tl_specular_kernels[TL_SPECULAR_KERNEL_COUNT] = {
+    tl_specular_generic,
+#define TL_SPECULAR_KERNEL(name,filament,noise) tl_specular_##name,
+TL_SPECULAR_KERNELS
+#undef TL_SPECULAR_KERNEL
+};
+
+// Calls the kernel which tl_prepare picked for the yarn type
+static tlColor tl_specular(tlIntersectionData intersection_data,
+        tlPatternData data, tlYarnParameterCache *cache)
+{
+    const tlWeaveParameters *params = cache->params;
+    if(!params->resolved_yarn_types || !tl_has_pattern(params)){
+        return tl_specular_generic(intersection_data, data, cache);
     }
+    uint8_t kernel =
+        params->resolved_yarn_types[cache->yarn_type].specular_kernel;
+    return tl_specular_kernels[kernel](intersection_data, data, cache);
+}
 
-    tlYarnSegment yarn;
-    yarn.length = length;
-    yarn.width = width;
-    yarn.start_u = start_u;
-    yarn.start_v = start_v;
-    yarn.warp_above = origin_entry.warp_above;
-    yarn.pattern_entry = origin_entry;
-    yarn.yarn_hit = yarn_hit;
-    yarn.between_parallel = between_parallel;
-    return yarn;
+// Evaluates the specular component given the yarn properties and the 
+// intersection data under the assumption that we have staple yarn (psi != 0).
+static float tl_eval_staple_specular(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    cache.yarn_type = data.yarn_type;
+    return tl_staple_specular(intersection_data, data, &cache);
 }
 
-/*
- * Given intersection_data, tl_get_pattern_data determines the current yarn
- * segment and associated paramters needed for shading.
- * Determination of yarn segment is made more complicated by the fact that 
- * yarnsizes can vary. This results in a certain number of special cases.
- */
-tlPatternData tl_get_pattern_data(tlIntersectionData intersection_data,
-        const tlWeaveParameters *params) {
-    if(params->pattern == 0){
-        tlPatternData data = {0};
-        return data;
+// Evaluates the specular component given the yarn properties and the 
+// intersection data under the assumption that we have filament yarn (psi = 0).
+static float tl_eval_filament_specular(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    cache.yarn_type = data.yarn_type;
+    return tl_filament_specular(intersection_data, data, &cache);
+}
+
+tlColor tl_eval_diffuse_cached(tlIntersectionData intersection_data,
+        tlPatternData data, tlYarnParameterCache *cache)
+{
+    cache->yarn_type = data.yarn_type;
+    tlColor opacity = tl_opacity(data, cache);
+    return tl_diffuse(intersection_data, data, cache, opacity);
+}
+
+tlColor tl_eval_opacity_cached(tlIntersectionData intersection_data,
+        tlPatternData data, tlYarnParameterCache *cache)
+{
+    cache->yarn_type = data.yarn_type;
+    return tl_opacity(data, cache);
+}
+
+tlColor tl_eval_specular_cached(tlIntersectionData intersection_data,
+        tlPatternData data, tlYarnParameterCache *cache)
+{
+    cache->yarn_type = data.yarn_type;
+    return tl_specular(intersection_data, data, cache);
+}
+
+tlColor tl_eval_diffuse(tlIntersectionData intersection_data,
+        tlPatternData data, const tlWeaveParameters *params)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    return tl_eval_diffuse_cached(intersection_data, data, &cache);
+}
+
+tlColor tl_eval_opacity(tlIntersectionData intersection_data,
+        tlPatternData data, const tlWeaveParameters *params)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    return tl_eval_opacity_cached(intersection_data, data, &cache);
+}
+
+tlColor tl_eval_specular(tlIntersectionData intersection_data,
+        tlPatternData data, const tlWeaveParameters *params)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    return tl_eval_specular_cached(intersection_data, data, &cache);
+}
+
+// -- Prefiltered shading -- //
+
+// Returns how much of the prefiltered pattern to use at the shading point,
+// from 0 for the detailed pattern to 1, see Prefiltered shading
+static float tl_prefilter_amount(const tlIntersectionData *intersection_data,
+        const tlWeaveParameters *params)
+{
+    if(!params->prefiltered){
+        return 0.f;
     }
-   
-    //Generate scaled uv coordinates from intersection_data
-    float uv_x = intersection_data.uv_x;
-    float uv_y = intersection_data.uv_y;
+    // Same scaling and rotation as tl_pattern_data, in cells
     float u_scale, v_scale;
-    if (params->realworld_uv) {
-        //the user parameters uscale, vscale change roles when realworld_uv
-        // is true. If true they are then used to tweak the realworld scales
-        u_scale = params->uscale/params->pattern_realwidth; 
-        v_scale = params->vscale/params->pattern_realheight;
-    } else {
-        u_scale = params->uscale;
-        v_scale = params->vscale;
+    tl_uv_scale(params, &u_scale, &v_scale);
+    u_scale *= (float)tl_loaded_pattern_width(params);
+    v_scale *= (float)tl_loaded_pattern_height(params);
+    float rot=params->uvrotation/180.f*(float)M_PI;
+    float sin_rot, cos_rot;
+    tl_sincosf(rot, &sin_rot, &cos_rot);
+    float du_dx = intersection_data->du_dx, dv_dx = intersection_data->dv_dx;
+    float du_dy = intersection_data->du_dy, dv_dy = intersection_data->dv_dy;
+    float x_u = (du_dx*cos_rot - dv_dx*sin_rot)*u_scale;
+    float x_v = (du_dx*sin_rot + dv_dx*cos_rot)*v_scale;
+    float y_u = (du_dy*cos_rot - dv_dy*sin_rot)*u_scale;
+    float y_v = (du_dy*sin_rot + dv_dy*cos_rot)*v_scale;
+    float length_x = x_u*x_u + x_v*x_v;
+    float length_y = y_u*y_u + y_v*y_v;
+    float footprint = sqrtf(length_x > length_y ? length_x : length_y);
+    float t = (footprint - TL_PREFILTER_MIN_FOOTPRINT)
+        /(TL_PREFILTER_MAX_FOOTPRINT - TL_PREFILTER_MIN_FOOTPRINT);
+    // Written so that NaN derivatives give the detailed pattern
+    if(!(t > 0.f)){
+        return 0.f;
+    }
+    if(t >= 1.f){
+        return 1.f;
     }
+    return t*t*(3.f - 2.f*t);
+}
 
-    // Apply uv rotation
-    {
-        float rot=params->uvrotation/180.f*(float)M_PI;
-        float tmp_u=uv_x;
-        float tmp_v=uv_y;
-        uv_x=(tmp_u*cosf(rot)-tmp_v*sinf(rot))*u_scale;
-        uv_y=(tmp_u*sinf(rot)+tmp_v*cosf(rot))*v_scale;
+// Evaluates the lobes selected by flags for the prefiltered pattern. The
+// pattern data of ret is left untouched.
+static void tl_prefiltered_eval(tlIntersectionData intersection_data,
+        tlYarnParameterCache *cache, uint32_t flags, tlEvalResult *ret)
+{
+    const tlPrefilteredPattern *prefiltered = cache->params->prefiltered;
+    tlColor black = {0.f,0.f,0.f};
+    ret->diffuse = black;
+    ret->specular = black;
+    ret->opacity = black;
+    // The last iteration is the gap between the yarns
+    for(uint32_t i=0;i<=prefiltered->num_yarn_types;i++){
+        int gap = i == prefiltered->num_yarn_types;
+        float coverage = gap ? prefiltered->gap_coverage
+            : prefiltered->coverage[i];
+        if(coverage <= 0.f){
+            continue;
+        }
+        tlPatternData data = {0};
+        data.yarn_hit = !gap;
+        data.yarn_type = gap ? 0 : i;
+        cache->yarn_type = data.yarn_type;
+        if(flags & (TL_EVAL_OPACITY | TL_EVAL_DIFFUSE)){
+            tlColor opacity = tl_opacity(data, cache);
+            ret->opacity.r += coverage*opacity.r;
+            ret->opacity.g += coverage*opacity.g;
+            ret->opacity.b += coverage*opacity.b;
+            if(flags & TL_EVAL_DIFFUSE){
+                tlColor diffuse = tl_diffuse(intersection_data, data, cache,
+                    opacity);
+                ret->diffuse.r += coverage*diffuse.r;
+                ret->diffuse.g += coverage*diffuse.g;
+                ret->diffuse.b += coverage*diffuse.b;
+            }
+        }
+        if((flags & TL_EVAL_SPECULAR) && !gap){
+            for(uint32_t s=prefiltered->first_sample[i];
+                    s<prefiltered->first_sample[i+1];s++){
+                const tlPrefilteredSample *sample = &prefiltered->samples[s];
+                data = sample->data;
+                tl_segment_uv_and_normal(&data, cache);
+                tlColor specular = tl_specular(intersection_data, data, cache);
+                ret->specular.r += sample->weight*specular.r;
+                ret->specular.g += sample->weight*specular.g;
+                ret->specular.b += sample->weight*specular.b;
+            }
+        }
     }
+}
 
-    //scaled and non-repeating uv.
-    float total_u = uv_x;
-    float total_v = uv_y;
+static void tl_blend_color(tlColor *a, tlColor b, float t)
+{
+    a->r += (b.r - a->r)*t;
+    a->g += (b.g - a->g)*t;
+    a->b += (b.b - a->b)*t;
+}
 
-    float u_repeat = fmod(uv_x,1.f);
-    float v_repeat = fmod(uv_y,1.f);
-    if (u_repeat < 0.f) {
-        u_repeat = u_repeat - floor(u_repeat);
+tlEvalResult tl_eval_all(tlIntersectionData intersection_data,
+        const tlWeaveParameters *params, uint32_t flags)
+{
+    tlEvalResult ret;
+    tlYarnParameterCache cache;
+    tlColor black = {0.f,0.f,0.f};
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    ret.pattern_data = tl_pattern_data(intersection_data, params, &cache, 1);
+    ret.diffuse = black;
+    ret.specular = black;
+    ret.opacity = black;
+    float prefiltered = tl_prefilter_amount(&intersection_data, params);
+    if(prefiltered < 1.f){
+        if(flags & (TL_EVAL_OPACITY | TL_EVAL_DIFFUSE)){
+            ret.opacity = tl_opacity(ret.pattern_data, &cache);
+        }
+        if(flags & TL_EVAL_DIFFUSE){
+            ret.diffuse = tl_diffuse(intersection_data, ret.pattern_data,
+                &cache, ret.opacity);
+        }
+        if(flags & TL_EVAL_SPECULAR){
+            ret.specular = tl_specular(intersection_data, ret.pattern_data,
+                &cache);
+        }
     }
-    if (v_repeat < 0.f) {
-        v_repeat = v_repeat - floor(v_repeat);
+    if(prefiltered > 0.f){
+        tlEvalResult filtered;
+        tl_prefiltered_eval(intersection_data, &cache, flags, &filtered);
+        tl_blend_color(&ret.diffuse, filtered.diffuse, prefiltered);
+        tl_blend_color(&ret.specular, filtered.specular, prefiltered);
+        tl_blend_color(&ret.opacity, filtered.opacity, prefiltered);
     }
-//non-repeating pattern index (used for specular noise)
-    uint32_t total_pattern_x = (uint32_t)((int32_t)(uv_x*params->pattern_width));
-    uint32_t total_pattern_y = (uint32_t)((int32_t)(uv_y*params->pattern_height));
+    return ret;
+}
 
-    //Get yarnsegment dimensions
-	tlYarnSegment yarnsegment = tl_get_yarn_segment(total_u, total_v, params, &intersection_data);
-    
-    if (!yarnsegment.yarn_hit) {
-        //No hit, No need to do more calculations.
-        tlPatternData ret_data;
-        ret_data.yarn_hit = 0;
-        ret_data.yarn_type = 0;
-        return ret_data;
+tlColor tl_eval_shadow_opacity(tlIntersectionData intersection_data,
+        const tlWeaveParameters *params)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    float prefiltered = tl_prefilter_amount(&intersection_data, params);
+    tlColor opacity = {0.f,0.f,0.f};
+    if(prefiltered < 1.f){
+        tlPatternData data = tl_pattern_data(intersection_data, params,
+            &cache, 0);
+        opacity = tl_opacity(data, &cache);
+    }
+    if(prefiltered > 0.f){
+        tlEvalResult filtered;
+        tl_prefiltered_eval(intersection_data, &cache, TL_EVAL_OPACITY,
+            &filtered);
+        tl_blend_color(&opacity, filtered.opacity, prefiltered);
     }
+    return opacity;
+}
 
-    float l = yarnsegment.length;
-	float w = yarnsegment.width;
-    float x, y;
-    if (!yarnsegment.warp_above) {
-        x = (total_u - yarnsegment.start_u)*params->pattern_width/l;
-        y = (total_v - yarnsegment.start_v)*params->pattern_height/w;
-    } else {
-        x = (total_u - yarnsegment.start_u)*params->pattern_width/w;
-        y = (total_v - yarnsegment.start_v)*params->pattern_height/l;
-    }
-    
-    //Rescale x, y to [-1,1], w,v scaled by 2
-    x = x*2.f - 1.f;
-    y = y*2.f - 1.f;
-    w = w*2.f;
-    l = l*2.f;
+tlColor tl_shade(tlIntersectionData intersection_data,
+        const tlWeaveParameters *params)
+{
+    tlEvalResult result = tl_eval_all(intersection_data,params,
+        TL_EVAL_DIFFUSE | TL_EVAL_SPECULAR);
+    tlColor ret = result.diffuse;
+    tlColor spec = result.specular;
+    ret.r+=spec.r; ret.g+=spec.g; ret.b+=spec.b;
+    return ret;
+}
 
-    /* Debug */
-    /*
-    printf("yarnsegment.width: %f, yarnsegment.length: %f\n", yarnsegment.width, yarnsegment.length);
-    printf("w: %f, l: %f\n", w, l);
-    printf("x: %f, y: %f\n", x, y);
-    printf("v_repeat: %f, u_repeat: %f\n", v_repeat, u_repeat);
-    printf("total_u - yarnsegment.start_u: %f - %f = %f\n", total_u, yarnsegment.start_u, (total_u - yarnsegment.start_u));
-    printf("total_v - yarnsegment.start_v: %f - %f = %f\n", total_v, yarnsegment.start_v, (total_v - yarnsegment.start_v));
-    printf("pattern_x: %d, pattern_y: %d\n", pattern_x, pattern_y);
-    */
+// -- Far-field BRDF -- //
 
-    //Swap X and Y for warp, so that we always have the yarn going along y.
-    if(!yarnsegment.warp_above){
-        float tmp1 = x;
-        x = -y;
-        y = tmp1;
-    }
+#define TL_FAR_FIELD_VERSION 3
+#define TL_FAR_FIELD_BYTE_ORDER 0x01020304
 
-    //return the results
-    tlPatternData ret_data;
-	ret_data.yarn_hit = yarnsegment.yarn_hit;
-	ret_data.ext_between_parallel = yarnsegment.between_parallel;
-	ret_data.yarn_type = yarnsegment.pattern_entry.yarn_type;
-    ret_data.length = l; 
-    ret_data.width  = w; 
-    ret_data.x = x; 
-    ret_data.y = y; 
-    ret_data.warp_above = yarnsegment.warp_above; 
-    calculate_segment_uv_and_normal(&ret_data, params, &intersection_data);
-    ret_data.total_index_x = total_pattern_x; //total x index of wrapped pattern matrix
-    ret_data.total_index_y = total_pattern_y; //total y index of wrapped pattern matrix
-    return ret_data;
+// FNV-1a
+static uint64_t tl_hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char*)data;
+    for(size_t i=0;i<size;i++){
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
 }
 
-// Evaluates the specular component given the yarn properties and the 
-// intersection data under the assumption that we have staple yarn (psi != 0).
-// Algorithm 3 from 'Specular Reflection from Woven Cloth', P. Irawan,
-// S. Marschner, 2012.
-float tl_eval_staple_specular(tlIntersectionData intersection_data,
-    tlPatternData data, const tlWeaveParameters *params)
+uint64_t tl_far_field_hash(const tlWeaveParameters *params)
 {
-    // The algorithm in this function assumes yarn local coordiantes.
-    // That is, y-axis always runs along yarn segment and x-axis runs across, 
-    // regardless if yarn is warp or weft.
-    
-    // To ensure yarn local coordinates, y-components of in and out directions,
-    // wi and wo (in global coordinate space) are swapped with their respective
-    // y-componenets if yarn_segment is weft.
-    tlVector wi = tlvector(intersection_data.wi_x, intersection_data.wi_y,
-        intersection_data.wi_z);
-    tlVector wo = tlvector(intersection_data.wo_x, intersection_data.wo_y,
-        intersection_data.wo_z);
-    if(!data.warp_above){
-        float tmp2 = wi.x;
-        float tmp3 = wo.x;
-        wi.x = -wi.y; wi.y = tmp2;
-        wo.x = -wo.y; wo.y = tmp3;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint32_t settings[] = {TL_FAR_FIELD_VERSION,
+        TL_FAR_FIELD_THETA_RESOLUTION, TL_FAR_FIELD_PHI_RESOLUTION,
+        TL_FAR_FIELD_SAMPLES, params->pattern_width, params->pattern_height,
+        params->pattern_repeats_x, params->pattern_repeats_y,
+        params->num_yarn_types, (uint32_t)tl_has_pattern(params)};
+    hash = tl_hash_bytes(hash, settings, sizeof(settings));
+    if(tl_has_pattern(params)){
+        for(uint32_t y=0;y<params->pattern_height;y++){
+            for(uint32_t x=0;x<params->pattern_width;x++){
+                PatternEntry entry;
+                lookup_pattern_entry(&entry, params, x, y);
+                uint32_t cell[] = {entry.warp_above, entry.yarn_type};
+                hash = tl_hash_bytes(hash, cell, sizeof(cell));
+            }
+        }
+    }
+    // The values are hashed one by one, since the structs have
+    // padding. Only whether a parameter is textured is part of the hash.
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        const tlYarnType *yarn_type = &params->yarn_types[i];
+        uint8_t textured;
+#define TL_FLOAT_PARAM(name) \
+        hash = tl_hash_bytes(hash, &yarn_type->name, sizeof(float));\
+        hash = tl_hash_bytes(hash, &yarn_type->name##_enabled, 1);\
+        textured = yarn_type->name##_texmap != 0;\
+        hash = tl_hash_bytes(hash, &textured, 1);
+#define TL_COLOR_PARAM(name) \
+        hash = tl_hash_bytes(hash, &yarn_type->name.r, sizeof(float));\
+        hash = tl_hash_bytes(hash, &yarn_type->name.g, sizeof(float));\
+        hash = tl_hash_bytes(hash, &yarn_type->name.b, sizeof(float));\
+        hash = tl_hash_bytes(hash, &yarn_type->name##_enabled, 1);\
+        textured = yarn_type->name##_texmap != 0;\
+        hash = tl_hash_bytes(hash, &textured, 1);
+#define TL_INT_PARAM(name) \
+        hash = tl_hash_bytes(hash, &yarn_type->name, 1);\
+        hash = tl_hash_bytes(hash, &yarn_type->name##_enabled, 1);
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_COLOR_PARAM
+#undef TL_INT_PARAM
     }
+    return hash;
+}
 
-    // ALG: 'COMPUTE u FROM y'
-    // Yarn coordinates have been transformed previously to the local
-    // coordinate system before hand by tl_get_pattern_data and available here 
-    // in the data parameter.
-    float u = data.u;
-    float x = data.x;
-    
-    // ALG: 'COMPUTE v USING (3)'
-    tlVector H = tlVector_normalize(tlVector_add(wi, wo)); //Bisector of wi, wo
-    float psi = tl_yarn_type_get_psi(params,data.yarn_type,
-		intersection_data.context);
-    float D;
-    {
-        float a = H.y*sinf(u) + H.z*cosf(u);
-        D = (H.y*cosf(u)-H.z*sinf(u))/(sqrtf(H.x*H.x + a*a))/
-			tanf(psi);
+static int tl_compare_yarn_type(const void *a, const void *b)
+{
+    uint32_t x = ((const tlPatternData*)a)->yarn_type;
+    uint32_t y = ((const tlPatternData*)b)->yarn_type;
+    return (x > y) - (x < y);
+}
+
+// A range of entries of the far-field table, built by one thread
+typedef struct
+{
+    const tlWeaveParameters *params;
+    void *context;
+    const tlPatternData *samples; //TL_FAR_FIELD_SAMPLES, sorted by yarn type
+    const float *rotation; //Rotation of each sample around the normal
+    tlFarFieldBRDF *far_field;
+    uint32_t first, end;
+} tlFarFieldJob;
+
+static void tl_far_field_build_entries(tlFarFieldJob *job)
+{
+    tlFarFieldBRDF *far_field = job->far_field;
+    uint32_t n_theta = far_field->theta_resolution;
+    uint32_t n_phi = far_field->phi_resolution;
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, job->params, job->context);
+    tlIntersectionData intersection_data = {0};
+    intersection_data.context = job->context;
+    for(uint32_t entry=job->first;entry<job->end;entry++){
+        uint32_t i = entry%n_theta;
+        uint32_t o = (entry/n_theta)%n_theta;
+        uint32_t p = entry/(n_theta*n_theta);
+        float theta_i = (float)i*0.5f*(float)M_PI/(float)(n_theta - 1);
+        float theta_o = (float)o*0.5f*(float)M_PI/(float)(n_theta - 1);
+        float phi_d = (float)p*2.f*(float)M_PI/(float)n_phi;
+        double sum[6] = {0.0};
+        for(uint32_t s=0;s<TL_FAR_FIELD_SAMPLES;s++){
+            tlPatternData data = job->samples[s];
+            float phi_o = job->rotation[s];
+            float phi_i = phi_o + phi_d;
+            intersection_data.wi_x = sinf(theta_i)*cosf(phi_i);
+            intersection_data.wi_y = sinf(theta_i)*sinf(phi_i);
+            intersection_data.wi_z = cosf(theta_i);
+            intersection_data.wo_x = sinf(theta_o)*cosf(phi_o);
+            intersection_data.wo_y = sinf(theta_o)*sinf(phi_o);
+            intersection_data.wo_z = cosf(theta_o);
+            cache.yarn_type = data.yarn_hit ? data.yarn_type : 0;
+            tlColor opacity = tl_opacity(data, &cache);
+            tlColor diffuse = tl_diffuse(intersection_data, data, &cache,
+                opacity);
+            tlColor specular = tl_specular(intersection_data, data, &cache);
+            sum[0] += diffuse.r; sum[1] += diffuse.g; sum[2] += diffuse.b;
+            sum[3] += specular.r; sum[4] += specular.g; sum[5] += specular.b;
+        }
+        double scale = 1.0/(double)TL_FAR_FIELD_SAMPLES;
+        far_field->diffuse[entry].r = (float)(sum[0]*scale);
+        far_field->diffuse[entry].g = (float)(sum[1]*scale);
+        far_field->diffuse[entry].b = (float)(sum[2]*scale);
+        far_field->specular[entry].r = (float)(sum[3]*scale);
+        far_field->specular[entry].g = (float)(sum[4]*scale);
+        far_field->specular[entry].b = (float)(sum[5]*scale);
     }
-    // NOTE(Peter): plus or minus on acos?
-    float specular_v = atan2f(-H.y*sinf(u) - H.z*cosf(u), H.x) + acosf(D);
-    
-    
-    float reflection = 0.f;
+}
 
-    // ALG: 'IF ABS(v) < pi/2'
-    if (fabsf(specular_v) < M_PI_2 && fabsf(D) < 1.f) {
-        
-        // TODO(Vidar): Clamp specular_v, do we need it?
-        // Make normal for highlights, uses u and specular_v
-        tlVector highlight_normal = tlVector_normalize(tlvector(sinf(specular_v),
-            sinf(u)*cosf(specular_v), cosf(u)*cosf(specular_v)));
+#ifndef TL_NO_THREADS
+#ifdef _WIN32
+static DWORD WINAPI tl_far_field_thread(LPVOID job)
+{
+    tl_far_field_build_entries((tlFarFieldJob*)job);
+    return 0;
+}
+#else
+static void *tl_far_field_thread(void *job)
+{
+    tl_far_field_build_entries((tlFarFieldJob*)job);
+    return 0;
+}
+#endif
+#endif
 
-        // Transform from angle to coordante on yarn surface.
-        // get specular_x, using irawans transformation.
-        float specular_x = specular_v/((float)M_PI_2);
-        // our transformation
-        //float specular_x = sinf(specular_v);
+#define TL_MAX_FAR_FIELD_THREADS 256
 
-        // Get neccessary yarn params for current type.
-        float delta_x = tl_yarn_type_get_delta_x(params,data.yarn_type,
-			intersection_data.context);
-        float umax;
-        if (data.ext_between_parallel){
-            // if current segment is an extension between two parallel yarns
-            // -> bend = 0
-            umax = 0.001f;
-        } else {
-            umax = tl_yarn_type_get_umax(params,data.yarn_type,
-                    intersection_data.context);
-        }
+static uint32_t tl_num_processors()
+{
+#if defined(TL_NO_THREADS)
+    return 1;
+#elif defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (uint32_t)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (uint32_t)n : 1;
+#endif
+}
 
-        // Clamp specular_x
-        specular_x = specular_x < 1.f - delta_x ? specular_x :
-            1.f - delta_x;
-        specular_x = specular_x > -1.f + delta_x ? specular_x :
-            -1.f + delta_x;
+void tl_prepare_far_field(tlWeaveParameters *params, void *context,
+    uint32_t num_threads)
+{
+    if(!params->prepare_id){
+        tl_prepare(params);
+    }
+    tl_free_far_field(params);
+    if(!tl_has_pattern(params) || !params->resolved_yarn_types
+            || params->num_yarn_types == 0){
+        return;
+    }
+    tlFarFieldBRDF *far_field = (tlFarFieldBRDF*)calloc(1,
+        sizeof(tlFarFieldBRDF));
+    uint32_t n_theta = TL_FAR_FIELD_THETA_RESOLUTION;
+    uint32_t n_phi = TL_FAR_FIELD_PHI_RESOLUTION;
+    uint32_t num_entries = n_theta*n_theta*n_phi;
+    tlPatternData *samples = (tlPatternData*)calloc(TL_FAR_FIELD_SAMPLES,
+        sizeof(tlPatternData));
+    float *rotation = (float*)malloc(TL_FAR_FIELD_SAMPLES*sizeof(float));
+    if(far_field){
+        far_field->diffuse = (tlColor*)malloc(num_entries*sizeof(tlColor));
+        far_field->specular = (tlColor*)malloc(num_entries*sizeof(tlColor));
+    }
+    if(!far_field || !far_field->diffuse || !far_field->specular || !samples
+            || !rotation){
+        params->far_field = far_field;
+        tl_free_far_field(params);
+        free(samples);
+        free(rotation);
+        return;
+    }
+    far_field->hash = tl_far_field_hash(params);
+    far_field->theta_resolution = n_theta;
+    far_field->phi_resolution = n_phi;
+
+    // The points are spread over one repeat of the stored pattern by a
+    // jittered grid, and their rotations by the golden ratio, so that the
+    // two are not correlated
+    // The grid is n_u by n_v, with n_u the largest divisor of the number of
+    // samples which is at most its square root, so that every row is full
+    // and all points have the same weight
+    uint32_t n_u = (uint32_t)sqrt((double)TL_FAR_FIELD_SAMPLES);
+    while(TL_FAR_FIELD_SAMPLES%n_u != 0){
+        n_u--;
+    }
+    uint32_t n_v = TL_FAR_FIELD_SAMPLES/n_u;
+    float repeat_u = 1.f/tl_pattern_repeats(params->pattern_repeats_x);
+    float repeat_v = 1.f/tl_pattern_repeats(params->pattern_repeats_y);
+    tlIntersectionData intersection_data = {0};
+    intersection_data.context = context;
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, context);
+    double opacity[3] = {0.0};
+    for(uint32_t s=0;s<TL_FAR_FIELD_SAMPLES;s++){
+        uint32_t i = s%n_u, j = s/n_u;
+        float u = ((float)i + sample_TEA_single(i, j, 8))/(float)n_u*repeat_u;
+        float v = ((float)j + sample_TEA_single(j, ~i, 8))/(float)n_v*repeat_v;
+        samples[s] = tl_pattern_data_at(u, v, intersection_data, params,
+            &cache, 1);
+        if(!samples[s].yarn_hit){
+            samples[s].yarn_type = 0;
+        }
+        cache.yarn_type = samples[s].yarn_type;
+        tlColor o = tl_opacity(samples[s], &cache);
+        opacity[0] += o.r; opacity[1] += o.g; opacity[2] += o.b;
+        double golden = 0.6180339887498949*(double)s;
+        rotation[s] = (float)(2.0*M_PI*(golden - floor(golden)));
+    }
+    far_field->opacity.r = (float)(opacity[0]/TL_FAR_FIELD_SAMPLES);
+    far_field->opacity.g = (float)(opacity[1]/TL_FAR_FIELD_SAMPLES);
+    far_field->opacity.b = (float)(opacity[2]/TL_FAR_FIELD_SAMPLES);
+    // Sorted so that the yarn parameter cache of each thread
+    // rarely has to evaluate the texmaps again. The rotations are
+    // independent of the points, so they are not sorted along.
+    qsort(samples, TL_FAR_FIELD_SAMPLES, sizeof(tlPatternData),
+        tl_compare_yarn_type);
+
+    if(num_threads == 0){
+        num_threads = tl_num_processors();
+    }
+    if(num_threads > TL_MAX_FAR_FIELD_THREADS){
+        num_threads = TL_MAX_FAR_FIELD_THREADS;
+    }
+    if(num_threads > num_entries){
+        num_threads = num_entries;
+    }
+    tlFarFieldJob jobs[TL_MAX_FAR_FIELD_THREADS];
+    for(uint32_t t=0;t<num_threads;t++){
+        jobs[t].params = params;
+        jobs[t].context = context;
+        jobs[t].samples = samples;
+        jobs[t].rotation = rotation;
+        jobs[t].far_field = far_field;
+        jobs[t].first = (uint32_t)((uint64_t)num_entries*t/num_threads);
+        jobs[t].end = (uint32_t)((uint64_t)num_entries*(t + 1)/num_threads);
+    }
+#ifdef TL_NO_THREADS
+    for(uint32_t t=0;t<num_threads;t++){
+        tl_far_field_build_entries(&jobs[t]);
+    }
+#else
+    // The calling thread builds the first range. If a thread
+    // can not be started, its range is built here as well.
+#ifdef _WIN32
+    HANDLE threads[TL_MAX_FAR_FIELD_THREADS];
+    for(uint32_t t=1;t<num_threads;t++){
+        threads[t] = CreateThread(0, 0, tl_far_field_thread, &jobs[t], 0, 0);
+    }
+    tl_far_field_build_entries(&jobs[0]);
+    for(uint32_t t=1;t<num_threads;t++){
+        if(threads[t]){
+            WaitForSingleObject(threads[t], INFINITE);
+            CloseHandle(threads[t]);
+        } else{
+            tl_far_field_build_entries(&jobs[t]);
+        }
+    }
+#else
+    pthread_t threads[TL_MAX_FAR_FIELD_THREADS];
+    uint8_t started[TL_MAX_FAR_FIELD_THREADS];
+    for(uint32_t t=1;t<num_threads;t++){
+        started[t] = pthread_create(&threads[t], 0, tl_far_field_thread,
+            &jobs[t]) == 0;
+    }
+    tl_far_field_build_entries(&jobs[0]);
+    for(uint32_t t=1;t<num_threads;t++){
+        if(started[t]){
+            pthread_join(threads[t], 0);
+        } else{
+            tl_far_field_build_entries(&jobs[t]);
+        }
+    }
+#endif
+#endif
+    free(samples);
+    free(rotation);
+    params->far_field = far_field;
+}
 
-        // Check that we are in the highlight width area.
-        // This takes the role of Chi in the irawan paper.
-        if (fabsf(specular_x - x) < delta_x) {
-            float rho = tl_yarn_type_get_rho(params, data.yarn_type,
-                intersection_data.context);
+tlEvalResult tl_eval_far_field(tlIntersectionData intersection_data,
+        const tlWeaveParameters *params, uint32_t flags)
+{
+    const tlFarFieldBRDF *far_field = params->far_field;
+    if(!far_field){
+        return tl_eval_all(intersection_data, params, flags);
+    }
+    tlEvalResult ret;
+    tlColor black = {0.f,0.f,0.f};
+    memset(&ret.pattern_data, 0, sizeof(ret.pattern_data));
+    ret.diffuse = black;
+    ret.specular = black;
+    ret.opacity = black;
+    if(flags & (TL_EVAL_OPACITY | TL_EVAL_DIFFUSE)){
+        ret.opacity = far_field->opacity;
+    }
+    if(!(flags & (TL_EVAL_DIFFUSE | TL_EVAL_SPECULAR))){
+        return ret;
+    }
+    uint32_t n_theta = far_field->theta_resolution;
+    uint32_t n_phi = far_field->phi_resolution;
+    float wi_z = intersection_data.wi_z, wo_z = intersection_data.wo_z;
+    wi_z = wi_z < -1.f ? -1.f : (wi_z > 1.f ? 1.f : wi_z);
+    wo_z = wo_z < -1.f ? -1.f : (wo_z > 1.f ? 1.f : wo_z);
+    float phi_d = atan2f(intersection_data.wi_y, intersection_data.wi_x)
+        - atan2f(intersection_data.wo_y, intersection_data.wo_x);
+    // Directions below the horizon use the last row
+    float coord[3] = {
+        acosf(wi_z)*2.f/(float)M_PI*(float)(n_theta - 1),
+        acosf(wo_z)*2.f/(float)M_PI*(float)(n_theta - 1),
+        phi_d*0.5f/(float)M_PI*(float)n_phi
+    };
+    uint32_t index[3][2];
+    float weight[3];
+    for(int k=0;k<3;k++){
+        float c = coord[k];
+        if(k < 2){
+            float max = (float)(n_theta - 1);
+            c = c > 0.f ? (c < max ? c : max) : 0.f;
+        }
+        float f = floorf(c);
+        weight[k] = c - f;
+        int32_t i0 = (int32_t)f;
+        if(k < 2){
+            index[k][0] = (uint32_t)i0;
+            index[k][1] = (uint32_t)i0 + 1 < n_theta ? (uint32_t)i0 + 1
+                : (uint32_t)i0;
+        } else{
+            i0 %= (int32_t)n_phi;
+            i0 = i0 < 0 ? i0 + (int32_t)n_phi : i0;
+            index[k][0] = (uint32_t)i0;
+            index[k][1] = ((uint32_t)i0 + 1)%n_phi;
+        }
+    }
+    for(int corner=0;corner<8;corner++){
+        int a = corner&1, b = (corner>>1)&1, c = corner>>2;
+        float w = (a ? weight[0] : 1.f - weight[0])
+            *(b ? weight[1] : 1.f - weight[1])
+            *(c ? weight[2] : 1.f - weight[2]);
+        uint32_t entry = index[0][a] + index[1][b]*n_theta
+            + index[2][c]*n_theta*n_theta;
+        if(flags & TL_EVAL_DIFFUSE){
+            ret.diffuse.r += w*far_field->diffuse[entry].r;
+            ret.diffuse.g += w*far_field->diffuse[entry].g;
+            ret.diffuse.b += w*far_field->diffuse[entry].b;
+        }
+        if(flags & TL_EVAL_SPECULAR){
+            ret.specular.r += w*far_field->specular[entry].r;
+            ret.specular.g += w*far_field->specular[entry].g;
+            ret.specular.b += w*far_field->specular[entry].b;
+        }
+    }
+    return ret;
+}
 
-            // ALG: 'COMPUTE G_v USING (5)'
-            float a = 1.f; // radius of yarn
-            float R = 1.f / (sin(umax)); // radius of curvature
-            float Gv = a * (R + a * cosf(specular_v)) / (
-                tlVector_magnitude(tlVector_add(wi, wo)) *
-                tlVector_dot(highlight_normal, H) * fabsf(sinf(psi)));
+typedef struct
+{
+    int32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t theta_resolution, phi_resolution;
+    uint32_t padding;
+    uint64_t hash;
+    tlColor opacity;
+}tlFarFieldHeader;
+
+unsigned char *tl_far_field_to_blob(const tlWeaveParameters *params,
+    long *ret_len)
+{
+    const tlFarFieldBRDF *far_field = params->far_field;
+    *ret_len = 0;
+    if(!far_field){
+        return 0;
+    }
+    size_t num_entries = (size_t)far_field->theta_resolution
+        *far_field->theta_resolution*far_field->phi_resolution;
+    size_t table_size = num_entries*sizeof(tlColor);
+    size_t len = sizeof(tlFarFieldHeader) + 2*table_size;
+    unsigned char *data = (unsigned char*)malloc(len);
+    if(!data){
+        return 0;
+    }
+    tlFarFieldHeader header;
+    memset(&header, 0, sizeof(header));
+    header.version = TL_FAR_FIELD_VERSION;
+    header.byte_order = TL_FAR_FIELD_BYTE_ORDER;
+    header.header_size = sizeof(tlFarFieldHeader);
+    header.theta_resolution = far_field->theta_resolution;
+    header.phi_resolution = far_field->phi_resolution;
+    header.hash = far_field->hash;
+    header.opacity = far_field->opacity;
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), far_field->diffuse, table_size);
+    memcpy(data + sizeof(header) + table_size, far_field->specular,
+        table_size);
+    *ret_len = (long)len;
+    return data;
+}
 
-            // ALG: 'COMPUTE f_c USING (7)'
-            float fc;
-            {
-				float tx = -cosf(specular_v)*sinf(psi);
-				float ty = cosf(u)*cosf(psi) + sinf(u)*sinf(specular_v)*sinf(psi);
-				float tz = -sinf(u)*cosf(psi) + cosf(u)*sinf(specular_v)*sinf(psi);
+int tl_far_field_from_blob(tlWeaveParameters *params,
+    const unsigned char *data, long len, const char **error)
+{
+    tlFarFieldHeader header;
+    if(!data || len < (long)sizeof(header)){
+        *error = "Far-field blob is too short";
+        return 0;
+    }
+    memcpy(&header, data, sizeof(header));
+    if(header.version != TL_FAR_FIELD_VERSION
+            || header.byte_order != TL_FAR_FIELD_BYTE_ORDER
+            || header.header_size != sizeof(tlFarFieldHeader)){
+        *error = "Far-field blob was written by an incompatible build";
+        return 0;
+    }
+    if(header.hash != tl_far_field_hash(params)
+            || header.theta_resolution != TL_FAR_FIELD_THETA_RESOLUTION
+            || header.phi_resolution != TL_FAR_FIELD_PHI_RESOLUTION){
+        *error = "Far-field blob was built from other parameters";
+        return 0;
+    }
+    size_t num_entries = (size_t)header.theta_resolution
+        *header.theta_resolution*header.phi_resolution;
+    size_t table_size = num_entries*sizeof(tlColor);
+    if((size_t)len != sizeof(header) + 2*table_size){
+        *error = "Far-field blob has the wrong size";
+        return 0;
+    }
+    tlFarFieldBRDF *far_field = (tlFarFieldBRDF*)calloc(1,
+        sizeof(tlFarFieldBRDF));
+    if(far_field){
+        far_field->diffuse = (tlColor*)malloc(table_size);
+        far_field->specular = (tlColor*)malloc(table_size);
+    }
+    tl_free_far_field(params);
+    params->far_field = far_field;
+    if(!far_field || !far_field->diffuse || !far_field->specular){
+        tl_free_far_field(params);
+        *error = "Out of memory";
+        return 0;
+    }
+    far_field->hash = header.hash;
+    far_field->theta_resolution = header.theta_resolution;
+    far_field->phi_resolution = header.phi_resolution;
+    far_field->opacity = header.opacity;
+    memcpy(far_field->diffuse, data + sizeof(header), table_size);
+    memcpy(far_field->specular, data + sizeof(header) + table_size,
+        table_size);
+    return 1;
+}
 
-				tlVector tvec = tlvector(tx,ty,tz);
-				tlVector svec = tlVector_normalize(tlVector_cross(tvec, highlight_normal));
-				tlVector rvec = tlVector_normalize(tlVector_cross(tvec, svec));
+// -- Importance sampling -- //
 
-				float wos = tlVector_dot(wo, svec);
-				float wor = tlVector_dot(wo, rvec);
+// The band of fiber angles which is sampled is widened by this
+// much in each direction, so that the narrowest highlights are covered
+#define TL_SPECULAR_SAMPLING_MIN_WIDTH 0.02f
 
-				float wis = tlVector_dot(wi, svec);
-				float wir = tlVector_dot(wi, rvec);
+// The fiber at the shading point, in shading space, together with two
+// vectors spanning the plane orthogonal to it, and the angle between the
+// fiber and the highlight directions which is sampled, for wo in shading
+// space. Returns 0 if there is no highlight to sample.
+typedef struct
+{
+    tlVector t, s, r;
+    float theta_min, theta_max;
+    float rho;
+} tlSpecularLobe;
 
-				float cos_x = (wis*wos + wir*wor)/sqrtf((wis*wis+wir*wir)*(wos*wos+wor*wor));
-				fc = wrapped_cauchy(cos_x, rho);
-			}
+static int tl_specular_lobe(tlVector wo, tlPatternData data,
+    tlYarnParameterCache *cache, tlSpecularLobe *lobe)
+{
+    if(!tl_has_pattern(cache->params) || !data.yarn_hit){
+        return 0;
+    }
+    lobe->rho = tl_yarn_cache_get_rho(cache);
+    if (lobe->rho > 0.999f) {
+        // wrapped_cauchy is 0 for these, so is the specular
+        return 0;
+    }
+    float psi = tl_yarn_cache_get_psi(cache);
+    float delta_x = tl_yarn_cache_get_delta_x(cache);
+    float umax = data.ext_between_parallel ? 0.0001f :
+        tl_yarn_cache_get_umax(cache);
+    if (psi <= 0.001f) {
+        //Filament yarn
+        psi = 0.f;
+    }
 
-            // ALG: 'COMPUTE A USING (8)'
-            float widotn = tlVector_dot(wi, highlight_normal);
-            float wodotn = tlVector_dot(wo, highlight_normal);
-            widotn = (widotn < 0.f) ? 0.f : widotn;   
-            wodotn = (wodotn < 0.f) ? 0.f : wodotn;   
-            //TODO(Vidar): This is where we get the NAN
-            float A = 0.f;
-            if(widotn > 0.f && wodotn > 0.f){
-                A = 1.f / (4.0f * (float)M_PI) * (widotn*wodotn)/(widotn + wodotn);
-            }
+    // Same as the fiber tangent in tl_staple_specular, at the shading point
+    float sin_u, cos_u, sin_v, cos_v, sin_psi, cos_psi;
+    tl_sincosf(data.u, &sin_u, &cos_u);
+    tl_sincosf(data.v, &sin_v, &cos_v);
+    tl_sincosf(psi, &sin_psi, &cos_psi);
+
+    // The highlight moves across the yarn by delta_x as the fiber turns by
+    // alpha, along v for staple yarns and along u for filament yarns. The
+    // reflected directions turn twice as much.
+    float alpha = psi == 0.f ? delta_x*umax :
+        delta_x*(float)M_PI_2*fabsf(sin_psi);
+    float tx = -cos_v*sin_psi;
+    float ty = cos_u*cos_psi + sin_u*sin_v*sin_psi;
+    float tz = -sin_u*cos_psi + cos_u*sin_v*sin_psi;
+    if(!data.warp_above){
+        float tmp = tx;
+        tx  = ty;
+        ty  = -tmp;
+    }
+    lobe->t = tlVector_normalize(tlvector(tx,ty,tz));
+    tlVector s = tlVector_cross(lobe->t, tlvector(0.f,0.f,1.f));
+    if(tlVector_dot(s,s) < 1e-8f){
+        s = tlVector_cross(lobe->t, tlvector(1.f,0.f,0.f));
+    }
+    lobe->s = tlVector_normalize(s);
+    lobe->r = tlVector_cross(lobe->t, lobe->s);
+
+    // Angle between wo and the plane orthogonal to the fiber, the highlights
+    // are centered on the mirrored angle
+    float theta_c = -asinf(tl_clamp(tlVector_dot(wo, lobe->t), -1.f, 1.f));
+    float half_width = 2.f*alpha + TL_SPECULAR_SAMPLING_MIN_WIDTH;
+    lobe->theta_min = theta_c - half_width;
+    lobe->theta_max = theta_c + half_width;
+    lobe->theta_min = lobe->theta_min > -(float)M_PI_2 ? lobe->theta_min :
+        -(float)M_PI_2;
+    lobe->theta_max = lobe->theta_max < (float)M_PI_2 ? lobe->theta_max :
+        (float)M_PI_2;
+    return 1;
+}
 
-            // ALG: 'CLAMP x to range +/- (w-delta_x)/2'
-            // ALG: 'COMPUTE X USING (12)'
-            // We skip calculation of clamping function CHI. This is done 
-            // by the if clause above.
+static float tl_specular_lobe_pdf(const tlSpecularLobe *lobe, tlVector wi,
+    tlVector wo)
+{
+    if(wi.z <= 0.f){
+        return 0.f;
+    }
+    float theta = asinf(tl_clamp(tlVector_dot(wi, lobe->t), -1.f, 1.f));
+    if(theta < lobe->theta_min || theta > lobe->theta_max){
+        return 0.f;
+    }
+    float wis = tlVector_dot(wi, lobe->s);
+    float wir = tlVector_dot(wi, lobe->r);
+    float wos = tlVector_dot(wo, lobe->s);
+    float wor = tlVector_dot(wo, lobe->r);
+    float len = sqrtf((wis*wis+wir*wir)*(wos*wos+wor*wor));
+    float cos_x = len > 0.f ? (wis*wos + wir*wor)/len : 1.f;
+    // Solid angle is cos(theta) dtheta dphi
+    return wrapped_cauchy(cos_x, lobe->rho)
+        / ((lobe->theta_max - lobe->theta_min)*cosf(theta));
+}
 
-            // ALG: 'COMPUTE BTF T USING (13)'
-            float w = 2.f; //omega
-            reflection = 2.f*w*umax*fc*Gv*A/delta_x; // The specular component!
-        }
+tlVector tl_sample_specular_cached(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache, float rnd_x,
+    float rnd_y, float *pdf)
+{
+    tlVector wo = tlvector(intersection_data.wo_x, intersection_data.wo_y,
+        intersection_data.wo_z);
+    cache->yarn_type = data.yarn_type;
+    tlSpecularLobe lobe;
+    *pdf = 0.f;
+    if(!tl_specular_lobe(wo, data, cache, &lobe)){
+        return tlvector(0.f,0.f,1.f);
     }
-    return reflection;
+
+    float theta = lobe.theta_min + rnd_x*(lobe.theta_max - lobe.theta_min);
+    // Invert the cdf of the wrapped Cauchy distribution
+    float phi_o = tl_atan2f(tlVector_dot(wo, lobe.r),
+        tlVector_dot(wo, lobe.s));
+    float phi = phi_o + 2.f*atanf((1.f - lobe.rho)/(1.f + lobe.rho)
+        *tanf((float)M_PI*(rnd_y - 0.5f)));
+
+    float sin_theta, cos_theta, sin_phi, cos_phi;
+    tl_sincosf(theta, &sin_theta, &cos_theta);
+    tl_sincosf(phi, &sin_phi, &cos_phi);
+    tlVector wi = tlVector_add(tlVector_scale(sin_theta, lobe.t),
+        tlVector_add(tlVector_scale(cos_theta*cos_phi, lobe.s),
+        tlVector_scale(cos_theta*sin_phi, lobe.r)));
+    *pdf = tl_specular_lobe_pdf(&lobe, wi, wo);
+    return wi;
 }
 
-// Evaluates the specular component given the yarn properties and the 
-// intersection data under the assumption that we have filament yarn (psi = 0).
-// Algorithm 4 from "Specular Reflection from Woven Cloth", P. Irawan,
-// S. Marschner, 2012.
-float tl_eval_filament_specular(tlIntersectionData intersection_data,
-    tlPatternData data, const tlWeaveParameters *params)
+float tl_pdf_specular_cached(tlIntersectionData intersection_data,
+    tlPatternData data, tlYarnParameterCache *cache)
 {
-    // The algorithm in this function assumes yarn local coordiantes.
-    // That is, y-axis always runs along yarn segment and x-axis runs across, 
-    // regardless if yarn is warp or weft.
-    
-    // To ensure yarn local coordinates, y-components of in and out directions,
-    // wi and wo (in global coordinate space) are swapped with their respective
-    // y-componenets if yarn_segment is weft.
     tlVector wi = tlvector(intersection_data.wi_x, intersection_data.wi_y,
         intersection_data.wi_z);
     tlVector wo = tlvector(intersection_data.wo_x, intersection_data.wo_y,
         intersection_data.wo_z);
-    if(!data.warp_above){
-        float tmp2 = wi.x;
-        float tmp3 = wo.x;
-        wi.x = -wi.y; wi.y = tmp2;
-        wo.x = -wo.y; wo.y = tmp3;
+    cache->yarn_type = data.yarn_type;
+    tlSpecularLobe lobe;
+    if(!tl_specular_lobe(wo, data, cache, &lobe)){
+        return 0.f;
     }
+    return tl_specular_lobe_pdf(&lobe, wi, wo);
+}
 
-    // ALG: 'COMPUTE v FROM x'
-    // Yarn coordinates have been transformed previously to the local
-    // coordinate system by tl_get_pattern_data and available here 
-    // in the data parameter.
-    float v = data.v;
-    float y = data.y;
-    
-    // ALG: 'COMPUTE u USING (4)'
-    tlVector H = tlVector_normalize(tlVector_add(wi, wo)); //Bisector of wi, wo
-    float specular_u = atan2f(-H.z, H.y) + (float)M_PI_2; // plus or minus?
-    //float specular_u = atan2f(H.y, H.z);// + (float)M_PI_2; // plus or minus?
-
-    float umax;
-    if (data.ext_between_parallel == 1){
-        // if current segment is an extension between two parallel yarns
-        // -> bend = 0
-        umax = 0.0001f;
-    } else {
-        umax = tl_yarn_type_get_umax(params,data.yarn_type,
-                intersection_data.context);
+float tl_specular_lobe_probability_cached(
+    tlIntersectionData intersection_data, tlPatternData data,
+    tlYarnParameterCache *cache)
+{
+    if(!tl_has_pattern(cache->params) || !data.yarn_hit){
+        return 0.f;
     }
-    
-    float reflection = 0.f;
-    
-    // ALG: 'IF ABS(u) < umax'
-    if (fabsf(specular_u) < umax){
-       
-        // Make normal for highlights, uses v and specular_u
-        tlVector highlight_normal = tlVector_normalize(tlvector(sinf(v),
-            sinf(specular_u)*cosf(v), cosf(specular_u)*cosf(v)));
-
-        // Make tangent for highlights, uses v and specular_u
-        tlVector highlight_tangent = tlVector_normalize(tlvector(0.f, 
-            cosf(specular_u), -sinf(specular_u)));
-
-        // Transform from angle to coordante on yarn surface.
-        // get specular_y, using irawans transformation.
-        float specular_y = specular_u/umax;
-        // our transformation
-        //float specular_y = sinf(specular_u)/sinf(m_umax);
-
-        float delta_x = tl_yarn_type_get_delta_x(params, data.yarn_type,
-			intersection_data.context);
-        
-        // Clamp specular_y
-        specular_y = specular_y < 1.f - delta_x ? specular_y :
-            1.f - delta_x;
-        specular_y = specular_y > -1.f + delta_x ? specular_y :
-            -1.f + delta_x;
-
-        // Check that we are in the highlight width area.
-        // This takes the role of Chi in the irawan paper.
-        if (fabsf(specular_y - y) < delta_x) {
-            // ALG: 'COMPUTE G_u USING (6)'
-            // 'We can not use u as the parameter for filament yarns. 
-            // We integrate over u for staple and v for filament.' 
-            // That is, we need Gv for staple and Gu for filament.
-            float a = 1.f; //radius of yarn
-            float R = 1.f/(sin(umax)); //radius of curvature
-            float Gu = a*(R + a*cosf(v)) / (
-                tlVector_magnitude(tlVector_add(wi,wo)) *
-                fabsf((tlVector_cross(highlight_tangent,H).x)) );
+    cache->yarn_type = data.yarn_type;
+    // Strengths as in tl_diffuse and tl_specular, without the directional
+    // parts
+    tlColor specular_color = tl_yarn_cache_get_specular_color(cache);
+    float specular = specular_color.r > specular_color.g ?
+        specular_color.r : specular_color.g;
+    specular = specular_color.b > specular ? specular_color.b : specular;
+    specular *= tl_yarn_cache_get_specular_amount(cache);
+    tlColor color = tl_yarn_cache_get_color(cache);
+    float diffuse = color.r > color.g ? color.r : color.g;
+    diffuse = color.b > diffuse ? color.b : diffuse;
+    diffuse *= tl_yarn_cache_get_color_amount(cache)*(1.f - specular);
+    if(specular <= 0.f){
+        return 0.f;
+    }
+    if(diffuse <= 0.f){
+        return 1.f;
+    }
+    return specular/(specular + diffuse);
+}
 
-            float rho = tl_yarn_type_get_rho(params, data.yarn_type,
-				intersection_data.context);
+tlVector tl_sample_specular(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params, float rnd_x,
+    float rnd_y, float *pdf)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    return tl_sample_specular_cached(intersection_data, data, &cache, rnd_x,
+        rnd_y, pdf);
+}
 
-            // ALG: 'COMPUTE f_c USING (7)'
-            float fc;
-            {
-				float tx = 0.f;
-				float ty = cosf(specular_u);
-				float tz = -sinf(specular_u);
+float tl_pdf_specular(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    return tl_pdf_specular_cached(intersection_data, data, &cache);
+}
 
-				tlVector tvec = tlvector(tx,ty,tz);
-				tlVector svec = tlVector_normalize(tlVector_cross(tvec, highlight_normal));
-				tlVector rvec = tlVector_normalize(tlVector_cross(tvec, svec));
+float tl_specular_lobe_probability(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params)
+{
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache, params, intersection_data.context);
+    return tl_specular_lobe_probability_cached(intersection_data, data,
+        &cache);
+}
 
-				float wos = tlVector_dot(wo, svec);
-				float wor = tlVector_dot(wo, rvec);
+// -- Batch shading -- //
 
-				float wis = tlVector_dot(wi, svec);
-				float wir = tlVector_dot(wi, rvec);
+// Per-lane inputs for the batch kernels. These are filled in one lane at a
+// time by tl_batch_gather_lane, which does the pattern lookup and the
+// parameter/texmap evaluation, and then processed TL_SIMD_WIDTH lanes at a
+// time. wi and wo are in yarn local coordinates.
+typedef struct
+{
+    float wi_x[TL_SIMD_WIDTH], wi_y[TL_SIMD_WIDTH], wi_z[TL_SIMD_WIDTH];
+    float wo_x[TL_SIMD_WIDTH], wo_y[TL_SIMD_WIDTH], wo_z[TL_SIMD_WIDTH];
+    float u[TL_SIMD_WIDTH], v[TL_SIMD_WIDTH];
+    float x[TL_SIMD_WIDTH], y[TL_SIMD_WIDTH];
+    float psi[TL_SIMD_WIDTH], umax[TL_SIMD_WIDTH];
+    float delta_x[TL_SIMD_WIDTH], rho[TL_SIMD_WIDTH];
+    float noise[TL_SIMD_WIDTH], specular_amount[TL_SIMD_WIDTH];
+    float specular_r[TL_SIMD_WIDTH], specular_g[TL_SIMD_WIDTH];
+    float specular_b[TL_SIMD_WIDTH];
+    float color_r[TL_SIMD_WIDTH], color_g[TL_SIMD_WIDTH];
+    float color_b[TL_SIMD_WIDTH], color_amount[TL_SIMD_WIDTH];
+    float opacity_r[TL_SIMD_WIDTH], opacity_g[TL_SIMD_WIDTH];
+    float opacity_b[TL_SIMD_WIDTH], opacity_amount[TL_SIMD_WIDTH];
+    float staple[TL_SIMD_WIDTH], filament[TL_SIMD_WIDTH]; //Lane masks
+    uint8_t active[TL_SIMD_WIDTH];
+} tlBatchLanes;
+
+static void tl_batch_intersection(const tlIntersectionBatch *batch,
+    uint32_t i, tlIntersectionData *intersection_data)
+{
+    intersection_data->uv_x = batch->uv_x[i];
+    intersection_data->uv_y = batch->uv_y[i];
+    intersection_data->wi_x = batch->wi_x[i];
+    intersection_data->wi_y = batch->wi_y[i];
+    intersection_data->wi_z = batch->wi_z[i];
+    intersection_data->wo_x = batch->wo_x[i];
+    intersection_data->wo_y = batch->wo_y[i];
+    intersection_data->wo_z = batch->wo_z[i];
+    intersection_data->context = batch->context ? batch->context[i] : 0;
+    if(batch->du_dx){
+        intersection_data->du_dx = batch->du_dx[i];
+        intersection_data->dv_dx = batch->dv_dx[i];
+        intersection_data->du_dy = batch->du_dy[i];
+        intersection_data->dv_dy = batch->dv_dy[i];
+    } else{
+        intersection_data->du_dx = 0.f;
+        intersection_data->dv_dx = 0.f;
+        intersection_data->du_dy = 0.f;
+        intersection_data->dv_dy = 0.f;
+    }
+}
 
-				float cos_x = (wis*wos + wir*wor)/sqrtf((wis*wis+wir*wir)*(wos*wos+wor*wor));
-				fc = wrapped_cauchy(cos_x, rho);
-			}
+// Fills a lane with harmless values, so that inactive lanes do not produce
+// NaNs or denormals in the kernels.
+static void tl_batch_clear_lane(tlBatchLanes *lanes, int i)
+{
+    lanes->wi_x[i] = 0.f; lanes->wi_y[i] = 0.f; lanes->wi_z[i] = 1.f;
+    lanes->wo_x[i] = 0.f; lanes->wo_y[i] = 0.f; lanes->wo_z[i] = 1.f;
+    lanes->u[i] = 0.f; lanes->v[i] = 0.f;
+    lanes->x[i] = 0.f; lanes->y[i] = 0.f;
+    lanes->psi[i] = 0.5f; lanes->umax[i] = 0.5f;
+    lanes->delta_x[i] = 0.3f; lanes->rho[i] = 0.5f;
+    lanes->noise[i] = 1.f; lanes->specular_amount[i] = 0.f;
+    lanes->specular_r[i] = 0.f; lanes->specular_g[i] = 0.f;
+    lanes->specular_b[i] = 0.f;
+    lanes->color_r[i] = 0.f; lanes->color_g[i] = 0.f;
+    lanes->color_b[i] = 0.f; lanes->color_amount[i] = 0.f;
+    lanes->opacity_r[i] = 0.f; lanes->opacity_g[i] = 0.f;
+    lanes->opacity_b[i] = 0.f; lanes->opacity_amount[i] = 0.f;
+    lanes->staple[i] = tl_lane_mask(0);
+    lanes->filament[i] = tl_lane_mask(0);
+    lanes->active[i] = 0;
+}
 
-            // ALG: 'COMPUTE A USING (8)'
-            float widotn = tlVector_dot(wi, highlight_normal);
-            float wodotn = tlVector_dot(wo, highlight_normal);
-            widotn = (widotn < 0.f) ? 0.f : widotn;   
-            wodotn = (wodotn < 0.f) ? 0.f : wodotn;   
-            float A = 0.f;
-            if(widotn > 0.f && wodotn > 0.f){
-                A = 1.f / (4.0f*(float)M_PI) * (widotn*wodotn)/(widotn+wodotn);
-                //TODO(Peter): Explain from where the 1/4*PI factor comes from
-            }
+// Evaluates everything in tl_eval_specular and tl_eval_diffuse which is not
+// part of the vectorized kernels.
+static void tl_batch_gather_lane(tlBatchLanes *lanes, int i,
+    const tlIntersectionData *intersection_data, const tlPatternData *data,
+    tlYarnParameterCache *cache, int diffuse)
+{
+    tl_batch_clear_lane(lanes,i);
+    lanes->active[i] = 1;
+    int specular = tl_has_pattern(cache->params) && data->yarn_hit;
+    if(specular || diffuse){
+        tlColor specular_color = tl_yarn_cache_get_specular_color(cache);
+        lanes->specular_r[i] = specular_color.r;
+        lanes->specular_g[i] = specular_color.g;
+        lanes->specular_b[i] = specular_color.b;
+        lanes->specular_amount[i] = tl_yarn_cache_get_specular_amount(cache);
+    }
+    if(diffuse){
+        uint32_t yarn_type = data->yarn_hit ? cache->yarn_type : 0;
+        tlColor color = tl_yarn_cache_get_type_color(cache,yarn_type);
+        tlColor opacity = tl_yarn_cache_get_type_opacity(cache,yarn_type);
+        lanes->color_r[i] = color.r;
+        lanes->color_g[i] = color.g;
+        lanes->color_b[i] = color.b;
+        lanes->color_amount[i] = tl_yarn_cache_get_color_amount(cache);
+        lanes->opacity_r[i] = opacity.r;
+        lanes->opacity_g[i] = opacity.g;
+        lanes->opacity_b[i] = opacity.b;
+        lanes->opacity_amount[i] = tl_yarn_cache_get_opacity_amount(cache);
+        lanes->wi_z[i] = intersection_data->wi_z;
+    }
+    if(!specular){
+        return;
+    }
 
-            // ALG: 'COMPUTE As USING (9)'
-            //TODO(Peter): Implement As, -- smoothes the dissapeares of the
-            // higlight near the ends. Described in (9).
-            
-            // ALG: 'CLAMP y to range +/- (l-delta_y)/2'
-            // ALG: 'COMPUTE X USING (12)'
-            // We skip calculation of clamping function Chi. This is done 
-            // by the if clause above.
-            
-            // ALG: 'COMPUTE BTF T USING (13)'
-            float w = 2.f;
-            reflection = 2.f*w*umax*Gu*fc*A/delta_x; // The specular component!
-        }
+    // Same swap as in tl_eval_staple_specular/tl_eval_filament_specular
+    float wi_x = intersection_data->wi_x, wi_y = intersection_data->wi_y;
+    float wo_x = intersection_data->wo_x, wo_y = intersection_data->wo_y;
+    if(!data->warp_above){
+        float tmp2 = wi_x;
+        float tmp3 = wo_x;
+        wi_x = -wi_y; wi_y = tmp2;
+        wo_x = -wo_y; wo_y = tmp3;
+    }
+    lanes->wi_x[i] = wi_x; lanes->wi_y[i] = wi_y;
+    lanes->wi_z[i] = intersection_data->wi_z;
+    lanes->wo_x[i] = wo_x; lanes->wo_y[i] = wo_y;
+    lanes->wo_z[i] = intersection_data->wo_z;
+    lanes->u[i] = data->u; lanes->v[i] = data->v;
+    lanes->x[i] = data->x; lanes->y[i] = data->y;
+
+    float psi = tl_yarn_cache_get_psi(cache);
+    int filament = psi <= 0.001f;
+    lanes->psi[i] = psi;
+    lanes->staple[i] = tl_lane_mask(!filament);
+    lanes->filament[i] = tl_lane_mask(filament);
+    TL_STATS_ADD(staple_specular,!filament);
+    TL_STATS_ADD(filament_specular,filament);
+    if(data->ext_between_parallel){
+        lanes->umax[i] = filament ? 0.0001f : 0.001f;
+    } else{
+        lanes->umax[i] = tl_yarn_cache_get_umax(cache);
+    }
+    lanes->delta_x[i] = tl_yarn_cache_get_delta_x(cache);
+    lanes->rho[i] = tl_yarn_cache_get_rho(cache);
+    float specular_noise = tl_yarn_cache_get_specular_noise(cache);
+    if(specular_noise > 0.001f){
+        float iv = intensity_variation(*data);
+        lanes->noise[i] = (1.f-specular_noise) + specular_noise * iv;
     }
-    return reflection;
 }
 
-tlColor tl_eval_diffuse(tlIntersectionData intersection_data,
-        tlPatternData data, const tlWeaveParameters *params)
+// fc*A from tl_eval_staple_specular/tl_eval_filament_specular, given the
+// tangent and the highlight normal
+static inline tlVf tl_vf_fiber_scattering(tlVf3 tvec, tlVf3 highlight_normal,
+    tlVf3 wi, tlVf3 wo, tlVf rho)
 {
+    tlVf zero = tl_vf_set1(0.f);
+    tlVf one = tl_vf_set1(1.f);
+    tlVf3 svec = tl_vf3_normalize(tl_vf3_cross(tvec,highlight_normal));
+    tlVf3 rvec = tl_vf3_normalize(tl_vf3_cross(tvec,svec));
+    tlVf wos = tl_vf3_dot(wo,svec);
+    tlVf wor = tl_vf3_dot(wo,rvec);
+    tlVf wis = tl_vf3_dot(wi,svec);
+    tlVf wir = tl_vf3_dot(wi,rvec);
+    tlVf cos_x = tl_vf_div(
+        tl_vf_add(tl_vf_mul(wis,wos),tl_vf_mul(wir,wor)),
+        tl_vf_sqrt(tl_vf_mul(
+            tl_vf_add(tl_vf_mul(wis,wis),tl_vf_mul(wir,wir)),
+            tl_vf_add(tl_vf_mul(wos,wos),tl_vf_mul(wor,wor)))));
+
+    // Wrapped Cauchy
+    tlVf rho2 = tl_vf_mul(rho,rho);
+    tlVf fc = tl_vf_div(
+        tl_vf_mul(tl_vf_set1((float)(M_1_PI*0.5)),tl_vf_sub(one,rho2)),
+        tl_vf_add(tl_vf_sub(one,tl_vf_mul(tl_vf_add(rho,rho),cos_x)),rho2));
+    fc = tl_vf_andnot(tl_vf_cmpgt(rho,tl_vf_set1(0.999f)),fc);
+
+    tlVf widotn = tl_vf3_dot(wi,highlight_normal);
+    tlVf wodotn = tl_vf3_dot(wo,highlight_normal);
+    tlVf A = tl_vf_div(tl_vf_mul(tl_vf_set1(1.f/(4.f*(float)M_PI)),
+        tl_vf_mul(widotn,wodotn)),tl_vf_add(widotn,wodotn));
+    A = tl_vf_and(tl_vf_and(tl_vf_cmpgt(widotn,zero),
+        tl_vf_cmpgt(wodotn,zero)),A);
+    return tl_vf_mul(fc,A);
+}
 
-	tlYarnType *yarn_type = params->yarn_types + data.yarn_type;
-    if(!yarn_type->color_enabled || !data.yarn_hit){
-        yarn_type = &params->yarn_types[0];
+// Vectorized tl_eval_staple_specular
+static tlVf tl_batch_staple_specular(const tlBatchLanes *lanes)
+{
+    tlVf one = tl_vf_set1(1.f);
+    tlVf3 wi = tl_vf3_load(lanes->wi_x,lanes->wi_y,
+        lanes->wi_z);
+    tlVf3 wo = tl_vf3_load(lanes->wo_x,lanes->wo_y,
+        lanes->wo_z);
+    tlVf u = tl_vf_load(lanes->u);
+    tlVf x = tl_vf_load(lanes->x);
+    tlVf psi = tl_vf_load(lanes->psi);
+    tlVf umax = tl_vf_load(lanes->umax);
+    tlVf delta_x = tl_vf_load(lanes->delta_x);
+    tlVf rho = tl_vf_load(lanes->rho);
+    tlVf mask = tl_vf_load(lanes->staple);
+
+    tlVf3 wi_plus_wo = tl_vf3_add(wi,wo);
+    tlVf3 H = tl_vf3_normalize(wi_plus_wo);
+    tlVf sin_u, cos_u, sin_psi, cos_psi;
+    tl_vf_sincos(u,&sin_u,&cos_u);
+    tl_vf_sincos(psi,&sin_psi,&cos_psi);
+
+    tlVf a = tl_vf_add(tl_vf_mul(H.y,sin_u),tl_vf_mul(H.z,cos_u));
+    tlVf D = tl_vf_div(
+        tl_vf_sub(tl_vf_mul(H.y,cos_u),tl_vf_mul(H.z,sin_u)),
+        tl_vf_sqrt(tl_vf_add(tl_vf_mul(H.x,H.x),tl_vf_mul(a,a))));
+    D = tl_vf_mul(D,tl_vf_div(cos_psi,sin_psi));
+    mask = tl_vf_and(mask,tl_vf_cmplt(tl_vf_abs(D),one));
+    D = tl_vf_max(tl_vf_min(D,one),tl_vf_neg(one));
+    tlVf specular_v = tl_vf_add(tl_vf_atan2(tl_vf_neg(a),H.x),tl_vf_acos(D));
+    mask = tl_vf_and(mask,tl_vf_cmplt(tl_vf_abs(specular_v),
+        tl_vf_set1((float)M_PI_2)));
+    if(!tl_vf_any(mask)){
+        return tl_vf_set1(0.f);
     }
 
-    tlColor color = {
-        yarn_type->color.r,
-        yarn_type->color.g,
-        yarn_type->color.b
-    };
-	if(yarn_type->color_texmap){
-		color = tl_eval_texmap_color(yarn_type->color_texmap,
-            intersection_data.context);
-	}
+    tlVf sin_v, cos_v;
+    tl_vf_sincos(specular_v,&sin_v,&cos_v);
+    tlVf3 highlight_normal = tl_vf3_normalize(tl_vf3(sin_v,
+        tl_vf_mul(sin_u,cos_v),tl_vf_mul(cos_u,cos_v)));
 
-    // Apply multiplier
-    float color_amount = tl_yarn_type_get_color_amount(params, data.yarn_type,
-            intersection_data.context);
-    if (color_amount != 1.f) {
-        color.r *= color_amount;
-        color.g *= color_amount;
-        color.b *= color_amount;
+    tlVf specular_x = tl_vf_div(specular_v,tl_vf_set1((float)M_PI_2));
+    specular_x = tl_vf_min(specular_x,tl_vf_sub(one,delta_x));
+    specular_x = tl_vf_max(specular_x,tl_vf_sub(delta_x,one));
+#ifdef TL_STATS
+    tlVf highlight_mask = mask;
+#endif
+    mask = tl_vf_and(mask,tl_vf_cmplt(tl_vf_abs(tl_vf_sub(specular_x,x)),
+        delta_x));
+#ifdef TL_STATS
+    TL_STATS_ADD(specular_width_rejected,tl_vf_count(highlight_mask)
+        - tl_vf_count(mask));
+#endif
+
+    tlVf sin_umax, cos_umax;
+    tl_vf_sincos(umax,&sin_umax,&cos_umax);
+    tlVf R = tl_vf_div(one,sin_umax);
+    tlVf Gv = tl_vf_div(tl_vf_add(R,cos_v),
+        tl_vf_mul(tl_vf_mul(tl_vf3_magnitude(wi_plus_wo),
+        tl_vf3_dot(highlight_normal,H)),tl_vf_abs(sin_psi)));
+
+    tlVf3 tvec = tl_vf3(
+        tl_vf_neg(tl_vf_mul(cos_v,sin_psi)),
+        tl_vf_add(tl_vf_mul(cos_u,cos_psi),
+            tl_vf_mul(tl_vf_mul(sin_u,sin_v),sin_psi)),
+        tl_vf_add(tl_vf_neg(tl_vf_mul(sin_u,cos_psi)),
+            tl_vf_mul(tl_vf_mul(cos_u,sin_v),sin_psi)));
+    tlVf fc_A = tl_vf_fiber_scattering(tvec,highlight_normal,wi,wo,rho);
+
+    tlVf reflection = tl_vf_div(
+        tl_vf_mul(tl_vf_mul(tl_vf_mul(tl_vf_set1(4.f),umax),fc_A),Gv),delta_x);
+    return tl_vf_and(mask,reflection);
+}
+
+// Vectorized tl_eval_filament_specular
+static tlVf tl_batch_filament_specular(const tlBatchLanes *lanes)
+{
+    tlVf one = tl_vf_set1(1.f);
+    tlVf3 wi = tl_vf3_load(lanes->wi_x,lanes->wi_y,
+        lanes->wi_z);
+    tlVf3 wo = tl_vf3_load(lanes->wo_x,lanes->wo_y,
+        lanes->wo_z);
+    tlVf v = tl_vf_load(lanes->v);
+    tlVf y = tl_vf_load(lanes->y);
+    tlVf umax = tl_vf_load(lanes->umax);
+    tlVf delta_x = tl_vf_load(lanes->delta_x);
+    tlVf rho = tl_vf_load(lanes->rho);
+    tlVf mask = tl_vf_load(lanes->filament);
+
+    tlVf3 wi_plus_wo = tl_vf3_add(wi,wo);
+    tlVf3 H = tl_vf3_normalize(wi_plus_wo);
+    tlVf specular_u = tl_vf_add(tl_vf_atan2(tl_vf_neg(H.z),H.y),
+        tl_vf_set1((float)M_PI_2));
+    mask = tl_vf_and(mask,tl_vf_cmplt(tl_vf_abs(specular_u),umax));
+    if(!tl_vf_any(mask)){
+        return tl_vf_set1(0.f);
     }
-    
-    float value = intersection_data.wi_z;
-    color.r *= value;
-    color.g *= value;
-    color.b *= value;
 
-    //NOTE(Vidar): We use the max of the specular color for dimming the diffuse
-    tlColor specular_color=tl_yarn_type_get_specular_color(params,
-        data.yarn_type,intersection_data.context);
-    float specular_strength=specular_color.r>specular_color.g ?
-        specular_color.r : specular_color.g;
-    specular_strength=specular_color.b>specular_strength ?
-        specular_color.b : specular_strength;
-    float specular_amount = tl_yarn_type_get_specular_amount(params,
-        data.yarn_type,intersection_data.context);
-    specular_strength *= specular_amount;
+    tlVf sin_v, cos_v, sin_su, cos_su;
+    tl_vf_sincos(v,&sin_v,&cos_v);
+    tl_vf_sincos(specular_u,&sin_su,&cos_su);
+    tlVf3 highlight_normal = tl_vf3_normalize(tl_vf3(sin_v,
+        tl_vf_mul(sin_su,cos_v),tl_vf_mul(cos_su,cos_v)));
+    // Already normalized
+    tlVf3 tvec = tl_vf3(tl_vf_set1(0.f),cos_su,tl_vf_neg(sin_su));
+
+    tlVf specular_y = tl_vf_div(specular_u,umax);
+    specular_y = tl_vf_min(specular_y,tl_vf_sub(one,delta_x));
+    specular_y = tl_vf_max(specular_y,tl_vf_sub(delta_x,one));
+#ifdef TL_STATS
+    tlVf highlight_mask = mask;
+#endif
+    mask = tl_vf_and(mask,tl_vf_cmplt(tl_vf_abs(tl_vf_sub(specular_y,y)),
+        delta_x));
+#ifdef TL_STATS
+    TL_STATS_ADD(specular_width_rejected,tl_vf_count(highlight_mask)
+        - tl_vf_count(mask));
+#endif
 
-    float specular_strength_complement=1.f-specular_strength;
-    color.r*=specular_strength_complement;
-    color.g*=specular_strength_complement;
-    color.b*=specular_strength_complement;
+    tlVf sin_umax, cos_umax;
+    tl_vf_sincos(umax,&sin_umax,&cos_umax);
+    tlVf R = tl_vf_div(one,sin_umax);
+    tlVf Gu = tl_vf_div(tl_vf_add(R,cos_v),
+        tl_vf_mul(tl_vf3_magnitude(wi_plus_wo),
+        tl_vf_abs(tl_vf3_cross(tvec,H).x)));
 
-    tlColor opacity = tl_eval_opacity(intersection_data, data, params);
-    color.r*=opacity.r;
-    color.g*=opacity.g;
-    color.b*=opacity.b;
+    tlVf fc_A = tl_vf_fiber_scattering(tvec,highlight_normal,wi,wo,rho);
 
-    return color;
+    tlVf reflection = tl_vf_div(
+        tl_vf_mul(tl_vf_mul(tl_vf_mul(tl_vf_set1(4.f),umax),Gu),fc_A),delta_x);
+    return tl_vf_and(mask,reflection);
 }
 
-tlColor tl_eval_opacity(tlIntersectionData intersection_data,
-        tlPatternData data, const tlWeaveParameters *params)
+// Specular and, optionally, diffuse for the lanes. The color is written to
+// r, g and b
+static void tl_batch_shade_lanes(const tlBatchLanes *lanes, int diffuse,
+    float *r, float *g, float *b)
 {
-
-	tlYarnType *yarn_type = params->yarn_types + data.yarn_type;
-    if(!yarn_type->opacity_enabled || !data.yarn_hit){
-        yarn_type = &params->yarn_types[0];
+    tlVf reflection = tl_vf_set1(0.f);
+    if(tl_vf_any(tl_vf_load(lanes->staple))){
+        reflection = tl_batch_staple_specular(lanes);
     }
+    if(tl_vf_any(tl_vf_load(lanes->filament))){
+        reflection = tl_vf_select(tl_vf_load(lanes->filament),
+            tl_batch_filament_specular(lanes),reflection);
+    }
+    tlVf factor = tl_vf_mul(tl_vf_mul(tl_vf_mul(reflection,
+        tl_vf_set1(7.f)),tl_vf_load(lanes->noise)),
+        tl_vf_load(lanes->specular_amount));
+    tlVf specular_r = tl_vf_load(lanes->specular_r);
+    tlVf specular_g = tl_vf_load(lanes->specular_g);
+    tlVf specular_b = tl_vf_load(lanes->specular_b);
+    tlVf out_r = tl_vf_mul(specular_r,factor);
+    tlVf out_g = tl_vf_mul(specular_g,factor);
+    tlVf out_b = tl_vf_mul(specular_b,factor);
+
+    if(diffuse){
+        // Same as tl_eval_diffuse
+        tlVf color_amount = tl_vf_load(lanes->color_amount);
+        tlVf wi_z = tl_vf_load(lanes->wi_z);
+        tlVf specular_strength = tl_vf_mul(
+            tl_vf_max(tl_vf_max(specular_r,specular_g),specular_b),
+            tl_vf_load(lanes->specular_amount));
+        tlVf complement = tl_vf_sub(tl_vf_set1(1.f),specular_strength);
+        tlVf opacity_amount = tl_vf_load(lanes->opacity_amount);
+        tlVf color_r = tl_vf_mul(tl_vf_mul(tl_vf_mul(
+            tl_vf_load(lanes->color_r),color_amount),wi_z),complement);
+        tlVf color_g = tl_vf_mul(tl_vf_mul(tl_vf_mul(
+            tl_vf_load(lanes->color_g),color_amount),wi_z),complement);
+        tlVf color_b = tl_vf_mul(tl_vf_mul(tl_vf_mul(
+            tl_vf_load(lanes->color_b),color_amount),wi_z),complement);
+        color_r = tl_vf_mul(color_r,tl_vf_mul(
+            tl_vf_load(lanes->opacity_r),opacity_amount));
+        color_g = tl_vf_mul(color_g,tl_vf_mul(
+            tl_vf_load(lanes->opacity_g),opacity_amount));
+        color_b = tl_vf_mul(color_b,tl_vf_mul(
+            tl_vf_load(lanes->opacity_b),opacity_amount));
+        out_r = tl_vf_add(color_r,out_r);
+        out_g = tl_vf_add(color_g,out_g);
+        out_b = tl_vf_add(color_b,out_b);
+    }
+    tl_vf_store(r,out_r);
+    tl_vf_store(g,out_g);
+    tl_vf_store(b,out_b);
+}
 
-    tlColor opacity = {
-        yarn_type->opacity.r,
-        yarn_type->opacity.g,
-        yarn_type->opacity.b
-    };
-	if(yarn_type->opacity_texmap){
-		opacity = tl_eval_texmap_color(yarn_type->opacity_texmap,
-            intersection_data.context);
-	}
-
-    // Apply multiplier
-    float opacity_amount = tl_yarn_type_get_opacity_amount(params, data.yarn_type,
-            intersection_data.context);
-    if (opacity_amount != 1.f) {
-        opacity.r *= opacity_amount;
-        opacity.g *= opacity_amount;
-        opacity.b *= opacity_amount;
+// The parameters which tl_segment_uv_and_normal and tl_batch_gather_lane
+// will fetch for the lane
+static uint32_t tl_batch_needed_params(const tlPatternData *data,
+    const tlYarnParameterCache *cache, int diffuse)
+{
+    uint32_t needed = 0;
+    if(tl_has_pattern(cache->params) && data->yarn_hit){
+        needed |= (1u<<TL_YARN_PARAM_psi) | (1u<<TL_YARN_PARAM_delta_x)
+            | (1u<<TL_YARN_PARAM_rho) | (1u<<TL_YARN_PARAM_specular_noise)
+            | (1u<<TL_YARN_PARAM_specular_color)
+            | (1u<<TL_YARN_PARAM_specular_amount);
+        if(!data->ext_between_parallel){
+            needed |= 1u<<TL_YARN_PARAM_umax;
+        }
     }
-    
-    return opacity;
+    if(diffuse){
+        needed |= (1u<<TL_YARN_PARAM_specular_color)
+            | (1u<<TL_YARN_PARAM_specular_amount)
+            | (1u<<TL_YARN_PARAM_color_amount)
+            | (1u<<TL_YARN_PARAM_opacity_amount);
+        if(data->yarn_hit || cache->yarn_type == 0){
+            needed |= (1u<<TL_YARN_PARAM_color)
+                | (1u<<TL_YARN_PARAM_opacity);
+        }
+    }
+    return needed;
 }
 
+typedef char tl_texture_packet_size_check[
+    TL_TEXTURE_PACKET_SIZE % TL_SIMD_WIDTH == 0 ? 1 : -1];
 
-tlColor tl_eval_specular(tlIntersectionData intersection_data,
-        tlPatternData data, const tlWeaveParameters *params)
+// If pattern_data is 0, the pattern data is computed with
+// tl_get_pattern_data
+static void tl_eval_batch(const tlIntersectionBatch *intersection_data,
+    const tlPatternData *pattern_data, const tlWeaveParameters *params,
+    uint32_t count, tlColorBatch out, int diffuse)
 {
-    tlColor ret={0.f,0.f,0.f};
-    // Depending on the given psi parameter the yarn is considered
-    // staple or filament. They are treated differently in order
-    // to work better numerically. 
-    float reflection = 0.f;
-    if(params->pattern == 0){
-        return ret;
-    }
-	if(!data.yarn_hit){
-        //have not hit a yarn...
-        return ret;
-	}
-    float psi = tl_yarn_type_get_psi(params, data.yarn_type,
-		intersection_data.context);
-    if (psi <= 0.001f) {
-        //Filament yarn
-        reflection = tl_eval_filament_specular(intersection_data, data, params); 
-    } else {
-        //Staple yarn
-        reflection = tl_eval_staple_specular(intersection_data, data, params); 
+    // The points are processed in packets. The pattern lookup is
+    // done first for the whole packet, so that the texmaps can be evaluated
+    // together, and then the kernels are run TL_SIMD_WIDTH points at a time.
+    for(uint32_t start=0;start<count;start+=TL_TEXTURE_PACKET_SIZE){
+        uint32_t n = count - start;
+        n = n < TL_TEXTURE_PACKET_SIZE ? n : TL_TEXTURE_PACKET_SIZE;
+        tlIntersectionData d[TL_TEXTURE_PACKET_SIZE];
+        tlPatternData data[TL_TEXTURE_PACKET_SIZE];
+        tlYarnParameterCache cache[TL_TEXTURE_PACKET_SIZE];
+        uint32_t needed[TL_TEXTURE_PACKET_SIZE];
+        uint8_t active[TL_TEXTURE_PACKET_SIZE];
+        int num_active = 0;
+        for(uint32_t i=0;i<n;i++){
+            uint32_t index = start + i;
+            active[i] = !intersection_data->mask
+                || intersection_data->mask[index];
+            if(!active[i]){
+                tl_yarn_parameter_cache_init(&cache[i],params,0);
+                needed[i] = 0;
+                continue;
+            }
+            tl_batch_intersection(intersection_data,index,&d[i]);
+            tl_yarn_parameter_cache_init(&cache[i],params,d[i].context);
+            if(pattern_data){
+                data[i] = pattern_data[index];
+                cache[i].yarn_type = data[i].yarn_type;
+            } else{
+                data[i] = tl_pattern_data(d[i],params,&cache[i],0);
+            }
+            needed[i] = tl_batch_needed_params(&data[i],&cache[i],diffuse);
+            num_active++;
+        }
+        if(num_active == 0){
+            continue;
+        }
+        tl_batch_fetch_textured(cache,needed,n);
+        for(uint32_t group=0;group<n;group+=TL_SIMD_WIDTH){
+            tlBatchLanes lanes;
+            int num_lanes = 0;
+            for(int i=0;i<TL_SIMD_WIDTH;i++){
+                uint32_t k = group + i;
+                if(k >= n || !active[k]){
+                    tl_batch_clear_lane(&lanes,i);
+                    continue;
+                }
+                if(!pattern_data && data[k].yarn_hit){
+                    tl_segment_uv_and_normal(&data[k],&cache[k]);
+                }
+                tl_batch_gather_lane(&lanes,i,&d[k],&data[k],&cache[k],
+                    diffuse);
+                num_lanes++;
+            }
+            if(num_lanes == 0){
+                continue;
+            }
+            float r[TL_SIMD_WIDTH], g[TL_SIMD_WIDTH], b[TL_SIMD_WIDTH];
+            tl_batch_shade_lanes(&lanes,diffuse,r,g,b);
+            tl_simd_end();
+            for(int i=0;i<TL_SIMD_WIDTH;i++){
+                // tl_eval_specular_batch is given the pattern
+                // data, like tl_eval_specular, so it is not prefiltered
+                float prefiltered = lanes.active[i] && !pattern_data ?
+                    tl_prefilter_amount(&d[group+i],params) : 0.f;
+                if(prefiltered > 0.f){
+                    tlEvalResult filtered;
+                    tl_prefiltered_eval(d[group+i],&cache[group+i],
+                        TL_EVAL_DIFFUSE | TL_EVAL_SPECULAR,&filtered);
+                    tlColor c = {r[i],g[i],b[i]};
+                    tlColor f = filtered.diffuse;
+                    f.r += filtered.specular.r;
+                    f.g += filtered.specular.g;
+                    f.b += filtered.specular.b;
+                    tl_blend_color(&c,f,prefiltered);
+                    r[i] = c.r; g[i] = c.g; b[i] = c.b;
+                }
+                if(lanes.active[i]){
+                    out.r[start+group+i] = r[i];
+                    out.g[start+group+i] = g[i];
+                    out.b[start+group+i] = b[i];
+                }
+            }
+        }
     }
-	float specular_noise=tl_yarn_type_get_specular_noise(params,
-		data.yarn_type,intersection_data.context);
-	float noise=1.f;
-    if(specular_noise > 0.001f){
-		float iv = intensity_variation(data);
-		noise=(1.f-specular_noise)+specular_noise * iv;
+}
+
+void tl_get_pattern_data_batch(const tlIntersectionBatch *intersection_data,
+    const tlWeaveParameters *params, uint32_t count, tlPatternData *data)
+{
+    for(uint32_t i=0;i<count;i++){
+        if(intersection_data->mask && !intersection_data->mask[i]){
+            continue;
+        }
+        tlIntersectionData d;
+        tl_batch_intersection(intersection_data,i,&d);
+        data[i] = tl_get_pattern_data(d,params);
     }
-    tlColor specular_color=tl_yarn_type_get_specular_color(params,
-        data.yarn_type,intersection_data.context);
-    float specular_amount = tl_yarn_type_get_specular_amount(params,
-        data.yarn_type,intersection_data.context);
-	float factor = reflection * 7.f * noise * specular_amount; //NOTE(Vidar): The magic constant here is to give the highlights a reasonable strength
-    ret.r=specular_color.r*factor;
-    ret.g=specular_color.g*factor;
-    ret.b=specular_color.b*factor;
-    return ret;
 }
 
-tlColor tl_shade(tlIntersectionData intersection_data,
-        const tlWeaveParameters *params)
+void tl_eval_specular_batch(const tlIntersectionBatch *intersection_data,
+    const tlPatternData *data, const tlWeaveParameters *params,
+    uint32_t count, tlColorBatch out)
 {
-    tlPatternData data = tl_get_pattern_data(intersection_data,params);
-    tlColor ret = tl_eval_diffuse(intersection_data,data,params);
-    tlColor spec  = tl_eval_specular(intersection_data,data,params);
-    ret.r+=spec.r; ret.g+=spec.g; ret.b+=spec.b;
-    return ret;
+    tl_eval_batch(intersection_data,data,params,count,out,0);
+}
+
+void tl_shade_batch(const tlIntersectionBatch *intersection_data,
+    const tlWeaveParameters *params, uint32_t count, tlColorBatch out)
+{
+    tl_eval_batch(intersection_data,0,params,count,out,1);
 }
 
 #ifdef TL_NO_TEXTURE_CALLBACKS
@@ -2036,6 +7204,33 @@ tlColor tl_eval_texmap_color(void *texmap, void *context)
     tlColor ret = {1.f,1.f,1.f};
     return ret;
 }
+
+#ifdef TL_TEXTURE_BATCH_CALLBACKS
+void tl_eval_texmap_mono_lookup_batch(void *texmap, const float *u,
+    const float *v, void * const *context, uint32_t count, float *result)
+{
+    for(uint32_t i=0;i<count;i++){
+        result[i] = 1.f;
+    }
+}
+
+void tl_eval_texmap_mono_batch(void *texmap, void * const *context,
+    uint32_t count, float *result)
+{
+    for(uint32_t i=0;i<count;i++){
+        result[i] = 1.f;
+    }
+}
+
+void tl_eval_texmap_color_batch(void *texmap, void * const *context,
+    uint32_t count, tlColor *result)
+{
+    tlColor ret = {1.f,1.f,1.f};
+    for(uint32_t i=0;i<count;i++){
+        result[i] = ret;
+    }
+}
+#endif
 #endif
 
 #endif
@@ -1,7 +1,8 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include "wif.h"
-#include "ini.h" //TODO(Vidar): Write this ourselves
 
 //TODO(Vidar):Report errors in a proper way, not by printf
 
@@ -35,12 +36,58 @@ const uint32_t DATA_ALL_SECTIONS = DATA_WARP_SECTION | DATA_WEFT_SECTION |
     DATA_COLOR_TABLE_SECTION | DATA_WARP_COLORS_SECTION | 
     DATA_WEFT_COLORS_SECTION;
 
-static int string_to_float(const char *str, float *val)
+// A string pointing into the WIF file. It is not null
+// terminated, it ends at end.
+typedef struct
+{
+    const char *str;
+    const char *end;
+}WifString;
+
+static int wif_is_space(char c)
+{
+    return isspace((unsigned char)c);
+}
+
+static int wif_string_equals(WifString s, const char *str)
+{
+    size_t len = strlen(str);
+    return (size_t)(s.end - s.str) == len && memcmp(s.str, str, len) == 0;
+}
+
+// Same as atoi, but stops at end
+static int32_t wif_atoi_range(const char *p, const char *end)
+{
+    while(p < end && wif_is_space(*p)){
+        p++;
+    }
+    int negative = 0;
+    if(p < end && (*p == '-' || *p == '+')){
+        negative = *p == '-';
+        p++;
+    }
+    // Saturate like strtol does, atoi then keeps the low bits
+    uint64_t v = 0;
+    while(p < end && *p >= '0' && *p <= '9'){
+        uint64_t a = (uint64_t)(*p - '0');
+        v = v > (INT64_MAX - a)/10 ? (uint64_t)INT64_MAX + negative
+            : 10*v + a;
+        p++;
+    }
+    return (int32_t)(uint32_t)(negative ? (uint64_t)0 - v : v);
+}
+
+static int32_t wif_atoi(WifString s)
+{
+    return wif_atoi_range(s.str, s.end);
+}
+
+static int string_to_float(WifString s, float *val)
 {
     uint32_t accum  = 0;
     uint32_t scale = 10;
     char dot_encountered = 0;
-    while(*str){
+    for(const char *str = s.str; str < s.end; str++){
         if(*str == '.'){
             dot_encountered = 1;
         }else{
@@ -55,7 +102,6 @@ static int string_to_float(const char *str, float *val)
                 return 0;
             }
         }
-        str++;
     }
     *val = (float)accum / (float)scale;
     return 1;
@@ -89,6 +135,30 @@ static const char *get_section_name(uint32_t section)
     }
 }
 
+// Returns the DATA_*_SECTION of a section name, or 0 for
+// sections that we don't read
+static uint32_t get_section_id(WifString name)
+{
+    static const struct {const char *name; uint32_t section;} sections[] = {
+        {"WARP",          DATA_WARP_SECTION},
+        {"WEFT",          DATA_WEFT_SECTION},
+        {"WEAVING",       DATA_WEAVING_SECTION},
+        {"TIEUP",         DATA_TIEUP_SECTION},
+        {"THREADING",     DATA_THREADING_SECTION},
+        {"TREADLING",     DATA_TREADLING_SECTION},
+        {"COLOR PALETTE", DATA_COLOR_PALETTE_SECTION},
+        {"COLOR TABLE",   DATA_COLOR_TABLE_SECTION},
+        {"WARP COLORS",   DATA_WARP_COLORS_SECTION},
+        {"WEFT COLORS",   DATA_WEFT_COLORS_SECTION},
+    };
+    for(uint32_t i=0;i<sizeof(sections)/sizeof(*sections);i++){
+        if(wif_string_equals(name,sections[i].name)){
+            return sections[i].section;
+        }
+    }
+    return 0;
+}
+
 #define CHECK_KEY(key,section,name) if(!(data->read_keys & key)){ \
     printf("ERROR! Missing key \"" name "\" in section \"" section "\"\n");\
     return 1;}
@@ -126,67 +196,70 @@ static uint8_t set_section(WeaveData *data, uint32_t section)
     return 0;
 }
 
-static int32_t handler(void* user_data, const char* section, const char* name,
-                   const char* value)
+#define WIF_STR(s) (int)((s).end - (s).str), (s).str
+
+// Reads one name=value pair in the section with id section.
+// Returns 0 if there was an error.
+static int32_t read_key(WeaveData *data, uint32_t section,
+    WifString section_name, WifString name, WifString value)
 {
-    WeaveData *data = (WeaveData*)user_data;
-    WarpOrWeftData *wdata = 0;
-    if(strcmp("WARP",section)==0){
-        if(set_section(data, DATA_WARP_SECTION)) return 0;
-        wdata = &data->warp;
-    }
-    if(strcmp("WEFT",section)==0){
-        if(set_section(data, DATA_WEFT_SECTION)) return 0;
-        wdata = &data->weft;
+    if(section == 0){
+        return 1;
     }
-    if(wdata){
-        if(strcmp("Threads",name)==0){
+    if(set_section(data, section)) return 0;
+    switch(section){
+    case DATA_WARP_SECTION:
+    case DATA_WEFT_SECTION: {
+        WarpOrWeftData *wdata = section == DATA_WARP_SECTION ? &data->warp
+            : &data->weft;
+        if(wif_string_equals(name,"Threads")){
             data->read_keys |= WARP_OR_WEFT_THREADS_KEY;
-            uint32_t v = (uint32_t)atoi(value);
+            uint32_t v = (uint32_t)wif_atoi(value);
             if(v == 0){
                 printf("ERROR! Threads cannot be 0\n");
                 return 0;
             }
             wdata->num_threads = v;
         }
-        if(strcmp("Spacing",name)==0){
+        if(wif_string_equals(name,"Spacing")){
             data->read_keys |= WARP_OR_WEFT_SPACING_KEY;
             if(!string_to_float(value,&wdata->spacing)){
-                printf("could not read %s in [%s]!\n",name,section);
+                printf("could not read %.*s in [%.*s]!\n",WIF_STR(name),
+                    WIF_STR(section_name));
                 return 0;
             }
         }
-        if(strcmp("Thickness",name)==0){
+        if(wif_string_equals(name,"Thickness")){
             data->read_keys |= WARP_OR_WEFT_THICKNESS_KEY;
             if(!string_to_float(value,&wdata->thickness)){
-                printf("could not read %s in [%s]!\n",name,section);
+                printf("could not read %.*s in [%.*s]!\n",WIF_STR(name),
+                    WIF_STR(section_name));
                 return 0;
             }
         }
+        break;
     }
-    if(strcmp("WEAVING",section)==0){
-        if(set_section(data, DATA_WEAVING_SECTION)) return 0;
-        if(strcmp("Shafts",name)==0){
+    case DATA_WEAVING_SECTION:
+        if(wif_string_equals(name,"Shafts")){
             data->read_keys |= WEAVING_SHAFTS_KEY;
-            uint32_t v = (uint32_t)atoi(value);
+            uint32_t v = (uint32_t)wif_atoi(value);
             if(v == 0){
                 printf("ERROR! Shafts cannot be 0\n");
                 return 0;
             }
             data->num_shafts = v;
         }
-        if(strcmp("Treadles",name)==0){
+        if(wif_string_equals(name,"Treadles")){
             data->read_keys |= WEAVING_TREADLES_KEY;
-            uint32_t v = (uint32_t)atoi(value);
+            uint32_t v = (uint32_t)wif_atoi(value);
             if(v == 0){
                 printf("ERROR! Treadles cannot be 0\n");
                 return 0;
             }
             data->num_treadles = v;
         }
-    }
-    if(strcmp("TIEUP",section)==0){
-        if(set_section(data, DATA_TIEUP_SECTION)) return 0;
+        break;
+    case DATA_TIEUP_SECTION: {
         const char *p;
         uint32_t x;
         uint32_t num_tieup_entries = data->num_treadles * data->num_shafts;
@@ -198,27 +271,27 @@ static int32_t handler(void* user_data, const char* section, const char* name,
         if(data->tieup == 0){
             data->tieup = (uint8_t*)calloc(num_tieup_entries,sizeof(uint8_t));
         }
-        uint32_t index = (uint32_t)atoi(name);
+        uint32_t index = (uint32_t)wif_atoi(name);
         if(index > data->num_treadles || index == 0){
-            printf("ERROR! Tieup entry %s is invalid\n", name);
+            printf("ERROR! Tieup entry %.*s is invalid\n", WIF_STR(name));
             return 0;
         }
         x = data->num_treadles - index;
-        for(p = value; p != NULL && *p != '\0';){
-            uint32_t entry = (uint32_t)atoi(p);
+        for(p = value.str; p != NULL && p < value.end;){
+            uint32_t entry = (uint32_t)wif_atoi_range(p,value.end);
             if(entry > data->num_shafts || entry == 0){
-                printf("ERROR! Tieup entry %s contains the invalid value %d\n",
-                        name, entry);
+                printf("ERROR! Tieup entry %.*s contains the invalid value %d\n",
+                        WIF_STR(name), entry);
                 return 0;
             }
             uint32_t y = data->num_shafts - entry;
             data->tieup[x + y*data->num_treadles] = 1;
-            p = (const char*)strchr(p, ',');
+            p = (const char*)memchr(p, ',', value.end - p);
             p = (p == NULL)? NULL: p+1;
         }
+        break;
     }
-    if(strcmp("THREADING",section)==0){
-        if(set_section(data, DATA_THREADING_SECTION)) return 0;
+    case DATA_THREADING_SECTION: {
         uint32_t w = data->warp.num_threads ;
         if(w <= 0){
             printf("ERROR! Threading section appeared before specification of "
@@ -229,21 +302,22 @@ static int32_t handler(void* user_data, const char* section, const char* name,
             data->threading = (uint32_t*)calloc(w,sizeof(uint32_t));
         }
         //TODO(Vidar): Generalize this?
-        uint32_t index = (uint32_t)atoi(name);
+        uint32_t index = (uint32_t)wif_atoi(name);
         if(index > w || index == 0){
-            printf("ERROR! Threading entry %s is out of bounds\n",name);
+            printf("ERROR! Threading entry %.*s is out of bounds\n",
+                WIF_STR(name));
             return 0;
         }
-        uint32_t entry = (uint32_t)atoi(value);
+        uint32_t entry = (uint32_t)wif_atoi(value);
         if(entry > data->num_shafts || entry == 0){
-            printf("ERROR! Threading value %s at entry %s is out of bounds\n",
-                    name, value);
+            printf("ERROR! Threading value %.*s at entry %.*s is out of bounds\n",
+                    WIF_STR(name), WIF_STR(value));
             return 0;
         }
         data->threading[index-1] = data->num_shafts - entry;
+        break;
     }
-    if(strcmp("TREADLING",section)==0){
-        if(set_section(data, DATA_TREADLING_SECTION)) return 0;
+    case DATA_TREADLING_SECTION: {
         uint32_t w = data->weft.num_threads ;
         if(w <= 0){
             printf("ERROR! Treadling section appeared before specification of "
@@ -253,28 +327,28 @@ static int32_t handler(void* user_data, const char* section, const char* name,
         if(data->treadling == 0){
             data->treadling = (uint32_t*)calloc(w,sizeof(uint32_t));
         }
-        uint32_t index = (uint32_t)atoi(name);
+        uint32_t index = (uint32_t)wif_atoi(name);
         if(index > w || index == 0){
-            printf("ERROR! Treadling entry %s is out of bounds\n",name);
+            printf("ERROR! Treadling entry %.*s is out of bounds\n",
+                WIF_STR(name));
             return 0;
         }
-        uint32_t entry = (uint32_t)atoi(value);
+        uint32_t entry = (uint32_t)wif_atoi(value);
         if(entry > data->num_treadles || entry == 0){
-            printf("ERROR! Treadling value %s at entry %s is out of bounds\n",
-                    name, value);
+            printf("ERROR! Treadling value %.*s at entry %.*s is out of bounds\n",
+                    WIF_STR(name), WIF_STR(value));
             return 0;
         }
         data->treadling[(index-1)] = data->num_treadles - entry;
+        break;
     }
-    if(strcmp("COLOR PALETTE",section)==0){
-        if(set_section(data, DATA_COLOR_PALETTE_SECTION)) return 0;
-        if(strcmp("Entries",name)==0){
+    case DATA_COLOR_PALETTE_SECTION:
+        if(wif_string_equals(name,"Entries")){
             data->read_keys |= COLOR_PALETTE_ENTRIES_KEY;
-            data->num_colors = (uint32_t)atoi(value);
+            data->num_colors = (uint32_t)wif_atoi(value);
         }
-    }
-    if(strcmp("COLOR TABLE",section)==0){
-        if(set_section(data, DATA_COLOR_TABLE_SECTION)) return 0;
+        break;
+    case DATA_COLOR_TABLE_SECTION:
         if(data->num_colors==0){
             printf("ERROR! COLOR TABLE appeared before specification of "
                     "COLOR PALETTE\n");
@@ -283,115 +357,171 @@ static int32_t handler(void* user_data, const char* section, const char* name,
         if(data->colors == 0){
             data->colors = (float*)calloc(data->num_colors,sizeof(float)*3);
         }
-        uint32_t i = (uint32_t)atoi(name)-1;
-        //TODO(Vidar):Handle different formats
-        if(i<data->num_colors){
-            const char *p = value;
-            data->colors[i*3+0] = (float)(atoi(p))/255.0f;
-            p = strchr(p, ',')+1;
-            if(p == (void*)1){
-                printf("Invalid color at color table entry %s\n",name);
-                return 0;
-            }
-            data->colors[i*3+1] = (float)(atoi(p))/255.0f;
-            p = strchr(p, ',')+1;
-            if(p == (void*)1){
-                printf("Invalid color at color table entry %s\n",name);
-                return 0;
+        {
+            uint32_t i = (uint32_t)wif_atoi(name)-1;
+            //TODO(Vidar):Handle different formats
+            if(i<data->num_colors){
+                const char *p = value.str;
+                for(int c=0;c<3;c++){
+                    if(c > 0){
+                        p = (const char*)memchr(p, ',', value.end - p);
+                        if(p == NULL){
+                            printf("Invalid color at color table entry %.*s\n",
+                                WIF_STR(name));
+                            return 0;
+                        }
+                        p++;
+                    }
+                    data->colors[i*3+c] =
+                        (float)(wif_atoi_range(p,value.end))/255.0f;
+                }
             }
-            data->colors[i*3+2] = (float)(atoi(p))/255.0f;
         }
-    }
-    if(strcmp("WARP COLORS",section)==0){
-        if(set_section(data, DATA_WARP_COLORS_SECTION)) return 0;
-        uint32_t w = data->warp.num_threads ;
+        break;
+    case DATA_WARP_COLORS_SECTION:
+    case DATA_WEFT_COLORS_SECTION: {
+        WarpOrWeftData *wdata = section == DATA_WARP_COLORS_SECTION ?
+            &data->warp : &data->weft;
+        const char *warp_or_weft = section == DATA_WARP_COLORS_SECTION ?
+            "WARP" : "WEFT";
+        uint32_t w = wdata->num_threads ;
         if(w <= 0){
-            printf("ERROR! WARP COLORS section appeared before specification of "
-                    "warp threads!\n");
+            printf("ERROR! %s COLORS section appeared before specification of "
+                    "%s threads!\n", warp_or_weft,
+                    section == DATA_WARP_COLORS_SECTION ? "warp" : "weft");
             return 0;
         }
-        if(data->warp.colors == 0){
-            data->warp.colors = (uint32_t*)calloc(w,sizeof(uint32_t));
+        if(wdata->colors == 0){
+            wdata->colors = (uint32_t*)calloc(w,sizeof(uint32_t));
         }
-        uint32_t index = (uint32_t)atoi(name);
+        uint32_t index = (uint32_t)wif_atoi(name);
         if(index > w || index == 0){
-            printf("ERROR! Warp color entry %s is out of bounds\n",name);
+            printf("ERROR! %s color entry %.*s is out of bounds\n",
+                section == DATA_WARP_COLORS_SECTION ? "Warp" : "Weft",
+                WIF_STR(name));
             return 0;
         }
-        uint32_t entry = (uint32_t)atoi(value);
+        uint32_t entry = (uint32_t)wif_atoi(value);
         if(entry > data->num_colors || entry == 0){
-            printf("ERROR! Warp color value %s at entry %s is out of bounds\n",
-                    name, value);
+            printf("ERROR! %s color value %.*s at entry %.*s is out of bounds\n",
+                    section == DATA_WARP_COLORS_SECTION ? "Warp" : "Weft",
+                    WIF_STR(name), WIF_STR(value));
             return 0;
         }
-        data->warp.colors[(index-1)] = entry-1;
+        wdata->colors[(index-1)] = entry-1;
+        break;
     }
-    if(strcmp("WEFT COLORS",section)==0){
-        if(set_section(data, DATA_WEFT_COLORS_SECTION)) return 0;
-        //TODO(Vidar): Join with the case above...
-        uint32_t w = data->weft.num_threads ;
-        if(w <= 0){
-            printf("ERROR! WEFT COLORS section appeared before specification of "
-                    "weft threads!\n");
-            return 0;
-        }
-        if(data->weft.colors == 0){
-            data->weft.colors = (uint32_t*)calloc(w,sizeof(uint32_t));
-        }
-        uint32_t index = (uint32_t)atoi(name);
-        if(index > w || index == 0){
-            printf("ERROR! Weft color entry %s is out of bounds\n",name);
-            return 0;
-        }
-        uint32_t entry = (uint32_t)atoi(value);
-        if(entry > data->num_colors || entry == 0){
-            printf("ERROR! Weft color value %s at entry %s is out of bounds\n",
-                    name, value);
-            return 0;
-        }
-        data->weft.colors[(index-1)] = entry-1;
     }
     return 1;
 }
 
-struct read_data{
-        char *str;
-        long len;
-};
+// Returns the first char of chars, or the start of an inline
+// comment, in [s,end). An inline comment starts with ';' after whitespace.
+// Returns end if neither was found.
+static const char *find_chars_or_comment(const char *s, const char *end,
+    const char *chars)
+{
+    int was_space = 0;
+    while (s < end && (!chars || !strchr(chars, *s)) &&
+           !(was_space && *s == ';')) {
+        was_space = wif_is_space(*s);
+        s++;
+    }
+    return s;
+}
 
-static char* read_from_string(char* str, int num, void* stream)
+// Parses the INI structure of the WIF file in place, one line
+// at a time, and passes each name=value pair to read_key. Follows the
+// rules of the inih parser which was used before, but without a maximum
+// line length. Returns 0 on success, or the line number of the first error.
+static int parse_wif(WeaveData *data, const char *in_data, long len)
 {
-    struct read_data *data = (struct read_data*)stream;
-    if(data->len >0){
-            char *ret = str;
-            num--;
-            num = num > data->len ? data->len : num;
-            int end = 0;
-            for(int i=0;i<num;i++){
-                if(*data->str != '\n'){
-                        *str = *data->str;
-                        str++;
-                        data->str++;
-                        data->len--;
-                        end++;
-                }
+    const char *p = in_data;
+    const char *file_end = in_data + (len > 0 ? len : 0);
+    uint32_t section = 0;
+    WifString section_name = {"",""};
+    WifString prev_name = {"",""};
+    int lineno = 0;
+    int error = 0;
+    while(p < file_end){
+        const char *line = p;
+        const char *end = (const char*)memchr(p, '\n', file_end - p);
+        p = end ? end + 1 : file_end;
+        end = end ? end : file_end;
+        // The line ends at the first null char. The buffer can
+        // end with zeros when the file was read in text mode on windows
+        const char *nul = (const char*)memchr(line, 0, end - line);
+        end = nul ? nul : end;
+        lineno++;
+
+        const char *start = line;
+        if (lineno == 1 && end - start >= 3 &&
+                           (unsigned char)start[0] == 0xEF &&
+                           (unsigned char)start[1] == 0xBB &&
+                           (unsigned char)start[2] == 0xBF) {
+            start += 3;
+        }
+        while(end > start && wif_is_space(end[-1])){
+            end--;
+        }
+        while(start < end && wif_is_space(*start)){
+            start++;
+        }
+        if(start == end || *start == ';' || *start == '#'){
+            continue;
+        }
+        if(prev_name.end > prev_name.str && start > line){
+            // A line with leading whitespace continues the value
+            // of the previous name
+            WifString value = {start, end};
+            if(!read_key(data, section, section_name, prev_name, value)
+                && !error){
+                error = lineno;
+            }
+        } else if(*start == '['){
+            const char *section_end = find_chars_or_comment(start + 1, end,
+                "]");
+            if(section_end < end && *section_end == ']'){
+                section_name.str = start + 1;
+                section_name.end = section_end;
+                section = get_section_id(section_name);
+                prev_name.end = prev_name.str;
+            } else if(!error){
+                error = lineno;
             }
-            str[0] = 0;
-            if(data->str[0] == '\n'){
-                data->len--;
-                data->str++;
+        } else {
+            const char *separator = find_chars_or_comment(start, end, "=:");
+            if(separator < end && (*separator == '=' || *separator == ':')){
+                WifString name = {start, separator};
+                while(name.end > name.str && wif_is_space(name.end[-1])){
+                    name.end--;
+                }
+                WifString value = {separator + 1, end};
+                while(value.str < value.end && wif_is_space(*value.str)){
+                    value.str++;
+                }
+                value.end = find_chars_or_comment(value.str, value.end, 0);
+                while(value.end > value.str && wif_is_space(value.end[-1])){
+                    value.end--;
+                }
+                prev_name = name;
+                if(!read_key(data, section, section_name, name, value)
+                    && !error){
+                    error = lineno;
+                }
+            } else if(!error){
+                error = lineno;
             }
-            return ret;
+        }
     }
-    return NULL;
+    return error;
 }
 
 WeaveData *wif_read(char *in_data, long len, const char **error)
 {
     WeaveData *data;
     data = (WeaveData*)calloc(1,sizeof(WeaveData));
-    struct read_data d = {in_data,len};
-    int e = ini_parse_stream((ini_reader)read_from_string,&d,handler,data);
+    int e = parse_wif(data,in_data,len);
     if(e != 0){
         printf("ERROR! %d\n",e);
         *error = "Error reading file";
@@ -442,12 +572,11 @@ void wif_free_weavedata(WeaveData *data)
 }
 
 
-//NOTE(Vidar): This function takes the data which was read from the WIF file
-// and converts it to the data used by the shader
-void wif_get_pattern(tlWeaveParameters *param, WeaveData *data, uint32_t *w,
-    uint32_t *h, float *rw, float *rh)
+// Sets the size and yarn types of param from the data which was
+// read from the WIF file. Returns 0 if the pattern is empty.
+static int wif_get_yarn_types(tlWeaveParameters *param, WeaveData *data,
+    uint32_t *w, uint32_t *h, float *rw, float *rh)
 {
-    uint32_t x,y;
     if(data == 0){
         //NOTE(Vidar): The file was invalid...
         tlYarnType *yarn_types =
@@ -458,7 +587,7 @@ void wif_get_pattern(tlWeaveParameters *param, WeaveData *data, uint32_t *w,
         *w = 0;
         *h = 0;
         param->pattern = 0;
-        return;
+        return 0;
     }
 
 	//Pattern width/height in num of elements
@@ -475,8 +604,6 @@ void wif_get_pattern(tlWeaveParameters *param, WeaveData *data, uint32_t *w,
 
     if(*w > 0 && *h >0){
         uint32_t c;
-        PatternEntry *entries =
-            (PatternEntry*)calloc((*w)*(*h),sizeof(PatternEntry));
         tlYarnType *yarn_types =
             (tlYarnType*)calloc(data->num_colors+1,sizeof(tlYarnType));
 
@@ -494,6 +621,22 @@ void wif_get_pattern(tlWeaveParameters *param, WeaveData *data, uint32_t *w,
 		#undef TL_FLOAT_PARAM
 		#undef TL_COLOR_PARAM
         }
+		param->num_yarn_types = data->num_colors+1;
+        param->yarn_types = yarn_types;
+        return 1;
+    }
+    return 0;
+}
+
+//NOTE(Vidar): This function takes the data which was read from the WIF file
+// and converts it to the data used by the shader
+void wif_get_pattern(tlWeaveParameters *param, WeaveData *data, uint32_t *w,
+    uint32_t *h, float *rw, float *rh)
+{
+    uint32_t x,y;
+    if(wif_get_yarn_types(param,data,w,h,rw,rh)){
+        PatternEntry *entries =
+            (PatternEntry*)calloc((*w)*(*h),sizeof(PatternEntry));
         for(y=0;y<*h;y++){
             for(x=0;x<*w;x++){
                 uint32_t v = data->threading[x];
@@ -507,8 +650,34 @@ void wif_get_pattern(tlWeaveParameters *param, WeaveData *data, uint32_t *w,
             }
         }
         param->pattern = entries;
-		param->num_yarn_types = data->num_colors+1;
-        param->yarn_types = yarn_types;
+    }
+}
+
+void wif_get_draft(tlWeaveParameters *param, WeaveData *data, uint32_t *w,
+    uint32_t *h, float *rw, float *rh)
+{
+    uint32_t i;
+    if(wif_get_yarn_types(param,data,w,h,rw,rh)){
+        tlPatternDraft *draft =
+            (tlPatternDraft*)calloc(1,sizeof(tlPatternDraft));
+        draft->num_shafts = data->num_shafts;
+        draft->num_treadles = data->num_treadles;
+        draft->threading = data->threading;
+        draft->treadling = data->treadling;
+        draft->tieup = data->tieup;
+        data->threading = 0;
+        data->treadling = 0;
+        data->tieup = 0;
+        // Stored as uint8_t, just like PatternEntry::yarn_type
+        draft->warp_yarn_types = (uint8_t*)calloc(*w,sizeof(uint8_t));
+        draft->weft_yarn_types = (uint8_t*)calloc(*h,sizeof(uint8_t));
+        for(i=0;i<*w;i++){
+            draft->warp_yarn_types[i] = (uint8_t)(data->warp.colors[i]+1);
+        }
+        for(i=0;i<*h;i++){
+            draft->weft_yarn_types[i] = (uint8_t)(data->weft.colors[i]+1);
+        }
+        param->draft = draft;
     }
 }
 
@@ -31,5 +31,10 @@ void wif_free_weavedata(WeaveData *data);
 // Allocate and return the pattern from a WIF file
 void wif_get_pattern(tlWeaveParameters *param, WeaveData *data, uint32_t *w, uint32_t *h, 
      float *rw, float *rh);
+// Same as wif_get_pattern, but keeps the draft in param->draft instead of
+// expanding it into param->pattern. Takes over the threading, treadling and
+// tieup of data.
+void wif_get_draft(tlWeaveParameters *param, WeaveData *data, uint32_t *w,
+     uint32_t *h, float *rw, float *rh);
 //void wif_free_pattern(PatternEntry *pattern);
 
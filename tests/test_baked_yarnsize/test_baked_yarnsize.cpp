@@ -0,0 +1,137 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static int num_lookups = 0;
+static int yarnsize_texmap = 0;
+
+float tl_eval_texmap_mono(void *texmap, void *context)
+{
+    return 1.f;
+}
+
+// A yarnsize texture which only depends on u and v
+float tl_eval_texmap_mono_lookup(void *texmap, float u, float v,
+    void *context)
+{
+    num_lookups++;
+    return 0.3f + 0.6f*(0.5f + 0.5f*sinf(13.f*u)*cosf(7.f*v));
+}
+
+tlColor tl_eval_texmap_color(void *texmap, void *context)
+{
+    tlColor ret = {1.f,1.f,1.f};
+    return ret;
+}
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static tlWeaveParameters *load(float uscale, float vscale, float rotation)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif", &error);
+    assert(params);
+    params->realworld_uv = 0;
+    params->uscale = uscale;
+    params->vscale = vscale;
+    params->uvrotation = rotation;
+    params->yarn_types[1].yarnsize_texmap = &yarnsize_texmap;
+    params->yarn_types[1].yarnsize_enabled = 1;
+    return params;
+}
+
+static tlIntersectionData random_intersection(float uv_min, float uv_max)
+{
+    float phi_i = 2.f*(float)M_PI*rnd(), theta_i = 1.5f*rnd();
+    float phi_o = 2.f*(float)M_PI*rnd(), theta_o = 1.5f*rnd();
+    tlIntersectionData d = {uv_min + (uv_max-uv_min)*rnd(),
+        uv_min + (uv_max-uv_min)*rnd(),
+        sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i), cosf(theta_i),
+        sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o), cosf(theta_o),
+        0};
+    return d;
+}
+
+static void test_baked_shades_identically()
+{
+    float settings[][3] = {{1.f,1.f,0.f}, {3.f,2.f,0.f}, {2.f,5.f,30.f},
+        {1.5f,1.5f,-120.f}};
+    for(int s=0;s<4;s++){
+        tlWeaveParameters *params = load(settings[s][0],settings[s][1],
+            settings[s][2]);
+        tlWeaveParameters *baked = load(settings[s][0],settings[s][1],
+            settings[s][2]);
+        tl_prepare(params);
+        tl_prepare_baked_yarnsize(baked,0);
+        assert(!params->baked_yarnsize && baked->baked_yarnsize);
+        // uvs outside of the unit square use the callback
+        for(int i=0;i<20000;i++){
+            tlIntersectionData d = random_intersection(-0.5f,1.5f);
+            tlColor a = tl_shade(d,params);
+            tlColor b = tl_shade(d,baked);
+            assert(a.r == b.r && a.g == b.g && a.b == b.b);
+        }
+        free_params(params);
+        free_params(baked);
+    }
+}
+
+static void test_baked_skips_callbacks()
+{
+    tlWeaveParameters *params = load(3.f,2.f,30.f);
+    tl_prepare_baked_yarnsize(params,0);
+    num_lookups = 0;
+    for(int i=0;i<1000;i++){
+        tl_shade(random_intersection(0.f,1.f),params);
+    }
+    assert(num_lookups == 0);
+    // tl_prepare goes back to calling the texmap
+    tl_prepare(params);
+    assert(!params->baked_yarnsize);
+    for(int i=0;i<1000;i++){
+        tl_shade(random_intersection(0.f,1.f),params);
+    }
+    assert(num_lookups > 0);
+    free_params(params);
+}
+
+static void test_table_only_built_when_useful()
+{
+    tlWeaveParameters *params = load(1.f,1.f,0.f);
+    params->yarn_types[1].yarnsize_texmap = 0;
+    tl_prepare_baked_yarnsize(params,0);
+    assert(!params->baked_yarnsize);
+    free_params(params);
+
+    params = load(1e6f,1e6f,0.f);
+    tl_prepare_baked_yarnsize(params,0);
+    assert(!params->baked_yarnsize);
+    free_params(params);
+}
+
+int main()
+{
+    test(baked_shades_identically);
+    test(baked_skips_callbacks);
+    test(table_only_built_when_useful);
+    return 0;
+}
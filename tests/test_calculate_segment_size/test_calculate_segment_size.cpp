@@ -233,6 +233,51 @@ static void test_calculates_segment_between_parallel_warps_halfsize() {
     assert(yarn.width == 0.5); assert(yarn.length == 0.25 + 0.25);
 }
 
+static void test_pattern_run_tables_match_pattern_walk() {
+    //The run tables built by tl_prepare should give the same result as
+    // walking the pattern, also for runs longer than what fits in a table
+    // entry.
+    tlWeaveParameters *params = params_2parallel_halfsize;
+    uint32_t x, y;
+    for (y = 0; y < params->pattern_height; y++) {
+        for (x = 0; x < params->pattern_width; x++) {
+            for (int along_y = 0; along_y < 2; along_y++) {
+                assert(tl_pattern_run(params, x, y, along_y, 1) ==
+                    tl_pattern_run_walk(params, x, y, along_y, 1));
+                assert(tl_pattern_run(params, x, y, along_y, -1) ==
+                    tl_pattern_run_walk(params, x, y, along_y, -1));
+            }
+        }
+    }
+
+    uint32_t w = 300, h = 700;
+    uint8_t *warp_above = (uint8_t*)calloc(w*h, 1);
+    uint8_t *yarn_type  = (uint8_t*)calloc(w*h, 1);
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            warp_above[x + y*w] = (x % 7 == 0) || (y % 400 == 3 && x % 2);
+            yarn_type[x + y*w] = 1;
+        }
+    }
+    tlColor color = {1.f, 1.f, 1.f};
+    params = tl_weave_pattern_from_data(warp_above, yarn_type, 1, &color,
+        w, h);
+    tl_prepare(params);
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            for (int along_y = 0; along_y < 2; along_y++) {
+                assert(tl_pattern_run(params, x, y, along_y, 1) ==
+                    tl_pattern_run_walk(params, x, y, along_y, 1));
+                assert(tl_pattern_run(params, x, y, along_y, -1) ==
+                    tl_pattern_run_walk(params, x, y, along_y, -1));
+            }
+        }
+    }
+    tl_free_weave_parameters(params);
+    free(warp_above);
+    free(yarn_type);
+}
+
 static void setup() {
     intersection_data.wi_z = 1.f;
     intersection_data.context = NULL;
@@ -295,6 +340,7 @@ int main(int argc, char **argv)
     test(calculateSegmentDim_returns_true_when_hitting_extension);
     test(calculateSegmentDim_returns_false_when_missing_yarn_and_extension);
     test(calculates_segment_between_parallel_warps_halfsize);
+    test(pattern_run_tables_match_pattern_walk);
 }
 
 //Define dummy wceval for texmaps
@@ -0,0 +1,270 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#define TL_NO_TEXTURE_CALLBACKS
+#include "../../src/thunderloom.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+#define NUM_POINTS 500
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static void setup(tlWeaveParameters *params)
+{
+    params->realworld_uv = 0;
+    params->uscale = 1.f;
+    params->vscale = 1.f;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlColor color = {0.2f + 0.2f*(float)i, 0.5f, 0.3f};
+        params->yarn_types[i].color = color;
+        params->yarn_types[i].color_enabled = 1;
+    }
+    tl_prepare(params);
+}
+
+static tlIntersectionData points[NUM_POINTS];
+
+static void make_points()
+{
+    srand(1);
+    for(int i=0;i<NUM_POINTS;i++){
+        float phi_i = 2.f*(float)M_PI*rnd(), theta_i = 1.5f*rnd();
+        float phi_o = 2.f*(float)M_PI*rnd(), theta_o = 1.5f*rnd();
+        tlIntersectionData d = {rnd(), rnd(),
+            sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i),
+            cosf(theta_i),
+            sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o),
+            cosf(theta_o),
+            0};
+        points[i] = d;
+    }
+}
+
+static void shade_points(const tlWeaveParameters *params, tlColor *result)
+{
+    for(int i=0;i<NUM_POINTS;i++){
+        result[i] = tl_shade(points[i], params);
+    }
+}
+
+// Compiles params, frees it and checks that the compiled pattern shades
+// the same as params did
+static void check_compiled_copy(tlWeaveParameters *params)
+{
+    static tlColor expected[NUM_POINTS], result[NUM_POINTS];
+    setup(params);
+    shade_points(params, expected);
+    tlCompiledPattern *compiled = tl_compile_pattern(params, 0, 0);
+    assert(compiled && compiled->ref_count == 1);
+    free_params(params);
+    shade_points(&compiled->params, result);
+    assert(memcmp(result, expected, sizeof(expected)) == 0);
+    tl_release_compiled_pattern(compiled);
+}
+
+static void test_compiled_pattern_is_a_copy() {
+    const char *error = 0;
+    make_points();
+    check_compiled_copy(tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif", &error));
+    check_compiled_copy(tl_weave_pattern_from_file_draft(
+        "../../src/wif/data/41753.wif", &error));
+    tlWeaveParameters *packed = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif", &error);
+    tl_pack_pattern(packed);
+    assert(packed->packed);
+    check_compiled_copy(packed);
+    tlYarnStripe warp_stripes[] = {{3,1}, {1,2}};
+    tlYarnStripe weft_stripes[] = {{2,2}};
+    tlColor yarn_colors[] = {{0.8f,0.2f,0.2f}, {0.2f,0.2f,0.8f}};
+    check_compiled_copy(tl_weave_pattern_from_procedural(TL_WEAVE_TWILL,
+        2, 1, 1, warp_stripes, 2, weft_stripes, 1, 2, yarn_colors, &error));
+    // The compiled pattern keeps the cache entry alive
+    check_compiled_copy(tl_weave_pattern_from_file_cached(
+        "../../src/wif/data/41753.wif", &error));
+}
+
+static void test_edits_do_not_affect_compiled_pattern() {
+    static tlColor expected[NUM_POINTS], result[NUM_POINTS];
+    const char *error = 0;
+    make_points();
+    tlWeaveParameters *params = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif", &error);
+    setup(params);
+    shade_points(params, expected);
+    tlCompiledPattern *compiled = tl_compile_pattern(params,
+        TL_COMPILE_PREFILTERED, 0);
+    assert(compiled->params.prefiltered && !params->prefiltered);
+    params->yarn_types[0].color.r = 1.f;
+    params->pattern[0].warp_above = !params->pattern[0].warp_above;
+    params->uscale = 3.f;
+    tl_prepare(params);
+    shade_points(&compiled->params, result);
+    assert(memcmp(result, expected, sizeof(expected)) == 0);
+    tl_release_compiled_pattern(compiled);
+    free_params(params);
+}
+
+static void test_old_pattern_lives_until_released() {
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif", &error);
+    setup(params);
+    tlPatternSlot slot;
+    memset(&slot, 0, sizeof(slot));
+    assert(tl_pattern_slot_acquire(&slot) == 0);
+
+    tlCompiledPattern *a = tl_compile_pattern(params, 0, 0);
+    tl_pattern_slot_publish(&slot, a);
+    tlCompiledPattern *acquired_a = tl_pattern_slot_acquire(&slot);
+    assert(acquired_a == a && a->ref_count == 2);
+
+    params->yarn_types[0].color.g = 0.9f;
+    tlCompiledPattern *b = tl_compile_pattern(params, 0, 0);
+    tl_pattern_slot_publish(&slot, b);
+    assert(a->ref_count == 1);
+    tl_shade(points[0], &a->params);
+    tlCompiledPattern *acquired_b = tl_pattern_slot_acquire(&slot);
+    assert(acquired_b == b && b->ref_count == 2);
+    assert(acquired_b->params.yarn_types[0].color.g == 0.9f);
+    assert(acquired_a->params.yarn_types[0].color.g == 0.5f);
+    tl_release_compiled_pattern(acquired_a);
+
+    // Publishing NULL empties the slot
+    tl_pattern_slot_publish(&slot, 0);
+    assert(tl_pattern_slot_acquire(&slot) == 0);
+    assert(b->ref_count == 1);
+    tl_shade(points[0], &acquired_b->params);
+    tl_release_compiled_pattern(acquired_b);
+    free_params(params);
+}
+
+#define NUM_THREADS 4
+#define NUM_VERSIONS 100
+
+static tlPatternSlot render_slot;
+static volatile int rendering;
+
+// Shades with whatever compiled pattern is current, and checks that every
+// yarn type of it belongs to the same edit, which only increases
+static void render(int *num_frames)
+{
+    float last_version = -1.f;
+    do{
+        tlCompiledPattern *compiled = tl_pattern_slot_acquire(&render_slot);
+        const tlWeaveParameters *params = &compiled->params;
+        float version = params->yarn_types[0].color.r;
+        assert(version >= last_version);
+        for(uint32_t i=0;i<params->num_yarn_types;i++){
+            assert(params->yarn_types[i].color.r == version);
+            assert(params->yarn_types[i].specular_amount == version);
+        }
+        for(int i=0;i<10;i++){
+            tl_shade(points[i], params);
+        }
+        last_version = version;
+        tl_release_compiled_pattern(compiled);
+        (*num_frames)++;
+    } while(rendering);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI render_thread(LPVOID num_frames)
+{
+    render((int*)num_frames);
+    return 0;
+}
+#else
+static void *render_thread(void *num_frames)
+{
+    render((int*)num_frames);
+    return 0;
+}
+#endif
+
+static void set_version(tlWeaveParameters *params, int version)
+{
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        params->yarn_types[i].color.r = (float)version/NUM_VERSIONS;
+        params->yarn_types[i].specular_amount = (float)version/NUM_VERSIONS;
+        params->yarn_types[i].specular_amount_enabled = 1;
+    }
+}
+
+static void test_hot_swap_while_rendering() {
+    const char *error = 0;
+    make_points();
+    tlWeaveParameters *params = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif", &error);
+    setup(params);
+    set_version(params, 0);
+    memset(&render_slot, 0, sizeof(render_slot));
+    tl_pattern_slot_publish(&render_slot, tl_compile_pattern(params, 0, 0));
+    rendering = 1;
+    int num_frames[NUM_THREADS] = {0};
+#ifdef _WIN32
+    HANDLE threads[NUM_THREADS];
+    for(int i=0;i<NUM_THREADS;i++){
+        threads[i] = CreateThread(0, 0, render_thread, &num_frames[i], 0, 0);
+    }
+#else
+    pthread_t threads[NUM_THREADS];
+    for(int i=0;i<NUM_THREADS;i++){
+        pthread_create(&threads[i], 0, render_thread, &num_frames[i]);
+    }
+#endif
+    for(int version=1;version<NUM_VERSIONS;version++){
+        set_version(params, version);
+        tl_pattern_slot_publish(&render_slot,
+            tl_compile_pattern(params, 0, 0));
+    }
+    rendering = 0;
+    for(int i=0;i<NUM_THREADS;i++){
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], 0);
+#endif
+        assert(num_frames[i] > 0);
+    }
+    tlCompiledPattern *last = tl_pattern_slot_acquire(&render_slot);
+    assert(last->ref_count == 2);
+    assert(last->params.yarn_types[0].color.r
+        == (float)(NUM_VERSIONS - 1)/NUM_VERSIONS);
+    tl_release_compiled_pattern(last);
+    tl_pattern_slot_publish(&render_slot, 0);
+    free_params(params);
+}
+
+int main(int argc, char **argv)
+{
+    printf("-----------------------------\n");
+    test(compiled_pattern_is_a_copy);
+    test(edits_do_not_affect_compiled_pattern);
+    test(old_pattern_lives_until_released);
+    test(hot_swap_while_rendering);
+}
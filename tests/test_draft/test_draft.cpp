@@ -0,0 +1,171 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static const char *wif_files[] = {
+    "../../src/wif/data/2229.wif",
+    "../../src/wif/data/41753.wif",
+    "../test_calculate_segment_size/54235plain.wif",
+    "../test_yarn_size/3parallelwarps.wif",
+    "../test_yarn_size/3parallelwefts.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(*wif_files))
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static int same_color(tlColor a, tlColor b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+static int same_result(tlEvalResult a, tlEvalResult b)
+{
+    tlPatternData pa = a.pattern_data, pb = b.pattern_data;
+    if(!pa.yarn_hit || !pb.yarn_hit){
+        // The rest of the pattern data is not set between yarns
+        return pa.yarn_hit == pb.yarn_hit
+            && same_color(a.diffuse,b.diffuse)
+            && same_color(a.specular,b.specular)
+            && same_color(a.opacity,b.opacity);
+    }
+    return pa.yarn_type == pb.yarn_type && pa.normal_x == pb.normal_x
+        && pa.normal_y == pb.normal_y && pa.normal_z == pb.normal_z
+        && pa.u == pb.u && pa.v == pb.v && pa.length == pb.length
+        && pa.width == pb.width && pa.x == pb.x && pa.y == pb.y
+        && pa.total_index_x == pb.total_index_x
+        && pa.total_index_y == pb.total_index_y
+        && pa.warp_above == pb.warp_above && pa.yarn_hit == pb.yarn_hit
+        && pa.ext_between_parallel == pb.ext_between_parallel
+        && same_color(a.diffuse,b.diffuse)
+        && same_color(a.specular,b.specular)
+        && same_color(a.opacity,b.opacity);
+}
+
+static void setup(tlWeaveParameters *params)
+{
+    params->realworld_uv = 0;
+    params->uscale = 3.f;
+    params->vscale = 2.f;
+    params->yarn_types[0].yarnsize = 0.8f;
+    if(params->num_yarn_types > 1){
+        params->yarn_types[1].yarnsize = 0.6f;
+        params->yarn_types[1].yarnsize_enabled = 1;
+    }
+}
+
+static void test_draft_matches_pattern()
+{
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        const char *error = 0;
+        tlWeaveParameters *expanded = tl_weave_pattern_from_file(wif_files[f],
+            &error);
+        // Drafts are not shrunk to a single repeat
+        tl_expand_pattern_repeats(expanded);
+        tlWeaveParameters *draft = tl_weave_pattern_from_file_draft(
+            wif_files[f],&error);
+        assert(expanded && draft);
+        assert(draft->draft && !draft->pattern);
+        assert(draft->pattern_width == expanded->pattern_width);
+        assert(draft->pattern_height == expanded->pattern_height);
+        assert(draft->num_yarn_types == expanded->num_yarn_types);
+        uint32_t w = expanded->pattern_width;
+        uint32_t h = expanded->pattern_height;
+        for(uint32_t y=0;y<h;y++){
+            for(uint32_t x=0;x<w;x++){
+                PatternEntry a = expanded->pattern[x + y*w];
+                PatternEntry b = tl_pattern_entry(draft,x,y);
+                assert(a.warp_above == b.warp_above);
+                assert(a.yarn_type == b.yarn_type);
+            }
+        }
+        tl_prepare(expanded);
+        tl_prepare(draft);
+        for(uint32_t y=0;y<h;y++){
+            for(uint32_t x=0;x<w;x++){
+                for(int i=0;i<4;i++){
+                    uint8_t along_y = i/2;
+                    int32_t direction = i%2 ? 1 : -1;
+                    assert(tl_pattern_run(expanded,x,y,along_y,direction) ==
+                        tl_pattern_run(draft,x,y,along_y,direction));
+                }
+            }
+        }
+        free_params(expanded);
+        free_params(draft);
+    }
+}
+
+static void test_draft_shades_identically()
+{
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        const char *error = 0;
+        tlWeaveParameters *expanded = tl_weave_pattern_from_file(wif_files[f],
+            &error);
+        tl_expand_pattern_repeats(expanded);
+        tlWeaveParameters *draft = tl_weave_pattern_from_file_draft(
+            wif_files[f],&error);
+        setup(expanded);
+        setup(draft);
+        tl_prepare(expanded);
+        tl_prepare(draft);
+        for(int i=0;i<20000;i++){
+            float phi_i = 2.f*(float)M_PI*rnd(), theta_i = 1.5f*rnd();
+            float phi_o = 2.f*(float)M_PI*rnd(), theta_o = 1.5f*rnd();
+            tlIntersectionData d = {rnd(), rnd(),
+                sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i),
+                cosf(theta_i),
+                sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o),
+                cosf(theta_o), 0};
+            tlEvalResult a = tl_eval_all(d,expanded,TL_EVAL_ALL);
+            tlEvalResult b = tl_eval_all(d,draft,TL_EVAL_ALL);
+            assert(same_result(a,b));
+        }
+        free_params(expanded);
+        free_params(draft);
+    }
+}
+
+static void test_draft_writes_same_ptn()
+{
+    const char *error = 0;
+    tlWeaveParameters *expanded = tl_weave_pattern_from_file(wif_files[1],
+        &error);
+    tl_expand_pattern_repeats(expanded);
+    tlWeaveParameters *draft = tl_weave_pattern_from_file_draft(wif_files[1],
+        &error);
+    long len_a = 0, len_b = 0;
+    unsigned char *a = tl_pattern_to_ptn_v3_file(expanded,&len_a);
+    unsigned char *b = tl_pattern_to_ptn_v3_file(draft,&len_b);
+    assert(len_a == len_b && memcmp(a,b,len_a) == 0);
+    free(a);
+    free(b);
+    free_params(expanded);
+    free_params(draft);
+}
+
+int main()
+{
+    test(draft_matches_pattern);
+    test(draft_shades_identically);
+    test(draft_writes_same_ptn);
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#define TL_NO_TEXTURE_CALLBACKS
+// A coarser table than the default, to keep the test fast
+#define TL_FAR_FIELD_THETA_RESOLUTION 9
+#define TL_FAR_FIELD_PHI_RESOLUTION 16
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static tlWeaveParameters *load()
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif", &error);
+    assert(params);
+    params->realworld_uv = 0;
+    params->uscale = 1.f;
+    params->vscale = 1.f;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = &params->yarn_types[i];
+        yarn_type->yarnsize = 0.8f;
+        yarn_type->yarnsize_enabled = 1;
+        tlColor color = {0.2f + 0.3f*(float)i, 0.5f, 0.8f - 0.2f*(float)i};
+        yarn_type->color = color;
+        yarn_type->color_enabled = 1;
+    }
+    tl_prepare(params);
+    return params;
+}
+
+static tlIntersectionData intersection(float u, float v, float theta_i,
+    float phi_i, float theta_o, float phi_o)
+{
+    tlIntersectionData d = {u, v,
+        sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i), cosf(theta_i),
+        sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o), cosf(theta_o),
+        0};
+    return d;
+}
+
+static float color_difference(tlColor a, tlColor b)
+{
+    float d = fabsf(a.r - b.r);
+    d = fabsf(a.g - b.g) > d ? fabsf(a.g - b.g) : d;
+    return fabsf(a.b - b.b) > d ? fabsf(a.b - b.b) : d;
+}
+
+static void test_table_matches_average() {
+    tlWeaveParameters *params = load();
+    tl_prepare_far_field(params, 0, 0);
+    assert(params->far_field);
+    float step_theta = 0.5f*(float)M_PI/(TL_FAR_FIELD_THETA_RESOLUTION - 1);
+    float step_phi = 2.f*(float)M_PI/TL_FAR_FIELD_PHI_RESOLUTION;
+    // At the entries of the table, so that the interpolation
+    // does not add to the error
+    int entries[][3] = {{1, 2, 0}, {3, 5, 8}, {4, 4, 7}, {7, 2, 3}};
+    srand(1);
+    for(int k=0;k<4;k++){
+        float theta_i = entries[k][0]*step_theta;
+        float theta_o = entries[k][1]*step_theta;
+        float phi_d = entries[k][2]*step_phi;
+        double sum[6] = {0.0};
+        const int n = 50000;
+        for(int i=0;i<n;i++){
+            float phi_o = 2.f*(float)M_PI*rnd();
+            tlIntersectionData d = intersection(rnd(), rnd(), theta_i,
+                phi_o + phi_d, theta_o, phi_o);
+            tlEvalResult r = tl_eval_all(d, params,
+                TL_EVAL_DIFFUSE | TL_EVAL_SPECULAR);
+            sum[0] += r.diffuse.r; sum[1] += r.diffuse.g;
+            sum[2] += r.diffuse.b; sum[3] += r.specular.r;
+            sum[4] += r.specular.g; sum[5] += r.specular.b;
+        }
+        tlColor diffuse = {(float)(sum[0]/n), (float)(sum[1]/n),
+            (float)(sum[2]/n)};
+        tlColor specular = {(float)(sum[3]/n), (float)(sum[4]/n),
+            (float)(sum[5]/n)};
+        tlIntersectionData d = intersection(0.3f, 0.6f, theta_i,
+            1.f + phi_d, theta_o, 1.f);
+        tlEvalResult r = tl_eval_far_field(d, params, TL_EVAL_ALL);
+        assert(!r.pattern_data.yarn_hit);
+        assert(color_difference(r.diffuse, diffuse) < 0.01f*diffuse.g);
+        assert(color_difference(r.specular, specular)
+            < 0.15f*specular.r + 1e-3f);
+        // Rotating both directions gives the same result
+        d = intersection(0.3f, 0.6f, theta_i, 2.5f + phi_d, theta_o, 2.5f);
+        tlEvalResult rotated = tl_eval_far_field(d, params, TL_EVAL_ALL);
+        assert(color_difference(r.diffuse, rotated.diffuse) < 1e-5f);
+        assert(color_difference(r.specular, rotated.specular) < 1e-5f);
+    }
+    free_params(params);
+}
+
+static void test_threads_build_the_same_table() {
+    tlWeaveParameters *params = load();
+    tl_prepare_far_field(params, 0, 1);
+    tlFarFieldBRDF single = *params->far_field;
+    size_t size = TL_FAR_FIELD_THETA_RESOLUTION*TL_FAR_FIELD_THETA_RESOLUTION
+        *TL_FAR_FIELD_PHI_RESOLUTION*sizeof(tlColor);
+    tlColor *diffuse = (tlColor*)malloc(size);
+    tlColor *specular = (tlColor*)malloc(size);
+    memcpy(diffuse, single.diffuse, size);
+    memcpy(specular, single.specular, size);
+    tl_prepare_far_field(params, 0, 7);
+    assert(params->far_field->hash == single.hash);
+    assert(memcmp(params->far_field->diffuse, diffuse, size) == 0);
+    assert(memcmp(params->far_field->specular, specular, size) == 0);
+    // tl_prepare removes the table
+    tl_prepare(params);
+    assert(!params->far_field);
+    free(diffuse);
+    free(specular);
+    free_params(params);
+}
+
+static void test_blob_round_trip() {
+    tlWeaveParameters *params = load();
+    tl_prepare_far_field(params, 0, 0);
+    long len;
+    unsigned char *blob = tl_far_field_to_blob(params, &len);
+    assert(blob && len > 0);
+
+    tlWeaveParameters *loaded = load();
+    const char *error = 0;
+    assert(tl_far_field_from_blob(loaded, blob, len, &error));
+    srand(3);
+    for(int i=0;i<1000;i++){
+        tlIntersectionData d = intersection(rnd(), rnd(), 1.6f*rnd(),
+            2.f*(float)M_PI*rnd(), 1.6f*rnd(), 2.f*(float)M_PI*rnd());
+        tlEvalResult a = tl_eval_far_field(d, params, TL_EVAL_ALL);
+        tlEvalResult b = tl_eval_far_field(d, loaded, TL_EVAL_ALL);
+        assert(memcmp(&a.diffuse, &b.diffuse, sizeof(tlColor)) == 0);
+        assert(memcmp(&a.specular, &b.specular, sizeof(tlColor)) == 0);
+        assert(memcmp(&a.opacity, &b.opacity, sizeof(tlColor)) == 0);
+    }
+    free_params(loaded);
+
+    // A blob built from other parameters is rejected
+    loaded = load();
+    loaded->yarn_types[1].specular_amount = 0.5f;
+    loaded->yarn_types[1].specular_amount_enabled = 1;
+    error = 0;
+    assert(!tl_far_field_from_blob(loaded, blob, len, &error) && error);
+    assert(!loaded->far_field);
+    error = 0;
+    assert(!tl_far_field_from_blob(params, blob, len - 1, &error) && error);
+    free_params(loaded);
+    free(blob);
+    free_params(params);
+}
+
+int main(int argc, char **argv)
+{
+    printf("-----------------------------\n");
+    test(table_matches_average);
+    test(threads_build_the_same_table);
+    test(blob_round_trip);
+}
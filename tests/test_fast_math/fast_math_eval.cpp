@@ -0,0 +1,33 @@
+// The fast math versions of the shading functions are compiled in
+// this translation unit, so that test_fast_math.cpp can compare them against
+// the exact ones. The types are the same in both, only the functions differ.
+#define TL_NO_FILES
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_FAST_MATH
+#define TL_PUBLIC_FUNC_PREFIX static
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+#include "fast_math_eval.h"
+
+float fast_atan2f(float y, float x)
+{
+    return tl_atan2f(y,x);
+}
+
+tlPatternData fast_get_pattern_data(tlIntersectionData intersection_data,
+    const tlWeaveParameters *params)
+{
+    return tl_get_pattern_data(intersection_data,params);
+}
+
+tlColor fast_eval_specular(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params)
+{
+    return tl_eval_specular(intersection_data,data,params);
+}
+
+tlColor fast_shade(tlIntersectionData intersection_data,
+    const tlWeaveParameters *params)
+{
+    return tl_shade(intersection_data,params);
+}
@@ -0,0 +1,8 @@
+// Shading functions from fast_math_eval.cpp, compiled with TL_FAST_MATH
+float fast_atan2f(float y, float x);
+tlPatternData fast_get_pattern_data(tlIntersectionData intersection_data,
+    const tlWeaveParameters *params);
+tlColor fast_eval_specular(tlIntersectionData intersection_data,
+    tlPatternData data, const tlWeaveParameters *params);
+tlColor fast_shade(tlIntersectionData intersection_data,
+    const tlWeaveParameters *params);
@@ -0,0 +1,157 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+#include "fast_math_eval.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+// See the documentation of TL_FAST_MATH
+#define ATAN2_TOLERANCE 6e-7
+
+// Points right at the edge of a highlight can end up on either
+// side of it, so a few outliers are allowed.
+#define RELATIVE_TOLERANCE 1e-4f
+#define ABSOLUTE_TOLERANCE 1e-6f
+#define MAX_OUTLIER_FRACTION 0.001f
+
+// Directions on a grid over the hemisphere
+#define NUM_THETA 12
+#define NUM_PHI 24
+#define NUM_DIRECTIONS (NUM_THETA*NUM_PHI)
+#define NUM_UV 6
+
+static const char *wif_files[] = {
+    "../test_calculate_segment_size/54235plain.wif",
+    "../test_yarn_size/3parallelwarps.wif",
+    "../../src/wif/data/2229.wif",
+    "../../src/wif/data/41753.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(*wif_files))
+#define NUM_CONFIGS 3
+
+static float dir_x[NUM_DIRECTIONS], dir_y[NUM_DIRECTIONS],
+             dir_z[NUM_DIRECTIONS];
+
+static void generate_directions()
+{
+    for(int t=0;t<NUM_THETA;t++){
+        for(int p=0;p<NUM_PHI;p++){
+            float theta = 1.5f*(t + 0.5f)/(float)NUM_THETA;
+            float phi = 2.f*(float)M_PI*(p + 0.5f)/(float)NUM_PHI;
+            int i = t*NUM_PHI + p;
+            dir_x[i] = sinf(theta)*cosf(phi);
+            dir_y[i] = sinf(theta)*sinf(phi);
+            dir_z[i] = cosf(theta);
+        }
+    }
+}
+
+static tlIntersectionData intersection(float uv_x, float uv_y, int i, int o)
+{
+    tlIntersectionData ret = {uv_x, uv_y, dir_x[i], dir_y[i], dir_z[i],
+        dir_x[o], dir_y[o], dir_z[o], 0};
+    return ret;
+}
+
+static tlWeaveParameters *load_params(const char *file, int config)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(file,&error);
+    assert(params);
+    params->realworld_uv = 0;
+    params->uscale = config == 1 ? 3.f : 1.f;
+    params->vscale = config == 1 ? 2.f : 1.f;
+    params->uvrotation = config == 2 ? 30.f : 0.f;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = &params->yarn_types[i];
+        yarn_type->psi_enabled = 1;
+        yarn_type->psi = config == 0 ? 0.f : (i%2 ? 0.f : 0.5f);
+        yarn_type->specular_noise_enabled = 1;
+        yarn_type->specular_noise = config == 2 ? 0.4f : 0.f;
+    }
+    tl_prepare(params);
+    return params;
+}
+
+static int within_tolerance(float a, float b)
+{
+    return fabsf(a-b) <= RELATIVE_TOLERANCE*fabsf(b) + ABSOLUTE_TOLERANCE;
+}
+
+static int colors_within_tolerance(tlColor a, tlColor b)
+{
+    return within_tolerance(a.r,b.r) && within_tolerance(a.g,b.g)
+        && within_tolerance(a.b,b.b);
+}
+
+static void test_atan2_within_tolerance() {
+    double max_error = 0.0;
+    for(int i=-1000;i<=1000;i++){
+        for(int j=-1000;j<=1000;j++){
+            float y = 1e-3f*(float)i;
+            float x = 1e-3f*(float)j;
+            double e = fabs(fast_atan2f(y,x) - atan2((double)y,(double)x));
+            max_error = e > max_error ? e : max_error;
+        }
+    }
+    assert(fast_atan2f(0.f,0.f) == 0.f);
+    assert(max_error <= ATAN2_TOLERANCE);
+}
+
+// Compares the specular of the two paths for the same pattern data, and
+// tl_shade, which includes the pattern lookup, over the direction grid.
+static void test_fast_math_matches_exact() {
+    uint32_t num_points = 0, num_outliers = 0, num_highlights = 0;
+    generate_directions();
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        for(int config=0;config<NUM_CONFIGS;config++){
+            tlWeaveParameters *params = load_params(wif_files[f],config);
+            srand(f*NUM_CONFIGS + config);
+            for(int uv=0;uv<NUM_UV;uv++){
+                float uv_x = -1.f + 3.f*rand()/(float)RAND_MAX;
+                float uv_y = -1.f + 3.f*rand()/(float)RAND_MAX;
+                for(int i=0;i<NUM_DIRECTIONS;i++){
+                    for(int o=0;o<NUM_DIRECTIONS;o++){
+                        tlIntersectionData d = intersection(uv_x,uv_y,i,o);
+                        tlPatternData data = tl_get_pattern_data(d,params);
+                        tlColor exact = tl_eval_specular(d,data,params);
+                        tlColor fast = fast_eval_specular(d,data,params);
+                        num_points++;
+                        if(exact.r > 0.f){
+                            num_highlights++;
+                        }
+                        if(!colors_within_tolerance(fast,exact)){
+                            num_outliers++;
+                        }
+                        if(o%7 == 0){
+                            num_points++;
+                            if(!colors_within_tolerance(fast_shade(d,params),
+                                tl_shade(d,params))){
+                                num_outliers++;
+                            }
+                        }
+                    }
+                }
+            }
+            tl_free_weave_parameters(params);
+        }
+    }
+    // Make sure that we actually tested some highlights
+    assert(num_highlights > num_points/100);
+    assert(num_outliers <= MAX_OUTLIER_FRACTION*num_points);
+}
+
+int main(int argc, char **argv)
+{
+    printf("-----------------------------\n");
+    test(atan2_within_tolerance);
+    test(fast_math_matches_exact);
+}
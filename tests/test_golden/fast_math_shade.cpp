@@ -0,0 +1,17 @@
+// Compiled with TL_FAST_MATH, see fast_math_eval.cpp in
+// test_fast_math
+#define TL_NO_FILES
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_FAST_MATH
+#define TL_PUBLIC_FUNC_PREFIX static
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+#include "golden_modes.h"
+
+void fast_math_shade(const tlIntersectionData *points, uint32_t count,
+    const tlWeaveParameters *params, tlColor *out)
+{
+    for(uint32_t i=0;i<count;i++){
+        out[i] = tl_shade(points[i],params);
+    }
+}
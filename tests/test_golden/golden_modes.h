@@ -0,0 +1,6 @@
+// Shading modes which are chosen at compile time, each compiled in its own
+// translation unit. They shade count points with tl_shade.
+void fast_math_shade(const tlIntersectionData *points, uint32_t count,
+    const tlWeaveParameters *params, tlColor *out);
+void segment_cache_shade(const tlIntersectionData *points, uint32_t count,
+    const tlWeaveParameters *params, tlColor *out);
@@ -0,0 +1,17 @@
+// Compiled with TL_SEGMENT_CACHE, in the same way as
+// fast_math_shade.cpp
+#define TL_NO_FILES
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_SEGMENT_CACHE
+#define TL_PUBLIC_FUNC_PREFIX static
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+#include "golden_modes.h"
+
+void segment_cache_shade(const tlIntersectionData *points, uint32_t count,
+    const tlWeaveParameters *params, tlColor *out)
+{
+    for(uint32_t i=0;i<count;i++){
+        out[i] = tl_shade(points[i],params);
+    }
+}
@@ -0,0 +1,420 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+#include "golden_modes.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+// Renders a swatch of each pattern with every shading mode and compares it
+// against the references in references/, which are rendered with tl_shade.
+// Run with --update to write new references, after a change which is meant
+// to change the shading. The shading throughput of each swatch and mode is
+// printed at the end. With --check-budgets, a mode which is slower than its
+// budget, relative to tl_shade, fails. The budgets only catch large
+// regressions, since the timings vary by several percent between runs.
+
+// The WIF files in tests/ which are not copies of each other
+static const char *swatch_files[] = {
+    "../test_calculate_segment_size/2parallel.wif",
+    "../test_calculate_segment_size/54235plain.wif",
+    "../test_yarn_size/3parallelwarps.wif",
+    "../test_yarn_size/3parallelwefts.wif",
+    "../test_yarn_size/test.wif",
+    "../../frontends/mitsuba/example_scenes/monkeytowel/8452.wif",
+};
+#define NUM_SWATCHES (sizeof(swatch_files)/sizeof(*swatch_files))
+
+// Each swatch is 2x2 tiles, one for each pair of light and view directions,
+// given as theta and phi in degrees. Each tile shows CELLS_PER_TILE by
+// CELLS_PER_TILE cells of the pattern.
+#define TILE_SIZE 32
+#define SWATCH_SIZE (2*TILE_SIZE)
+#define NUM_PIXELS (SWATCH_SIZE*SWATCH_SIZE)
+#define CELLS_PER_TILE 4
+static const float tile_directions[4][4] = {
+    { 0.f,  0.f,  0.f,   0.f},
+    {30.f,  0.f, 30.f, 180.f},
+    {60.f, 90.f, 45.f, 270.f},
+    {45.f, 30.f, 10.f, 150.f},
+};
+
+// Allows for differences in libm and compiler between the
+// machine which rendered the references and this one
+#define REFERENCE_RELATIVE_TOLERANCE 1e-4f
+#define REFERENCE_ABSOLUTE_TOLERANCE 1e-5f
+
+// Minimum time spent shading each swatch in each timing, in seconds. The
+// modes are timed in turn, so that each timing can be compared to the exact
+// timing right before it, and the median of the repetitions is reported.
+#define MIN_TIMING 0.02
+#define TIMING_REPETITIONS 15
+
+typedef void (*ShadeFunction)(const tlIntersectionData *points,
+    uint32_t count, const tlWeaveParameters *params, tlColor *out);
+
+enum
+{
+    LOAD_EXPANDED,
+    LOAD_DRAFT,
+    LOAD_PACKED,
+};
+
+typedef struct
+{
+    const char *name;
+    ShadeFunction shade;
+    int load;
+    // Added to the reference tolerance. Points right at the edge
+    // of a highlight can end up on either side of it in the approximate
+    // modes, so a few outliers are allowed.
+    float relative_tolerance;
+    float max_outlier_fraction;
+    // The longest time per point allowed with --check-budgets, relative to
+    // the exact mode. Kept well above the expected time, since the budgets
+    // are checked on shared machines.
+    float budget;
+} ShadingMode;
+
+static void exact_shade(const tlIntersectionData *points, uint32_t count,
+    const tlWeaveParameters *params, tlColor *out)
+{
+    for(uint32_t i=0;i<count;i++){
+        out[i] = tl_shade(points[i],params);
+    }
+}
+
+static void batch_shade(const tlIntersectionData *points, uint32_t count,
+    const tlWeaveParameters *params, tlColor *out)
+{
+    static float a[11*NUM_PIXELS];
+    assert(count <= NUM_PIXELS);
+    float *uv_x = a, *uv_y = a + count;
+    float *wi_x = a + 2*count, *wi_y = a + 3*count, *wi_z = a + 4*count;
+    float *wo_x = a + 5*count, *wo_y = a + 6*count, *wo_z = a + 7*count;
+    float *r = a + 8*count, *g = a + 9*count, *b = a + 10*count;
+    for(uint32_t i=0;i<count;i++){
+        uv_x[i] = points[i].uv_x; uv_y[i] = points[i].uv_y;
+        wi_x[i] = points[i].wi_x; wi_y[i] = points[i].wi_y;
+        wi_z[i] = points[i].wi_z;
+        wo_x[i] = points[i].wo_x; wo_y[i] = points[i].wo_y;
+        wo_z[i] = points[i].wo_z;
+    }
+    tlIntersectionBatch batch = {uv_x, uv_y, wi_x, wi_y, wi_z,
+        wo_x, wo_y, wo_z, 0, 0, 0, 0, 0, 0};
+    tlColorBatch colors = {r, g, b};
+    tl_shade_batch(&batch,params,count,colors);
+    for(uint32_t i=0;i<count;i++){
+        tlColor color = {r[i], g[i], b[i]};
+        out[i] = color;
+    }
+}
+
+static const ShadingMode modes[] = {
+    {"exact",         exact_shade,         LOAD_EXPANDED, 0.f,   0.f,    1.5f},
+    {"batch",         batch_shade,         LOAD_EXPANDED, 2e-4f, 0.001f, 1.5f},
+    {"fast_math",     fast_math_shade,     LOAD_EXPANDED, 1e-4f, 0.001f, 1.5f},
+    {"segment_cache", segment_cache_shade, LOAD_EXPANDED, 0.f,   0.f,    1.5f},
+    {"draft",         exact_shade,         LOAD_DRAFT,    0.f,   0.f,    3.f},
+    {"packed",        exact_shade,         LOAD_PACKED,   0.f,   0.f,    3.f},
+};
+#define NUM_MODES (sizeof(modes)/sizeof(*modes))
+
+// Median nanoseconds per shading point, and median time relative to the
+// exact mode, by swatch and mode
+static double timings[NUM_SWATCHES][NUM_MODES];
+static double relative_timings[NUM_SWATCHES][NUM_MODES];
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static tlWeaveParameters *load_swatch(uint32_t swatch, int load)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = load == LOAD_DRAFT ?
+        tl_weave_pattern_from_file_draft(swatch_files[swatch],&error) :
+        tl_weave_pattern_from_file(swatch_files[swatch],&error);
+    if(!params){
+        printf("%s: %s\n", swatch_files[swatch], error);
+    }
+    assert(params);
+    if(load == LOAD_PACKED){
+        tl_pack_pattern(params);
+        assert(params->packed);
+    }
+    params->realworld_uv = 0;
+    // uscale and vscale refer to the whole pattern of the file,
+    // while a draft is not reduced to a single repeat
+    params->uscale = (float)CELLS_PER_TILE/((float)params->pattern_width
+        *tl_pattern_repeats(params->pattern_repeats_x));
+    params->vscale = (float)CELLS_PER_TILE/((float)params->pattern_height
+        *tl_pattern_repeats(params->pattern_repeats_y));
+    // Thinner yarns and filament yarns for some of the yarn
+    // types, so that the extensions and both specular models are covered
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = &params->yarn_types[i];
+        yarn_type->yarnsize = i%2 ? 0.7f : 1.f;
+        yarn_type->yarnsize_enabled = 1;
+        if(i%3 == 2){
+            yarn_type->psi = 0.f;
+            yarn_type->psi_enabled = 1;
+        }
+    }
+    tl_prepare(params);
+    return params;
+}
+
+static tlVector direction(float theta, float phi)
+{
+    theta *= (float)M_PI/180.f;
+    phi *= (float)M_PI/180.f;
+    tlVector ret = {sinf(theta)*cosf(phi), sinf(theta)*sinf(phi),
+        cosf(theta), 0.f};
+    return ret;
+}
+
+static tlIntersectionData points[NUM_PIXELS];
+
+static void make_points()
+{
+    for(int y=0;y<SWATCH_SIZE;y++){
+        for(int x=0;x<SWATCH_SIZE;x++){
+            const float *d = tile_directions[x/TILE_SIZE
+                + 2*(y/TILE_SIZE)];
+            tlVector wi = direction(d[0],d[1]);
+            tlVector wo = direction(d[2],d[3]);
+            tlIntersectionData point = {
+                ((float)(x%TILE_SIZE) + 0.5f)/(float)TILE_SIZE,
+                ((float)(y%TILE_SIZE) + 0.5f)/(float)TILE_SIZE,
+                wi.x, wi.y, wi.z, wo.x, wo.y, wo.z, 0};
+            points[x + y*SWATCH_SIZE] = point;
+        }
+    }
+}
+
+// -- Reference images -- //
+// The references are stored as PFM files, three little endian floats per
+// pixel with the bottom row first
+
+static void reference_path(uint32_t swatch, char *path, size_t size)
+{
+    const char *name = strrchr(swatch_files[swatch],'/') + 1;
+    snprintf(path,size,"references/%.*s.pfm",
+        (int)(strrchr(name,'.') - name),name);
+}
+
+static void write_reference(uint32_t swatch, const tlColor *image)
+{
+    char path[256];
+    reference_path(swatch,path,sizeof(path));
+    FILE *f = fopen(path,"wb");
+    assert(f);
+    fprintf(f,"PF\n%d %d\n-1.0\n",SWATCH_SIZE,SWATCH_SIZE);
+    for(int y=SWATCH_SIZE-1;y>=0;y--){
+        fwrite(image + y*SWATCH_SIZE,sizeof(tlColor),SWATCH_SIZE,f);
+    }
+    fclose(f);
+}
+
+static int read_reference(uint32_t swatch, tlColor *image)
+{
+    char path[256];
+    reference_path(swatch,path,sizeof(path));
+    FILE *f = fopen(path,"rb");
+    if(!f){
+        printf("\n%s is missing, run with --update to write it\n",path);
+        return 0;
+    }
+    int w = 0, h = 0;
+    float scale = 0.f;
+    int ok = fscanf(f,"PF %d %d %f",&w,&h,&scale) == 3 && fgetc(f) == '\n'
+        && w == SWATCH_SIZE && h == SWATCH_SIZE && scale < 0.f;
+    for(int y=SWATCH_SIZE-1;ok && y>=0;y--){
+        ok = fread(image + y*SWATCH_SIZE,sizeof(tlColor),SWATCH_SIZE,f)
+            == SWATCH_SIZE;
+    }
+    fclose(f);
+    if(!ok){
+        printf("\n%s is not a %dx%d PFM file\n",path,SWATCH_SIZE,SWATCH_SIZE);
+    }
+    return ok;
+}
+
+static double now()
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Shades the swatch into image for at least MIN_TIMING seconds, and returns
+// the time per point in nanoseconds
+static double time_shading(const ShadingMode *mode,
+    const tlWeaveParameters *params, tlColor *image)
+{
+    uint32_t passes = 0;
+    double start = now(), elapsed;
+    do{
+        mode->shade(points,NUM_PIXELS,params,image);
+        passes++;
+        elapsed = now() - start;
+    }while(elapsed < MIN_TIMING);
+    return elapsed*1e9/((double)passes*NUM_PIXELS);
+}
+
+static double median(double *values, int count)
+{
+    for(int i=1;i<count;i++){
+        for(int j=i;j>0 && values[j-1] > values[j];j--){
+            double tmp = values[j];
+            values[j] = values[j-1];
+            values[j-1] = tmp;
+        }
+    }
+    return count%2 ? values[count/2]
+        : 0.5*(values[count/2-1] + values[count/2]);
+}
+
+static int channel_differs(float value, float reference, float relative)
+{
+    float tolerance = REFERENCE_ABSOLUTE_TOLERANCE +
+        (REFERENCE_RELATIVE_TOLERANCE + relative)*fabsf(reference);
+    // Written so that NaN differs
+    return !(fabsf(value - reference) <= tolerance);
+}
+
+static void test_mode(uint32_t m)
+{
+    const ShadingMode *mode = &modes[m];
+    static tlColor image[NUM_PIXELS], reference[NUM_PIXELS];
+    make_points();
+    for(uint32_t s=0;s<NUM_SWATCHES;s++){
+        int ok = read_reference(s,reference);
+        assert(ok);
+        tlWeaveParameters *params = load_swatch(s,mode->load);
+        mode->shade(points,NUM_PIXELS,params,image);
+        uint32_t outliers = 0;
+        float max_error = 0.f;
+        for(uint32_t i=0;i<NUM_PIXELS;i++){
+            const float *a = &image[i].r, *b = &reference[i].r;
+            int differs = 0;
+            for(int c=0;c<3;c++){
+                differs |= channel_differs(a[c],b[c],
+                    mode->relative_tolerance);
+                float error = fabsf(a[c] - b[c]);
+                max_error = error > max_error ? error : max_error;
+            }
+            outliers += differs;
+        }
+        if(outliers > mode->max_outlier_fraction*NUM_PIXELS){
+            printf("\n%s: %u pixels differ, max error %g\n",swatch_files[s],
+                outliers,max_error);
+        }
+        assert(outliers <= mode->max_outlier_fraction*NUM_PIXELS);
+        free_params(params);
+    }
+}
+
+static void test_exact_matches_references() { test_mode(0); }
+static void test_batch_matches_references() { test_mode(1); }
+static void test_fast_math_matches_references() { test_mode(2); }
+static void test_segment_cache_matches_references() { test_mode(3); }
+static void test_draft_matches_references() { test_mode(4); }
+static void test_packed_matches_references() { test_mode(5); }
+
+static void update_references()
+{
+    static tlColor image[NUM_PIXELS];
+    make_points();
+    for(uint32_t s=0;s<NUM_SWATCHES;s++){
+        tlWeaveParameters *params = load_swatch(s,LOAD_EXPANDED);
+        exact_shade(points,NUM_PIXELS,params,image);
+        write_reference(s,image);
+        free_params(params);
+    }
+}
+
+static void measure_timings()
+{
+    static tlColor image[NUM_PIXELS];
+    make_points();
+    for(uint32_t s=0;s<NUM_SWATCHES;s++){
+        tlWeaveParameters *params[NUM_MODES];
+        double ns[NUM_MODES][TIMING_REPETITIONS];
+        double relative[NUM_MODES][TIMING_REPETITIONS];
+        for(uint32_t m=0;m<NUM_MODES;m++){
+            params[m] = load_swatch(s,modes[m].load);
+            // Untimed, to warm up the caches
+            modes[m].shade(points,NUM_PIXELS,params[m],image);
+        }
+        for(int r=0;r<TIMING_REPETITIONS;r++){
+            for(uint32_t m=0;m<NUM_MODES;m++){
+                ns[m][r] = time_shading(&modes[m],params[m],image);
+                relative[m][r] = ns[m][r]/ns[0][r];
+            }
+        }
+        for(uint32_t m=0;m<NUM_MODES;m++){
+            timings[s][m] = median(ns[m],TIMING_REPETITIONS);
+            relative_timings[s][m] = median(relative[m],TIMING_REPETITIONS);
+            free_params(params[m]);
+        }
+    }
+}
+
+// Prints the timings as CSV, and returns the number of modes over budget
+static int report_timings(int check_budgets)
+{
+    int over_budget = 0;
+    printf("swatch,mode,ns_per_point,points_per_s,relative_to_exact\n");
+    for(uint32_t s=0;s<NUM_SWATCHES;s++){
+        const char *name = strrchr(swatch_files[s],'/') + 1;
+        for(uint32_t m=0;m<NUM_MODES;m++){
+            double relative = relative_timings[s][m];
+            printf("%s,%s,%.1f,%.0f,%.2f\n",name,modes[m].name,timings[s][m],
+                1e9/timings[s][m],relative);
+            if(check_budgets && relative > modes[m].budget){
+                printf("%s,%s: over the budget of %.2f\n",name,modes[m].name,
+                    modes[m].budget);
+                over_budget++;
+            }
+        }
+    }
+    return over_budget;
+}
+
+int main(int argc, char **argv)
+{
+    int check_budgets = 0;
+    for(int i=1;i<argc;i++){
+        if(strcmp(argv[i],"--update") == 0){
+            update_references();
+            printf("Wrote %d references\n",(int)NUM_SWATCHES);
+            return 0;
+        } else if(strcmp(argv[i],"--check-budgets") == 0){
+            check_budgets = 1;
+        } else{
+            printf("usage: test_golden.bin [--update] [--check-budgets]\n");
+            return 1;
+        }
+    }
+    printf("-----------------------------\n");
+    test(exact_matches_references);
+    test(batch_matches_references);
+    test(fast_math_matches_references);
+    test(segment_cache_matches_references);
+    test(draft_matches_references);
+    test(packed_matches_references);
+    measure_timings();
+    return report_timings(check_budgets) ? 1 : 0;
+}
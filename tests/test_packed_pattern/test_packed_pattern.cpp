@@ -0,0 +1,174 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static const char *wif_files[] = {
+    "../../src/wif/data/2229.wif",
+    "../../src/wif/data/41753.wif",
+    "../test_calculate_segment_size/54235plain.wif",
+    "../test_yarn_size/3parallelwarps.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(*wif_files))
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+// A random pattern with long floats, which are broken up with the given
+// probability, and num_types different yarn types
+static tlWeaveParameters *random_pattern(uint32_t w, uint32_t h,
+    uint32_t num_types, float change)
+{
+    uint8_t *warp_above = (uint8_t*)malloc(w*h);
+    uint8_t *yarn_type = (uint8_t*)malloc(w*h);
+    tlColor *colors = (tlColor*)calloc(num_types,sizeof(tlColor));
+    uint8_t current = 0;
+    for(uint32_t i=0;i<w*h;i++){
+        if(rnd() < change){
+            current = !current;
+        }
+        // Alternate between rows and columns of floats
+        uint32_t x = i%w, y = i/w;
+        warp_above[(i/h) + (i%h)*w] = (x%3 == 0) ? current : 0;
+        if(y%5 == 0){
+            warp_above[i] = 1;
+        }
+        yarn_type[i] = (uint8_t)(1 + rand()%num_types);
+    }
+    tlWeaveParameters *params = tl_weave_pattern_from_data(warp_above,
+        yarn_type,num_types,colors,w,h);
+    free(warp_above);
+    free(yarn_type);
+    free(colors);
+    return params;
+}
+
+static void check_packed(tlWeaveParameters *params)
+{
+    uint32_t w = params->pattern_width;
+    uint32_t h = params->pattern_height;
+    tlWeaveParameters *packed = (tlWeaveParameters*)calloc(1,
+        sizeof(tlWeaveParameters));
+    *packed = *params;
+    packed->yarn_types = (tlYarnType*)calloc(params->num_yarn_types,
+        sizeof(tlYarnType));
+    memcpy(packed->yarn_types,params->yarn_types,
+        params->num_yarn_types*sizeof(tlYarnType));
+    packed->pattern = (PatternEntry*)malloc(w*h*sizeof(PatternEntry));
+    memcpy(packed->pattern,params->pattern,w*h*sizeof(PatternEntry));
+    tl_pack_pattern(packed);
+    assert(packed->packed && !packed->pattern);
+    tl_prepare(params);
+    tl_prepare(packed);
+    assert(!packed->pattern_runs);
+    for(uint32_t y=0;y<h;y++){
+        for(uint32_t x=0;x<w;x++){
+            PatternEntry a = params->pattern[x + y*w];
+            PatternEntry b = tl_pattern_entry(packed,x,y);
+            assert(a.warp_above == b.warp_above);
+            assert(a.yarn_type == b.yarn_type);
+            for(int i=0;i<4;i++){
+                uint8_t along_y = i/2;
+                int32_t direction = i%2 ? 1 : -1;
+                assert(tl_pattern_run(params,x,y,along_y,direction) ==
+                    tl_pattern_run(packed,x,y,along_y,direction));
+            }
+        }
+    }
+    free_params(packed);
+}
+
+static void test_packed_matches_pattern()
+{
+    uint32_t sizes[][2] = {{1,1}, {8,8}, {37,21}, {300,11}, {5,613}};
+    uint32_t types[] = {1, 2, 3, 5, 17, 200};
+    for(uint32_t s=0;s<sizeof(sizes)/sizeof(*sizes);s++){
+        for(uint32_t t=0;t<sizeof(types)/sizeof(*types);t++){
+            for(int c=0;c<3;c++){
+                tlWeaveParameters *params = random_pattern(sizes[s][0],
+                    sizes[s][1],types[t],c == 0 ? 0.f : (c == 1 ? 0.01f : 0.4f));
+                check_packed(params);
+                free_params(params);
+            }
+        }
+    }
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        const char *error = 0;
+        tlWeaveParameters *params = tl_weave_pattern_from_file(wif_files[f],
+            &error);
+        assert(params);
+        check_packed(params);
+        free_params(params);
+    }
+}
+
+static void test_packed_shades_identically()
+{
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        const char *error = 0;
+        tlWeaveParameters *params = tl_weave_pattern_from_file(wif_files[f],
+            &error);
+        tlWeaveParameters *packed = tl_weave_pattern_from_file(wif_files[f],
+            &error);
+        tl_pack_pattern(packed);
+        tlWeaveParameters *p[2] = {params, packed};
+        for(int k=0;k<2;k++){
+            p[k]->realworld_uv = 0;
+            p[k]->uscale = 3.f;
+            p[k]->vscale = 2.f;
+            tl_prepare(p[k]);
+        }
+        for(int i=0;i<20000;i++){
+            float phi_i = 2.f*(float)M_PI*rnd(), theta_i = 1.5f*rnd();
+            float phi_o = 2.f*(float)M_PI*rnd(), theta_o = 1.5f*rnd();
+            tlIntersectionData d = {rnd(), rnd(),
+                sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i),
+                cosf(theta_i),
+                sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o),
+                cosf(theta_o), 0};
+            tlColor a = tl_shade(d,params);
+            tlColor b = tl_shade(d,packed);
+            assert(a.r == b.r && a.g == b.g && a.b == b.b);
+        }
+        free_params(params);
+        free_params(packed);
+    }
+}
+
+static void test_palette_sets_bits()
+{
+    uint32_t types[] = {1, 2, 3, 4, 5, 16, 17, 200};
+    uint32_t bits[]  = {0, 1, 2, 2, 4, 4,  8,  8};
+    for(int t=0;t<8;t++){
+        // Large enough for every yarn type to appear
+        tlWeaveParameters *params = random_pattern(64,64,types[t],0.1f);
+        tl_pack_pattern(params);
+        assert(params->packed->yarn_type_bits == bits[t]);
+        free_params(params);
+    }
+}
+
+int main()
+{
+    test(packed_matches_pattern);
+    test(packed_shades_identically);
+    test(palette_sets_bits);
+    return 0;
+}
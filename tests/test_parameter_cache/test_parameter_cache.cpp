@@ -0,0 +1,219 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+#define NUM_POINTS 2000
+#define MAX_YARN_TYPES 16
+
+// One texmap per yarn type and parameter, so that the number of
+// evaluations of each can be counted
+static int texmaps[MAX_YARN_TYPES*TL_YARN_PARAM_COUNT];
+static int evaluations[MAX_YARN_TYPES*TL_YARN_PARAM_COUNT];
+
+static float texmap_value(void *texmap)
+{
+    int index = (int)((int*)texmap - texmaps);
+    evaluations[index]++;
+    return 0.2f + 0.6f*(float)(index%7)/6.f;
+}
+
+float tl_eval_texmap_mono(void *texmap, void *context)
+{
+    return texmap_value(texmap);
+}
+
+float tl_eval_texmap_mono_lookup(void *texmap, float u, float v,
+    void *context)
+{
+    return 1.f;
+}
+
+tlColor tl_eval_texmap_color(void *texmap, void *context)
+{
+    float value = texmap_value(texmap);
+    tlColor ret = {value, 0.5f*value, 1.f-value};
+    return ret;
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+// Loads a pattern with every float and color parameter textured
+static tlWeaveParameters *load_textured(float yarnsize)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif",&error);
+    assert(params && params->num_yarn_types <= MAX_YARN_TYPES);
+    params->realworld_uv = 0;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = &params->yarn_types[i];
+        int *t = texmaps + i*TL_YARN_PARAM_COUNT;
+#define TL_FLOAT_PARAM(name) \
+        yarn_type->name##_texmap = &t[TL_YARN_PARAM_##name];\
+        yarn_type->name##_enabled = 1;
+#define TL_COLOR_PARAM(name) TL_FLOAT_PARAM(name)
+#define TL_INT_PARAM(name)
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_COLOR_PARAM
+#undef TL_INT_PARAM
+        // The yarn size is looked up per cell, not per point
+        yarn_type->yarnsize_texmap = 0;
+        yarn_type->yarnsize = yarnsize;
+    }
+    tl_prepare(params);
+    return params;
+}
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static tlIntersectionData random_intersection()
+{
+    float phi_i = 2.f*(float)M_PI*rnd(), theta_i = 1.5f*rnd();
+    float phi_o = 2.f*(float)M_PI*rnd(), theta_o = 1.5f*rnd();
+    tlIntersectionData d = {3.f*rnd(), 3.f*rnd(),
+        sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i), cosf(theta_i),
+        sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o), cosf(theta_o),
+        0};
+    return d;
+}
+
+static int max_evaluations()
+{
+    int ret = 0;
+    for(int i=0;i<MAX_YARN_TYPES*TL_YARN_PARAM_COUNT;i++){
+        ret = evaluations[i] > ret ? evaluations[i] : ret;
+    }
+    return ret;
+}
+
+static int colors_equal(tlColor a, tlColor b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+static int pattern_data_equal(tlPatternData a, tlPatternData b)
+{
+    if(a.yarn_hit != b.yarn_hit || a.yarn_type != b.yarn_type){
+        return 0;
+    }
+    // The rest is only set where a yarn is hit
+    return !a.yarn_hit || (a.u == b.u && a.v == b.v && a.x == b.x
+        && a.y == b.y && a.normal_x == b.normal_x && a.normal_y == b.normal_y
+        && a.normal_z == b.normal_z && a.warp_above == b.warp_above);
+}
+
+static void test_cached_functions_match_uncached() {
+    tlWeaveParameters *params = load_textured(0.8f);
+    srand(1);
+    for(int i=0;i<NUM_POINTS;i++){
+        tlIntersectionData d = random_intersection();
+        float rnd_x = rnd(), rnd_y = rnd();
+        tlYarnParameterCache cache;
+        tl_yarn_parameter_cache_init(&cache,params,d.context);
+        tlPatternData data = tl_get_pattern_data_cached(d,&cache);
+        tlPatternData reference = tl_get_pattern_data(d,params);
+        assert(pattern_data_equal(data,reference));
+        assert(colors_equal(tl_eval_diffuse_cached(d,data,&cache),
+            tl_eval_diffuse(d,data,params)));
+        assert(colors_equal(tl_eval_specular_cached(d,data,&cache),
+            tl_eval_specular(d,data,params)));
+        assert(colors_equal(tl_eval_opacity_cached(d,data,&cache),
+            tl_eval_opacity(d,data,params)));
+        assert(tl_pdf_specular_cached(d,data,&cache)
+            == tl_pdf_specular(d,data,params));
+        assert(tl_specular_lobe_probability_cached(d,data,&cache)
+            == tl_specular_lobe_probability(d,data,params));
+        float pdf, reference_pdf;
+        tlVector wi = tl_sample_specular_cached(d,data,&cache,rnd_x,rnd_y,
+            &pdf);
+        tlVector reference_wi = tl_sample_specular(d,data,params,rnd_x,
+            rnd_y,&reference_pdf);
+        assert(wi.x == reference_wi.x && wi.y == reference_wi.y
+            && wi.z == reference_wi.z && pdf == reference_pdf);
+    }
+    free_params(params);
+}
+
+static void test_each_texmap_evaluated_once_per_point() {
+    // With the smaller yarns, some points are between the yarns,
+    // where the color and opacity of yarn type 0 are used
+    float yarnsizes[] = {1.f, 0.6f};
+    for(int s=0;s<2;s++){
+        tlWeaveParameters *params = load_textured(yarnsizes[s]);
+        srand(2);
+        for(int i=0;i<NUM_POINTS;i++){
+            tlIntersectionData d = random_intersection();
+            float pdf;
+            memset(evaluations,0,sizeof(evaluations));
+            tlYarnParameterCache cache;
+            tl_yarn_parameter_cache_init(&cache,params,d.context);
+            tlPatternData data = tl_get_pattern_data_cached(d,&cache);
+            tl_specular_lobe_probability_cached(d,data,&cache);
+            tl_sample_specular_cached(d,data,&cache,rnd(),rnd(),&pdf);
+            tl_pdf_specular_cached(d,data,&cache);
+            tl_eval_opacity_cached(d,data,&cache);
+            tl_eval_diffuse_cached(d,data,&cache);
+            tl_eval_specular_cached(d,data,&cache);
+            assert(max_evaluations() == 1);
+
+            memset(evaluations,0,sizeof(evaluations));
+            tl_shade(d,params);
+            assert(max_evaluations() == 1);
+        }
+        free_params(params);
+    }
+}
+
+static void test_cache_keeps_several_yarn_types() {
+    tlWeaveParameters *params = load_textured(1.f);
+    assert(params->num_yarn_types > TL_YARN_CACHE_YARN_TYPES);
+    memset(evaluations,0,sizeof(evaluations));
+    tlYarnParameterCache cache;
+    tl_yarn_parameter_cache_init(&cache,params,0);
+    tlColor color[TL_YARN_CACHE_YARN_TYPES];
+    for(int pass=0;pass<2;pass++){
+        for(uint32_t i=0;i<TL_YARN_CACHE_YARN_TYPES;i++){
+            tlColor c = tl_yarn_cache_get_type_color(&cache,i);
+            if(pass == 0){
+                color[i] = c;
+            }
+            assert(colors_equal(c,color[i]));
+        }
+    }
+    for(uint32_t i=0;i<TL_YARN_CACHE_YARN_TYPES;i++){
+        assert(evaluations[i*TL_YARN_PARAM_COUNT + TL_YARN_PARAM_color] == 1);
+    }
+    // A yarn type which does not fit replaces the last one
+    uint32_t last = TL_YARN_CACHE_YARN_TYPES - 1;
+    tl_yarn_cache_get_type_color(&cache,TL_YARN_CACHE_YARN_TYPES);
+    tl_yarn_cache_get_type_color(&cache,0);
+    tl_yarn_cache_get_type_color(&cache,last);
+    assert(evaluations[TL_YARN_PARAM_color] == 1);
+    assert(evaluations[last*TL_YARN_PARAM_COUNT + TL_YARN_PARAM_color] == 2);
+    free_params(params);
+}
+
+int main(int argc, char **argv)
+{
+    printf("-----------------------------\n");
+    test(cached_functions_match_uncached);
+    test(each_texmap_evaluated_once_per_point);
+    test(cache_keeps_several_yarn_types);
+}
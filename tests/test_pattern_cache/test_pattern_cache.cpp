@@ -0,0 +1,164 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static const char *wif_file = "../../src/wif/data/2229.wif";
+static const char *other_wif_file = "../test_calculate_segment_size/54235plain.wif";
+static const char *tmp_wif_file = "test_pattern_cache.wif";
+
+static void copy_file(const char *src, const char *dst)
+{
+    FILE *in = fopen(src,"rb");
+    FILE *out = fopen(dst,"wb");
+    assert(in && out);
+    char buffer[4096];
+    size_t len;
+    while((len = fread(buffer,1,sizeof(buffer),in)) > 0){
+        fwrite(buffer,1,len,out);
+    }
+    fclose(in);
+    fclose(out);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static void test_materials_share_pattern()
+{
+    const char *error = 0;
+    tlWeaveParameters *a = tl_weave_pattern_from_file_cached(wif_file,&error);
+    tlWeaveParameters *b = tl_weave_pattern_from_file_cached(wif_file,&error);
+    assert(a && b);
+    assert(a->pattern == b->pattern);
+    assert(a->yarn_types != b->yarn_types);
+    assert(tl_pattern_cache && !tl_pattern_cache->next);
+    assert(tl_pattern_cache->ref_count == 2);
+
+    tl_prepare(a);
+    tl_prepare(b);
+    assert(a->pattern_runs && a->pattern_runs == b->pattern_runs);
+
+    // Each material has its own fabric parameters and yarn types
+    a->uscale = 2.f;
+    a->yarn_types[0].psi = 0.123f;
+    assert(b->uscale != 2.f);
+    assert(b->yarn_types[0].psi != 0.123f);
+
+    free_params(a);
+    assert(tl_pattern_cache && tl_pattern_cache->ref_count == 1);
+    free_params(b);
+    // Kept loaded for the next material using the file
+    assert(tl_pattern_cache && tl_pattern_cache->ref_count == 0);
+    tl_clear_pattern_cache();
+    assert(!tl_pattern_cache);
+}
+
+static void test_cached_load_matches_uncached()
+{
+    const char *error = 0;
+    tlWeaveParameters *cached = tl_weave_pattern_from_file_cached(wif_file,&error);
+    tlWeaveParameters *loaded = tl_weave_pattern_from_file(wif_file,&error);
+    tlWeaveParameters *params[2] = {cached, loaded};
+    for(int i=0;i<2;i++){
+        params[i]->realworld_uv = 0;
+        params[i]->uscale = params[i]->vscale = 1.f;
+        tl_prepare(params[i]);
+    }
+    assert(cached->pattern_width == loaded->pattern_width);
+    assert(cached->pattern_height == loaded->pattern_height);
+    assert(cached->num_yarn_types == loaded->num_yarn_types);
+    assert(memcmp(cached->pattern,loaded->pattern,
+        loaded->pattern_width*loaded->pattern_height*sizeof(PatternEntry)) == 0);
+    assert(memcmp(cached->pattern_runs,loaded->pattern_runs,
+        loaded->pattern_width*loaded->pattern_height*sizeof(tlPatternRuns)) == 0);
+    for(int i=0;i<1000;i++){
+        tlIntersectionData d = {rand()/(float)RAND_MAX, rand()/(float)RAND_MAX,
+            0.f, 0.6f, 0.8f, 0.f, -0.6f, 0.8f, 0};
+        tlColor a = tl_shade(d,cached);
+        tlColor b = tl_shade(d,loaded);
+        assert(a.r == b.r && a.g == b.g && a.b == b.b);
+    }
+    free_params(cached);
+    free_params(loaded);
+    tl_clear_pattern_cache();
+    assert(!tl_pattern_cache);
+}
+
+static void test_changed_file_is_loaded_again()
+{
+    const char *error = 0;
+    copy_file(wif_file,tmp_wif_file);
+    tlWeaveParameters *a = tl_weave_pattern_from_file_cached(tmp_wif_file,&error);
+    copy_file(other_wif_file,tmp_wif_file);
+    tlWeaveParameters *b = tl_weave_pattern_from_file_cached(tmp_wif_file,&error);
+    assert(a && b);
+    assert(a->pattern != b->pattern);
+    assert(a->pattern_width != b->pattern_width);
+    free_params(a);
+    free_params(b);
+    tl_clear_pattern_cache();
+    assert(!tl_pattern_cache);
+    remove(tmp_wif_file);
+}
+
+static void test_freed_file_is_not_loaded_again()
+{
+    const char *error = 0;
+    tlWeaveParameters *a = tl_weave_pattern_from_file_cached(wif_file,&error);
+    assert(a);
+    PatternEntry *pattern = a->pattern;
+    free_params(a);
+    tlWeaveParameters *b = tl_weave_pattern_from_file_cached(wif_file,&error);
+    assert(b && b->pattern == pattern);
+    assert(tl_pattern_cache && !tl_pattern_cache->next);
+    assert(tl_pattern_cache->ref_count == 1);
+    free_params(b);
+    tl_clear_pattern_cache();
+    assert(!tl_pattern_cache);
+}
+
+static void test_unused_files_are_evicted_oldest_first()
+{
+    const char *error = 0;
+    char filenames[TL_PATTERN_CACHE_RETAINED + 1][64];
+    for(int i=0;i<TL_PATTERN_CACHE_RETAINED + 1;i++){
+        sprintf(filenames[i],"test_pattern_cache_%d.wif",i);
+        copy_file(wif_file,filenames[i]);
+        free_params(tl_weave_pattern_from_file_cached(filenames[i],&error));
+    }
+    int count = 0;
+    for(tlPatternCacheEntry *e = tl_pattern_cache; e; e = e->next){
+        assert(e->ref_count == 0);
+        assert(!strstr(e->path,filenames[0]));
+        count++;
+    }
+    assert(count == TL_PATTERN_CACHE_RETAINED);
+    tl_clear_pattern_cache();
+    assert(!tl_pattern_cache);
+    for(int i=0;i<TL_PATTERN_CACHE_RETAINED + 1;i++){
+        remove(filenames[i]);
+    }
+}
+
+int main()
+{
+    test(materials_share_pattern);
+    test(cached_load_matches_uncached);
+    test(changed_file_is_loaded_again);
+    test(freed_file_is_not_loaded_again);
+    test(unused_files_are_evicted_oldest_first);
+    return 0;
+}
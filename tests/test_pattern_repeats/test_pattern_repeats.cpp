@@ -0,0 +1,206 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static const char *wif_files[] = {
+    "../../src/wif/data/2229.wif",
+    "../../src/wif/data/41753.wif",
+    "../../frontends/mitsuba/example_scenes/monkeytowel/8452.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(*wif_files))
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+// A twill tile of the given size repeated repeats_x by repeats_y times
+static tlWeaveParameters *repeated_twill(uint32_t tile_w, uint32_t tile_h,
+    uint32_t repeats_x, uint32_t repeats_y)
+{
+    uint32_t w = tile_w*repeats_x, h = tile_h*repeats_y;
+    uint8_t *warp_above = (uint8_t*)malloc(w*h);
+    uint8_t *yarn_type = (uint8_t*)malloc(w*h);
+    tlColor colors[3] = {{1.f,0.f,0.f}, {0.f,1.f,0.f}, {0.f,0.f,1.f}};
+    for(uint32_t y=0;y<h;y++){
+        for(uint32_t x=0;x<w;x++){
+            uint32_t tx = x%tile_w, ty = y%tile_h;
+            warp_above[x + y*w] = (tx + ty)%3 == 0;
+            yarn_type[x + y*w] = (uint8_t)(1 + (tx/3 + ty)%3);
+        }
+    }
+    tlWeaveParameters *params = tl_weave_pattern_from_data(warp_above,
+        yarn_type,3,colors,w,h);
+    params->pattern_realwidth = 0.1f*w;
+    params->pattern_realheight = 0.1f*h;
+    free(warp_above);
+    free(yarn_type);
+    return params;
+}
+
+// Saves the pattern as a PTN file and loads it again
+static tlWeaveParameters *ptn_round_trip(tlWeaveParameters *params, int v3)
+{
+    long len = 0;
+    unsigned char *data = v3 ? tl_pattern_to_ptn_v3_file(params,&len) :
+        tl_pattern_to_ptn_file(params,&len);
+    const char *error = 0;
+    tlWeaveParameters *loaded = tl_weave_pattern_from_ptn(data,len,&error);
+    assert(loaded);
+    free(data);
+    return loaded;
+}
+
+static uint8_t same_entry(PatternEntry a, PatternEntry b)
+{
+    return a.warp_above == b.warp_above && a.yarn_type == b.yarn_type;
+}
+
+static void test_ptn_finds_repeats()
+{
+    tlWeaveParameters *params = repeated_twill(6,3,5,4);
+    tlWeaveParameters *loaded = ptn_round_trip(params,0);
+    assert(loaded->pattern_width == 6 && loaded->pattern_height == 3);
+    assert(loaded->pattern_repeats_x == 5 && loaded->pattern_repeats_y == 4);
+    // The real size is still the size of the whole pattern
+    assert(loaded->pattern_realwidth == params->pattern_realwidth);
+    assert(loaded->pattern_realheight == params->pattern_realheight);
+    for(uint32_t y=0;y<3;y++){
+        for(uint32_t x=0;x<6;x++){
+            assert(same_entry(loaded->pattern[x + y*6],
+                params->pattern[x + y*30]));
+        }
+    }
+    free_params(loaded);
+    free_params(params);
+}
+
+static void test_irregular_pattern_is_kept()
+{
+    // Only the yarn type of the last cell breaks the repeat
+    tlWeaveParameters *params = repeated_twill(6,3,5,4);
+    params->pattern[30*12 - 1].yarn_type = 1 + params->pattern[0].yarn_type%3;
+    tlWeaveParameters *loaded = ptn_round_trip(params,0);
+    assert(loaded->pattern_width == 30 && loaded->pattern_height == 12);
+    assert(tl_pattern_repeats(loaded->pattern_repeats_x) == 1.f);
+    assert(tl_pattern_repeats(loaded->pattern_repeats_y) == 1.f);
+    free_params(loaded);
+    free_params(params);
+
+    // A row of warp only can't be shrunk along x, but the columns
+    // may still be shrunk along y
+    params = repeated_twill(6,3,5,4);
+    for(uint32_t y=0;y<12;y+=3){
+        for(uint32_t x=0;x<30;x++){
+            params->pattern[x + y*30].warp_above = 1;
+        }
+    }
+    loaded = ptn_round_trip(params,0);
+    assert(loaded->pattern_width == 30 && loaded->pattern_height == 3);
+    assert(tl_pattern_repeats(loaded->pattern_repeats_x) == 1.f);
+    assert(loaded->pattern_repeats_y == 4);
+    free_params(loaded);
+    free_params(params);
+}
+
+static void test_repeats_shade_like_whole_pattern()
+{
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        const char *error = 0;
+        tlWeaveParameters *params = tl_weave_pattern_from_file(wif_files[f],
+            &error);
+        assert(params);
+        assert(params->pattern_repeats_x > 1 || params->pattern_repeats_y > 1);
+        tlWeaveParameters *whole = tl_weave_pattern_from_file(wif_files[f],
+            &error);
+        tl_expand_pattern_repeats(whole);
+        assert(whole->pattern_width ==
+            params->pattern_width*params->pattern_repeats_x);
+        assert(whole->pattern_height ==
+            params->pattern_height*params->pattern_repeats_y);
+        tlWeaveParameters *p[2] = {params, whole};
+        for(int k=0;k<2;k++){
+            p[k]->realworld_uv = f%2;
+            p[k]->uscale = 3.f;
+            p[k]->vscale = 2.f;
+            p[k]->uvrotation = 30.f;
+            tl_prepare(p[k]);
+        }
+        for(int i=0;i<20000;i++){
+            float phi_i = 2.f*(float)M_PI*rnd(), theta_i = 1.5f*rnd();
+            float phi_o = 2.f*(float)M_PI*rnd(), theta_o = 1.5f*rnd();
+            tlIntersectionData d = {rnd(), rnd(),
+                sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i),
+                cosf(theta_i),
+                sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o),
+                cosf(theta_o), 0};
+            tlColor a = tl_shade(d,params);
+            tlColor b = tl_shade(d,whole);
+            assert(a.r == b.r && a.g == b.g && a.b == b.b);
+        }
+        free_params(params);
+        free_params(whole);
+    }
+}
+
+static void test_expand_and_v3_round_trip()
+{
+    tlWeaveParameters *params = repeated_twill(6,3,5,4);
+    tlWeaveParameters *loaded = ptn_round_trip(params,0);
+
+    // v3 files keep the single repeat
+    tlWeaveParameters *v3 = ptn_round_trip(loaded,1);
+    assert(v3->pattern_width == 6 && v3->pattern_height == 3);
+    assert(v3->pattern_repeats_x == 5 && v3->pattern_repeats_y == 4);
+
+    // v2 files store the whole pattern
+    long len = 0;
+    unsigned char *data = tl_pattern_to_ptn_file(v3,&len);
+    int32_t *header = (int32_t*)data;
+    assert(header[0] == 2);
+    free(data);
+
+    tl_expand_pattern_repeats(v3);
+    tlWeaveParameters *p[2] = {loaded, v3};
+    for(int k=0;k<2;k++){
+        if(k == 0){
+            tl_expand_pattern_repeats(p[k]);
+        }
+        assert(p[k]->pattern_width == 30 && p[k]->pattern_height == 12);
+        assert(p[k]->pattern_repeats_x == 0 && p[k]->pattern_repeats_y == 0);
+        assert(fabsf(p[k]->pattern_realwidth - 3.f) < 1e-5f);
+        assert(fabsf(p[k]->pattern_realheight - 1.2f) < 1e-5f);
+        for(uint32_t i=0;i<30*12;i++){
+            assert(same_entry(p[k]->pattern[i],params->pattern[i]));
+        }
+    }
+    free_params(v3);
+    free_params(loaded);
+    free_params(params);
+}
+
+int main()
+{
+    test(ptn_finds_repeats);
+    test(irregular_pattern_is_kept);
+    test(repeats_shade_like_whole_pattern);
+    test(expand_and_v3_round_trip);
+    return 0;
+}
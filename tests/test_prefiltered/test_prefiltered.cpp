@@ -0,0 +1,251 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#define TL_NO_TEXTURE_CALLBACKS
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+// Loads a pattern with gaps between the yarns and a different color per
+// yarn type
+static tlWeaveParameters *load(float rotation)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif", &error);
+    assert(params);
+    params->realworld_uv = 0;
+    params->uscale = 2.f;
+    params->vscale = 3.f;
+    params->uvrotation = rotation;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = &params->yarn_types[i];
+        yarn_type->yarnsize = 0.7f;
+        yarn_type->yarnsize_enabled = 1;
+        tlColor color = {0.2f + 0.2f*(float)(i%4), 0.5f, 0.9f - 0.1f*(float)i};
+        yarn_type->color = color;
+        yarn_type->color_enabled = 1;
+    }
+    tl_prepare(params);
+    return params;
+}
+
+static tlIntersectionData intersection(float u, float v, float theta_i,
+    float phi_i, float theta_o, float phi_o)
+{
+    tlIntersectionData d = {u, v,
+        sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i), cosf(theta_i),
+        sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o), cosf(theta_o),
+        0};
+    return d;
+}
+
+static tlIntersectionData random_intersection()
+{
+    return intersection(3.f*rnd(), 3.f*rnd(), 1.5f*rnd(),
+        2.f*(float)M_PI*rnd(), 1.5f*rnd(), 2.f*(float)M_PI*rnd());
+}
+
+// Sets the derivatives so that the footprint is the given number of cells
+static void set_footprint(tlIntersectionData *d,
+    const tlWeaveParameters *params, float cells)
+{
+    float u_scale = params->uscale
+        *(float)(params->pattern_repeats_x ? params->pattern_repeats_x : 1)
+        *(float)params->pattern_width;
+    float v_scale = params->vscale
+        *(float)(params->pattern_repeats_y ? params->pattern_repeats_y : 1)
+        *(float)params->pattern_height;
+    // Without rotation the x derivative is the longest
+    d->du_dx = cells/u_scale;
+    d->dv_dx = 0.f;
+    d->du_dy = 0.f;
+    d->dv_dy = 0.5f*cells/v_scale;
+}
+
+static int colors_equal(tlColor a, tlColor b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+static float color_difference(tlColor a, tlColor b)
+{
+    float d = fabsf(a.r - b.r);
+    d = fabsf(a.g - b.g) > d ? fabsf(a.g - b.g) : d;
+    return fabsf(a.b - b.b) > d ? fabsf(a.b - b.b) : d;
+}
+
+static void test_small_footprint_matches_detailed() {
+    tlWeaveParameters *params = load(30.f);
+    tlWeaveParameters *reference = load(30.f);
+    tl_prepare_prefiltered(params, 0);
+    assert(params->prefiltered && !reference->prefiltered);
+    srand(1);
+    for(int i=0;i<2000;i++){
+        tlIntersectionData d = random_intersection();
+        // The rotation stretches the footprint by at most
+        // vscale/uscale
+        set_footprint(&d, params, 0.6f*rnd());
+        tlEvalResult a = tl_eval_all(d, params, TL_EVAL_ALL);
+        tlEvalResult b = tl_eval_all(d, reference, TL_EVAL_ALL);
+        assert(colors_equal(a.diffuse, b.diffuse));
+        assert(colors_equal(a.specular, b.specular));
+        assert(colors_equal(a.opacity, b.opacity));
+        assert(colors_equal(tl_shade(d, params), tl_shade(d, reference)));
+        assert(colors_equal(tl_eval_shadow_opacity(d, params),
+            tl_eval_shadow_opacity(d, reference)));
+    }
+    // tl_prepare removes the prefiltered pattern
+    tl_prepare(params);
+    assert(!params->prefiltered);
+    free_params(params);
+    free_params(reference);
+}
+
+static void test_large_footprint_matches_average() {
+    tlWeaveParameters *params = load(0.f);
+    tl_prepare_prefiltered(params, 0);
+    float directions[][4] = {
+        {0.3f, 0.f, 0.3f, (float)M_PI},
+        {0.7f, 1.f, 0.5f, 4.f},
+        {1.1f, 2.f, 0.9f, 5.5f},
+    };
+    for(int k=0;k<3;k++){
+        float *dir = directions[k];
+        // Average the detailed pattern over one whole repeat
+        const int n = 600;
+        double sum[9] = {0.0};
+        for(int j=0;j<n;j++){
+            for(int i=0;i<n;i++){
+                tlIntersectionData d = intersection(
+                    ((float)i + rnd())/(float)n/params->uscale,
+                    ((float)j + rnd())/(float)n/params->vscale,
+                    dir[0], dir[1], dir[2], dir[3]);
+                tlEvalResult r = tl_eval_all(d, params, TL_EVAL_ALL);
+                tlColor c[3] = {r.diffuse, r.specular, r.opacity};
+                for(int l=0;l<3;l++){
+                    sum[3*l] += c[l].r;
+                    sum[3*l+1] += c[l].g;
+                    sum[3*l+2] += c[l].b;
+                }
+            }
+        }
+        tlColor average[3];
+        for(int l=0;l<3;l++){
+            average[l].r = (float)(sum[3*l]/(n*n));
+            average[l].g = (float)(sum[3*l+1]/(n*n));
+            average[l].b = (float)(sum[3*l+2]/(n*n));
+        }
+        tlColor diffuse = average[0], specular = average[1];
+        tlColor opacity = average[2];
+
+        tlIntersectionData d = intersection(0.37f, 0.81f, dir[0], dir[1],
+            dir[2], dir[3]);
+        set_footprint(&d, params, 10.f);
+        tlEvalResult filtered = tl_eval_all(d, params, TL_EVAL_ALL);
+        assert(color_difference(filtered.diffuse, diffuse)
+            < 1e-3f);
+        assert(color_difference(filtered.opacity, opacity) < 0.01f);
+        assert(color_difference(filtered.specular, specular)
+            < 0.15f*specular.r + 1e-3f);
+        // The same everywhere, so there is no moire
+        d.uv_x = 1.93f; d.uv_y = 0.11f;
+        tlEvalResult other = tl_eval_all(d, params, TL_EVAL_ALL);
+        assert(colors_equal(other.diffuse, filtered.diffuse));
+        assert(colors_equal(other.specular, filtered.specular));
+    }
+    free_params(params);
+}
+
+static void test_blend_is_continuous() {
+    tlWeaveParameters *params = load(0.f);
+    tl_prepare_prefiltered(params, 0);
+    srand(3);
+    for(int i=0;i<200;i++){
+        tlIntersectionData d = random_intersection();
+        tlColor detailed = tl_shade(d, params);
+        set_footprint(&d, params, 100.f);
+        tlColor filtered = tl_shade(d, params);
+        float step = 0.f;
+        tlColor last = detailed;
+        for(float cells=0.f;cells<=4.f;cells+=0.01f){
+            set_footprint(&d, params, cells);
+            tlColor c = tl_shade(d, params);
+            if(cells < TL_PREFILTER_MIN_FOOTPRINT){
+                assert(colors_equal(c, detailed));
+            }
+            if(cells > TL_PREFILTER_MAX_FOOTPRINT){
+                assert(colors_equal(c, filtered));
+            }
+            float diff = color_difference(c, last);
+            step = diff > step ? diff : step;
+            last = c;
+        }
+        float range = color_difference(detailed, filtered);
+        assert(step <= 0.01f*range + 1e-6f);
+    }
+    free_params(params);
+}
+
+static void test_batch_matches_scalar() {
+    tlWeaveParameters *params = load(0.f);
+    tl_prepare_prefiltered(params, 0);
+    const int count = 500;
+    float uv_x[count], uv_y[count];
+    float wi_x[count], wi_y[count], wi_z[count];
+    float wo_x[count], wo_y[count], wo_z[count];
+    float du_dx[count], dv_dx[count], du_dy[count], dv_dy[count];
+    float r[count], g[count], b[count];
+    tlIntersectionData d[count];
+    srand(4);
+    for(int i=0;i<count;i++){
+        d[i] = random_intersection();
+        set_footprint(&d[i], params, 4.f*rnd());
+        uv_x[i] = d[i].uv_x; uv_y[i] = d[i].uv_y;
+        wi_x[i] = d[i].wi_x; wi_y[i] = d[i].wi_y; wi_z[i] = d[i].wi_z;
+        wo_x[i] = d[i].wo_x; wo_y[i] = d[i].wo_y; wo_z[i] = d[i].wo_z;
+        du_dx[i] = d[i].du_dx; dv_dx[i] = d[i].dv_dx;
+        du_dy[i] = d[i].du_dy; dv_dy[i] = d[i].dv_dy;
+    }
+    tlIntersectionBatch batch = {uv_x, uv_y, wi_x, wi_y, wi_z,
+        wo_x, wo_y, wo_z, 0, 0, du_dx, dv_dx, du_dy, dv_dy};
+    tlColorBatch out = {r, g, b};
+    tl_shade_batch(&batch, params, count, out);
+    int num_off = 0;
+    for(int i=0;i<count;i++){
+        tlColor c = tl_shade(d[i], params);
+        tlColor o = {r[i], g[i], b[i]};
+        float tolerance = 2e-4f*(fabsf(c.r) + fabsf(c.g) + fabsf(c.b))
+            + 1e-6f;
+        num_off += color_difference(c, o) > tolerance;
+    }
+    // See Batch shading about points at the edge of a highlight
+    assert(num_off <= 1);
+    free_params(params);
+}
+
+int main(int argc, char **argv)
+{
+    printf("-----------------------------\n");
+    test(small_footprint_matches_detailed);
+    test(large_footprint_matches_average);
+    test(blend_is_continuous);
+    test(batch_matches_scalar);
+}
@@ -0,0 +1,216 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static tlColor colors[3] = {{0.8f,0.1f,0.1f}, {0.1f,0.8f,0.1f},
+    {0.1f,0.1f,0.8f}};
+static tlYarnStripe warp_stripes[] = {{3,1}, {1,2}, {2,3}};
+static tlYarnStripe weft_stripes[] = {{4,2}, {1,3}};
+static tlYarnStripe single_stripe[] = {{1,1}};
+
+// family, warp_float, weft_float, shift
+static uint32_t weaves[][4] = {
+    {TL_WEAVE_PLAIN, 0, 0, 0},
+    {TL_WEAVE_TWILL, 2, 1, 0},
+    {TL_WEAVE_TWILL, 2, 2, 3},
+    {TL_WEAVE_TWILL, 1, 3, 2},
+    {TL_WEAVE_SATIN, 4, 1, 2},
+    {TL_WEAVE_SATIN, 1, 7, 3},
+    {TL_WEAVE_BASKET, 2, 2, 0},
+    {TL_WEAVE_BASKET, 3, 1, 0},
+};
+#define NUM_WEAVES (sizeof(weaves)/sizeof(*weaves))
+
+static tlWeaveParameters *procedural(uint32_t i, int striped)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_procedural(
+        weaves[i][0], weaves[i][1], weaves[i][2], weaves[i][3],
+        striped ? warp_stripes : single_stripe, striped ? 3 : 1,
+        striped ? weft_stripes : single_stripe, striped ? 2 : 1,
+        3, colors, &error);
+    assert(params && params->procedural && !params->pattern);
+    return params;
+}
+
+// The same pattern stored cell by cell
+static tlWeaveParameters *materialized(const tlWeaveParameters *params)
+{
+    uint32_t w = params->pattern_width;
+    uint32_t h = params->pattern_height;
+    PatternEntry *pattern = tl_expanded_pattern(params);
+    uint8_t *warp_above = (uint8_t*)malloc(w*h);
+    uint8_t *yarn_type = (uint8_t*)malloc(w*h);
+    for(uint32_t i=0;i<w*h;i++){
+        warp_above[i] = pattern[i].warp_above;
+        yarn_type[i] = pattern[i].yarn_type;
+    }
+    tlWeaveParameters *ret = tl_weave_pattern_from_data(warp_above,
+        yarn_type,3,colors,w,h);
+    free(pattern);
+    free(warp_above);
+    free(yarn_type);
+    return ret;
+}
+
+static void test_procedural_matches_pattern()
+{
+    for(uint32_t i=0;i<NUM_WEAVES;i++){
+        for(int striped=0;striped<2;striped++){
+            tlWeaveParameters *params = procedural(i,striped);
+            tlWeaveParameters *pattern = materialized(params);
+            tl_prepare(params);
+            tl_prepare(pattern);
+            assert(!params->pattern_runs);
+            uint32_t w = params->pattern_width;
+            uint32_t h = params->pattern_height;
+            for(uint32_t y=0;y<h;y++){
+                for(uint32_t x=0;x<w;x++){
+                    for(int d=0;d<4;d++){
+                        uint8_t along_y = d/2;
+                        int32_t direction = d%2 ? 1 : -1;
+                        assert(tl_pattern_run(params,x,y,along_y,direction) ==
+                            tl_pattern_run(pattern,x,y,along_y,direction));
+                    }
+                }
+            }
+            free_params(params);
+            free_params(pattern);
+        }
+    }
+}
+
+static void test_procedural_shades_identically()
+{
+    for(uint32_t i=0;i<NUM_WEAVES;i++){
+        tlWeaveParameters *params = procedural(i,1);
+        tlWeaveParameters *pattern = materialized(params);
+        tlWeaveParameters *p[2] = {params, pattern};
+        for(int k=0;k<2;k++){
+            p[k]->realworld_uv = 0;
+            p[k]->uscale = 3.f;
+            p[k]->vscale = 2.f;
+            p[k]->yarn_types[2].yarnsize = 0.6f;
+            p[k]->yarn_types[2].yarnsize_enabled = 1;
+            tl_prepare(p[k]);
+        }
+        for(int j=0;j<5000;j++){
+            float phi_i = 2.f*(float)M_PI*rnd(), theta_i = 1.5f*rnd();
+            float phi_o = 2.f*(float)M_PI*rnd(), theta_o = 1.5f*rnd();
+            tlIntersectionData d = {rnd(), rnd(),
+                sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i),
+                cosf(theta_i),
+                sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o),
+                cosf(theta_o), 0};
+            tlColor a = tl_shade(d,params);
+            tlColor b = tl_shade(d,pattern);
+            assert(a.r == b.r && a.g == b.g && a.b == b.b);
+        }
+        free_params(params);
+        free_params(pattern);
+    }
+}
+
+static void test_known_weaves()
+{
+    // Plain weave is a checkerboard
+    tlWeaveParameters *params = procedural(0,0);
+    assert(params->pattern_width == 2 && params->pattern_height == 2);
+    for(uint32_t y=0;y<2;y++){
+        for(uint32_t x=0;x<2;x++){
+            assert(tl_pattern_entry(params,x,y).warp_above == ((x + y)%2 == 0));
+        }
+    }
+    free_params(params);
+
+    // A satin has a single interlacing in each row and column
+    params = procedural(4,0);
+    assert(params->pattern_width == 5 && params->pattern_height == 5);
+    for(uint32_t i=0;i<5;i++){
+        uint32_t row = 0, column = 0;
+        for(uint32_t j=0;j<5;j++){
+            row += !tl_pattern_entry(params,j,i).warp_above;
+            column += !tl_pattern_entry(params,i,j).warp_above;
+        }
+        assert(row == 1 && column == 1);
+    }
+    free_params(params);
+
+    // The pattern covers both the weave and the stripes
+    params = procedural(1,1);
+    assert(params->pattern_width == 6 && params->pattern_height == 15);
+    for(uint32_t x=0;x<6;x++){
+        // Find a cell where the warp is on top
+        uint32_t y = 0;
+        while(!tl_pattern_entry(params,x,y).warp_above){
+            y++;
+        }
+        uint8_t expected = x < 3 ? 1 : (x == 3 ? 2 : 3);
+        assert(tl_pattern_entry(params,x,y).yarn_type == expected);
+    }
+    free_params(params);
+
+    params = procedural(6,0);
+    assert(params->pattern_width == 4 && params->pattern_height == 4);
+    assert(tl_pattern_entry(params,1,1).warp_above);
+    assert(!tl_pattern_entry(params,2,1).warp_above);
+    free_params(params);
+}
+
+static void test_invalid_parameters_are_rejected()
+{
+    uint32_t invalid[][4] = {
+        {TL_WEAVE_TWILL, 0, 2, 1},
+        {TL_WEAVE_SATIN, 3, 1, 2},
+        {TL_WEAVE_SATIN, 4, 2, 2},
+        {TL_WEAVE_SATIN, 5, 1, 2},
+        {TL_WEAVE_SATIN, 4, 1, 1},
+        {TL_WEAVE_BASKET, 0, 1, 0},
+        {17, 1, 1, 1},
+    };
+    for(uint32_t i=0;i<sizeof(invalid)/sizeof(*invalid);i++){
+        const char *error = 0;
+        tlWeaveParameters *params = tl_weave_pattern_from_procedural(
+            invalid[i][0], invalid[i][1], invalid[i][2], invalid[i][3],
+            single_stripe, 1, single_stripe, 1, 3, colors, &error);
+        assert(!params && error);
+    }
+    tlYarnStripe bad_stripes[][1] = {{{0,1}}, {{1,0}}, {{1,4}}};
+    for(uint32_t i=0;i<3;i++){
+        const char *error = 0;
+        tlWeaveParameters *params = tl_weave_pattern_from_procedural(
+            TL_WEAVE_PLAIN, 0, 0, 0, single_stripe, 1, bad_stripes[i], 1,
+            3, colors, &error);
+        assert(!params && error);
+    }
+}
+
+int main()
+{
+    test(procedural_matches_pattern);
+    test(procedural_shades_identically);
+    test(known_weaves);
+    test(invalid_parameters_are_rejected);
+    return 0;
+}
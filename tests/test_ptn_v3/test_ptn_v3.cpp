@@ -0,0 +1,168 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static const char *wif_file = "../../src/wif/data/2229.wif";
+static const char *ptn_file = "test_ptn_v3.ptn";
+
+static tlWeaveParameters *load_wif()
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(wif_file,&error);
+    assert(params);
+    params->realworld_uv = 0;
+    params->uscale = 2.f;
+    params->vscale = 3.f;
+    params->yarn_types[0].psi = 0.5f;
+    params->yarn_types[0].psi_enabled = 1;
+    return params;
+}
+
+static void write_file(const char *filename, unsigned char *data, long len)
+{
+    FILE *fp = fopen(filename,"wb");
+    assert(fp);
+    fwrite(data,1,len,fp);
+    fclose(fp);
+}
+
+static void assert_same_params(tlWeaveParameters *a, tlWeaveParameters *b)
+{
+    assert(a->uscale == b->uscale);
+    assert(a->vscale == b->vscale);
+    assert(a->realworld_uv == b->realworld_uv);
+    assert(a->pattern_width == b->pattern_width);
+    assert(a->pattern_height == b->pattern_height);
+    assert(a->num_yarn_types == b->num_yarn_types);
+    assert(a->pattern_realwidth == b->pattern_realwidth);
+    assert(a->pattern_realheight == b->pattern_realheight);
+    assert(memcmp(a->pattern,b->pattern,
+        a->pattern_width*a->pattern_height*sizeof(PatternEntry)) == 0);
+    assert(memcmp(a->yarn_types,b->yarn_types,
+        a->num_yarn_types*sizeof(tlYarnType)) == 0);
+}
+
+static void assert_same_shading(tlWeaveParameters *a, tlWeaveParameters *b)
+{
+    tl_prepare(a);
+    tl_prepare(b);
+    for(int i=0;i<1000;i++){
+        tlIntersectionData d = {rand()/(float)RAND_MAX, rand()/(float)RAND_MAX,
+            0.f, 0.6f, 0.8f, 0.f, -0.6f, 0.8f, 0};
+        tlColor ca = tl_shade(d,a);
+        tlColor cb = tl_shade(d,b);
+        assert(ca.r == cb.r && ca.g == cb.g && ca.b == cb.b);
+    }
+}
+
+static void test_mapped_load_matches_wif()
+{
+    tlWeaveParameters *params = load_wif();
+    long len = 0;
+    unsigned char *data = tl_pattern_to_ptn_v3_file(params,&len);
+    write_file(ptn_file,data,len);
+    free(data);
+
+    const char *error = 0;
+    tlWeaveParameters *mapped = tl_weave_pattern_from_file(ptn_file,&error);
+    assert(mapped);
+    assert(mapped->ptn_mapping);
+    assert(mapped->ptn_mapping_size == (size_t)len);
+    unsigned char *pattern = (unsigned char *)mapped->pattern;
+    unsigned char *mapping = (unsigned char *)mapped->ptn_mapping;
+    assert(pattern >= mapping && pattern < mapping + len);
+    assert((pattern - mapping) % TL_PTN_V3_ALIGNMENT == 0);
+    assert_same_params(params,mapped);
+    assert_same_shading(params,mapped);
+
+    tl_free_weave_parameters(params);
+    tl_free_weave_parameters(mapped);
+    remove(ptn_file);
+}
+
+static void test_buffer_load_copies_pattern()
+{
+    tlWeaveParameters *params = load_wif();
+    long len = 0;
+    unsigned char *data = tl_pattern_to_ptn_v3_file(params,&len);
+    const char *error = 0;
+    tlWeaveParameters *loaded = tl_weave_pattern_from_ptn(data,len,&error);
+    assert(loaded);
+    assert(!loaded->ptn_mapping);
+    assert_same_params(params,loaded);
+    free(data);
+    // The pattern must not point into the freed buffer
+    assert_same_shading(params,loaded);
+    tl_free_weave_parameters(params);
+    tl_free_weave_parameters(loaded);
+}
+
+static void test_invalid_files_are_rejected()
+{
+    tlWeaveParameters *params = load_wif();
+    long len = 0;
+    unsigned char *data = tl_pattern_to_ptn_v3_file(params,&len);
+    const char *error = 0;
+
+    // Truncated
+    write_file(ptn_file,data,len-1);
+    assert(!tl_weave_pattern_from_file(ptn_file,&error));
+    assert(error);
+
+    // Written by a build with a different yarn type layout
+    error = 0;
+    ((tlPtnV3Header*)data)->yarn_type_size++;
+    write_file(ptn_file,data,len);
+    assert(!tl_weave_pattern_from_file(ptn_file,&error));
+    assert(error);
+    ((tlPtnV3Header*)data)->yarn_type_size--;
+
+    // Pattern outside of the file
+    error = 0;
+    ((tlPtnV3Header*)data)->pattern_offset += TL_PTN_V3_ALIGNMENT;
+    assert(!tl_weave_pattern_from_ptn(data,len,&error));
+    assert(error);
+    ((tlPtnV3Header*)data)->pattern_offset -= TL_PTN_V3_ALIGNMENT;
+
+    // A yarn type outside of the file, which is only found when the
+    // pattern is prepared
+    tlPtnV3Header *header = (tlPtnV3Header*)data;
+    PatternEntry *pattern = (PatternEntry*)(data + header->pattern_offset);
+    uint32_t num_cells = header->pattern_width*header->pattern_height;
+    pattern[0].yarn_type = (uint8_t)header->num_yarn_types;
+    pattern[num_cells-1].yarn_type = 255;
+    write_file(ptn_file,data,len);
+    tlWeaveParameters *corrupt = tl_weave_pattern_from_file(ptn_file,&error);
+    assert(corrupt);
+    tl_prepare(corrupt);
+    assert(corrupt->pattern[0].yarn_type == 0);
+    assert(corrupt->pattern[num_cells-1].yarn_type == 0);
+    for(int i=0;i<1000;i++){
+        tlIntersectionData d = {rand()/(float)RAND_MAX, rand()/(float)RAND_MAX,
+            0.f, 0.6f, 0.8f, 0.f, -0.6f, 0.8f, 0};
+        tl_shade(d,corrupt);
+    }
+    tl_free_weave_parameters(corrupt);
+
+    free(data);
+    tl_free_weave_parameters(params);
+    remove(ptn_file);
+}
+
+int main()
+{
+    test(mapped_load_matches_wif);
+    test(buffer_load_copies_pattern);
+    test(invalid_files_are_rejected);
+    return 0;
+}
@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+#define NUM_SHADING_POINTS 8
+#define NUM_SAMPLES 4000
+#define GRID_SIZE 600 //For integrating over the hemisphere
+
+static const char *wif_files[] = {
+    "../test_calculate_segment_size/54235plain.wif",
+    "../../src/wif/data/2229.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(*wif_files))
+#define NUM_CONFIGS 2
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static tlWeaveParameters *load_params(const char *file, int config)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(file,&error);
+    assert(params);
+    params->realworld_uv = 0;
+    params->uscale = 1.f;
+    params->vscale = 1.f;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = &params->yarn_types[i];
+        yarn_type->psi_enabled = 1;
+        yarn_type->psi = config == 0 ? 0.5f : 0.f;
+    }
+    tl_prepare(params);
+    return params;
+}
+
+// A shading point with a random uv and wo, which hits a yarn
+static tlIntersectionData shading_point(const tlWeaveParameters *params,
+    tlPatternData *data)
+{
+    tlIntersectionData ret;
+    do{
+        float phi = 2.f*(float)M_PI*rnd();
+        float theta = 1.2f*rnd();
+        tlIntersectionData d = {rnd(), rnd(), 0.f, 0.f, 1.f,
+            sinf(theta)*cosf(phi), sinf(theta)*sinf(phi), cosf(theta), 0};
+        ret = d;
+        *data = tl_get_pattern_data(ret,params);
+    } while(!data->yarn_hit);
+    return ret;
+}
+
+static tlIntersectionData with_wi(tlIntersectionData d, tlVector wi)
+{
+    d.wi_x = wi.x; d.wi_y = wi.y; d.wi_z = wi.z;
+    return d;
+}
+
+static tlVector sample_cosine(float rnd_x, float rnd_y)
+{
+    float r = sqrtf(rnd_x);
+    float phi = 2.f*(float)M_PI*rnd_y;
+    return tlvector(r*cosf(phi), r*sinf(phi), sqrtf(1.f - rnd_x));
+}
+
+static void test_sample_specular_matches_pdf_specular() {
+    uint32_t num_sampled = 0, num_samples = 0;
+    srand(1);
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        for(int config=0;config<NUM_CONFIGS;config++){
+            tlWeaveParameters *params = load_params(wif_files[f],config);
+            for(int i=0;i<NUM_SHADING_POINTS;i++){
+                tlPatternData data;
+                tlIntersectionData d = shading_point(params,&data);
+                for(int j=0;j<NUM_SAMPLES;j++){
+                    float pdf;
+                    tlVector wi = tl_sample_specular(d,data,params,rnd(),
+                        rnd(),&pdf);
+                    num_samples++;
+                    if(pdf > 0.f){
+                        num_sampled++;
+                        assert(wi.z > 0.f);
+                        assert(fabsf(tlVector_magnitude(wi) - 1.f) < 1e-4f);
+                        float pdf2 = tl_pdf_specular(with_wi(d,wi),data,
+                            params);
+                        assert(fabsf(pdf - pdf2) <= 1e-3f*pdf);
+                    }
+                }
+            }
+            tl_free_weave_parameters(params);
+        }
+    }
+    // Only samples below the surface should fail
+    assert(num_sampled > num_samples/2);
+}
+
+static void test_pdf_specular_integrates_to_at_most_one() {
+    srand(2);
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        for(int config=0;config<NUM_CONFIGS;config++){
+            tlWeaveParameters *params = load_params(wif_files[f],config);
+            for(int i=0;i<NUM_SHADING_POINTS;i++){
+                tlPatternData data;
+                tlIntersectionData d = shading_point(params,&data);
+                double integral = 0.0;
+                for(int y=0;y<GRID_SIZE;y++){
+                    for(int x=0;x<GRID_SIZE;x++){
+                        tlVector wi = sample_cosine((y + 0.5f)/GRID_SIZE,
+                            (x + 0.5f)/GRID_SIZE);
+                        double pdf_cosine = wi.z*M_1_PI;
+                        integral += tl_pdf_specular(with_wi(d,wi),data,params)
+                            /(pdf_cosine*GRID_SIZE*GRID_SIZE);
+                    }
+                }
+                assert(integral <= 1.02);
+            }
+            tl_free_weave_parameters(params);
+        }
+    }
+}
+
+// Estimates the integral of the specular over the hemisphere with cosine
+// sampling and with the combined sampling described in the documentation.
+// Both should agree, and the combined sampling should have lower variance.
+static void test_combined_sampling_reduces_variance() {
+    double variance_cosine = 0.0, variance_combined = 0.0;
+    srand(3);
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        for(int config=0;config<NUM_CONFIGS;config++){
+            tlWeaveParameters *params = load_params(wif_files[f],config);
+            for(int i=0;i<NUM_SHADING_POINTS;i++){
+                tlPatternData data;
+                tlIntersectionData d = shading_point(params,&data);
+                float p = tl_specular_lobe_probability(d,data,params);
+                assert(p >= 0.f && p <= 1.f);
+                double sum_cosine = 0.0, sum2_cosine = 0.0;
+                double sum_combined = 0.0, sum2_combined = 0.0;
+                for(int j=0;j<NUM_SAMPLES;j++){
+                    tlVector wi = sample_cosine(rnd(),rnd());
+                    tlIntersectionData di = with_wi(d,wi);
+                    double value = tl_eval_specular(di,data,params).r
+                        /(wi.z*M_1_PI);
+                    sum_cosine += value;
+                    sum2_cosine += value*value;
+
+                    value = 0.0;
+                    if(rnd() < p){
+                        float pdf;
+                        wi = tl_sample_specular(d,data,params,rnd(),rnd(),
+                            &pdf);
+                        if(pdf == 0.f){
+                            continue;
+                        }
+                    } else{
+                        wi = sample_cosine(rnd(),rnd());
+                    }
+                    di = with_wi(d,wi);
+                    double pdf_combined = p*tl_pdf_specular(di,data,params)
+                        + (1.f-p)*wi.z*M_1_PI;
+                    value = tl_eval_specular(di,data,params).r/pdf_combined;
+                    sum_combined += value;
+                    sum2_combined += value*value;
+                }
+                double mean_cosine = sum_cosine/NUM_SAMPLES;
+                double mean_combined = sum_combined/NUM_SAMPLES;
+                double var_cosine = (sum2_cosine/NUM_SAMPLES
+                    - mean_cosine*mean_cosine)/NUM_SAMPLES;
+                double var_combined = (sum2_combined/NUM_SAMPLES
+                    - mean_combined*mean_combined)/NUM_SAMPLES;
+                // Allow five standard deviations of both
+                assert(fabs(mean_cosine - mean_combined)
+                    <= 5.0*sqrt(var_cosine + var_combined) + 1e-6);
+                variance_cosine += var_cosine;
+                variance_combined += var_combined;
+            }
+            tl_free_weave_parameters(params);
+        }
+    }
+    assert(variance_combined < 0.5*variance_cosine);
+}
+
+static void test_no_specular_sampling_between_yarns() {
+    tlWeaveParameters *params = load_params(wif_files[0],0);
+    tlIntersectionData d = {0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 1.f, 0};
+    tlPatternData data = tl_get_pattern_data(d,params);
+    data.yarn_hit = 0;
+    float pdf = 1.f;
+    tl_sample_specular(d,data,params,0.5f,0.5f,&pdf);
+    assert(pdf == 0.f);
+    assert(tl_pdf_specular(d,data,params) == 0.f);
+    assert(tl_specular_lobe_probability(d,data,params) == 0.f);
+    tl_free_weave_parameters(params);
+}
+
+int main(int argc, char **argv)
+{
+    printf("-----------------------------\n");
+    test(sample_specular_matches_pdf_specular);
+    test(pdf_specular_integrates_to_at_most_one);
+    test(combined_sampling_reduces_variance);
+    test(no_specular_sampling_between_yarns);
+}
@@ -0,0 +1,161 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_SEGMENT_CACHE
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static const char *wif_files[] = {
+    "../../src/wif/data/2229.wif",
+    "../../src/wif/data/41753.wif",
+    "../test_calculate_segment_size/2parallel.wif",
+    "../test_yarn_size/3parallelwarps.wif",
+    "../test_yarn_size/3parallelwefts.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(*wif_files))
+#define N 256
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static tlWeaveParameters *load(const char *filename)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(filename,&error);
+    assert(params);
+    params->realworld_uv = 0;
+    params->uscale = 2.f;
+    params->vscale = 3.f;
+    params->uvrotation = 20.f;
+    params->yarn_types[0].yarnsize = 0.7f;
+    if(params->num_yarn_types > 1){
+        params->yarn_types[1].yarnsize = 0.4f;
+        params->yarn_types[1].yarnsize_enabled = 1;
+    }
+    tl_prepare(params);
+    return params;
+}
+
+static int same_segment(tlYarnSegment a, tlYarnSegment b)
+{
+    return a.pattern_entry.warp_above == b.pattern_entry.warp_above
+        && a.pattern_entry.yarn_type == b.pattern_entry.yarn_type
+        && a.length == b.length && a.width == b.width
+        && a.start_u == b.start_u && a.start_v == b.start_v
+        && a.between_parallel == b.between_parallel
+        && a.warp_above == b.warp_above && a.yarn_hit == b.yarn_hit;
+}
+
+static tlYarnSegment segment(tlWeaveParameters *params, float u, float v)
+{
+    tlIntersectionData d = {u, v, 0.f, 0.f, 1.f, 0.f, 0.f, 1.f, 0};
+    return tl_get_yarn_segment(u, v, params, &d);
+}
+
+// Compares the segments of a raster scan, where most lookups hit the cache,
+// with the same points looked up in random order, where most do not
+static void test_cached_segments_match()
+{
+    tlYarnSegment *scan = (tlYarnSegment*)malloc(N*N*sizeof(tlYarnSegment));
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        tlWeaveParameters *params = load(wif_files[f]);
+        tlWeaveParameters *other = load(wif_files[(f+1)%NUM_WIF_FILES]);
+        for(int y=0;y<N;y++){
+            for(int x=0;x<N;x++){
+                scan[x + y*N] = segment(params, x/(float)N, y/(float)N);
+                if(x%64 == 0){
+                    // Switching material empties the cache
+                    segment(other, x/(float)N, y/(float)N);
+                }
+            }
+        }
+        for(int i=0;i<N*N;i++){
+            int j = rand()%(N*N);
+            tlYarnSegment a = segment(params, (j%N)/(float)N, (j/N)/(float)N);
+            assert(same_segment(a, scan[j]));
+        }
+        free_params(params);
+        free_params(other);
+    }
+    free(scan);
+}
+
+static void test_coherent_lookups_hit()
+{
+    tlWeaveParameters *params = load(wif_files[1]);
+    tl_segment_cache_stats(1);
+    for(int y=0;y<N;y++){
+        for(int x=0;x<N;x++){
+            segment(params, x/(float)N, y/(float)N);
+        }
+    }
+    tlSegmentCacheStats stats = tl_segment_cache_stats(1);
+    assert(stats.hits + stats.misses == N*N);
+    assert(stats.hits > stats.misses);
+    stats = tl_segment_cache_stats(0);
+    assert(stats.hits == 0 && stats.misses == 0);
+    free_params(params);
+}
+
+static void test_prepare_empties_cache()
+{
+    tlWeaveParameters *params = load(wif_files[1]);
+    tlWeaveParameters *changed = load(wif_files[1]);
+    changed->yarn_types[0].yarnsize = 0.3f;
+    tl_prepare(changed);
+    for(int i=0;i<1000;i++){
+        float u = rnd(), v = rnd();
+        segment(changed, u, v);
+        params->yarn_types[0].yarnsize = 0.3f;
+        tl_prepare(params);
+        assert(same_segment(segment(params, u, v), segment(changed, u, v)));
+        params->yarn_types[0].yarnsize = 0.7f;
+        tl_prepare(params);
+    }
+    free_params(params);
+    free_params(changed);
+}
+
+static void test_textured_yarnsize_is_not_cached()
+{
+    static int texmap = 0;
+    tlWeaveParameters *params = load(wif_files[1]);
+    params->yarn_types[0].yarnsize_texmap = &texmap;
+    tl_prepare(params);
+    tl_segment_cache_stats(1);
+    segment(params, 0.5f, 0.5f);
+    segment(params, 0.5f, 0.5f);
+    tlSegmentCacheStats stats = tl_segment_cache_stats(1);
+    assert(stats.hits == 0 && stats.misses == 0);
+    tl_prepare_baked_yarnsize(params, 0);
+    segment(params, 0.5f, 0.5f);
+    segment(params, 0.5f, 0.5f);
+    stats = tl_segment_cache_stats(1);
+    assert(stats.hits == 1 && stats.misses == 1);
+    free_params(params);
+}
+
+int main()
+{
+    test(cached_segments_match);
+    test(coherent_lookups_hit);
+    test(prepare_empties_cache);
+    test(textured_yarnsize_is_not_cached);
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+// See the documentation of tl_shade_batch
+#define RELATIVE_TOLERANCE 2e-4f
+#define ABSOLUTE_TOLERANCE 1e-6f
+#define MAX_OUTLIER_FRACTION 0.001f
+
+#define NUM_POINTS 4099 //Not a multiple of the SIMD width
+
+static const char *wif_files[] = {
+    "../test_calculate_segment_size/2parallel.wif",
+    "../test_calculate_segment_size/54235plain.wif",
+    "../test_yarn_size/3parallelwarps.wif",
+    "../test_yarn_size/test.wif",
+    "../../src/wif/data/2229.wif",
+    "../../src/wif/data/41753.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(*wif_files))
+#define NUM_CONFIGS 4
+
+static float uv_x[NUM_POINTS], uv_y[NUM_POINTS];
+static float wi_x[NUM_POINTS], wi_y[NUM_POINTS], wi_z[NUM_POINTS];
+static float wo_x[NUM_POINTS], wo_y[NUM_POINTS], wo_z[NUM_POINTS];
+static uint8_t mask[NUM_POINTS];
+static float out_r[NUM_POINTS], out_g[NUM_POINTS], out_b[NUM_POINTS];
+static tlPatternData pattern_data[NUM_POINTS];
+
+static tlIntersectionBatch batch()
+{
+    tlIntersectionBatch ret = {uv_x, uv_y, wi_x, wi_y, wi_z, wo_x, wo_y, wo_z,
+        0, 0};
+    return ret;
+}
+
+static tlIntersectionData intersection(uint32_t i)
+{
+    tlIntersectionData ret = {uv_x[i], uv_y[i], wi_x[i], wi_y[i], wi_z[i],
+        wo_x[i], wo_y[i], wo_z[i], 0};
+    return ret;
+}
+
+static tlColorBatch out()
+{
+    tlColorBatch ret = {out_r, out_g, out_b};
+    return ret;
+}
+
+// Shading points with directions spread over the hemisphere
+static void generate_points(uint32_t seed)
+{
+    srand(seed);
+    for(uint32_t i=0;i<NUM_POINTS;i++){
+        uv_x[i] = -1.f + 3.f*rand()/(float)RAND_MAX;
+        uv_y[i] = -1.f + 3.f*rand()/(float)RAND_MAX;
+        float phi_i = 2.f*(float)M_PI*rand()/(float)RAND_MAX;
+        float theta_i = 1.5f*rand()/(float)RAND_MAX;
+        float phi_o = 2.f*(float)M_PI*rand()/(float)RAND_MAX;
+        float theta_o = 1.5f*rand()/(float)RAND_MAX;
+        wi_x[i] = sinf(theta_i)*cosf(phi_i);
+        wi_y[i] = sinf(theta_i)*sinf(phi_i);
+        wi_z[i] = cosf(theta_i);
+        wo_x[i] = sinf(theta_o)*cosf(phi_o);
+        wo_y[i] = sinf(theta_o)*sinf(phi_o);
+        wo_z[i] = cosf(theta_o);
+    }
+}
+
+static tlWeaveParameters *load_params(const char *file, int config)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(file,&error);
+    assert(params);
+    params->realworld_uv = 0;
+    params->uscale = config >= 2 ? 3.f : 1.f;
+    params->vscale = config >= 2 ? 2.f : 1.f;
+    params->uvrotation = config == 3 ? 30.f : 0.f;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = &params->yarn_types[i];
+        yarn_type->yarnsize_enabled = 1;
+        yarn_type->yarnsize = config == 1 ? 0.5f : (i%2 ? 1.f : 0.7f);
+        yarn_type->psi_enabled = 1;
+        yarn_type->psi = i%2 ? 0.f : 0.5f;
+        yarn_type->specular_noise_enabled = 1;
+        yarn_type->specular_noise = config%2 ? 0.4f : 0.f;
+    }
+    tl_prepare(params);
+    return params;
+}
+
+static int within_tolerance(float a, float b)
+{
+    return fabsf(a-b) <= RELATIVE_TOLERANCE*fabsf(b) + ABSOLUTE_TOLERANCE;
+}
+
+static void test_shade_batch_matches_shade() {
+    uint32_t num_points = 0, num_outliers = 0;
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        for(int config=0;config<NUM_CONFIGS;config++){
+            tlWeaveParameters *params = load_params(wif_files[f],config);
+            generate_points(f*NUM_CONFIGS+config);
+            tlIntersectionBatch b = batch();
+            tl_shade_batch(&b,params,NUM_POINTS,out());
+            for(uint32_t i=0;i<NUM_POINTS;i++){
+                tlColor c = tl_shade(intersection(i),params);
+                num_points++;
+                if(!within_tolerance(out_r[i],c.r)
+                    || !within_tolerance(out_g[i],c.g)
+                    || !within_tolerance(out_b[i],c.b)){
+                    num_outliers++;
+                }
+            }
+            tl_free_weave_parameters(params);
+        }
+    }
+    assert(num_outliers <= MAX_OUTLIER_FRACTION*num_points);
+}
+
+static void test_specular_batch_matches_eval_specular() {
+    uint32_t num_points = 0, num_outliers = 0, num_highlights = 0;
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        for(int config=0;config<NUM_CONFIGS;config++){
+            tlWeaveParameters *params = load_params(wif_files[f],config);
+            generate_points(100+f*NUM_CONFIGS+config);
+            tlIntersectionBatch b = batch();
+            tl_get_pattern_data_batch(&b,params,NUM_POINTS,pattern_data);
+            tl_eval_specular_batch(&b,pattern_data,params,NUM_POINTS,out());
+            for(uint32_t i=0;i<NUM_POINTS;i++){
+                tlColor c = tl_eval_specular(intersection(i),pattern_data[i],
+                    params);
+                num_points++;
+                if(c.r > 0.f){
+                    num_highlights++;
+                }
+                if(!within_tolerance(out_r[i],c.r)
+                    || !within_tolerance(out_g[i],c.g)
+                    || !within_tolerance(out_b[i],c.b)){
+                    num_outliers++;
+                }
+            }
+            tl_free_weave_parameters(params);
+        }
+    }
+    // Make sure that we actually tested some highlights
+    assert(num_highlights > num_points/20);
+    assert(num_outliers <= MAX_OUTLIER_FRACTION*num_points);
+}
+
+static void test_shade_batch_skips_masked_points() {
+    tlWeaveParameters *params = load_params(wif_files[4],0);
+    generate_points(1);
+    for(uint32_t i=0;i<NUM_POINTS;i++){
+        mask[i] = i%3 != 0;
+        out_r[i] = out_g[i] = out_b[i] = -1.f;
+    }
+    tlIntersectionBatch b = batch();
+    b.mask = mask;
+    tl_shade_batch(&b,params,NUM_POINTS,out());
+    for(uint32_t i=0;i<NUM_POINTS;i++){
+        if(mask[i]){
+            tlColor c = tl_shade(intersection(i),params);
+            assert(within_tolerance(out_r[i],c.r));
+        } else{
+            assert(out_r[i] == -1.f && out_g[i] == -1.f && out_b[i] == -1.f);
+        }
+    }
+    tl_free_weave_parameters(params);
+}
+
+int main(int argc, char **argv)
+{
+    printf("-----------------------------\n");
+    test(shade_batch_matches_shade);
+    test(specular_batch_matches_eval_specular);
+    test(shade_batch_skips_masked_points);
+}
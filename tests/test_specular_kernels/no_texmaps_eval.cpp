@@ -0,0 +1,20 @@
+// The shading functions without texmap support are compiled in
+// this translation unit, so that test_specular_kernels.cpp can compare them
+// against the usual ones. The types are the same in both.
+#define TL_NO_FILES
+#define TL_NO_TEXMAPS
+#define TL_PUBLIC_FUNC_PREFIX static
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+#include "no_texmaps_eval.h"
+
+void no_texmaps_prepare(tlWeaveParameters *params)
+{
+    tl_prepare(params);
+}
+
+tlColor no_texmaps_shade(tlIntersectionData intersection_data,
+    const tlWeaveParameters *params)
+{
+    return tl_shade(intersection_data,params);
+}
@@ -0,0 +1,4 @@
+// Shading functions from no_texmaps_eval.cpp, compiled with TL_NO_TEXMAPS
+void no_texmaps_prepare(tlWeaveParameters *params);
+tlColor no_texmaps_shade(tlIntersectionData intersection_data,
+    const tlWeaveParameters *params);
@@ -0,0 +1,191 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+#include "no_texmaps_eval.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static const char *wif_files[] = {
+    "../../src/wif/data/2229.wif",
+    "../../src/wif/data/41753.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(*wif_files))
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static tlIntersectionData random_intersection()
+{
+    float phi_i = 2.f*(float)M_PI*rnd(), theta_i = 1.5f*rnd();
+    float phi_o = 2.f*(float)M_PI*rnd(), theta_o = 1.5f*rnd();
+    tlIntersectionData d = {rnd(), rnd(),
+        sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i),
+        cosf(theta_i),
+        sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o),
+        cosf(theta_o), 0};
+    return d;
+}
+
+// Sets up the yarn types so that they use different kernels
+static void setup(tlWeaveParameters *params)
+{
+    params->realworld_uv = 0;
+    params->uscale = 3.f;
+    params->vscale = 2.f;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = params->yarn_types + i;
+        yarn_type->psi_enabled = 1;
+        yarn_type->psi = i%2 ? 0.f : 0.5f;
+        yarn_type->specular_noise_enabled = 1;
+        yarn_type->specular_noise = (i/2)%2 ? 0.4f : 0.f;
+        yarn_type->specular_amount_enabled = 1;
+        yarn_type->specular_amount = 0.8f;
+    }
+}
+
+static tlWeaveParameters *load(const char *filename)
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(filename,&error);
+    assert(params);
+    setup(params);
+    return params;
+}
+
+static void test_kernels_match_generic()
+{
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        tlWeaveParameters *params = load(wif_files[f]);
+        tl_prepare(params);
+        for(int i=0;i<20000;i++){
+            tlIntersectionData d = random_intersection();
+            tlYarnParameterCache cache;
+            tl_yarn_parameter_cache_init(&cache, params, d.context);
+            tlPatternData data = tl_pattern_data(d, params, &cache, 1);
+            tlColor a = tl_specular(d, data, &cache);
+            tlYarnParameterCache generic_cache;
+            tl_yarn_parameter_cache_init(&generic_cache, params, d.context);
+            generic_cache.yarn_type = data.yarn_type;
+            tlColor b = tl_specular_generic(d, data, &generic_cache);
+            assert(a.r == b.r && a.g == b.g && a.b == b.b);
+        }
+        free_params(params);
+    }
+}
+
+static void test_kernel_selection()
+{
+    uint8_t warp_above[] = {1,0,0,1};
+    uint8_t yarn_type[] = {1,2,3,1};
+    tlColor colors[3] = {{1.f,1.f,1.f}, {1.f,1.f,1.f}, {1.f,1.f,1.f}};
+    tlWeaveParameters *params = tl_weave_pattern_from_data(warp_above,
+        yarn_type,3,colors,2,2);
+    setup(params);
+    static int texmap = 0;
+    params->yarn_types[3].specular_noise_texmap = &texmap;
+    tl_prepare(params);
+    const tlResolvedYarnType *r = params->resolved_yarn_types;
+    assert(r[0].specular_kernel == TL_SPECULAR_KERNEL_staple);
+    assert(r[1].specular_kernel == TL_SPECULAR_KERNEL_filament);
+    assert(r[2].specular_kernel == TL_SPECULAR_KERNEL_staple_noise);
+    assert(r[3].specular_kernel == TL_SPECULAR_KERNEL_generic);
+
+    // Yarn types without psi enabled use the one of yarn type 0
+    params->yarn_types[1].psi_enabled = 0;
+    params->yarn_types[0].psi = 0.f;
+    params->yarn_types[3].specular_noise_texmap = 0;
+    tl_prepare(params);
+    r = params->resolved_yarn_types;
+    assert(r[0].specular_kernel == TL_SPECULAR_KERNEL_filament);
+    assert(r[1].specular_kernel == TL_SPECULAR_KERNEL_filament);
+    assert(r[3].specular_kernel == TL_SPECULAR_KERNEL_filament_noise);
+    free_params(params);
+}
+
+static void test_update_yarn_types()
+{
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        tlWeaveParameters *params = load(wif_files[f]);
+        tlWeaveParameters *prepared = load(wif_files[f]);
+        tl_prepare(params);
+        const tlResolvedYarnType *table = params->resolved_yarn_types;
+        uint64_t prepare_id = params->prepare_id;
+        // Edited after tl_prepare, as between two interactive renders
+        for(uint32_t i=0;i<params->num_yarn_types;i++){
+            tlYarnType *yarn_types[2] = {params->yarn_types + i,
+                prepared->yarn_types + i};
+            for(int k=0;k<2;k++){
+                yarn_types[k]->psi = i%2 ? 0.5f : 0.f;
+                yarn_types[k]->yarnsize_enabled = 1;
+                yarn_types[k]->yarnsize = 0.7f;
+                yarn_types[k]->color_enabled = 1;
+                yarn_types[k]->color.g = 0.1f;
+            }
+        }
+        tl_update_yarn_types(params);
+        tl_prepare(prepared);
+        assert(params->resolved_yarn_types == table);
+        assert(params->prepare_id != prepare_id);
+        for(uint32_t i=0;i<params->num_yarn_types;i++){
+            assert(table[i].specular_kernel ==
+                prepared->resolved_yarn_types[i].specular_kernel);
+        }
+        for(int i=0;i<20000;i++){
+            tlIntersectionData d = random_intersection();
+            tlColor a = tl_shade(d,params);
+            tlColor b = tl_shade(d,prepared);
+            assert(a.r == b.r && a.g == b.g && a.b == b.b);
+        }
+        free_params(params);
+        free_params(prepared);
+    }
+}
+
+static void test_no_texmaps_ignores_texmaps()
+{
+    static int texmap = 0;
+    for(uint32_t f=0;f<NUM_WIF_FILES;f++){
+        tlWeaveParameters *params = load(wif_files[f]);
+        tlWeaveParameters *textured = load(wif_files[f]);
+        textured->yarn_types[0].color_texmap = &texmap;
+        textured->yarn_types[1].psi_texmap = &texmap;
+        textured->yarn_types[1].yarnsize_texmap = &texmap;
+        tl_prepare(params);
+        no_texmaps_prepare(textured);
+        assert(textured->resolved_yarn_types[0].textured == 0);
+        assert(textured->resolved_yarn_types[1].textured == 0);
+        for(int i=0;i<20000;i++){
+            tlIntersectionData d = random_intersection();
+            tlColor a = tl_shade(d,params);
+            tlColor b = no_texmaps_shade(d,textured);
+            assert(a.r == b.r && a.g == b.g && a.b == b.b);
+        }
+        free_params(params);
+        free_params(textured);
+    }
+}
+
+int main()
+{
+    test(kernels_match_generic);
+    test(kernel_selection);
+    test(update_yarn_types);
+    test(no_texmaps_ignores_texmaps);
+    return 0;
+}
@@ -0,0 +1,298 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_STATS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+#define NUM_POINTS 5000
+#define NUM_THREADS 4
+#define MAX_YARN_TYPES 16
+
+// One texmap per yarn type and parameter, so that the evaluations of each
+// parameter can be counted
+static int texmaps[MAX_YARN_TYPES*TL_YARN_PARAM_COUNT];
+static int evaluations[TL_YARN_PARAM_COUNT];
+
+static float texmap_value(void *texmap)
+{
+    int index = (int)((int*)texmap - texmaps);
+    evaluations[index%TL_YARN_PARAM_COUNT]++;
+    return 0.2f + 0.6f*(float)(index%7)/6.f;
+}
+
+float tl_eval_texmap_mono(void *texmap, void *context)
+{
+    return texmap_value(texmap);
+}
+
+float tl_eval_texmap_mono_lookup(void *texmap, float u, float v,
+    void *context)
+{
+    return texmap_value(texmap);
+}
+
+tlColor tl_eval_texmap_color(void *texmap, void *context)
+{
+    float value = texmap_value(texmap);
+    tlColor ret = {value, 0.5f*value, 1.f-value};
+    return ret;
+}
+
+static float rnd()
+{
+    return rand()/(RAND_MAX + 1.f);
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static tlIntersectionData points[NUM_POINTS];
+
+static void make_points()
+{
+    srand(1);
+    for(int i=0;i<NUM_POINTS;i++){
+        float phi_i = 2.f*(float)M_PI*rnd(), theta_i = 1.5f*rnd();
+        float phi_o = 2.f*(float)M_PI*rnd(), theta_o = 1.5f*rnd();
+        tlIntersectionData d = {rnd(), rnd(),
+            sinf(theta_i)*cosf(phi_i), sinf(theta_i)*sinf(phi_i),
+            cosf(theta_i),
+            sinf(theta_o)*cosf(phi_o), sinf(theta_o)*sinf(phi_o),
+            cosf(theta_o), 0};
+        points[i] = d;
+    }
+}
+
+// Thin yarns, so that some points miss them, and every other yarn type a
+// filament yarn
+static tlWeaveParameters *load()
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif", &error);
+    assert(params && params->num_yarn_types <= MAX_YARN_TYPES);
+    params->realworld_uv = 0;
+    params->uscale = 2.f;
+    params->vscale = 2.f;
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = &params->yarn_types[i];
+        yarn_type->yarnsize = 0.6f;
+        yarn_type->yarnsize_enabled = 1;
+        yarn_type->psi = i%2 ? 0.f : 0.5f;
+        yarn_type->psi_enabled = 1;
+    }
+    tl_prepare(params);
+    return params;
+}
+
+static int is_filament(const tlWeaveParameters *params, tlPatternData data)
+{
+    return params->yarn_types[data.yarn_type].psi == 0.f;
+}
+
+static void test_segment_counts_match_lookups() {
+    make_points();
+    tlWeaveParameters *params = load();
+    tl_stats_reset();
+    uint64_t misses = 0;
+    for(int i=0;i<NUM_POINTS;i++){
+        misses += !tl_get_pattern_data(points[i], params).yarn_hit;
+    }
+    tlStats stats;
+    tl_stats_get(&stats);
+    assert(stats.segment_lookups == NUM_POINTS);
+    assert(stats.yarn_misses == misses && misses > 0);
+    // Without the segment cache, each lookup measures one segment
+    assert(stats.segment_walks == NUM_POINTS);
+    assert(stats.extension_searches > 0);
+    assert(stats.extension_search_steps >= stats.extension_searches);
+    assert(stats.pattern_run_reads >=
+        2*stats.segment_walks + stats.extension_searches);
+    for(int i=0;i<TL_YARN_PARAM_COUNT;i++){
+        assert(stats.texmap_evaluations[i] == 0);
+    }
+
+    tl_stats_reset();
+    tl_stats_get(&stats);
+    assert(stats.segment_lookups == 0 && stats.pattern_run_reads == 0);
+    free_params(params);
+}
+
+static void test_specular_counts() {
+    make_points();
+    tlWeaveParameters *params = load();
+    uint64_t staple = 0, filament = 0;
+    for(int i=0;i<NUM_POINTS;i++){
+        tlPatternData data = tl_get_pattern_data(points[i], params);
+        if(data.yarn_hit){
+            filament += is_filament(params, data);
+            staple += !is_filament(params, data);
+        }
+    }
+    assert(staple > 0 && filament > 0);
+    tl_stats_reset();
+    for(int i=0;i<NUM_POINTS;i++){
+        tl_shade(points[i], params);
+    }
+    tlStats stats;
+    tl_stats_get(&stats);
+    assert(stats.staple_specular == staple);
+    assert(stats.filament_specular == filament);
+    assert(stats.specular_width_rejected > 0);
+    assert(stats.specular_width_rejected < staple + filament);
+
+    // The vectorized kernels count the same yarns, but may round
+    // differently right at the edge of a highlight
+    float uv_x[NUM_POINTS], uv_y[NUM_POINTS];
+    float wi_x[NUM_POINTS], wi_y[NUM_POINTS], wi_z[NUM_POINTS];
+    float wo_x[NUM_POINTS], wo_y[NUM_POINTS], wo_z[NUM_POINTS];
+    float r[NUM_POINTS], g[NUM_POINTS], b[NUM_POINTS];
+    for(int i=0;i<NUM_POINTS;i++){
+        uv_x[i] = points[i].uv_x; uv_y[i] = points[i].uv_y;
+        wi_x[i] = points[i].wi_x; wi_y[i] = points[i].wi_y;
+        wi_z[i] = points[i].wi_z;
+        wo_x[i] = points[i].wo_x; wo_y[i] = points[i].wo_y;
+        wo_z[i] = points[i].wo_z;
+    }
+    tlIntersectionBatch batch = {uv_x, uv_y, wi_x, wi_y, wi_z,
+        wo_x, wo_y, wo_z, 0, 0, 0, 0, 0, 0};
+    tlColorBatch out = {r, g, b};
+    tl_stats_reset();
+    tl_shade_batch(&batch, params, NUM_POINTS, out);
+    tlStats batch_stats;
+    tl_stats_get(&batch_stats);
+    assert(batch_stats.segment_lookups == NUM_POINTS);
+    assert(batch_stats.staple_specular == staple);
+    assert(batch_stats.filament_specular == filament);
+    int64_t difference = (int64_t)batch_stats.specular_width_rejected
+        - (int64_t)stats.specular_width_rejected;
+    assert(difference >= -NUM_POINTS/1000 && difference <= NUM_POINTS/1000);
+    free_params(params);
+}
+
+static void test_texmap_evaluations_match_callbacks() {
+    make_points();
+    tlWeaveParameters *params = load();
+    for(uint32_t i=0;i<params->num_yarn_types;i++){
+        tlYarnType *yarn_type = &params->yarn_types[i];
+        int *t = texmaps + i*TL_YARN_PARAM_COUNT;
+#define TL_FLOAT_PARAM(name) \
+        yarn_type->name##_texmap = &t[TL_YARN_PARAM_##name];\
+        yarn_type->name##_enabled = 1;
+#define TL_COLOR_PARAM(name) TL_FLOAT_PARAM(name)
+#define TL_INT_PARAM(name)
+TL_YARN_PARAMETERS
+#undef TL_FLOAT_PARAM
+#undef TL_COLOR_PARAM
+#undef TL_INT_PARAM
+    }
+    tl_prepare(params);
+    for(int pass=0;pass<2;pass++){
+        memset(evaluations, 0, sizeof(evaluations));
+        tl_stats_reset();
+        if(pass == 0){
+            for(int i=0;i<NUM_POINTS;i++){
+                tl_shade(points[i], params);
+            }
+        } else{
+            // Evaluated per packet, with one texmap per parameter
+            for(int i=0;i<NUM_POINTS;i++){
+                float r, g, b;
+                tlIntersectionBatch batch = {&points[i].uv_x, &points[i].uv_y,
+                    &points[i].wi_x, &points[i].wi_y, &points[i].wi_z,
+                    &points[i].wo_x, &points[i].wo_y, &points[i].wo_z,
+                    0, 0, 0, 0, 0, 0};
+                tlColorBatch out = {&r, &g, &b};
+                tl_shade_batch(&batch, params, 1, out);
+            }
+        }
+        tlStats stats;
+        tl_stats_get(&stats);
+        for(int i=0;i<TL_YARN_PARAM_COUNT;i++){
+            assert(stats.texmap_evaluations[i] == (uint64_t)evaluations[i]);
+        }
+        assert(stats.texmap_evaluations[TL_YARN_PARAM_color] > 0);
+        assert(stats.texmap_evaluations[TL_YARN_PARAM_yarnsize] > 0);
+    }
+    free_params(params);
+}
+
+static tlWeaveParameters *thread_params;
+
+static void look_up_points()
+{
+    for(int i=0;i<NUM_POINTS;i++){
+        tl_get_pattern_data(points[i], thread_params);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI lookup_thread(LPVOID unused)
+{
+    look_up_points();
+    return 0;
+}
+#else
+static void *lookup_thread(void *unused)
+{
+    look_up_points();
+    return 0;
+}
+#endif
+
+static void test_threads_are_merged() {
+    make_points();
+    thread_params = load();
+    tl_stats_reset();
+    look_up_points();
+#ifdef _WIN32
+    HANDLE threads[NUM_THREADS];
+    for(int i=0;i<NUM_THREADS;i++){
+        threads[i] = CreateThread(0, 0, lookup_thread, 0, 0, 0);
+    }
+    for(int i=0;i<NUM_THREADS;i++){
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[NUM_THREADS];
+    for(int i=0;i<NUM_THREADS;i++){
+        pthread_create(&threads[i], 0, lookup_thread, 0);
+    }
+    for(int i=0;i<NUM_THREADS;i++){
+        pthread_join(threads[i], 0);
+    }
+#endif
+    // The threads have exited, but their counts are kept
+    tlStats stats;
+    tl_stats_get(&stats);
+    assert(stats.segment_lookups == (uint64_t)NUM_POINTS*(NUM_THREADS + 1));
+    free_params(thread_params);
+}
+
+int main(int argc, char **argv)
+{
+    printf("-----------------------------\n");
+    test(segment_counts_match_lookups);
+    test(specular_counts);
+    test(texmap_evaluations_match_callbacks);
+    test(threads_are_merged);
+}
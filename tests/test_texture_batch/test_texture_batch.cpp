@@ -0,0 +1,258 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_TEXTURE_BATCH_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+// See the documentation of tl_shade_batch
+#define RELATIVE_TOLERANCE 2e-4f
+#define ABSOLUTE_TOLERANCE 1e-6f
+#define MAX_OUTLIER_FRACTION 0.001f
+
+#define NUM_POINTS 1000 //Not a multiple of the packet size
+
+static int scalar_calls = 0;
+static int batch_calls = 0;
+static int batch_points = 0;
+
+// The texmaps are identified by their address. The value depends on the
+// texmap and on the shading point, which the context points to.
+static int mono_texmap_a = 0, mono_texmap_b = 1, color_texmap = 2;
+static int yarnsize_texmap = 3;
+
+static uint32_t point_index[NUM_POINTS];
+static void *contexts[NUM_POINTS];
+
+static float mono_value(void *texmap, void *context)
+{
+    float t = (float)*(int*)texmap;
+    float i = (float)*(uint32_t*)context;
+    return 0.5f + 0.4f*sinf(0.37f*i + t);
+}
+
+static float lookup_value(void *texmap, float u, float v)
+{
+    float t = (float)*(int*)texmap;
+    return 0.3f + 0.6f*(0.5f + 0.5f*sinf(13.f*u + t)*cosf(7.f*v));
+}
+
+float tl_eval_texmap_mono(void *texmap, void *context)
+{
+    scalar_calls++;
+    return mono_value(texmap,context);
+}
+
+float tl_eval_texmap_mono_lookup(void *texmap, float u, float v,
+    void *context)
+{
+    scalar_calls++;
+    return lookup_value(texmap,u,v);
+}
+
+tlColor tl_eval_texmap_color(void *texmap, void *context)
+{
+    scalar_calls++;
+    float m = mono_value(texmap,context);
+    tlColor ret = {m, 1.f-m, 0.5f*m};
+    return ret;
+}
+
+void tl_eval_texmap_mono_lookup_batch(void *texmap, const float *u,
+    const float *v, void * const *context, uint32_t count, float *result)
+{
+    batch_calls++;
+    batch_points += count;
+    for(uint32_t i=0;i<count;i++){
+        result[i] = lookup_value(texmap,u[i],v[i]);
+    }
+}
+
+void tl_eval_texmap_mono_batch(void *texmap, void * const *context,
+    uint32_t count, float *result)
+{
+    batch_calls++;
+    batch_points += count;
+    for(uint32_t i=0;i<count;i++){
+        result[i] = mono_value(texmap,context[i]);
+    }
+}
+
+void tl_eval_texmap_color_batch(void *texmap, void * const *context,
+    uint32_t count, tlColor *result)
+{
+    batch_calls++;
+    batch_points += count;
+    for(uint32_t i=0;i<count;i++){
+        float m = mono_value(texmap,context[i]);
+        tlColor c = {m, 1.f-m, 0.5f*m};
+        result[i] = c;
+    }
+}
+
+static void reset_counters()
+{
+    scalar_calls = batch_calls = batch_points = 0;
+}
+
+static float uv_x[NUM_POINTS], uv_y[NUM_POINTS];
+static float wi_x[NUM_POINTS], wi_y[NUM_POINTS], wi_z[NUM_POINTS];
+static float wo_x[NUM_POINTS], wo_y[NUM_POINTS], wo_z[NUM_POINTS];
+static float out_r[NUM_POINTS], out_g[NUM_POINTS], out_b[NUM_POINTS];
+
+static tlIntersectionBatch batch()
+{
+    tlIntersectionBatch ret = {uv_x, uv_y, wi_x, wi_y, wi_z, wo_x, wo_y, wo_z,
+        0, contexts};
+    return ret;
+}
+
+static tlIntersectionData intersection(uint32_t i)
+{
+    tlIntersectionData ret = {uv_x[i], uv_y[i], wi_x[i], wi_y[i], wi_z[i],
+        wo_x[i], wo_y[i], wo_z[i], contexts[i]};
+    return ret;
+}
+
+static tlColorBatch out()
+{
+    tlColorBatch ret = {out_r, out_g, out_b};
+    return ret;
+}
+
+static void generate_points(uint32_t seed)
+{
+    srand(seed);
+    for(uint32_t i=0;i<NUM_POINTS;i++){
+        point_index[i] = i;
+        contexts[i] = &point_index[i];
+        uv_x[i] = -1.f + 3.f*rand()/(float)RAND_MAX;
+        uv_y[i] = -1.f + 3.f*rand()/(float)RAND_MAX;
+        float phi_i = 2.f*(float)M_PI*rand()/(float)RAND_MAX;
+        float theta_i = 1.5f*rand()/(float)RAND_MAX;
+        float phi_o = 2.f*(float)M_PI*rand()/(float)RAND_MAX;
+        float theta_o = 1.5f*rand()/(float)RAND_MAX;
+        wi_x[i] = sinf(theta_i)*cosf(phi_i);
+        wi_y[i] = sinf(theta_i)*sinf(phi_i);
+        wi_z[i] = cosf(theta_i);
+        wo_x[i] = sinf(theta_o)*cosf(phi_o);
+        wo_y[i] = sinf(theta_o)*sinf(phi_o);
+        wo_z[i] = cosf(theta_o);
+    }
+}
+
+static void free_params(tlWeaveParameters *params)
+{
+    tl_free_weave_parameters(params);
+    free(params);
+}
+
+static tlWeaveParameters *load_params()
+{
+    const char *error = 0;
+    tlWeaveParameters *params = tl_weave_pattern_from_file(
+        "../../src/wif/data/41753.wif",&error);
+    assert(params);
+    params->realworld_uv = 0;
+    params->uscale = 3.f;
+    params->vscale = 2.f;
+    return params;
+}
+
+static int within_tolerance(float a, float b)
+{
+    return fabsf(a-b) <= RELATIVE_TOLERANCE*fabsf(b) + ABSOLUTE_TOLERANCE;
+}
+
+static void test_batch_callbacks_match_scalar() {
+    tlWeaveParameters *params = load_params();
+    // Textures on several yarn types and parameters, with some
+    // texmaps shared between parameters
+    tlYarnType *yarn_types = params->yarn_types;
+    yarn_types[0].color_texmap = &color_texmap;
+    yarn_types[0].specular_amount_texmap = &mono_texmap_a;
+    yarn_types[0].color_amount_texmap = &mono_texmap_a;
+    yarn_types[1].umax_texmap = &mono_texmap_b;
+    yarn_types[1].umax_enabled = 1;
+    yarn_types[1].psi_texmap = &mono_texmap_b;
+    yarn_types[1].psi_enabled = 1;
+    yarn_types[1].specular_color_texmap = &color_texmap;
+    yarn_types[1].specular_color_enabled = 1;
+    tl_prepare(params);
+    generate_points(1);
+    tlIntersectionBatch b = batch();
+    reset_counters();
+    tl_shade_batch(&b,params,NUM_POINTS,out());
+    assert(scalar_calls == 0 && batch_calls > 0);
+    uint32_t num_outliers = 0;
+    for(uint32_t i=0;i<NUM_POINTS;i++){
+        tlColor c = tl_shade(intersection(i),params);
+        if(!within_tolerance(out_r[i],c.r) || !within_tolerance(out_g[i],c.g)
+                || !within_tolerance(out_b[i],c.b)){
+            num_outliers++;
+        }
+    }
+    assert(num_outliers <= MAX_OUTLIER_FRACTION*NUM_POINTS);
+    free_params(params);
+}
+
+static void test_one_call_per_texmap_and_packet() {
+    tlWeaveParameters *params = load_params();
+    // Every yarn type inherits these, and tl_shade_batch needs
+    // all of them at every point, also where no yarn is hit
+    params->yarn_types[0].specular_amount_texmap = &mono_texmap_a;
+    params->yarn_types[0].color_amount_texmap = &mono_texmap_a;
+    params->yarn_types[0].opacity_amount_texmap = &mono_texmap_b;
+    params->yarn_types[0].color_texmap = &color_texmap;
+    for(uint32_t i=1;i<params->num_yarn_types;i++){
+        params->yarn_types[i].color_enabled = 0;
+    }
+    tl_prepare(params);
+    generate_points(2);
+    tlIntersectionBatch b = batch();
+    reset_counters();
+    tl_shade_batch(&b,params,NUM_POINTS,out());
+    int num_packets = (NUM_POINTS + TL_TEXTURE_PACKET_SIZE - 1)
+        /TL_TEXTURE_PACKET_SIZE;
+    assert(scalar_calls == 0);
+    assert(batch_calls == 3*num_packets);
+    assert(batch_points == 3*NUM_POINTS);
+    free_params(params);
+}
+
+static void test_baked_yarnsize_matches_scalar() {
+    tlWeaveParameters *params = load_params();
+    params->uvrotation = 30.f;
+    params->yarn_types[0].yarnsize_texmap = &yarnsize_texmap;
+    params->yarn_types[1].yarnsize_texmap = &mono_texmap_a;
+    params->yarn_types[1].yarnsize_enabled = 1;
+    reset_counters();
+    tl_prepare_baked_yarnsize(params,0);
+    const tlBakedYarnsize *baked = params->baked_yarnsize;
+    assert(baked);
+    assert(scalar_calls == 0 && batch_calls > 0);
+    assert(batch_points == (int)(baked->width*baked->height));
+    for(uint32_t y=0;y<baked->height;y++){
+        for(uint32_t x=0;x<baked->width;x++){
+            float size = tl_lookup_yarn_segment_size(baked->x0 + (int32_t)x,
+                baked->y0 + (int32_t)y,params,0);
+            assert(baked->yarnsize[x + y*baked->width] == size);
+        }
+    }
+    free_params(params);
+}
+
+int main(int argc, char **argv)
+{
+    printf("-----------------------------\n");
+    test(batch_callbacks_match_scalar);
+    test(one_call_per_texmap_and_packet);
+    test(baked_yarnsize_matches_scalar);
+}
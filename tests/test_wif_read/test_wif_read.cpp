@@ -0,0 +1,119 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_NO_TEXTURE_CALLBACKS
+#define TL_THUNDERLOOM_IMPLEMENTATION
+#include "../../src/thunderloom.h"
+
+#define test(fn) \
+        printf("\x1b[33m" # fn "\x1b[0m "); \
+        test_##fn(); \
+        puts("\x1b[1;32m ok \x1b[0m");
+
+static const char *wif_header =
+    "[WEAVING]\n"
+    "Shafts=80\n"
+    "Treadles=2\n"
+    "[COLOR PALETTE]\n"
+    "Entries=2\n"
+    "[COLOR TABLE]\n"
+    "1=255,0,0\n"
+    "2=0,0,255\n"
+    "[WARP]\n"
+    "Threads=2\n"
+    "Spacing=0.0185\n"
+    "Thickness=0.0213\n"
+    "[WEFT]\n"
+    "Threads=2\n"
+    "Spacing=0.0185\n"
+    "Thickness=0.0213\n"
+    "[THREADING]\n"
+    "1=1\n"
+    "2=80\n"
+    "[TREADLING]\n"
+    "1=1\n"
+    "2=2\n"
+    "[WARP COLORS]\n"
+    "1=1\n"
+    "2=1\n"
+    "[WEFT COLORS]\n"
+    "1=2\n"
+    "2=2\n";
+
+static char *wif_with_tieup(const char *tieup, const char *newline)
+{
+    size_t len = strlen(wif_header) + strlen(tieup) + 64;
+    for(const char *c=wif_header;*c;c++){
+        len += *c == '\n' ? strlen(newline) : 0;
+    }
+    char *data = (char*)calloc(len,1);
+    char *dest = data;
+    for(const char *c=wif_header;*c;c++){
+        if(*c == '\n'){
+            dest += sprintf(dest,"%s",newline);
+        }else{
+            *dest++ = *c;
+        }
+    }
+    sprintf(dest,"[TIEUP]%s%s%s",newline,tieup,newline);
+    return data;
+}
+
+static void test_long_lines()
+{
+    // Treadle 1 is tied to all 80 shafts, which makes the line
+    // longer than the 200 characters that the old parser could read
+    char tieup[512];
+    char *p = tieup;
+    p += sprintf(p,"1=1");
+    for(int i=2;i<=80;i++){
+        p += sprintf(p,",%d",i);
+    }
+    sprintf(p,"\n2=2 ; comment");
+    assert(strlen(tieup) > 200);
+
+    char *data = wif_with_tieup(tieup,"\n");
+    const char *error = 0;
+    WeaveData *weave_data = wif_read(data,(long)strlen(data),&error);
+    assert(weave_data);
+    for(uint32_t shaft=0;shaft<80;shaft++){
+        uint8_t treadle_1 = weave_data->tieup[1 + shaft*2];
+        uint8_t treadle_2 = weave_data->tieup[0 + shaft*2];
+        assert(treadle_1 == 1);
+        assert(treadle_2 == (shaft == 78));
+    }
+    wif_free_weavedata(weave_data);
+    free(data);
+}
+
+static void test_crlf_and_trailing_zeros()
+{
+    char *data = wif_with_tieup("1=1\r\n2=2","\r\n");
+    long len = (long)strlen(data);
+    char *padded = (char*)calloc(len+16,1);
+    memcpy(padded,data,len);
+    const char *error = 0;
+    // Reading a file in text mode on windows leaves zeros at the
+    // end of the buffer
+    WeaveData *weave_data = wif_read(padded,len+16,&error);
+    assert(weave_data);
+    assert(weave_data->warp.num_threads == 2);
+    assert(weave_data->num_colors == 2);
+    assert(weave_data->colors[0] == 1.f && weave_data->colors[5] == 1.f);
+    assert(weave_data->threading[1] == 0);
+    assert(weave_data->treadling[1] == 0);
+    // The input is parsed in place, but must not be modified
+    assert(memcmp(padded,data,len) == 0);
+    wif_free_weavedata(weave_data);
+    free(padded);
+    free(data);
+}
+
+int main()
+{
+    test(long_lines);
+    test(crlf_and_trailing_zeros);
+    return 0;
+}